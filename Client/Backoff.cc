@@ -23,6 +23,7 @@ Backoff::Backoff(uint64_t windowCount, uint64_t windowNanos)
     , windowCount(std::max(1UL, windowCount))
     , windowDuration(windowNanos)
     , startTimes()
+    , notBefore(TimePoint::min())
 {
     for (uint64_t i = 0; i < windowCount; ++i)
         startTimes.push_back(TimePoint::min());
@@ -40,7 +41,7 @@ Backoff::delayAndBegin(TimePoint timeout)
     if (now > timeout)
         return;
     TimePoint oldest = startTimes.at(0);
-    TimePoint permissible = oldest + windowDuration;
+    TimePoint permissible = std::max(oldest + windowDuration, notBefore);
     if (permissible > now) {
         if (permissible > timeout) { // now < timeout < permissible
             Core::Time::sleep(timeout);
@@ -54,5 +55,12 @@ Backoff::delayAndBegin(TimePoint timeout)
     startTimes.push_back(now);
 }
 
+void
+Backoff::delayUntil(TimePoint time)
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    notBefore = std::max(notBefore, time);
+}
+
 } // namespace LogCabin::Client
 } // namespace LogCabin
@@ -27,7 +27,8 @@ namespace Client {
 
 /**
  * A simple backoff mechanism. Currently used in the client library to
- * rate-limit the creation of new TCP connections.
+ * rate-limit the creation of new TCP connections, and to hold off RPCs when
+ * a server reports that it is overloaded.
  */
 class Backoff {
   public:
@@ -63,6 +64,16 @@ class Backoff {
      */
     void delayAndBegin(TimePoint timeout);
 
+    /**
+     * Prevent any operations from beginning before the given time, in
+     * addition to the usual rate limit. This is used when a server asks the
+     * client to retry later.
+     * \param time
+     *      delayAndBegin() will sleep until at least this time. Earlier
+     *      values than a previous call have no effect.
+     */
+    void delayUntil(TimePoint time);
+
   private:
 
     /**
@@ -88,6 +99,11 @@ class Backoff {
      * most recent.
      */
     std::deque<TimePoint> startTimes;
+
+    /**
+     * No operations may begin before this time. See delayUntil().
+     */
+    TimePoint notBefore;
 };
 
 } // namespace LogCabin::Client
@@ -79,6 +79,25 @@ TEST(ClientBackoffTest, timeout_TimingSensitive) {
     EXPECT_GT(t7 + slop, t8);
 }
 
+TEST(ClientBackoffTest, delayUntil_TimingSensitive) {
+    Backoff backoff(2, 1);
+    TimePoint t1 = Clock::now();
+    backoff.delayUntil(t1 + std::chrono::milliseconds(10));
+    backoff.delayUntil(t1); // no effect
+    backoff.delayAndBegin(t1 + std::chrono::milliseconds(4)); // delay 4ms
+    TimePoint t2 = Clock::now();
+    backoff.delayAndBegin(TimePoint::max()); // delay until 10ms
+    TimePoint t3 = Clock::now();
+    backoff.delayAndBegin(TimePoint::max()); // immediate
+    TimePoint t4 = Clock::now();
+    std::chrono::milliseconds slop(5);
+    EXPECT_LT(t1 + std::chrono::milliseconds(4), t2);
+    EXPECT_GT(t1 + std::chrono::milliseconds(4) + slop, t2);
+    EXPECT_LT(t1 + std::chrono::milliseconds(10), t3);
+    EXPECT_GT(t1 + std::chrono::milliseconds(10) + slop, t3);
+    EXPECT_GT(t3 + slop, t4);
+}
+
 } // namespace LogCabin::Client::<anonymous>
 } // namespace LogCabin::Client
 } // namespace LogCabin
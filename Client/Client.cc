@@ -90,6 +90,16 @@ ConfigurationResult::~ConfigurationResult()
 {
 }
 
+////////// ReadCacheStats //////////
+
+ReadCacheStats::ReadCacheStats()
+    : hits(0)
+    , misses(0)
+    , invalidations(0)
+    , expirations(0)
+{
+}
+
 ////////// enum Status //////////
 
 std::ostream&
@@ -158,6 +168,90 @@ TimeoutException::TimeoutException(const std::string& error)
 {
 }
 
+////////// Future //////////
+
+Future::Future(std::shared_ptr<FutureDetails> futureDetails)
+    : futureDetails(futureDetails)
+{
+}
+
+Future::Future()
+    : futureDetails()
+{
+}
+
+Future::Future(Future&& other)
+    : futureDetails(std::move(other.futureDetails))
+{
+}
+
+Future::~Future()
+{
+}
+
+Future&
+Future::operator=(Future&& other)
+{
+    futureDetails = std::move(other.futureDetails);
+    return *this;
+}
+
+bool
+Future::valid() const
+{
+    return bool(futureDetails);
+}
+
+Result
+Future::wait()
+{
+    if (!futureDetails) {
+        Result result;
+        result.status = Status::INVALID_ARGUMENT;
+        result.error = "Future does not refer to an operation";
+        return result;
+    }
+    return futureDetails->wait();
+}
+
+void
+Future::waitEx()
+{
+    throwException(wait());
+}
+
+std::string
+Future::getContents()
+{
+    if (wait().status != Status::OK)
+        return "";
+    return futureDetails->contents;
+}
+
+uint64_t
+Future::getVersion()
+{
+    if (wait().status != Status::OK)
+        return 0;
+    return futureDetails->version;
+}
+
+int64_t
+Future::getValue()
+{
+    if (wait().status != Status::OK)
+        return 0;
+    return futureDetails->value;
+}
+
+std::vector<std::string>
+Future::getChildren()
+{
+    if (wait().status != Status::OK)
+        return {};
+    return futureDetails->children;
+}
+
 ////////// TreeDetails //////////
 
 /**
@@ -171,6 +265,8 @@ class TreeDetails {
         , workingDirectory(workingDirectory)
         , condition()
         , timeoutNanos(0)
+        , ephemeral(false)
+        , ttlNanos(0)
     {
     }
     /**
@@ -190,6 +286,15 @@ class TreeDetails {
      * If nonzero, a relative timeout in nanoseconds for all Tree operations.
      */
     uint64_t timeoutNanos;
+    /**
+     * If set, files written by this Tree are ephemeral.
+     */
+    bool ephemeral;
+    /**
+     * If nonzero, files written by this Tree expire this many nanoseconds
+     * later.
+     */
+    uint64_t ttlNanos;
 };
 
 
@@ -268,6 +373,50 @@ Tree::getWorkingDirectory() const
 
 Result
 Tree::setCondition(const std::string& path, const std::string& value)
+{
+    return setConditionHelper(path, value, false, 0);
+}
+
+void
+Tree::setConditionEx(const std::string& path, const std::string& value)
+{
+    throwException(setCondition(path, value));
+}
+
+Result
+Tree::setCondition(const std::string& path, uint64_t version)
+{
+    return setConditionHelper(path, "", true, version);
+}
+
+void
+Tree::setConditionEx(const std::string& path, uint64_t version)
+{
+    throwException(setCondition(path, version));
+}
+
+std::pair<std::string, std::string>
+Tree::getCondition() const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return {treeDetails->condition.path, treeDetails->condition.contents};
+}
+
+bool
+Tree::getVersionCondition(uint64_t& version) const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    if (!treeDetails->condition.hasVersion)
+        return false;
+    version = treeDetails->condition.version;
+    return true;
+}
+
+Result
+Tree::setConditionHelper(const std::string& path,
+                         const std::string& value,
+                         bool hasVersion,
+                         uint64_t version)
 {
     // This method sets the condition regardless of whether it succeeds -- that
     // way if it doesn't, future calls on this Tree will result in errors
@@ -277,56 +426,77 @@ Tree::setCondition(const std::string& path, const std::string& value)
     std::string realPath;
     std::shared_ptr<TreeDetails> newTreeDetails(new TreeDetails(*treeDetails));
     if (path.empty()) {
-        newTreeDetails->condition = {"", ""};
+        newTreeDetails->condition = Condition();
     } else {
         Result result = treeDetails->clientImpl->canonicalize(
                                     path,
                                     treeDetails->workingDirectory,
                                     realPath);
         if (result.status != Status::OK) {
-            newTreeDetails->condition = {
-                Core::StringUtil::format(
+            realPath = Core::StringUtil::format(
                         "invalid from prior call to setCondition('%s') "
                         "relative to '%s'",
                         path.c_str(),
-                        treeDetails->workingDirectory.c_str()),
-                value,
-            };
+                        treeDetails->workingDirectory.c_str());
+        }
+        if (hasVersion)
+            newTreeDetails->condition = Condition(realPath, version);
+        else
+            newTreeDetails->condition = Condition(realPath, value);
+        if (result.status != Status::OK) {
             treeDetails = newTreeDetails;
             return result;
         }
-        newTreeDetails->condition = {realPath, value};
     }
     treeDetails = newTreeDetails;
     return Result();
 }
 
+uint64_t
+Tree::getTimeout() const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->timeoutNanos;
+}
+
 void
-Tree::setConditionEx(const std::string& path, const std::string& value)
+Tree::setTimeout(uint64_t nanoseconds)
 {
-    throwException(setCondition(path, value));
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    std::shared_ptr<TreeDetails> newTreeDetails(new TreeDetails(*treeDetails));
+    newTreeDetails->timeoutNanos = nanoseconds;
+    treeDetails = newTreeDetails;
 }
 
-std::pair<std::string, std::string>
-Tree::getCondition() const
+bool
+Tree::getEphemeral() const
 {
     std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
-    return treeDetails->condition;
+    return treeDetails->ephemeral;
+}
+
+void
+Tree::setEphemeral(bool ephemeral)
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    std::shared_ptr<TreeDetails> newTreeDetails(new TreeDetails(*treeDetails));
+    newTreeDetails->ephemeral = ephemeral;
+    treeDetails = newTreeDetails;
 }
 
 uint64_t
-Tree::getTimeout() const
+Tree::getTTL() const
 {
     std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
-    return treeDetails->timeoutNanos;
+    return treeDetails->ttlNanos;
 }
 
 void
-Tree::setTimeout(uint64_t nanoseconds)
+Tree::setTTL(uint64_t nanoseconds)
 {
     std::lock_guard<std::mutex> lockGuard(mutex);
     std::shared_ptr<TreeDetails> newTreeDetails(new TreeDetails(*treeDetails));
-    newTreeDetails->timeoutNanos = nanoseconds;
+    newTreeDetails->ttlNanos = nanoseconds;
     treeDetails = newTreeDetails;
 }
 
@@ -368,6 +538,35 @@ Tree::listDirectoryEx(const std::string& path) const
     return children;
 }
 
+Result
+Tree::listDirectory(const std::string& path,
+                    const std::string& startAfter,
+                    const std::string& prefix,
+                    uint64_t limit,
+                    std::vector<std::string>& children,
+                    bool& more) const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->listDirectory(
+        path,
+        treeDetails->workingDirectory,
+        startAfter,
+        prefix,
+        limit,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        children,
+        more);
+}
+
+DirectoryIterator
+Tree::iterateDirectory(const std::string& path,
+                       const std::string& prefix,
+                       uint64_t pageSize) const
+{
+    return DirectoryIterator(*this, path, prefix, pageSize);
+}
+
 Result
 Tree::removeDirectory(const std::string& path)
 {
@@ -394,7 +593,9 @@ Tree::write(const std::string& path, const std::string& contents)
         treeDetails->workingDirectory,
         contents,
         treeDetails->condition,
-        ClientImpl::absTimeout(treeDetails->timeoutNanos));
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        treeDetails->ephemeral,
+        treeDetails->ttlNanos);
 }
 
 void
@@ -403,6 +604,95 @@ Tree::writeEx(const std::string& path, const std::string& contents)
     throwException(write(path, contents));
 }
 
+Result
+Tree::writeStream(const std::string& path,
+                  std::istream& in,
+                  uint64_t pieceSize)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->writeStream(
+        path,
+        treeDetails->workingDirectory,
+        in,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        pieceSize,
+        treeDetails->ephemeral,
+        treeDetails->ttlNanos);
+}
+
+void
+Tree::writeStreamEx(const std::string& path,
+                    std::istream& in,
+                    uint64_t pieceSize)
+{
+    throwException(writeStream(path, in, pieceSize));
+}
+
+Result
+Tree::increment(const std::string& path, int64_t delta, int64_t& value)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->increment(
+        path,
+        treeDetails->workingDirectory,
+        delta,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        value);
+}
+
+int64_t
+Tree::incrementEx(const std::string& path, int64_t delta)
+{
+    int64_t value;
+    throwException(increment(path, delta, value));
+    return value;
+}
+
+Result
+Tree::append(const std::string& path, const std::string& contents)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->append(
+        path,
+        treeDetails->workingDirectory,
+        contents,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos));
+}
+
+void
+Tree::appendEx(const std::string& path, const std::string& contents)
+{
+    throwException(append(path, contents));
+}
+
+Result
+Tree::compareAndSwap(const std::string& path,
+                     const std::string& oldContents,
+                     const std::string& newContents)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->compareAndSwap(
+        path,
+        treeDetails->workingDirectory,
+        oldContents,
+        newContents,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        treeDetails->ephemeral,
+        treeDetails->ttlNanos);
+}
+
+void
+Tree::compareAndSwapEx(const std::string& path,
+                       const std::string& oldContents,
+                       const std::string& newContents)
+{
+    throwException(compareAndSwap(path, oldContents, newContents));
+}
+
 Result
 Tree::read(const std::string& path, std::string& contents) const
 {
@@ -415,6 +705,21 @@ Tree::read(const std::string& path, std::string& contents) const
         contents);
 }
 
+Result
+Tree::read(const std::string& path,
+           std::string& contents,
+           uint64_t& version) const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->read(
+        path,
+        treeDetails->workingDirectory,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        contents,
+        version);
+}
+
 std::string
 Tree::readEx(const std::string& path) const
 {
@@ -423,6 +728,58 @@ Tree::readEx(const std::string& path) const
     return contents;
 }
 
+std::string
+Tree::readEx(const std::string& path, uint64_t& version) const
+{
+    std::string contents;
+    throwException(read(path, contents, version));
+    return contents;
+}
+
+Result
+Tree::read(const std::string& path,
+           uint64_t offset,
+           uint64_t length,
+           std::string& contents,
+           uint64_t& version,
+           uint64_t& size) const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->read(
+        path,
+        treeDetails->workingDirectory,
+        offset,
+        length,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        contents,
+        version,
+        size);
+}
+
+Result
+Tree::readStream(const std::string& path,
+                 std::ostream& out,
+                 uint64_t pieceSize) const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    return treeDetails->clientImpl->readStream(
+        path,
+        treeDetails->workingDirectory,
+        treeDetails->condition,
+        ClientImpl::absTimeout(treeDetails->timeoutNanos),
+        out,
+        pieceSize);
+}
+
+void
+Tree::readStreamEx(const std::string& path,
+                   std::ostream& out,
+                   uint64_t pieceSize) const
+{
+    throwException(readStream(path, out, pieceSize));
+}
+
 Result
 Tree::removeFile(const std::string& path)
 {
@@ -440,6 +797,144 @@ Tree::removeFileEx(const std::string& path)
     throwException(removeFile(path));
 }
 
+Future
+Tree::makeDirectoryAsync(const std::string& path)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    std::shared_ptr<FutureDetails> futureDetails =
+        treeDetails->clientImpl->makeDirectoryAsync(
+            path,
+            treeDetails->workingDirectory,
+            treeDetails->condition,
+            ClientImpl::absTimeout(treeDetails->timeoutNanos));
+    futureDetails->clientImplRef = treeDetails->clientImpl;
+    return Future(futureDetails);
+}
+
+Future
+Tree::listDirectoryAsync(const std::string& path) const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    std::shared_ptr<FutureDetails> futureDetails =
+        treeDetails->clientImpl->listDirectoryAsync(
+            path,
+            treeDetails->workingDirectory,
+            "", "", 0,
+            treeDetails->condition,
+            ClientImpl::absTimeout(treeDetails->timeoutNanos));
+    futureDetails->clientImplRef = treeDetails->clientImpl;
+    return Future(futureDetails);
+}
+
+Future
+Tree::removeDirectoryAsync(const std::string& path)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    std::shared_ptr<FutureDetails> futureDetails =
+        treeDetails->clientImpl->removeDirectoryAsync(
+            path,
+            treeDetails->workingDirectory,
+            treeDetails->condition,
+            ClientImpl::absTimeout(treeDetails->timeoutNanos));
+    futureDetails->clientImplRef = treeDetails->clientImpl;
+    return Future(futureDetails);
+}
+
+Future
+Tree::writeAsync(const std::string& path, const std::string& contents)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    std::shared_ptr<FutureDetails> futureDetails =
+        treeDetails->clientImpl->writeAsync(
+            path,
+            treeDetails->workingDirectory,
+            contents,
+            treeDetails->condition,
+            ClientImpl::absTimeout(treeDetails->timeoutNanos),
+            treeDetails->ephemeral,
+            treeDetails->ttlNanos);
+    futureDetails->clientImplRef = treeDetails->clientImpl;
+    return Future(futureDetails);
+}
+
+Future
+Tree::incrementAsync(const std::string& path, int64_t delta)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    std::shared_ptr<FutureDetails> futureDetails =
+        treeDetails->clientImpl->incrementAsync(
+            path,
+            treeDetails->workingDirectory,
+            delta,
+            treeDetails->condition,
+            ClientImpl::absTimeout(treeDetails->timeoutNanos));
+    futureDetails->clientImplRef = treeDetails->clientImpl;
+    return Future(futureDetails);
+}
+
+Future
+Tree::appendAsync(const std::string& path, const std::string& contents)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    std::shared_ptr<FutureDetails> futureDetails =
+        treeDetails->clientImpl->appendAsync(
+            path,
+            treeDetails->workingDirectory,
+            contents,
+            treeDetails->condition,
+            ClientImpl::absTimeout(treeDetails->timeoutNanos));
+    futureDetails->clientImplRef = treeDetails->clientImpl;
+    return Future(futureDetails);
+}
+
+Future
+Tree::compareAndSwapAsync(const std::string& path,
+                          const std::string& oldContents,
+                          const std::string& newContents)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    std::shared_ptr<FutureDetails> futureDetails =
+        treeDetails->clientImpl->compareAndSwapAsync(
+            path,
+            treeDetails->workingDirectory,
+            oldContents,
+            newContents,
+            treeDetails->condition,
+            ClientImpl::absTimeout(treeDetails->timeoutNanos),
+            treeDetails->ephemeral,
+            treeDetails->ttlNanos);
+    futureDetails->clientImplRef = treeDetails->clientImpl;
+    return Future(futureDetails);
+}
+
+Future
+Tree::readAsync(const std::string& path) const
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    std::shared_ptr<FutureDetails> futureDetails =
+        treeDetails->clientImpl->readAsync(
+            path,
+            treeDetails->workingDirectory,
+            treeDetails->condition,
+            ClientImpl::absTimeout(treeDetails->timeoutNanos));
+    futureDetails->clientImplRef = treeDetails->clientImpl;
+    return Future(futureDetails);
+}
+
+Future
+Tree::removeFileAsync(const std::string& path)
+{
+    std::shared_ptr<const TreeDetails> treeDetails = getTreeDetails();
+    std::shared_ptr<FutureDetails> futureDetails =
+        treeDetails->clientImpl->removeFileAsync(
+            path,
+            treeDetails->workingDirectory,
+            treeDetails->condition,
+            ClientImpl::absTimeout(treeDetails->timeoutNanos));
+    futureDetails->clientImplRef = treeDetails->clientImpl;
+    return Future(futureDetails);
+}
+
 std::shared_ptr<const TreeDetails>
 Tree::getTreeDetails() const
 {
@@ -449,6 +944,42 @@ Tree::getTreeDetails() const
     return ret;
 }
 
+////////// DirectoryIterator //////////
+
+DirectoryIterator::DirectoryIterator(const Tree& tree,
+                                     const std::string& path,
+                                     const std::string& prefix,
+                                     uint64_t pageSize)
+    : tree(tree)
+    , path(path)
+    , prefix(prefix)
+    , pageSize(pageSize)
+    , page()
+    , pageIndex(0)
+    , more(true)
+{
+}
+
+bool
+DirectoryIterator::hasNext()
+{
+    while (pageIndex == page.size() && more) {
+        std::string startAfter;
+        if (!page.empty())
+            startAfter = page.back();
+        throwException(tree.listDirectory(path, startAfter, prefix,
+                                          pageSize, page, more));
+        pageIndex = 0;
+    }
+    return pageIndex < page.size();
+}
+
+std::string
+DirectoryIterator::next()
+{
+    return page.at(pageIndex++);
+}
+
 ////////// TestingCallbacks //////////
 
 TestingCallbacks::TestingCallbacks()
@@ -481,7 +1012,8 @@ Cluster::Cluster(std::shared_ptr<TestingCallbacks> testingCallbacks,
                  const std::map<std::string, std::string>& options)
     : clientImpl(std::make_shared<MockClientImpl>(
         testingCallbacks ? testingCallbacks
-                         : std::make_shared<TestingCallbacks>()))
+                         : std::make_shared<TestingCallbacks>(),
+        options))
 {
     clientImpl->init("-MOCK-");
 }
@@ -568,5 +1100,11 @@ Cluster::getTree()
     return Tree(clientImpl, "/");
 }
 
+ReadCacheStats
+Cluster::getReadCacheStats() const
+{
+    return clientImpl->getReadCacheStats();
+}
+
 } // namespace LogCabin::Client
 } // namespace LogCabin
@@ -15,11 +15,14 @@
  */
 
 #include <algorithm>
+#include <istream>
+#include <ostream>
 
 #include "Core/Debug.h"
 #include "Client/ClientImpl.h"
 #include "Core/ProtoBuf.h"
 #include "Core/StringUtil.h"
+#include "Core/ThreadId.h"
 #include "Protocol/Common.h"
 #include "RPC/Address.h"
 #include "RPC/ClientRPC.h"
@@ -82,9 +85,11 @@ template<typename Message>
 void
 setCondition(Message& request, const Condition& condition)
 {
-    if (!condition.first.empty()) {
-        request.mutable_condition()->set_path(condition.first);
-        request.mutable_condition()->set_contents(condition.second);
+    if (!condition.path.empty()) {
+        request.mutable_condition()->set_path(condition.path);
+        request.mutable_condition()->set_contents(condition.contents);
+        if (condition.hasVersion)
+            request.mutable_condition()->set_version(condition.version);
     }
 }
 
@@ -114,100 +119,286 @@ split(const std::string& path, std::vector<std::string>& components)
 }
 
 /**
- * Wrapper around LeaderRPC::call() that repackages a timeout as a
- * ReadOnlyTree status and error message.
+ * Drop the read cache entries that a read-write tree command may modify.
  */
 void
-treeCall(LeaderRPCBase& leaderRPC,
-         const Protocol::Client::ReadOnlyTree::Request& request,
-         Protocol::Client::ReadOnlyTree::Response& response,
-         ClientImpl::TimePoint timeout)
+invalidateCache(ReadCache& readCache,
+                const Protocol::Client::ReadWriteTree::Request& request)
+{
+    if (request.has_write())
+        readCache.invalidate(request.write().path(), false);
+    if (request.has_append())
+        readCache.invalidate(request.append().path(), false);
+    if (request.has_increment())
+        readCache.invalidate(request.increment().path(), false);
+    if (request.has_compare_and_swap())
+        readCache.invalidate(request.compare_and_swap().path(), false);
+    if (request.has_remove_file())
+        readCache.invalidate(request.remove_file().path(), false);
+    if (request.has_remove_directory())
+        readCache.invalidate(request.remove_directory().path(), true);
+}
+} // anonymous namespace
+
+using Protocol::Client::OpCode;
+namespace PC = Protocol::Client;
+
+////////// struct Condition //////////
+
+Condition::Condition()
+    : path()
+    , contents()
+    , hasVersion(false)
+    , version(0)
+{
+}
+
+Condition::Condition(const std::string& path, const std::string& contents)
+    : path(path)
+    , contents(contents)
+    , hasVersion(false)
+    , version(0)
+{
+}
+
+Condition::Condition(const std::string& path, uint64_t version)
+    : path(path)
+    , contents()
+    , hasVersion(true)
+    , version(version)
+{
+}
+
+bool
+Condition::operator==(const Condition& other) const
+{
+    return (path == other.path &&
+            contents == other.contents &&
+            hasVersion == other.hasVersion &&
+            version == other.version);
+}
+
+////////// class FutureDetails //////////
+
+FutureDetails::FutureDetails(ClientImpl& clientImpl, TimePoint timeout)
+    : clientImpl(clientImpl)
+    , clientImplRef()
+    , timeout(timeout)
+    , opCode()
+    , request()
+    , response()
+    , call()
+    , rpcInfo()
+    , rpcHelperIndex(0)
+    , done(false)
+    , result()
+    , contents()
+    , version(0)
+    , size(0)
+    , value(0)
+    , children()
+    , more(false)
+    , batched(false)
+    , readOffset(0)
+    , readLength(0)
+    , cachePath()
+    , cacheToken(0)
+    , sentAt()
+{
+}
+
+FutureDetails::~FutureDetails()
+{
+    if (opCode == OpCode::STATE_MACHINE_COMMAND)
+        clientImpl.writeBatcher.abandon(*this);
+    if (call)
+        call->cancel();
+    if (rpcInfo.client_id() > 0 && !done)
+        clientImpl.getRPCHelper(rpcHelperIndex).doneWithRPC(rpcInfo);
+}
+
+void
+FutureDetails::start(const PC::ReadOnlyTree::Request& trequest)
 {
     VERBOSE("Calling read-only tree query with request:\n%s",
             Core::StringUtil::trim(
-                Core::ProtoBuf::dumpString(request)).c_str());
-    LeaderRPC::Status status;
-    Protocol::Client::StateMachineQuery::Request qrequest;
-    Protocol::Client::StateMachineQuery::Response qresponse;
-    *qrequest.mutable_tree() = request;
-    status = leaderRPC.call(Protocol::Client::OpCode::STATE_MACHINE_QUERY,
-                            qrequest, qresponse, timeout);
-    switch (status) {
-        case LeaderRPC::Status::OK:
-            response = *qresponse.mutable_tree();
-            VERBOSE("Reply to read-only tree query:\n%s",
-                    Core::StringUtil::trim(
-                        Core::ProtoBuf::dumpString(response)).c_str());
-            break;
-        case LeaderRPC::Status::TIMEOUT:
-            response.set_status(Protocol::Client::Status::TIMEOUT);
-            response.set_error("Client-specified timeout elapsed");
-            VERBOSE("Timeout elapsed on read-only tree query");
-            break;
-        case LeaderRPC::Status::INVALID_REQUEST:
-            // TODO(ongaro): Once any new Tree request types are introduced,
-            // this PANIC will need to move up the call stack, so that we can
-            // try a new-style request and then ask for forgiveness if it
-            // fails. Same for the read-write tree calls below.
-            PANIC("The server and/or replicated state machine doesn't support "
-                  "the read-only tree query or claims the request is "
-                  "malformed. Request is: %s",
-                  Core::ProtoBuf::dumpString(request).c_str());
-    }
+                Core::ProtoBuf::dumpString(trequest)).c_str());
+    std::unique_ptr<PC::StateMachineQuery::Request> qrequest(
+        new PC::StateMachineQuery::Request());
+    *qrequest->mutable_tree() = trequest;
+    opCode = OpCode::STATE_MACHINE_QUERY;
+    request = std::move(qrequest);
+    response.reset(new PC::StateMachineQuery::Response());
+    call = clientImpl.leaderRPC->makeCall();
+    call->start(opCode, *request, timeout);
 }
 
-/**
- * Wrapper around LeaderRPC::call() that repackages a timeout as a
- * ReadWriteTree status and error message. Also checks whether getRPCInfo
- * timed out.
- */
 void
-treeCall(LeaderRPCBase& leaderRPC,
-         const Protocol::Client::ReadWriteTree::Request& request,
-         Protocol::Client::ReadWriteTree::Response& response,
-         ClientImpl::TimePoint timeout)
+FutureDetails::start(const PC::ReadWriteTree::Request& trequest)
 {
     VERBOSE("Calling read-write tree command with request:\n%s",
             Core::StringUtil::trim(
-                Core::ProtoBuf::dumpString(request)).c_str());
-    Protocol::Client::StateMachineCommand::Request crequest;
-    Protocol::Client::StateMachineCommand::Response cresponse;
-    *crequest.mutable_tree() = request;
-    LeaderRPC::Status status;
-    if (request.exactly_once().client_id() == 0) {
+                Core::ProtoBuf::dumpString(trequest)).c_str());
+    rpcInfo = trequest.exactly_once();
+    if (rpcInfo.client_id() == 0) {
         VERBOSE("Already timed out on establishing session for read-write "
                 "tree command");
-        status = LeaderRPC::Status::TIMEOUT;
-    } else {
-        status = leaderRPC.call(Protocol::Client::OpCode::STATE_MACHINE_COMMAND,
-                                crequest, cresponse, timeout);
+        Result timedOut;
+        timedOut.status = Status::TIMEOUT;
+        timedOut.error = "Client-specified timeout elapsed";
+        finish(timedOut);
+        return;
     }
+    std::unique_ptr<PC::StateMachineCommand::Request> crequest(
+        new PC::StateMachineCommand::Request());
+    *crequest->mutable_tree() = trequest;
+    opCode = OpCode::STATE_MACHINE_COMMAND;
+    invalidateCache(clientImpl.readCache, trequest);
+    request = std::move(crequest);
+    response.reset(new PC::StateMachineCommand::Response());
+    if (clientImpl.writeBatcher.add(*this))
+        return;
+    call = clientImpl.leaderRPC->makeCall();
+    call->start(opCode, *request, timeout);
+}
 
-    switch (status) {
-        case LeaderRPC::Status::OK:
-            response = *cresponse.mutable_tree();
-            VERBOSE("Reply to read-write tree command:\n%s",
-                    Core::StringUtil::trim(
-                        Core::ProtoBuf::dumpString(response)).c_str());
-            break;
-        case LeaderRPC::Status::TIMEOUT:
-            response.set_status(Protocol::Client::Status::TIMEOUT);
-            response.set_error("Client-specified timeout elapsed");
-            VERBOSE("Timeout elapsed on read-write tree command");
-            break;
-        case LeaderRPC::Status::INVALID_REQUEST:
-            PANIC("The server and/or replicated state machine doesn't support "
-                  "the read-write tree command or claims the request is "
-                  "malformed. Request is: %s",
-                  Core::ProtoBuf::dumpString(request).c_str());
+void
+FutureDetails::finish(const Result& result)
+{
+    assert(!done);
+    call.reset();
+    if (rpcInfo.client_id() > 0)
+        clientImpl.getRPCHelper(rpcHelperIndex).doneWithRPC(rpcInfo);
+    if (opCode == OpCode::STATE_MACHINE_COMMAND) {
+        // Reads sent while the command was outstanding may have returned
+        // either the old or the new contents, so drop those too.
+        invalidateCache(clientImpl.readCache,
+                        static_cast<PC::StateMachineCommand::Request&>(
+                            *request).tree());
     }
+    this->result = result;
+    done = true;
 }
 
+const Result&
+FutureDetails::wait()
+{
+    if (opCode == OpCode::STATE_MACHINE_COMMAND) {
+        clientImpl.writeBatcher.wait(*this);
+        if (!done && !call) {
+            // The batcher handed the command back to be sent on its own.
+            call = clientImpl.leaderRPC->makeCall();
+            call->start(opCode, *request, timeout);
+        }
+    }
+    while (!done) {
+        LeaderRPCBase::Call::Status status = call->wait(*response, timeout);
+        switch (status) {
+            case LeaderRPCBase::Call::Status::OK:
+                if (opCode == OpCode::STATE_MACHINE_QUERY) {
+                    finish(static_cast<PC::StateMachineQuery::Response&>(
+                                *response).tree());
+                } else {
+                    finish(static_cast<PC::StateMachineCommand::Response&>(
+                                *response).tree());
+                }
+                break;
+            case LeaderRPCBase::Call::Status::RETRY:
+                // Resend the same request: for read-write commands, the
+                // exactly-once RPC info lets the cluster detect duplicates.
+                if (opCode == OpCode::STATE_MACHINE_COMMAND)
+                    refreshRPCInfo();
+                call = clientImpl.leaderRPC->makeCall();
+                call->start(opCode, *request, timeout);
+                break;
+            case LeaderRPCBase::Call::Status::TIMEOUT: {
+                VERBOSE("Timeout elapsed on tree operation");
+                Result timedOut;
+                timedOut.status = Status::TIMEOUT;
+                timedOut.error = "Client-specified timeout elapsed";
+                finish(timedOut);
+                break;
+            }
+            case LeaderRPCBase::Call::Status::INVALID_REQUEST:
+                // TODO(ongaro): Once any new Tree request types are
+                // introduced, this PANIC will need to move up the call stack,
+                // so that we can try a new-style request and then ask for
+                // forgiveness if it fails.
+                PANIC("The server and/or replicated state machine doesn't "
+                      "support the tree operation or claims the request is "
+                      "malformed. Request is: %s",
+                      Core::ProtoBuf::dumpString(*request).c_str());
+        }
+    }
+    return result;
+}
 
-} // anonymous namespace
+void
+FutureDetails::refreshRPCInfo()
+{
+    PC::ExactlyOnceRPCInfo& info =
+        *static_cast<PC::StateMachineCommand::Request&>(*request).
+            mutable_tree()->mutable_exactly_once();
+    clientImpl.getRPCHelper(rpcHelperIndex).refreshRPCInfo(info);
+    rpcInfo = info;
+}
 
-using Protocol::Client::OpCode;
+void
+FutureDetails::finish(const PC::ReadOnlyTree::Response& tresponse)
+{
+    VERBOSE("Reply to read-only tree query:\n%s",
+            Core::StringUtil::trim(
+                Core::ProtoBuf::dumpString(tresponse)).c_str());
+    if (tresponse.status() != PC::Status::OK) {
+        finish(treeError(tresponse));
+        return;
+    }
+    if (tresponse.has_read()) {
+        contents = tresponse.read().contents();
+        version = tresponse.read().version();
+        if (tresponse.read().has_size()) {
+            size = tresponse.read().size();
+        } else {
+            // The server returned the entire file, either because this
+            // wasn't a ranged read or because it predates them.
+            size = contents.size();
+            if (readOffset != 0 || readLength != 0) {
+                contents = contents.substr(
+                    std::min(readOffset, size),
+                    readLength == 0 ? std::string::npos : readLength);
+            }
+        }
+        if (!cachePath.empty()) {
+            clientImpl.readCache.fill(cachePath, contents, version,
+                                      cacheToken, sentAt,
+                                      tresponse.read().lease_nanos());
+        }
+    }
+    if (tresponse.has_list_directory()) {
+        children = std::vector<std::string>(
+                        tresponse.list_directory().child().begin(),
+                        tresponse.list_directory().child().end());
+        more = tresponse.list_directory().more();
+    }
+    finish(Result());
+}
 
+void
+FutureDetails::finish(const PC::ReadWriteTree::Response& tresponse)
+{
+    VERBOSE("Reply to read-write tree command:\n%s",
+            Core::StringUtil::trim(
+                Core::ProtoBuf::dumpString(tresponse)).c_str());
+    if (tresponse.status() != PC::Status::OK) {
+        finish(treeError(tresponse));
+        return;
+    }
+    if (tresponse.has_increment())
+        value = tresponse.increment().value();
+    if (tresponse.has_version())
+        version = tresponse.version();
+    finish(Result());
+}
 
 ////////// class ClientImpl::ExactlyOnceRPCHelper //////////
 
@@ -222,6 +413,7 @@ ClientImpl::ExactlyOnceRPCHelper::ExactlyOnceRPCHelper(ClientImpl* client)
     , lastKeepAliveStart(TimePoint::min())
       // TODO(ongaro): set dynamically based on cluster configuration
     , keepAliveInterval(std::chrono::milliseconds(60 * 1000))
+    , renewSessionsSupported(true)
     , sessionCloseTimeout(std::chrono::milliseconds(
         client->config.read<uint64_t>(
             "sessionCloseTimeoutMilliseconds",
@@ -297,6 +489,16 @@ ClientImpl::ExactlyOnceRPCHelper::doneWithRPC(
     doneWithRPC(rpcInfo, Core::HoldingMutex(lockGuard));
 }
 
+void
+ClientImpl::ExactlyOnceRPCHelper::refreshRPCInfo(
+        Protocol::Client::ExactlyOnceRPCInfo& rpcInfo)
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    if (rpcInfo.client_id() != clientId || outstandingRPCNumbers.empty())
+        return;
+    rpcInfo.set_first_outstanding_rpc(*outstandingRPCNumbers.begin());
+}
+
 Protocol::Client::ExactlyOnceRPCInfo
 ClientImpl::ExactlyOnceRPCHelper::getRPCInfo(
         Core::HoldingMutex holdingMutex,
@@ -336,8 +538,9 @@ ClientImpl::ExactlyOnceRPCHelper::getRPCInfo(
             this);
     }
 
+    // The keep-alive thread notices this when its current wait times out;
+    // waking it on every RPC would cost a context switch each.
     lastKeepAliveStart = Clock::now();
-    keepAliveCV.notify_all();
     rpcInfo.set_client_id(clientId);
     uint64_t rpcNumber = nextRPCNumber;
     ++nextRPCNumber;
@@ -368,17 +571,32 @@ ClientImpl::ExactlyOnceRPCHelper::keepAliveThreadMain()
         }
         if (Clock::now() > nextKeepAlive) {
             Protocol::Client::StateMachineCommand::Request request;
-            Protocol::Client::ReadWriteTree::Request& trequest =
-                *request.mutable_tree();
-            *trequest.mutable_exactly_once() = getRPCInfo(
-                Core::HoldingMutex(lockGuard),
-                TimePoint::max());
-            setCondition(trequest,
-                 {"keepalive",
-                 "this is just a no-op to keep the client's session active; "
-                 "the condition is expected to fail"});
-            trequest.mutable_write()->set_path("keepalive");
-            trequest.mutable_write()->set_contents("you shouldn't see this!");
+            if (renewSessionsSupported) {
+                // The leader merges this with other clients' renewals into
+                // a single log entry.
+                lastKeepAliveStart = Clock::now();
+                Protocol::Client::RenewSessions::Request& renew =
+                    *request.mutable_renew_sessions();
+                renew.add_client_id(clientId);
+                if (outstandingRPCNumbers.empty())
+                    renew.add_first_outstanding_rpc(nextRPCNumber);
+                else
+                    renew.add_first_outstanding_rpc(
+                        *outstandingRPCNumbers.begin());
+            } else {
+                Protocol::Client::ReadWriteTree::Request& trequest =
+                    *request.mutable_tree();
+                *trequest.mutable_exactly_once() = getRPCInfo(
+                    Core::HoldingMutex(lockGuard),
+                    TimePoint::max());
+                setCondition(trequest,
+                     {"keepalive",
+                     "this is just a no-op to keep the client's session "
+                     "active; the condition is expected to fail"});
+                trequest.mutable_write()->set_path("keepalive");
+                trequest.mutable_write()->set_contents(
+                    "you shouldn't see this!");
+            }
             Protocol::Client::StateMachineCommand::Response response;
             keepAliveCall = client->leaderRPC->makeCall();
             keepAliveCall->start(OpCode::STATE_MACHINE_COMMAND, request,
@@ -398,9 +616,29 @@ ClientImpl::ExactlyOnceRPCHelper::keepAliveThreadMain()
                 case LeaderRPCBase::Call::Status::TIMEOUT:
                     PANIC("Unexpected timeout for keep-alive");
                 case LeaderRPCBase::Call::Status::INVALID_REQUEST:
+                    if (request.has_renew_sessions()) {
+                        NOTICE("The cluster doesn't support the "
+                               "RenewSessions command (introduced in state "
+                               "machine version 7). Falling back to no-op "
+                               "writes to keep session %lu alive.",
+                               clientId);
+                        renewSessionsSupported = false;
+                        lastKeepAliveStart = TimePoint::min();
+                        continue; // retry outer loop
+                    }
                     PANIC("The server rejected our keep-alive request (Tree "
                           "write with unmet condition) as invalid");
             }
+            if (request.has_renew_sessions()) {
+                if (response.renew_sessions().expired_client_id_size() > 0) {
+                    WARNING("Client session %lu expired before it could be "
+                            "renewed",
+                            clientId);
+                }
+                continue;
+            }
+            const Protocol::Client::ReadWriteTree::Request& trequest =
+                request.tree();
             doneWithRPC(trequest.exactly_once(),
                         Core::HoldingMutex(lockGuard));
             const Protocol::Client::ReadWriteTree::Response& tresponse =
@@ -418,6 +656,249 @@ ClientImpl::ExactlyOnceRPCHelper::keepAliveThreadMain()
     }
 }
 
+////////// class ClientImpl::WriteBatcher //////////
+
+ClientImpl::WriteBatcher::WriteBatcher(ClientImpl& client)
+    : client(client)
+    , maxOperations(client.config.read<uint64_t>(
+        "writeBatchMaxOperations", 1))
+    , maxBytes(Protocol::Common::MAX_MESSAGE_LENGTH - 1024)
+    , window(client.config.read<uint64_t>(
+        "writeBatchMicroseconds", 1000))
+    , mutex()
+    , changed()
+    , exiting(false)
+    , supported(true)
+    , pending()
+    , pendingSince(TimePoint::min())
+    , inFlight()
+    , call()
+    , thread()
+{
+}
+
+ClientImpl::WriteBatcher::~WriteBatcher()
+{
+    exit();
+}
+
+void
+ClientImpl::WriteBatcher::exit()
+{
+    {
+        std::lock_guard<Core::Mutex> lockGuard(mutex);
+        exiting = true;
+        if (call)
+            call->cancel();
+        changed.notify_all();
+    }
+    if (thread.joinable())
+        thread.join();
+}
+
+bool
+ClientImpl::WriteBatcher::add(FutureDetails& future)
+{
+    if (maxOperations <= 1)
+        return false;
+    if (getBatchedBytes(future) > maxBytes)
+        return false;
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    if (!supported || exiting)
+        return false;
+    if (!thread.joinable()) {
+        thread = std::thread(
+            &ClientImpl::WriteBatcher::batcherThreadMain,
+            this);
+    }
+    if (pending.empty())
+        pendingSince = Clock::now();
+    pending.push_back(&future);
+    future.batched = true;
+    changed.notify_all();
+    return true;
+}
+
+void
+ClientImpl::WriteBatcher::wait(FutureDetails& future)
+{
+    std::unique_lock<Core::Mutex> lockGuard(mutex);
+    while (future.batched)
+        changed.wait(lockGuard);
+}
+
+void
+ClientImpl::WriteBatcher::abandon(FutureDetails& future)
+{
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
+    if (!future.batched)
+        return;
+    auto it = std::find(pending.begin(), pending.end(), &future);
+    if (it != pending.end())
+        pending.erase(it);
+    FutureDetails* none = NULL;
+    std::replace(inFlight.begin(), inFlight.end(), &future, none);
+    future.batched = false;
+}
+
+void
+ClientImpl::WriteBatcher::batcherThreadMain()
+{
+    std::unique_lock<Core::Mutex> lockGuard(mutex);
+    while (!exiting) {
+        if (pending.empty()) {
+            changed.wait(lockGuard);
+            continue;
+        }
+        // Take as many commands as fit in one batch. The first one always
+        // fits, since add() turns away commands larger than maxBytes.
+        uint64_t n = 0;
+        uint64_t bytes = 0;
+        while (n < pending.size() && n < maxOperations) {
+            uint64_t commandBytes = getBatchedBytes(*pending.at(n));
+            if (n > 0 && bytes + commandBytes > maxBytes)
+                break;
+            bytes += commandBytes;
+            ++n;
+        }
+        bool full = (n == maxOperations || n < pending.size());
+        TimePoint sendAt = pendingSince + window;
+        if (!full && Clock::now() < sendAt) {
+            changed.wait_until(lockGuard, sendAt);
+            continue;
+        }
+        inFlight.assign(pending.begin(), pending.begin() + long(n));
+        pending.erase(pending.begin(), pending.begin() + long(n));
+        pendingSince = Clock::now();
+        sendBatch(lockGuard);
+    }
+
+    // Fail whatever is left, since no one will send it.
+    Result shuttingDown;
+    shuttingDown.status = Status::TIMEOUT;
+    shuttingDown.error = "Client library is shutting down";
+    inFlight.insert(inFlight.end(), pending.begin(), pending.end());
+    pending.clear();
+    for (auto it = inFlight.begin(); it != inFlight.end(); ++it) {
+        if (*it != NULL) {
+            (*it)->finish(shuttingDown);
+            (*it)->batched = false;
+        }
+    }
+    inFlight.clear();
+    changed.notify_all();
+}
+
+uint64_t
+ClientImpl::WriteBatcher::getBatchedBytes(const FutureDetails& future)
+{
+    const PC::ReadWriteTree::Request& trequest =
+        static_cast<const PC::StateMachineCommand::Request&>(
+            *future.request).tree();
+    // One byte of tag plus at most ten bytes of varint length prefix. The
+    // response must fit in an RPC too: an error message may quote the path
+    // twice along with a short excerpt of the file's contents, so count
+    // the command twice and add some slack for that.
+    return 2 * (uint64_t(trequest.ByteSize()) + 11) + 1024;
+}
+
+void
+ClientImpl::WriteBatcher::sendBatch(std::unique_lock<Core::Mutex>& lockGuard)
+{
+    while (!exiting) {
+        FutureDetails* none = NULL;
+        inFlight.erase(std::remove(inFlight.begin(), inFlight.end(), none),
+                       inFlight.end());
+        if (inFlight.empty())
+            return;
+        PC::StateMachineCommand::Request request;
+        TimePoint timeout = TimePoint::max();
+        for (auto it = inFlight.begin(); it != inFlight.end(); ++it) {
+            FutureDetails& future = **it;
+            *request.add_tree_batch() =
+                static_cast<PC::StateMachineCommand::Request&>(
+                    *future.request).tree();
+            timeout = std::min(timeout, future.timeout);
+        }
+        VERBOSE("Sending batch of %lu read-write tree commands",
+                inFlight.size());
+        PC::StateMachineCommand::Response response;
+        call = client.leaderRPC->makeCall();
+        call->start(OpCode::STATE_MACHINE_COMMAND, request, timeout);
+        LeaderRPCBase::Call::Status status;
+        {
+            // release lock to allow new commands to queue up meanwhile and
+            // to allow concurrent cancellation
+            Core::MutexUnlock<Core::Mutex> unlockGuard(lockGuard);
+            status = call->wait(response, timeout);
+        }
+        call.reset();
+        switch (status) {
+            case LeaderRPCBase::Call::Status::OK:
+                if (uint64_t(response.tree_batch_size()) != inFlight.size()) {
+                    PANIC("Sent %lu commands in a batch but got %d "
+                          "responses: %s",
+                          inFlight.size(),
+                          response.tree_batch_size(),
+                          Core::ProtoBuf::dumpString(response).c_str());
+                }
+                for (size_t i = 0; i < inFlight.size(); ++i) {
+                    if (inFlight.at(i) != NULL) {
+                        inFlight.at(i)->finish(
+                            response.tree_batch(int(i)));
+                        inFlight.at(i)->batched = false;
+                    }
+                }
+                inFlight.clear();
+                changed.notify_all();
+                return;
+            case LeaderRPCBase::Call::Status::RETRY:
+                // Resend the batch: the exactly-once RPC info of each
+                // command lets the cluster detect duplicates.
+                for (auto it = inFlight.begin(); it != inFlight.end(); ++it) {
+                    if (*it != NULL)
+                        (*it)->refreshRPCInfo();
+                }
+                break;
+            case LeaderRPCBase::Call::Status::TIMEOUT: {
+                // Fail the commands whose timeouts elapsed and keep going
+                // with the rest.
+                TimePoint now = Clock::now();
+                Result timedOut;
+                timedOut.status = Status::TIMEOUT;
+                timedOut.error = "Client-specified timeout elapsed";
+                for (auto it = inFlight.begin(); it != inFlight.end(); ++it) {
+                    if (*it != NULL && (*it)->timeout <= now) {
+                        (*it)->finish(timedOut);
+                        (*it)->batched = false;
+                        *it = NULL;
+                    }
+                }
+                changed.notify_all();
+                break;
+            }
+            case LeaderRPCBase::Call::Status::INVALID_REQUEST:
+                // The cluster did not apply the batch, so the commands can
+                // safely be sent again individually.
+                NOTICE("The cluster rejected a batch of read-write tree "
+                       "commands, probably because its state machine is "
+                       "older than version 6. Sending commands "
+                       "individually from now on.");
+                supported = false;
+                inFlight.insert(inFlight.end(), pending.begin(),
+                                pending.end());
+                pending.clear();
+                for (auto it = inFlight.begin(); it != inFlight.end(); ++it) {
+                    if (*it != NULL)
+                        (*it)->batched = false;
+                }
+                inFlight.clear();
+                changed.notify_all();
+                return;
+        }
+    }
+}
+
 ////////// class ClientImpl //////////
 
 ClientImpl::TimePoint
@@ -436,6 +917,12 @@ ClientImpl::absTimeout(uint64_t relTimeoutNanos)
 
 ClientImpl::ClientImpl(const std::map<std::string, std::string>& options)
     : config(options)
+    , readCache(ReadCache::parseMode(
+                    config.read<std::string>("readCache", "none")),
+                std::chrono::milliseconds(
+                    config.read<uint64_t>("readCacheMaxStalenessMilliseconds",
+                                          1000)),
+                config.read<uint64_t>("readCacheMaxEntries", 1000))
     , eventLoop()
     , clusterUUID()
     , sessionManager(eventLoop, config)
@@ -444,8 +931,13 @@ ClientImpl::ClientImpl(const std::map<std::string, std::string>& options)
     , hosts()
     , leaderRPC()             // set in init()
     , exactlyOnceRPCHelper(this)
+    , extraRPCHelpers()
+    , writeBatcher(*this)
     , eventLoopThread()
 {
+    uint64_t sessions = config.read<uint64_t>("exactlyOnceSessions", 1);
+    for (uint64_t i = 1; i < sessions; ++i)
+        extraRPCHelpers.emplace_back(new ExactlyOnceRPCHelper(this));
     NOTICE("Configuration settings:\n"
            "# begin config\n"
            "%s"
@@ -458,7 +950,10 @@ ClientImpl::ClientImpl(const std::map<std::string, std::string>& options)
 
 ClientImpl::~ClientImpl()
 {
+    writeBatcher.exit();
     exactlyOnceRPCHelper.exit();
+    for (auto it = extraRPCHelpers.begin(); it != extraRPCHelpers.end(); ++it)
+        (*it)->exit();
     eventLoop.exit();
     if (eventLoopThread.joinable())
         eventLoopThread.join();
@@ -544,6 +1039,12 @@ ClientImpl::setConfiguration(uint64_t oldId,
           Core::ProtoBuf::dumpString(response).c_str());
 }
 
+ReadCacheStats
+ClientImpl::getReadCacheStats() const
+{
+    return readCache.getStats();
+}
+
 Result
 ClientImpl::getServerInfo(const std::string& host,
                           TimePoint timeout,
@@ -670,22 +1171,8 @@ ClientImpl::makeDirectory(const std::string& path,
                           const Condition& condition,
                           TimePoint timeout)
 {
-    std::string realPath;
-    Result result = canonicalize(path, workingDirectory, realPath);
-    if (result.status != Status::OK)
-        return result;
-    Protocol::Client::ReadWriteTree::Request request;
-    *request.mutable_exactly_once() =
-        exactlyOnceRPCHelper.getRPCInfo(timeout);
-    setCondition(request, condition);
-    request.mutable_make_directory()->set_path(realPath);
-    Protocol::Client::ReadWriteTree::Response response;
-    treeCall(*leaderRPC,
-             request, response, timeout);
-    exactlyOnceRPCHelper.doneWithRPC(request.exactly_once());
-    if (response.status() != Protocol::Client::Status::OK)
-        return treeError(response);
-    return Result();
+    return makeDirectoryAsync(path, workingDirectory,
+                              condition, timeout)->wait();
 }
 
 Result
@@ -695,121 +1182,455 @@ ClientImpl::listDirectory(const std::string& path,
                           TimePoint timeout,
                           std::vector<std::string>& children)
 {
-    children.clear();
+    bool more;
+    return listDirectory(path, workingDirectory, "", "", 0,
+                         condition, timeout, children, more);
+}
+
+Result
+ClientImpl::listDirectory(const std::string& path,
+                          const std::string& workingDirectory,
+                          const std::string& startAfter,
+                          const std::string& prefix,
+                          uint64_t limit,
+                          const Condition& condition,
+                          TimePoint timeout,
+                          std::vector<std::string>& children,
+                          bool& more)
+{
+    std::shared_ptr<FutureDetails> future =
+        listDirectoryAsync(path, workingDirectory, startAfter, prefix, limit,
+                           condition, timeout);
+    Result result = future->wait();
+    children = future->children;
+    more = future->more;
+    return result;
+}
+
+Result
+ClientImpl::removeDirectory(const std::string& path,
+                            const std::string& workingDirectory,
+                            const Condition& condition,
+                            TimePoint timeout)
+{
+    return removeDirectoryAsync(path, workingDirectory,
+                                condition, timeout)->wait();
+}
+
+Result
+ClientImpl::write(const std::string& path,
+                  const std::string& workingDirectory,
+                  const std::string& contents,
+                  const Condition& condition,
+                  TimePoint timeout,
+                  bool ephemeral,
+                  uint64_t ttlNanos)
+{
+    return writeAsync(path, workingDirectory, contents,
+                      condition, timeout, ephemeral, ttlNanos)->wait();
+}
+
+Result
+ClientImpl::increment(const std::string& path,
+                      const std::string& workingDirectory,
+                      int64_t delta,
+                      const Condition& condition,
+                      TimePoint timeout,
+                      int64_t& value)
+{
+    std::shared_ptr<FutureDetails> future =
+        incrementAsync(path, workingDirectory, delta, condition, timeout);
+    Result result = future->wait();
+    value = future->value;
+    return result;
+}
+
+Result
+ClientImpl::append(const std::string& path,
+                   const std::string& workingDirectory,
+                   const std::string& contents,
+                   const Condition& condition,
+                   TimePoint timeout)
+{
+    return appendAsync(path, workingDirectory, contents,
+                       condition, timeout)->wait();
+}
+
+Result
+ClientImpl::compareAndSwap(const std::string& path,
+                           const std::string& workingDirectory,
+                           const std::string& oldContents,
+                           const std::string& newContents,
+                           const Condition& condition,
+                           TimePoint timeout,
+                           bool ephemeral,
+                           uint64_t ttlNanos)
+{
+    return compareAndSwapAsync(path, workingDirectory, oldContents,
+                               newContents, condition, timeout,
+                               ephemeral, ttlNanos)->wait();
+}
+
+Result
+ClientImpl::read(const std::string& path,
+                 const std::string& workingDirectory,
+                 const Condition& condition,
+                 TimePoint timeout,
+                 std::string& contents)
+{
+    uint64_t version;
+    return read(path, workingDirectory, condition, timeout, contents, version);
+}
+
+Result
+ClientImpl::read(const std::string& path,
+                 const std::string& workingDirectory,
+                 const Condition& condition,
+                 TimePoint timeout,
+                 std::string& contents,
+                 uint64_t& version)
+{
+    std::shared_ptr<FutureDetails> future =
+        readAsync(path, workingDirectory, condition, timeout);
+    Result result = future->wait();
+    contents = std::move(future->contents);
+    version = future->version;
+    return result;
+}
+
+Result
+ClientImpl::read(const std::string& path,
+                 const std::string& workingDirectory,
+                 uint64_t offset,
+                 uint64_t length,
+                 const Condition& condition,
+                 TimePoint timeout,
+                 std::string& contents,
+                 uint64_t& version,
+                 uint64_t& size)
+{
+    std::shared_ptr<FutureDetails> future =
+        readAsync(path, workingDirectory, offset, length, condition, timeout);
+    Result result = future->wait();
+    contents = std::move(future->contents);
+    version = future->version;
+    size = future->size;
+    return result;
+}
+
+Result
+ClientImpl::readStream(const std::string& path,
+                       const std::string& workingDirectory,
+                       const Condition& condition,
+                       TimePoint timeout,
+                       std::ostream& out,
+                       uint64_t pieceSize)
+{
     std::string realPath;
     Result result = canonicalize(path, workingDirectory, realPath);
     if (result.status != Status::OK)
         return result;
+    uint64_t firstVersion = 0;
+    uint64_t offset = 0;
+    while (true) {
+        std::string contents;
+        uint64_t version;
+        uint64_t size;
+        result = read(realPath, "/", offset, pieceSize, condition,
+                      timeout, contents, version, size);
+        if (result.status != Status::OK)
+            return result;
+        // The remaining pieces must come from the same version of the file
+        // (this can't be checked for files last modified before versions
+        // were tracked).
+        if (offset == 0) {
+            firstVersion = version;
+        } else if (version != firstVersion) {
+            result.status = Status::CONDITION_NOT_MET;
+            result.error = Core::StringUtil::format(
+                "Path '%s' changed from version %lu to %lu while it was "
+                "being read",
+                realPath.c_str(), firstVersion, version);
+            return result;
+        }
+        out.write(contents.data(), std::streamsize(contents.size()));
+        offset += contents.size();
+        if (contents.empty() || offset >= size)
+            return result;
+    }
+}
+
+Result
+ClientImpl::writeStream(const std::string& path,
+                        const std::string& workingDirectory,
+                        std::istream& in,
+                        const Condition& condition,
+                        TimePoint timeout,
+                        uint64_t pieceSize,
+                        bool ephemeral,
+                        uint64_t ttlNanos)
+{
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return result;
+    std::vector<char> buffer(std::max<uint64_t>(pieceSize, 1));
+    bool first = true;
+    uint64_t version = 0;
+    while (true) {
+        in.read(buffer.data(), std::streamsize(buffer.size()));
+        std::string piece(buffer.data(), size_t(in.gcount()));
+        std::shared_ptr<FutureDetails> future;
+        if (first) {
+            // The first piece replaces the file and checks the condition;
+            // the rest are appended to it.
+            future = writeAsync(realPath, "/", piece, condition, timeout,
+                                ephemeral, ttlNanos);
+            first = false;
+        } else if (!piece.empty()) {
+            // Each append requires the version left by the previous piece,
+            // so it fails if another writer touched the file in between
+            // (this can't be checked if the cluster doesn't track versions).
+            Condition pieceCondition;
+            if (version != 0)
+                pieceCondition = Condition(realPath, version);
+            future = appendAsync(realPath, "/", piece, pieceCondition,
+                                 timeout);
+        }
+        if (future) {
+            result = future->wait();
+            version = future->version;
+        }
+        if (result.status != Status::OK || !in)
+            return result;
+    }
+}
+
+Result
+ClientImpl::removeFile(const std::string& path,
+                       const std::string& workingDirectory,
+                       const Condition& condition,
+                       TimePoint timeout)
+{
+    return removeFileAsync(path, workingDirectory,
+                           condition, timeout)->wait();
+}
+
+std::shared_ptr<FutureDetails>
+ClientImpl::makeDirectoryAsync(const std::string& path,
+                               const std::string& workingDirectory,
+                               const Condition& condition,
+                               TimePoint timeout)
+{
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return finished(result, timeout);
+    Protocol::Client::ReadWriteTree::Request request;
+    setCondition(request, condition);
+    request.mutable_make_directory()->set_path(realPath);
+    return startCommand(request, timeout);
+}
+
+std::shared_ptr<FutureDetails>
+ClientImpl::listDirectoryAsync(const std::string& path,
+                               const std::string& workingDirectory,
+                               const std::string& startAfter,
+                               const std::string& prefix,
+                               uint64_t limit,
+                               const Condition& condition,
+                               TimePoint timeout)
+{
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return finished(result, timeout);
     Protocol::Client::ReadOnlyTree::Request request;
     setCondition(request, condition);
     request.mutable_list_directory()->set_path(realPath);
-    Protocol::Client::ReadOnlyTree::Response response;
-    treeCall(*leaderRPC,
-             request, response, timeout);
-    if (response.status() != Protocol::Client::Status::OK)
-        return treeError(response);
-    children = std::vector<std::string>(
-                    response.list_directory().child().begin(),
-                    response.list_directory().child().end());
-    return Result();
+    if (!startAfter.empty())
+        request.mutable_list_directory()->set_start_after(startAfter);
+    if (!prefix.empty())
+        request.mutable_list_directory()->set_prefix(prefix);
+    if (limit > 0)
+        request.mutable_list_directory()->set_limit(limit);
+    return startQuery(request, timeout);
 }
 
-Result
-ClientImpl::removeDirectory(const std::string& path,
-                            const std::string& workingDirectory,
-                            const Condition& condition,
-                            TimePoint timeout)
+std::shared_ptr<FutureDetails>
+ClientImpl::removeDirectoryAsync(const std::string& path,
+                                 const std::string& workingDirectory,
+                                 const Condition& condition,
+                                 TimePoint timeout)
 {
     std::string realPath;
     Result result = canonicalize(path, workingDirectory, realPath);
     if (result.status != Status::OK)
-        return result;
+        return finished(result, timeout);
     Protocol::Client::ReadWriteTree::Request request;
-    *request.mutable_exactly_once() =
-        exactlyOnceRPCHelper.getRPCInfo(timeout);
     setCondition(request, condition);
     request.mutable_remove_directory()->set_path(realPath);
-    Protocol::Client::ReadWriteTree::Response response;
-    treeCall(*leaderRPC,
-             request, response, timeout);
-    exactlyOnceRPCHelper.doneWithRPC(request.exactly_once());
-    if (response.status() != Protocol::Client::Status::OK)
-        return treeError(response);
-    return Result();
+    return startCommand(request, timeout);
 }
 
-Result
-ClientImpl::write(const std::string& path,
-                  const std::string& workingDirectory,
-                  const std::string& contents,
-                  const Condition& condition,
-                  TimePoint timeout)
+std::shared_ptr<FutureDetails>
+ClientImpl::writeAsync(const std::string& path,
+                       const std::string& workingDirectory,
+                       const std::string& contents,
+                       const Condition& condition,
+                       TimePoint timeout,
+                       bool ephemeral,
+                       uint64_t ttlNanos)
 {
     std::string realPath;
     Result result = canonicalize(path, workingDirectory, realPath);
     if (result.status != Status::OK)
-        return result;
+        return finished(result, timeout);
     Protocol::Client::ReadWriteTree::Request request;
-    *request.mutable_exactly_once() =
-        exactlyOnceRPCHelper.getRPCInfo(timeout);
     setCondition(request, condition);
     request.mutable_write()->set_path(realPath);
     request.mutable_write()->set_contents(contents);
-    Protocol::Client::ReadWriteTree::Response response;
-    treeCall(*leaderRPC,
-             request, response, timeout);
-    exactlyOnceRPCHelper.doneWithRPC(request.exactly_once());
-    if (response.status() != Protocol::Client::Status::OK)
-        return treeError(response);
-    return Result();
+    if (ephemeral)
+        request.mutable_write()->set_ephemeral(true);
+    if (ttlNanos != 0)
+        request.mutable_write()->set_ttl_nanos(ttlNanos);
+    return startCommand(request, timeout);
 }
 
-Result
-ClientImpl::read(const std::string& path,
-                 const std::string& workingDirectory,
-                 const Condition& condition,
-                 TimePoint timeout,
-                 std::string& contents)
+std::shared_ptr<FutureDetails>
+ClientImpl::incrementAsync(const std::string& path,
+                           const std::string& workingDirectory,
+                           int64_t delta,
+                           const Condition& condition,
+                           TimePoint timeout)
 {
-    contents = "";
     std::string realPath;
     Result result = canonicalize(path, workingDirectory, realPath);
     if (result.status != Status::OK)
-        return result;
+        return finished(result, timeout);
+    Protocol::Client::ReadWriteTree::Request request;
+    setCondition(request, condition);
+    request.mutable_increment()->set_path(realPath);
+    request.mutable_increment()->set_delta(delta);
+    return startCommand(request, timeout);
+}
+
+std::shared_ptr<FutureDetails>
+ClientImpl::appendAsync(const std::string& path,
+                        const std::string& workingDirectory,
+                        const std::string& contents,
+                        const Condition& condition,
+                        TimePoint timeout)
+{
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return finished(result, timeout);
+    Protocol::Client::ReadWriteTree::Request request;
+    setCondition(request, condition);
+    request.mutable_append()->set_path(realPath);
+    request.mutable_append()->set_contents(contents);
+    return startCommand(request, timeout);
+}
+
+std::shared_ptr<FutureDetails>
+ClientImpl::compareAndSwapAsync(const std::string& path,
+                                const std::string& workingDirectory,
+                                const std::string& oldContents,
+                                const std::string& newContents,
+                                const Condition& condition,
+                                TimePoint timeout,
+                                bool ephemeral,
+                                uint64_t ttlNanos)
+{
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return finished(result, timeout);
+    Protocol::Client::ReadWriteTree::Request request;
+    setCondition(request, condition);
+    request.mutable_compare_and_swap()->set_path(realPath);
+    request.mutable_compare_and_swap()->set_old_contents(oldContents);
+    request.mutable_compare_and_swap()->set_new_contents(newContents);
+    if (ephemeral)
+        request.mutable_compare_and_swap()->set_ephemeral(true);
+    if (ttlNanos != 0)
+        request.mutable_compare_and_swap()->set_ttl_nanos(ttlNanos);
+    return startCommand(request, timeout);
+}
+
+std::shared_ptr<FutureDetails>
+ClientImpl::readAsync(const std::string& path,
+                      const std::string& workingDirectory,
+                      const Condition& condition,
+                      TimePoint timeout)
+{
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return finished(result, timeout);
     Protocol::Client::ReadOnlyTree::Request request;
     setCondition(request, condition);
     request.mutable_read()->set_path(realPath);
-    Protocol::Client::ReadOnlyTree::Response response;
-    treeCall(*leaderRPC,
-             request, response, timeout);
-    if (response.status() != Protocol::Client::Status::OK)
-        return treeError(response);
-    contents = response.read().contents();
-    return Result();
+    ReadCache::Mode mode = readCache.getMode();
+    if (mode == ReadCache::Mode::DISABLED || !condition.path.empty())
+        return startQuery(request, timeout);
+
+    std::shared_ptr<FutureDetails> future =
+        std::make_shared<FutureDetails>(*this, timeout);
+    if (readCache.lookup(realPath, future->contents, future->version)) {
+        future->finish(Result());
+        return future;
+    }
+    if (mode == ReadCache::Mode::LINEARIZABLE)
+        request.mutable_read()->set_lease(true);
+    future->cachePath = realPath;
+    future->cacheToken = readCache.beginFill();
+    future->sentAt = Clock::now();
+    future->start(request);
+    return future;
 }
 
-Result
-ClientImpl::removeFile(const std::string& path,
-                       const std::string& workingDirectory,
-                       const Condition& condition,
-                       TimePoint timeout)
+std::shared_ptr<FutureDetails>
+ClientImpl::readAsync(const std::string& path,
+                      const std::string& workingDirectory,
+                      uint64_t offset,
+                      uint64_t length,
+                      const Condition& condition,
+                      TimePoint timeout)
 {
     std::string realPath;
     Result result = canonicalize(path, workingDirectory, realPath);
     if (result.status != Status::OK)
-        return result;
+        return finished(result, timeout);
+    Protocol::Client::ReadOnlyTree::Request request;
+    setCondition(request, condition);
+    request.mutable_read()->set_path(realPath);
+    request.mutable_read()->set_offset(offset);
+    if (length != 0)
+        request.mutable_read()->set_length(length);
+    std::shared_ptr<FutureDetails> future =
+        std::make_shared<FutureDetails>(*this, timeout);
+    future->readOffset = offset;
+    future->readLength = length;
+    future->start(request);
+    return future;
+}
+
+std::shared_ptr<FutureDetails>
+ClientImpl::removeFileAsync(const std::string& path,
+                            const std::string& workingDirectory,
+                            const Condition& condition,
+                            TimePoint timeout)
+{
+    std::string realPath;
+    Result result = canonicalize(path, workingDirectory, realPath);
+    if (result.status != Status::OK)
+        return finished(result, timeout);
     Protocol::Client::ReadWriteTree::Request request;
-    *request.mutable_exactly_once() =
-        exactlyOnceRPCHelper.getRPCInfo(timeout);
     setCondition(request, condition);
     request.mutable_remove_file()->set_path(realPath);
-    Protocol::Client::ReadWriteTree::Response response;
-    treeCall(*leaderRPC,
-             request, response, timeout);
-    exactlyOnceRPCHelper.doneWithRPC(request.exactly_once());
-    if (response.status() != Protocol::Client::Status::OK)
-        return treeError(response);
-    return Result();
+    return startCommand(request, timeout);
 }
 
 Result
@@ -879,5 +1700,54 @@ ClientImpl::serverControl(const std::string& host,
 }
 
 
+std::shared_ptr<FutureDetails>
+ClientImpl::startCommand(Protocol::Client::ReadWriteTree::Request& request,
+                         TimePoint timeout)
+{
+    size_t rpcHelperIndex = pickRPCHelper();
+    *request.mutable_exactly_once() =
+        getRPCHelper(rpcHelperIndex).getRPCInfo(timeout);
+    std::shared_ptr<FutureDetails> future =
+        std::make_shared<FutureDetails>(*this, timeout);
+    future->rpcHelperIndex = rpcHelperIndex;
+    future->start(request);
+    return future;
+}
+
+size_t
+ClientImpl::pickRPCHelper() const
+{
+    if (extraRPCHelpers.empty())
+        return 0;
+    return Core::ThreadId::getId() % (extraRPCHelpers.size() + 1);
+}
+
+ClientImpl::ExactlyOnceRPCHelper&
+ClientImpl::getRPCHelper(size_t index)
+{
+    if (index == 0)
+        return exactlyOnceRPCHelper;
+    return *extraRPCHelpers.at(index - 1);
+}
+
+std::shared_ptr<FutureDetails>
+ClientImpl::startQuery(const Protocol::Client::ReadOnlyTree::Request& request,
+                       TimePoint timeout)
+{
+    std::shared_ptr<FutureDetails> future =
+        std::make_shared<FutureDetails>(*this, timeout);
+    future->start(request);
+    return future;
+}
+
+std::shared_ptr<FutureDetails>
+ClientImpl::finished(const Result& result, TimePoint timeout)
+{
+    std::shared_ptr<FutureDetails> future =
+        std::make_shared<FutureDetails>(*this, timeout);
+    future->finish(result);
+    return future;
+}
+
 } // namespace LogCabin::Client
 } // namespace LogCabin
@@ -14,6 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <deque>
+#include <iosfwd>
 #include <memory>
 #include <set>
 #include <string>
@@ -23,6 +25,7 @@
 #include "include/LogCabin/Client.h"
 #include "Client/Backoff.h"
 #include "Client/LeaderRPC.h"
+#include "Client/ReadCache.h"
 #include "Client/SessionManager.h"
 #include "Core/ConditionVariable.h"
 #include "Core/Config.h"
@@ -38,12 +41,243 @@ namespace Client {
 
 /**
  * A predicate on tree operations.
- * First component: the absolute path corresponding to the 'path'
- * argument of setCondition(), or empty if no condition is set.
- * Second component: the file contents given as the 'value' argument of
- * setCondition().
  */
-typedef std::pair<std::string, std::string> Condition;
+struct Condition {
+    /// Construct an empty condition (no predicate).
+    Condition();
+    /// Construct a condition on the contents of a file.
+    Condition(const std::string& path, const std::string& contents);
+    /// Construct a condition on the version of a file or directory.
+    Condition(const std::string& path, uint64_t version);
+    /// Return true if both conditions specify the same predicate.
+    bool operator==(const Condition& other) const;
+    /**
+     * The absolute path corresponding to the 'path' argument of
+     * setCondition(), or empty if no condition is set.
+     */
+    std::string path;
+    /**
+     * The file contents given as the 'value' argument of setCondition().
+     * Unused if 'hasVersion' is set.
+     */
+    std::string contents;
+    /**
+     * True if this is a condition on 'version' rather than 'contents'.
+     */
+    bool hasVersion;
+    /**
+     * The version given as the 'version' argument of setCondition().
+     */
+    uint64_t version;
+};
+
+/**
+ * Implementation-specific members of Client::Future: a tree operation that
+ * was started asynchronously. ClientImpl sends the request when it creates
+ * this object, and wait() collects the response, retrying on new leaders as
+ * needed.
+ */
+class FutureDetails {
+  public:
+    /// Clock used for timeouts.
+    typedef LeaderRPCBase::Clock Clock;
+    /// Type for absolute time values used for timeouts.
+    typedef LeaderRPCBase::TimePoint TimePoint;
+
+    /**
+     * Constructor.
+     * \param clientImpl
+     *      Used to send the request and, for read-write operations, to report
+     *      when the operation is done with its exactly-once RPC info.
+     * \param timeout
+     *      Absolute time after which wait() gives up on the operation.
+     */
+    FutureDetails(ClientImpl& clientImpl, TimePoint timeout);
+
+    /**
+     * Destructor. Abandons the operation if it hasn't completed.
+     */
+    ~FutureDetails();
+
+    /**
+     * Send a read-only tree query.
+     */
+    void start(const Protocol::Client::ReadOnlyTree::Request& request);
+
+    /**
+     * Send a read-write tree command. The request's exactly-once RPC info
+     * must come from ClientImpl's ExactlyOnceRPCHelper; this object calls
+     * doneWithRPC() once the operation completes or is abandoned.
+     */
+    void start(const Protocol::Client::ReadWriteTree::Request& request);
+
+    /**
+     * Complete the operation without sending anything, for example because
+     * the arguments were invalid.
+     */
+    void finish(const Result& result);
+
+    /**
+     * Wait for the operation to complete or the timeout to elapse.
+     * \return
+     *      The outcome of the operation.
+     */
+    const Result& wait();
+
+    /**
+     * Fill in the results from a read-write tree response and mark the
+     * operation done. Used by wait() and by ClientImpl's write batcher.
+     */
+    void finish(const Protocol::Client::ReadWriteTree::Response& tresponse);
+
+    /**
+     * Before a read-write command is sent again, update the first
+     * outstanding RPC number in its request. This lets the cluster discard
+     * the responses that the client has received since the command was
+     * first sent, which it may need to do before it will apply this one.
+     */
+    void refreshRPCInfo();
+
+    /**
+     * Client implementation.
+     */
+    ClientImpl& clientImpl;
+
+    /**
+     * If set, keeps clientImpl from being destroyed while the operation is
+     * outstanding. Client::Tree sets this; unit tests may not.
+     */
+    std::shared_ptr<ClientImpl> clientImplRef;
+
+    /**
+     * See constructor.
+     */
+    const TimePoint timeout;
+
+    /**
+     * Operation code of the request: STATE_MACHINE_QUERY or
+     * STATE_MACHINE_COMMAND.
+     */
+    Protocol::Client::OpCode opCode;
+
+    /**
+     * The StateMachineQuery or StateMachineCommand request, kept for retries.
+     */
+    std::unique_ptr<google::protobuf::Message> request;
+
+    /**
+     * Receives the StateMachineQuery or StateMachineCommand response.
+     */
+    std::unique_ptr<google::protobuf::Message> response;
+
+    /**
+     * The RPC to the cluster leader, or NULL once the operation completed.
+     */
+    std::unique_ptr<LeaderRPCBase::Call> call;
+
+    /**
+     * For read-write commands, the exactly-once RPC info the request carries.
+     * Its client_id is 0 for read-only queries.
+     */
+    Protocol::Client::ExactlyOnceRPCInfo rpcInfo;
+
+    /**
+     * For read-write commands, which of the client's sessions rpcInfo came
+     * from. See ClientImpl::getRPCHelper().
+     */
+    size_t rpcHelperIndex;
+
+    /**
+     * Set once the operation completed and 'result' and the fields below are
+     * filled in.
+     */
+    bool done;
+
+    /**
+     * Outcome of the operation, once 'done' is set.
+     */
+    Result result;
+
+    /**
+     * For successful reads, the file's contents.
+     */
+    std::string contents;
+
+    /**
+     * For successful reads, the file's version. For successful writes and
+     * appends, the file's new version (0 if the cluster doesn't say).
+     */
+    uint64_t version;
+
+    /**
+     * For successful reads, the total number of bytes in the file (which
+     * may be more than 'contents' for ranged reads).
+     */
+    uint64_t size;
+
+    /**
+     * For successful increments, the counter's new value.
+     */
+    int64_t value;
+
+    /**
+     * For successful directory listings, the children.
+     */
+    std::vector<std::string> children;
+
+    /**
+     * For successful directory listings, whether more children follow.
+     */
+    bool more;
+
+    /**
+     * Set while ClientImpl's write batcher owns this read-write command,
+     * until it either completes the command or hands it back to be sent on
+     * its own. Protected by the batcher's mutex.
+     */
+    bool batched;
+
+    /**
+     * For ranged reads, the offset requested (see ClientImpl::readAsync()).
+     * Used to trim the contents returned by servers that predate ranged
+     * reads.
+     */
+    uint64_t readOffset;
+
+    /**
+     * For ranged reads, the length requested, or 0 for the rest of the file.
+     */
+    uint64_t readLength;
+
+    /**
+     * For reads that may be stored in ClientImpl's read cache, the canonical
+     * path of the file. Empty otherwise.
+     */
+    std::string cachePath;
+
+    /**
+     * For reads that may be stored in the read cache, the value of
+     * ReadCache::beginFill() from before the query was sent.
+     */
+    uint64_t cacheToken;
+
+    /**
+     * For reads that may be stored in the read cache, when the query was
+     * sent.
+     */
+    TimePoint sentAt;
+
+  private:
+    /**
+     * Fill in the results from a read-only tree response and mark the
+     * operation done.
+     */
+    void finish(const Protocol::Client::ReadOnlyTree::Response& tresponse);
+
+    // FutureDetails is not copyable
+    FutureDetails(const FutureDetails&) = delete;
+    FutureDetails& operator=(const FutureDetails&) = delete;
+};
 
 /**
  * The implementation of the client library.
@@ -91,6 +325,9 @@ class ClientImpl {
                             uint64_t oldId,
                             const Configuration& newConfiguration);
 
+    /// See Cluster::getReadCacheStats.
+    ReadCacheStats getReadCacheStats() const;
+
     /// See Cluster::getServerInfo.
     Result getServerInfo(const std::string& host,
                          TimePoint timeout,
@@ -123,18 +360,56 @@ class ClientImpl {
                          TimePoint timeout,
                          std::vector<std::string>& children);
 
+    /// See Tree::listDirectory.
+    Result listDirectory(const std::string& path,
+                         const std::string& workingDirectory,
+                         const std::string& startAfter,
+                         const std::string& prefix,
+                         uint64_t limit,
+                         const Condition& condition,
+                         TimePoint timeout,
+                         std::vector<std::string>& children,
+                         bool& more);
+
     /// See Tree::removeDirectory.
     Result removeDirectory(const std::string& path,
                            const std::string& workingDirectory,
                            const Condition& condition,
                            TimePoint timeout);
 
-    /// See Tree::write.
+    /// See Tree::write, Tree::setEphemeral, and Tree::setTTL.
     Result write(const std::string& path,
                  const std::string& workingDirectory,
                  const std::string& contents,
                  const Condition& condition,
-                 TimePoint timeout);
+                 TimePoint timeout,
+                 bool ephemeral = false,
+                 uint64_t ttlNanos = 0);
+
+    /// See Tree::increment.
+    Result increment(const std::string& path,
+                     const std::string& workingDirectory,
+                     int64_t delta,
+                     const Condition& condition,
+                     TimePoint timeout,
+                     int64_t& value);
+
+    /// See Tree::append.
+    Result append(const std::string& path,
+                  const std::string& workingDirectory,
+                  const std::string& contents,
+                  const Condition& condition,
+                  TimePoint timeout);
+
+    /// See Tree::compareAndSwap, Tree::setEphemeral, and Tree::setTTL.
+    Result compareAndSwap(const std::string& path,
+                          const std::string& workingDirectory,
+                          const std::string& oldContents,
+                          const std::string& newContents,
+                          const Condition& condition,
+                          TimePoint timeout,
+                          bool ephemeral = false,
+                          uint64_t ttlNanos = 0);
 
     /// See Tree::read.
     Result read(const std::string& path,
@@ -143,12 +418,135 @@ class ClientImpl {
                 TimePoint timeout,
                 std::string& contents);
 
+    /// See Tree::read.
+    Result read(const std::string& path,
+                const std::string& workingDirectory,
+                const Condition& condition,
+                TimePoint timeout,
+                std::string& contents,
+                uint64_t& version);
+
+    /// See Tree::read (with offset and length).
+    Result read(const std::string& path,
+                const std::string& workingDirectory,
+                uint64_t offset,
+                uint64_t length,
+                const Condition& condition,
+                TimePoint timeout,
+                std::string& contents,
+                uint64_t& version,
+                uint64_t& size);
+
+    /// See Tree::readStream.
+    Result readStream(const std::string& path,
+                      const std::string& workingDirectory,
+                      const Condition& condition,
+                      TimePoint timeout,
+                      std::ostream& out,
+                      uint64_t pieceSize);
+
+    /// See Tree::writeStream, Tree::setEphemeral, and Tree::setTTL.
+    Result writeStream(const std::string& path,
+                       const std::string& workingDirectory,
+                       std::istream& in,
+                       const Condition& condition,
+                       TimePoint timeout,
+                       uint64_t pieceSize,
+                       bool ephemeral = false,
+                       uint64_t ttlNanos = 0);
+
     /// See Tree::removeFile.
     Result removeFile(const std::string& path,
                       const std::string& workingDirectory,
                       const Condition& condition,
                       TimePoint timeout);
 
+    /// See Tree::makeDirectoryAsync.
+    std::shared_ptr<FutureDetails>
+    makeDirectoryAsync(const std::string& path,
+                       const std::string& workingDirectory,
+                       const Condition& condition,
+                       TimePoint timeout);
+
+    /// See Tree::listDirectoryAsync.
+    std::shared_ptr<FutureDetails>
+    listDirectoryAsync(const std::string& path,
+                       const std::string& workingDirectory,
+                       const std::string& startAfter,
+                       const std::string& prefix,
+                       uint64_t limit,
+                       const Condition& condition,
+                       TimePoint timeout);
+
+    /// See Tree::removeDirectoryAsync.
+    std::shared_ptr<FutureDetails>
+    removeDirectoryAsync(const std::string& path,
+                         const std::string& workingDirectory,
+                         const Condition& condition,
+                         TimePoint timeout);
+
+    /// See Tree::writeAsync, Tree::setEphemeral, and Tree::setTTL.
+    std::shared_ptr<FutureDetails>
+    writeAsync(const std::string& path,
+               const std::string& workingDirectory,
+               const std::string& contents,
+               const Condition& condition,
+               TimePoint timeout,
+               bool ephemeral = false,
+               uint64_t ttlNanos = 0);
+
+    /// See Tree::incrementAsync.
+    std::shared_ptr<FutureDetails>
+    incrementAsync(const std::string& path,
+                   const std::string& workingDirectory,
+                   int64_t delta,
+                   const Condition& condition,
+                   TimePoint timeout);
+
+    /// See Tree::appendAsync.
+    std::shared_ptr<FutureDetails>
+    appendAsync(const std::string& path,
+                const std::string& workingDirectory,
+                const std::string& contents,
+                const Condition& condition,
+                TimePoint timeout);
+
+    /// See Tree::compareAndSwapAsync, Tree::setEphemeral, and
+    /// Tree::setTTL.
+    std::shared_ptr<FutureDetails>
+    compareAndSwapAsync(const std::string& path,
+                        const std::string& workingDirectory,
+                        const std::string& oldContents,
+                        const std::string& newContents,
+                        const Condition& condition,
+                        TimePoint timeout,
+                        bool ephemeral = false,
+                        uint64_t ttlNanos = 0);
+
+    /// See Tree::readAsync.
+    std::shared_ptr<FutureDetails>
+    readAsync(const std::string& path,
+              const std::string& workingDirectory,
+              const Condition& condition,
+              TimePoint timeout);
+
+    /// Asynchronous version of read (with offset and length). Ranged reads
+    /// bypass the read cache.
+    std::shared_ptr<FutureDetails>
+    readAsync(const std::string& path,
+              const std::string& workingDirectory,
+              uint64_t offset,
+              uint64_t length,
+              const Condition& condition,
+              TimePoint timeout);
+
+    /// See Tree::removeFileAsync.
+    std::shared_ptr<FutureDetails>
+    removeFileAsync(const std::string& path,
+                    const std::string& workingDirectory,
+                    const Condition& condition,
+                    TimePoint timeout);
+
     /**
      * Low-level interface to ServerControl service used by
      * Client/ServerControl.cc.
@@ -161,11 +559,39 @@ class ClientImpl {
 
   protected:
 
+    /**
+     * Start a read-write tree command asynchronously. Assigns the request
+     * its exactly-once RPC info first.
+     */
+    std::shared_ptr<FutureDetails>
+    startCommand(Protocol::Client::ReadWriteTree::Request& request,
+                 TimePoint timeout);
+
+    /**
+     * Start a read-only tree query asynchronously.
+     */
+    std::shared_ptr<FutureDetails>
+    startQuery(const Protocol::Client::ReadOnlyTree::Request& request,
+               TimePoint timeout);
+
+    /**
+     * Return a FutureDetails that has already completed with the given
+     * result.
+     */
+    std::shared_ptr<FutureDetails>
+    finished(const Result& result, TimePoint timeout);
+
     /**
      * Options/settings.
      */
     const Core::Config config;
 
+    /**
+     * Holds the results of recent reads, if enabled with the readCache
+     * option.
+     */
+    ReadCache readCache;
+
     /**
      * The Event::Loop used to drive the underlying RPC mechanism.
      */
@@ -239,6 +665,12 @@ class ClientImpl {
          * Call this after receiving an RPCs response.
          */
         void doneWithRPC(const Protocol::Client::ExactlyOnceRPCInfo&);
+        /**
+         * Call this before resending an RPC. Sets the info's
+         * first_outstanding_rpc to the lowest RPC number for which this
+         * client is still awaiting a response.
+         */
+        void refreshRPCInfo(Protocol::Client::ExactlyOnceRPCInfo& rpcInfo);
 
       private:
 
@@ -256,6 +688,8 @@ class ClientImpl {
         /**
          * Main function for keep-alive thread. Periodically makes
          * requests to the cluster to keep the client's session active.
+         * These use the RenewSessions command, which the leader merges across
+         * clients, if the cluster supports it.
          */
         void keepAliveThreadMain();
 
@@ -283,8 +717,9 @@ class ClientImpl {
          */
         uint64_t nextRPCNumber;
         /**
-         * keepAliveThread blocks on this. Notified when lastKeepAliveStart,
-         * keepAliveIntervalMs, or exiting changes.
+         * keepAliveThread blocks on this. Notified when keepAliveInterval or
+         * exiting changes. It isn't notified when lastKeepAliveStart moves
+         * later; the thread just waits again when it wakes up.
          */
         Core::ConditionVariable keepAliveCV;
         /**
@@ -302,6 +737,12 @@ class ClientImpl {
          * inactivity.
          */
         std::chrono::milliseconds keepAliveInterval;
+        /**
+         * True if keep-alives should use the RenewSessions command, false
+         * once the cluster has rejected it. In that case keep-alives fall back
+         * to read-write tree commands, which cost a log entry each.
+         */
+        bool renewSessionsSupported;
         /**
          * How long to wait for the CloseSession RPC before giving up.
          */
@@ -325,13 +766,182 @@ class ClientImpl {
         // ExactlyOnceRPCHelper is not copyable.
         ExactlyOnceRPCHelper(const ExactlyOnceRPCHelper&) = delete;
         ExactlyOnceRPCHelper& operator=(const ExactlyOnceRPCHelper&) = delete;
-    } exactlyOnceRPCHelper;
+    };
+
+    /**
+     * Return the index of the session that read-write commands from the
+     * calling thread should use. Threads are spread round-robin across
+     * #exactlyOnceRPCHelper and #extraRPCHelpers by thread ID, so each thread
+     * always uses the same session.
+     */
+    size_t pickRPCHelper() const;
+
+    /**
+     * Return the session with the given index: 0 for #exactlyOnceRPCHelper,
+     * or one of #extraRPCHelpers.
+     */
+    ExactlyOnceRPCHelper& getRPCHelper(size_t index);
+
+    /**
+     * Provides exactly-once semantics for read-write RPCs using the client's
+     * first session with the cluster.
+     */
+    ExactlyOnceRPCHelper exactlyOnceRPCHelper;
+
+    /**
+     * Additional sessions with the cluster, so that threads issuing many
+     * read-write commands at once don't all contend for the one
+     * ExactlyOnceRPCHelper mutex. There are exactlyOnceSessions - 1 of these
+     * (see Cluster::Options). Like #exactlyOnceRPCHelper, each opens its
+     * session lazily, so sessions no thread uses are never opened.
+     */
+    std::vector<std::unique_ptr<ExactlyOnceRPCHelper>> extraRPCHelpers;
+
+    /**
+     * Coalesces read-write tree commands issued around the same time, possibly
+     * from many threads, into a single StateMachineCommand carrying a
+     * tree_batch. Each operation keeps its own exactly-once RPC info, so the
+     * cluster applies and caches each one separately, and each caller gets
+     * its own Result. This is opt-in (see Cluster::Options): it trades up to
+     * writeBatchMicroseconds of latency for far fewer RPCs and log entries.
+     *
+     * One batch is in flight at a time; commands issued meanwhile form the
+     * next batch. If the cluster rejects batches (it runs a state machine
+     * version older than 6), the batcher hands all its commands back to be
+     * sent individually and disables itself.
+     *
+     * This class is implemented in a monitor style.
+     */
+    class WriteBatcher {
+      public:
+        /**
+         * Constructor.
+         * \param client
+         *      Used to read settings and send batches to the cluster.
+         */
+        explicit WriteBatcher(ClientImpl& client);
+        /**
+         * Destructor.
+         */
+        ~WriteBatcher();
+        /**
+         * Prepare to shut down (join with thread). Commands that haven't
+         * completed by then fail with a TIMEOUT status.
+         */
+        void exit();
+        /**
+         * Queue a read-write command to be sent as part of a batch.
+         * \param future
+         *      Command whose request has been filled in but not sent.
+         * \return
+         *      True if the batcher took ownership of the command (and set
+         *      its 'batched' flag); false if batching is disabled or the
+         *      command alone is larger than #maxBytes, in which case the
+         *      caller should send the command itself.
+         */
+        bool add(FutureDetails& future);
+        /**
+         * Block until the batcher no longer owns the given command: either
+         * it completed or it needs to be sent on its own.
+         */
+        void wait(FutureDetails& future);
+        /**
+         * Forget the given command, which is being destroyed. Its response,
+         * if one arrives, is dropped.
+         */
+        void abandon(FutureDetails& future);
+
+      private:
+        /**
+         * Main function for the batcher thread. Waits for commands to
+         * accumulate for up to #window, then sends them with sendBatch().
+         */
+        void batcherThreadMain();
+        /**
+         * Send the commands in #inFlight as one batch, retrying until each
+         * completes, times out, or is abandoned.
+         */
+        void sendBatch(std::unique_lock<Core::Mutex>& lockGuard);
+        /**
+         * Return the number of bytes the given command may add to a batch
+         * request or to its response, whichever is larger.
+         */
+        static uint64_t getBatchedBytes(const FutureDetails& future);
+
+        /**
+         * Used to send batches to the cluster.
+         */
+        ClientImpl& client;
+        /**
+         * Largest number of commands sent in one batch. Batching is disabled
+         * if this is 1 or less. Non-const for unit tests.
+         */
+        uint64_t maxOperations;
+        /**
+         * Largest number of bytes of commands sent in one batch, so that the
+         * batch and its response each fit in a single RPC (see
+         * getBatchedBytes()). Non-const for unit tests.
+         */
+        uint64_t maxBytes;
+        /**
+         * How long the first queued command waits for others to join its
+         * batch. Non-const for unit tests.
+         */
+        std::chrono::microseconds window;
+        /**
+         * Protects all the members of this class and the 'batched' flag of
+         * each command it owns.
+         */
+        mutable Core::Mutex mutex;
+        /**
+         * Notified when commands are queued or complete, when the batcher
+         * disables itself, and when exiting.
+         */
+        Core::ConditionVariable changed;
+        /**
+         * Flag to the batcher thread that it should shut down.
+         */
+        bool exiting;
+        /**
+         * Cleared once the cluster rejects a batch as invalid.
+         */
+        bool supported;
+        /**
+         * Commands waiting to be sent, oldest first.
+         */
+        std::deque<FutureDetails*> pending;
+        /**
+         * When the oldest command in #pending was queued.
+         */
+        TimePoint pendingSince;
+        /**
+         * Commands in the batch being sent. Abandoned commands are replaced
+         * with NULL so that the rest still line up with the responses.
+         */
+        std::vector<FutureDetails*> inFlight;
+        /**
+         * If set, this is the RPC carrying the current batch. It is canceled
+         * to interrupt #thread when exiting.
+         */
+        std::unique_ptr<LeaderRPCBase::Call> call;
+        /**
+         * Runs batcherThreadMain(). Spawned lazily on the first batched
+         * command.
+         */
+        std::thread thread;
+
+        // WriteBatcher is not copyable.
+        WriteBatcher(const WriteBatcher&) = delete;
+        WriteBatcher& operator=(const WriteBatcher&) = delete;
+    } writeBatcher;
 
     /**
      * A thread that runs the Event::Loop.
      */
     std::thread eventLoopThread;
 
+    friend class FutureDetails;
+
     // ClientImpl is not copyable
     ClientImpl(const ClientImpl&) = delete;
     ClientImpl& operator=(const ClientImpl&) = delete;
@@ -15,11 +15,13 @@
  */
 
 #include <gtest/gtest.h>
+#include <thread>
 
 #include "Client/ClientImpl.h"
 #include "Client/LeaderRPCMock.h"
 #include "Core/ProtoBuf.h"
 #include "Core/StringUtil.h"
+#include "Core/ThreadId.h"
 #include "Core/Time.h"
 #include "Protocol/Common.h"
 #include "RPC/Server.h"
@@ -157,6 +159,216 @@ TEST_F(ClientClientImplExactlyOnceTest, doneWithRPC) {
     EXPECT_EQ(4U, rpcInfo5.first_outstanding_rpc());
 }
 
+TEST_F(ClientClientImplExactlyOnceTest, refreshRPCInfo) {
+    client.exactlyOnceRPCHelper.refreshRPCInfo(rpcInfo2);
+    EXPECT_EQ(1U, rpcInfo2.first_outstanding_rpc());
+    client.exactlyOnceRPCHelper.doneWithRPC(rpcInfo1);
+    client.exactlyOnceRPCHelper.refreshRPCInfo(rpcInfo2);
+    EXPECT_EQ(2U, rpcInfo2.first_outstanding_rpc());
+    EXPECT_EQ(2U, rpcInfo2.rpc_number());
+
+    // info from another session is left alone
+    RPCInfo other = rpcInfo1;
+    other.set_client_id(4);
+    client.exactlyOnceRPCHelper.refreshRPCInfo(other);
+    EXPECT_EQ(1U, other.first_outstanding_rpc());
+}
+
+TEST_F(ClientClientImplExactlyOnceTest, asyncCommands) {
+    mockRPC->expect(OpCode::STATE_MACHINE_COMMAND,
+        fromString<Protocol::Client::StateMachineCommand::Response>(
+                    "tree { status: OK }"));
+    mockRPC->expect(OpCode::STATE_MACHINE_COMMAND,
+        fromString<Protocol::Client::StateMachineCommand::Response>(
+                    "tree { status: CONDITION_NOT_MET error: 'no' }"));
+    std::shared_ptr<Client::FutureDetails> future1 =
+        client.writeAsync("a", "/", "x", {}, TimePoint::max());
+    std::shared_ptr<Client::FutureDetails> future2 =
+        client.writeAsync("b", "/", "y", {}, TimePoint::max());
+    // both are in flight at once
+    mockRPC->popRequest();
+    EXPECT_EQ("tree { "
+              "  exactly_once { "
+              "    client_id: 3 first_outstanding_rpc: 1 rpc_number: 3 "
+              "  } "
+              "  write { path: '/a' contents: 'x' } "
+              "}", *mockRPC->popRequest());
+    EXPECT_EQ("tree { "
+              "  exactly_once { "
+              "    client_id: 3 first_outstanding_rpc: 1 rpc_number: 4 "
+              "  } "
+              "  write { path: '/b' contents: 'y' } "
+              "}", *mockRPC->popRequest());
+    EXPECT_EQ((std::set<uint64_t>{1, 2, 3, 4}),
+              client.exactlyOnceRPCHelper.outstandingRPCNumbers);
+    EXPECT_EQ(Client::Status::OK, future1->wait().status);
+    EXPECT_EQ((std::set<uint64_t>{1, 2, 4}),
+              client.exactlyOnceRPCHelper.outstandingRPCNumbers);
+    EXPECT_EQ(Client::Status::CONDITION_NOT_MET, future2->wait().status);
+    EXPECT_EQ("no", future2->wait().error);
+    EXPECT_EQ((std::set<uint64_t>{1, 2}),
+              client.exactlyOnceRPCHelper.outstandingRPCNumbers);
+}
+
+TEST_F(ClientClientImplExactlyOnceTest, exactlyOnceSessions) {
+    EXPECT_EQ(0U, client.extraRPCHelpers.size());
+    EXPECT_EQ(0U, client.pickRPCHelper());
+
+    std::map<std::string, std::string> options = {
+        {"exactlyOnceSessions", "3"},
+    };
+    Client::ClientImpl client2(options);
+    Client::LeaderRPCMock* mockRPC2 = new Client::LeaderRPCMock();
+    client2.leaderRPC = std::unique_ptr<Client::LeaderRPCBase>(mockRPC2);
+    ASSERT_EQ(2U, client2.extraRPCHelpers.size());
+    EXPECT_EQ(&client2.exactlyOnceRPCHelper, &client2.getRPCHelper(0));
+    EXPECT_EQ(client2.extraRPCHelpers.at(1).get(), &client2.getRPCHelper(2));
+    size_t index = client2.pickRPCHelper();
+    EXPECT_EQ(Core::ThreadId::getId() % 3, index);
+
+    // commands from this thread open and use only that session
+    mockRPC2->expect(OpCode::STATE_MACHINE_COMMAND,
+        fromString<Protocol::Client::StateMachineCommand::Response>(
+                    "open_session { client_id: 5 }"));
+    mockRPC2->expect(OpCode::STATE_MACHINE_COMMAND,
+        fromString<Protocol::Client::StateMachineCommand::Response>(
+                    "tree { status: OK }"));
+    std::shared_ptr<Client::FutureDetails> future =
+        client2.writeAsync("a", "/", "x", {}, TimePoint::max());
+    EXPECT_EQ(index, future->rpcHelperIndex);
+    EXPECT_EQ(Client::Status::OK, future->wait().status);
+    mockRPC2->popRequest();
+    EXPECT_EQ("tree { "
+              "  exactly_once { "
+              "    client_id: 5 first_outstanding_rpc: 1 rpc_number: 1 "
+              "  } "
+              "  write { path: '/a' contents: 'x' } "
+              "}", *mockRPC2->popRequest());
+    for (size_t i = 0; i < 3; ++i) {
+        Client::ClientImpl::ExactlyOnceRPCHelper& helper =
+            client2.getRPCHelper(i);
+        EXPECT_EQ(i == index ? 5U : 0U, helper.clientId);
+        EXPECT_TRUE(helper.outstandingRPCNumbers.empty());
+    }
+    mockRPC2->expect(OpCode::STATE_MACHINE_COMMAND,
+        fromString<Protocol::Client::StateMachineCommand::Response>(
+                    "close_session { }"));
+}
+
+TEST_F(ClientClientImplExactlyOnceTest, asyncCommands_retry) {
+    mockRPC->expect(OpCode::STATE_MACHINE_COMMAND,
+        fromString<Protocol::Client::StateMachineCommand::Response>(
+                    "tree { status: OK }"));
+    mockRPC->expect(OpCode::STATE_MACHINE_COMMAND,
+        fromString<Protocol::Client::StateMachineCommand::Response>(
+                    "tree { status: OK }"));
+    std::shared_ptr<Client::FutureDetails> future =
+        client.writeAsync("a", "/", "x", {}, TimePoint::max());
+    // the mock returns RETRY for canceled calls
+    future->call->cancel();
+    EXPECT_EQ(Client::Status::OK, future->wait().status);
+    // the retry carries the same exactly-once info
+    EXPECT_EQ(3U, mockRPC->requestLog.size());
+    mockRPC->popRequest();
+    EXPECT_EQ(*mockRPC->popRequest(), *mockRPC->popRequest());
+}
+
+TEST_F(ClientClientImplExactlyOnceTest, writeBatcher) {
+    client.writeBatcher.maxOperations = 2;
+    client.writeBatcher.window = std::chrono::seconds(10);
+    mockRPC->expect(OpCode::STATE_MACHINE_COMMAND,
+        fromString<Protocol::Client::StateMachineCommand::Response>(
+                    "tree_batch { status: OK } "
+                    "tree_batch { status: CONDITION_NOT_MET error: 'no' }"));
+    std::shared_ptr<Client::FutureDetails> future1 =
+        client.writeAsync("a", "/", "x", {}, TimePoint::max());
+    // the batch is sent as soon as it is full
+    EXPECT_EQ(Client::Status::CONDITION_NOT_MET,
+              client.writeAsync("b", "/", "y", {}, TimePoint::max())->
+                wait().status);
+    EXPECT_EQ(Client::Status::OK, future1->wait().status);
+    EXPECT_EQ(2U, mockRPC->requestLog.size());
+    mockRPC->popRequest();
+    EXPECT_EQ("tree_batch { "
+              "  exactly_once { "
+              "    client_id: 3 first_outstanding_rpc: 1 rpc_number: 3 "
+              "  } "
+              "  write { path: '/a' contents: 'x' } "
+              "} "
+              "tree_batch { "
+              "  exactly_once { "
+              "    client_id: 3 first_outstanding_rpc: 1 rpc_number: 4 "
+              "  } "
+              "  write { path: '/b' contents: 'y' } "
+              "}", *mockRPC->popRequest());
+    EXPECT_EQ((std::set<uint64_t>{1, 2}),
+              client.exactlyOnceRPCHelper.outstandingRPCNumbers);
+}
+
+TEST_F(ClientClientImplExactlyOnceTest, writeBatcher_maxBytes) {
+    client.writeBatcher.maxOperations = 3;
+    client.writeBatcher.window = std::chrono::seconds(10);
+    std::shared_ptr<Client::FutureDetails> future1 =
+        client.writeAsync("a", "/", "x", {}, TimePoint::max());
+    client.writeBatcher.maxBytes =
+        client.writeBatcher.getBatchedBytes(*future1) + 10;
+
+    // a command larger than maxBytes is sent on its own
+    mockRPC->expect(OpCode::STATE_MACHINE_COMMAND,
+        fromString<Protocol::Client::StateMachineCommand::Response>(
+                    "tree { status: OK }"));
+    EXPECT_EQ(Client::Status::OK,
+              client.writeAsync("b", "/", std::string(100, 'z'), {},
+                                TimePoint::max())->wait().status);
+
+    // the batch is sent once the next command doesn't fit in it
+    mockRPC->expect(OpCode::STATE_MACHINE_COMMAND,
+        fromString<Protocol::Client::StateMachineCommand::Response>(
+                    "tree_batch { status: OK }"));
+    std::shared_ptr<Client::FutureDetails> future3 =
+        client.writeAsync("c", "/", "y", {}, TimePoint::max());
+    EXPECT_EQ(Client::Status::OK, future1->wait().status);
+    EXPECT_EQ(3U, mockRPC->requestLog.size());
+    mockRPC->popRequest();
+    EXPECT_EQ("tree { "
+              "  exactly_once { "
+              "    client_id: 3 first_outstanding_rpc: 1 rpc_number: 4 "
+              "  } "
+              "  write { path: '/b' contents: '" + std::string(100, 'z') +
+              "' } "
+              "}", *mockRPC->popRequest());
+    EXPECT_EQ("tree_batch { "
+              "  exactly_once { "
+              "    client_id: 3 first_outstanding_rpc: 1 rpc_number: 3 "
+              "  } "
+              "  write { path: '/a' contents: 'x' } "
+              "}", *mockRPC->popRequest());
+    client.writeBatcher.exit();
+    EXPECT_EQ(Client::Status::TIMEOUT, future3->wait().status);
+}
+
+TEST_F(ClientClientImplExactlyOnceTest, writeBatcher_abandon) {
+    client.writeBatcher.maxOperations = 2;
+    client.writeBatcher.window = std::chrono::seconds(10);
+    client.writeAsync("a", "/", "x", {}, TimePoint::max());
+    EXPECT_EQ(0U, client.writeBatcher.pending.size());
+    EXPECT_EQ((std::set<uint64_t>{1, 2}),
+              client.exactlyOnceRPCHelper.outstandingRPCNumbers);
+    EXPECT_EQ(1U, mockRPC->requestLog.size());
+}
+
+TEST_F(ClientClientImplExactlyOnceTest, writeBatcher_exit) {
+    client.writeBatcher.maxOperations = 2;
+    client.writeBatcher.window = std::chrono::seconds(10);
+    std::shared_ptr<Client::FutureDetails> future =
+        client.writeAsync("a", "/", "x", {}, TimePoint::max());
+    client.writeBatcher.exit();
+    EXPECT_EQ(Client::Status::TIMEOUT, future->wait().status);
+    EXPECT_EQ((std::set<uint64_t>{1, 2}),
+              client.exactlyOnceRPCHelper.outstandingRPCNumbers);
+    EXPECT_FALSE(client.writeBatcher.add(*future));
+}
+
 // This test is timing-sensitive. Not sure how else to do it.
 TEST_F(ClientClientImplExactlyOnceTest, keepAliveThreadMain_TimingSensitive) {
     std::string disclaimer("This test depends on timing, so failures are "
@@ -165,10 +377,7 @@ TEST_F(ClientClientImplExactlyOnceTest, keepAliveThreadMain_TimingSensitive) {
     for (uint64_t i = 0; i < 6; ++i) {
         mockRPC->expect(OpCode::STATE_MACHINE_COMMAND,
             fromString<Protocol::Client::StateMachineCommand::Response>(
-                "tree {"
-                "  status: CONDITION_NOT_MET "
-                "  error: 'err' "
-                "}"));
+                "renew_sessions { }"));
     }
     client.exactlyOnceRPCHelper.keepAliveInterval = milliseconds(2);
     client.exactlyOnceRPCHelper.keepAliveCV.notify_all();
@@ -274,6 +483,124 @@ TEST_F(ClientClientImplServiceMockTest, exactlyOnceRPCInfo_exit_invalidRequest)
     client.exactlyOnceRPCHelper.clientId = 0;
 }
 
+TEST_F(ClientClientImplServiceMockTest, writeBatcher_invalidRequest)
+{
+    client.writeBatcher.maxOperations = 2;
+    client.writeBatcher.window = std::chrono::seconds(10);
+    Protocol::Client::StateMachineCommand::Request openSession;
+    Protocol::Client::StateMachineCommand::Response openSessionResponse;
+    openSession.mutable_open_session();
+    openSessionResponse.mutable_open_session()->set_client_id(3);
+    service->reply(Protocol::Client::OpCode::STATE_MACHINE_COMMAND,
+                   openSession, openSessionResponse);
+
+    Protocol::Client::StateMachineCommand::Request a =
+        fromString<Protocol::Client::StateMachineCommand::Request>(
+            "tree { "
+            "  exactly_once { "
+            "    client_id: 3 first_outstanding_rpc: 1 rpc_number: 1 "
+            "  } "
+            "  write { path: '/a' contents: 'x' } "
+            "}");
+    Protocol::Client::StateMachineCommand::Request b =
+        fromString<Protocol::Client::StateMachineCommand::Request>(
+            "tree { "
+            "  exactly_once { "
+            "    client_id: 3 first_outstanding_rpc: 1 rpc_number: 2 "
+            "  } "
+            "  write { path: '/b' contents: 'y' } "
+            "}");
+    Protocol::Client::StateMachineCommand::Request batch;
+    *batch.add_tree_batch() = a.tree();
+    *batch.add_tree_batch() = b.tree();
+    Protocol::Client::StateMachineCommand::Response ok =
+        fromString<Protocol::Client::StateMachineCommand::Response>(
+            "tree { status: OK }");
+    service->rejectInvalidRequest(
+        Protocol::Client::OpCode::STATE_MACHINE_COMMAND, batch);
+    service->reply(Protocol::Client::OpCode::STATE_MACHINE_COMMAND, a, ok);
+    service->reply(Protocol::Client::OpCode::STATE_MACHINE_COMMAND, b, ok);
+
+    LogCabin::Core::Debug::setLogPolicy({
+        {"Client/ClientImpl.cc", "WARNING"}
+    });
+    std::shared_ptr<Client::FutureDetails> future1 =
+        client.writeAsync("a", "/", "x", {}, TimePoint::max());
+    std::shared_ptr<Client::FutureDetails> future2 =
+        client.writeAsync("b", "/", "y", {}, TimePoint::max());
+    EXPECT_EQ(Client::Status::OK, future1->wait().status);
+    EXPECT_EQ(Client::Status::OK, future2->wait().status);
+    EXPECT_FALSE(client.writeBatcher.supported);
+    LogCabin::Core::Debug::setLogPolicy({
+        {"", "WARNING"}
+    });
+    // prevent destructor from calling CloseSession
+    client.exactlyOnceRPCHelper.clientId = 0;
+}
+
+TEST_F(ClientClientImplServiceMockTest,
+       keepAliveThreadMain_renewSessionsInvalidRequest)
+{
+    Protocol::Client::StateMachineCommand::Request renew =
+        fromString<Protocol::Client::StateMachineCommand::Request>(
+            "renew_sessions { client_id: 3 first_outstanding_rpc: 1 }");
+    Protocol::Client::StateMachineCommand::Request write =
+        fromString<Protocol::Client::StateMachineCommand::Request>(
+            "tree { "
+            "  exactly_once { "
+            "    client_id: 3 first_outstanding_rpc: 1 rpc_number: 1 "
+            "  } "
+            "  condition { "
+            "    path: 'keepalive' "
+            "    contents: 'this is just a no-op to keep the client\\'s "
+            "session active; the condition is expected to fail' "
+            "  } "
+            "  write { path: 'keepalive' contents: 'you shouldn\\'t see "
+            "this!' } "
+            "}");
+    service->rejectInvalidRequest(
+        Protocol::Client::OpCode::STATE_MACHINE_COMMAND, renew);
+    service->reply(Protocol::Client::OpCode::STATE_MACHINE_COMMAND, write,
+        fromString<Protocol::Client::StateMachineCommand::Response>(
+            "tree { status: CONDITION_NOT_MET }"));
+
+    LogCabin::Core::Debug::setLogPolicy({
+        {"Client/ClientImpl.cc", "WARNING"}
+    });
+    Client::ClientImpl::ExactlyOnceRPCHelper& helper =
+        client.exactlyOnceRPCHelper;
+    helper.clientId = 3;
+    helper.lastKeepAliveStart = Client::ClientImpl::TimePoint::min();
+    std::thread thread(
+        &Client::ClientImpl::ExactlyOnceRPCHelper::keepAliveThreadMain,
+        &helper);
+    // Wait for the fallback keep-alive to complete.
+    for (uint64_t i = 0; i < 1000; ++i) {
+        {
+            std::lock_guard<Core::Mutex> lockGuard(helper.mutex);
+            if (helper.nextRPCNumber == 2 &&
+                helper.outstandingRPCNumbers.empty()) {
+                break;
+            }
+        }
+        usleep(1000);
+    }
+    {
+        std::lock_guard<Core::Mutex> lockGuard(helper.mutex);
+        EXPECT_FALSE(helper.renewSessionsSupported);
+        EXPECT_EQ(2U, helper.nextRPCNumber);
+        EXPECT_TRUE(helper.outstandingRPCNumbers.empty());
+        helper.exiting = true;
+        helper.keepAliveCV.notify_all();
+    }
+    thread.join();
+    LogCabin::Core::Debug::setLogPolicy({
+        {"", "WARNING"}
+    });
+    // prevent destructor from calling CloseSession
+    helper.clientId = 0;
+}
+
 TEST_F(ClientClientImplServiceMockTest, getServerInfo) {
     Protocol::Client::GetServerInfo::Request request;
     Protocol::Client::GetServerInfo::Response response;
@@ -17,12 +17,15 @@
 #include <gtest/gtest.h>
 #include <deque>
 #include <queue>
+#include <sstream>
+#include <thread>
 
 #include "Client/ClientImpl.h"
 #include "Client/LeaderRPCMock.h"
 #include "Core/Debug.h"
 #include "Core/ProtoBuf.h"
 #include "Core/StringUtil.h"
+#include "Core/Time.h"
 #include "build/Protocol/Client.pb.h"
 #include "include/LogCabin/Client.h"
 
@@ -122,16 +125,30 @@ TEST_F(ClientTreeTest, setWorkingDirectory)
 
 TEST_F(ClientTreeTest, getCondition)
 {
-    EXPECT_EQ((Client::Condition {"", ""}),
+    EXPECT_EQ((std::pair<std::string, std::string> {"", ""}),
               tree.getCondition());
     tree.setCondition("a", "b");
-    EXPECT_EQ((Client::Condition {"/a", "b"}),
+    EXPECT_EQ((std::pair<std::string, std::string> {"/a", "b"}),
               tree.getCondition());
+    uint64_t version = 7;
+    EXPECT_FALSE(tree.getVersionCondition(version));
+    EXPECT_EQ(7UL, version);
+    tree.setCondition("a", 0UL);
+    EXPECT_EQ((std::pair<std::string, std::string> {"/a", ""}),
+              tree.getCondition());
+    EXPECT_TRUE(tree.getVersionCondition(version));
+    EXPECT_EQ(0UL, version);
+    tree.setCondition("c", 12UL);
+    EXPECT_EQ((std::pair<std::string, std::string> {"/c", ""}),
+              tree.getCondition());
+    EXPECT_TRUE(tree.getVersionCondition(version));
+    EXPECT_EQ(12UL, version);
     tree.setCondition("", "asdf");
-    EXPECT_EQ((Client::Condition {"", ""}),
+    EXPECT_FALSE(tree.getVersionCondition(version));
+    EXPECT_EQ((std::pair<std::string, std::string> {"", ""}),
               tree.getCondition());
     tree.setCondition("", "");
-    EXPECT_EQ((Client::Condition {"", ""}),
+    EXPECT_EQ((std::pair<std::string, std::string> {"", ""}),
               tree.getCondition());
 }
 
@@ -145,7 +162,7 @@ TEST_F(ClientTreeTest, setCondition)
     EXPECT_EQ("Path '/..' from working directory '/' attempts to look up "
               "directory above root ('/')",
               result.error);
-    EXPECT_EQ((Client::Condition {
+    EXPECT_EQ((std::pair<std::string, std::string> {
                    "invalid from prior call to setCondition('/..') "
                    "relative to '/'",
                    "x"
@@ -168,6 +185,99 @@ TEST_F(ClientTreeTest, setTimeout)
     EXPECT_EQ(0UL, tree.getTimeout());
 }
 
+/**
+ * Records whether each read-write tree command asked for an ephemeral file.
+ */
+class EphemeralCallbacks : public Client::TestingCallbacks {
+  public:
+    EphemeralCallbacks()
+        : ephemeral()
+    {
+    }
+    bool stateMachineCommand(
+            Protocol::Client::StateMachineCommand_Request& request,
+            Protocol::Client::StateMachineCommand_Response& response) {
+        if (request.has_tree()) {
+            ephemeral.push_back(
+                request.tree().write().ephemeral() ||
+                request.tree().compare_and_swap().ephemeral());
+        }
+        return false;
+    }
+    std::vector<bool> ephemeral;
+};
+
+TEST_F(ClientTreeTest, setEphemeral)
+{
+    auto callbacks = std::make_shared<EphemeralCallbacks>();
+    Client::Cluster cluster2(callbacks);
+    Client::Tree tree2 = cluster2.getTree();
+    EXPECT_FALSE(tree2.getEphemeral());
+    EXPECT_OK(tree2.write("/a", "x"));
+    tree2.setEphemeral(true);
+    EXPECT_TRUE(tree2.getEphemeral());
+    EXPECT_OK(tree2.write("/a", "y"));
+    EXPECT_OK(tree2.compareAndSwap("/a", "y", "z"));
+    EXPECT_OK(tree2.append("/a", "z"));
+    tree2.setEphemeral(false);
+    EXPECT_OK(tree2.write("/a", "x"));
+    EXPECT_EQ((std::vector<bool> { false, true, true, false, false }),
+              callbacks->ephemeral);
+}
+
+/**
+ * Records the time-to-live each read-write tree command asked for.
+ */
+class TTLCallbacks : public Client::TestingCallbacks {
+  public:
+    TTLCallbacks()
+        : ttlNanos()
+    {
+    }
+    bool stateMachineCommand(
+            Protocol::Client::StateMachineCommand_Request& request,
+            Protocol::Client::StateMachineCommand_Response& response) {
+        if (request.has_tree()) {
+            ttlNanos.push_back(
+                request.tree().write().ttl_nanos() +
+                request.tree().compare_and_swap().ttl_nanos());
+        }
+        return false;
+    }
+    std::vector<uint64_t> ttlNanos;
+};
+
+TEST_F(ClientTreeTest, setTTL)
+{
+    auto callbacks = std::make_shared<TTLCallbacks>();
+    Client::Cluster cluster2(callbacks);
+    Client::Tree tree2 = cluster2.getTree();
+    EXPECT_EQ(0U, tree2.getTTL());
+    EXPECT_OK(tree2.write("/a", "x"));
+    tree2.setTTL(3600000000000UL);
+    EXPECT_EQ(3600000000000UL, tree2.getTTL());
+    EXPECT_OK(tree2.write("/a", "y"));
+    EXPECT_OK(tree2.compareAndSwap("/a", "y", "z"));
+    EXPECT_OK(tree2.append("/a", "z"));
+    tree2.setTTL(0);
+    EXPECT_OK(tree2.write("/a", "x"));
+    EXPECT_EQ((std::vector<uint64_t> {
+                  0, 3600000000000UL, 3600000000000UL, 0, 0 }),
+              callbacks->ttlNanos);
+}
+
+TEST_F(ClientTreeTest, setTTL_expires)
+{
+    Core::Time::SteadyClock::Mocker mocker;
+    Core::Time::SteadyClock::mockValue = Core::Time::SteadyClock::now();
+    tree.setTTL(10);
+    EXPECT_OK(tree.write("/a", "x"));
+    std::string contents;
+    EXPECT_OK(tree.read("/a", contents));
+    Core::Time::SteadyClock::mockValue += std::chrono::nanoseconds(10);
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree.read("/a", contents).status);
+}
+
 TEST_F(ClientTreeTest, makeDirectory)
 {
     EXPECT_OK(tree.makeDirectory("/foo"));
@@ -195,6 +305,47 @@ TEST_F(ClientTreeTest, listDirectory)
               children);
 }
 
+TEST_F(ClientTreeTest, listDirectory_paged)
+{
+    std::vector<std::string> children;
+    bool more = false;
+    EXPECT_OK(tree.makeDirectory("/d/x"));
+    EXPECT_OK(tree.write("/d/a", "1"));
+    EXPECT_OK(tree.write("/d/b", "2"));
+    EXPECT_OK(tree.write("/d/bc", "3"));
+    EXPECT_OK(tree.listDirectory("/d", "", "", 2, children, more));
+    EXPECT_EQ((std::vector<std::string>{"x/", "a"}),
+              children);
+    EXPECT_TRUE(more);
+    EXPECT_OK(tree.listDirectory("/d", "a", "b", 2, children, more));
+    EXPECT_EQ((std::vector<std::string>{"b", "bc"}),
+              children);
+    EXPECT_FALSE(more);
+}
+
+TEST_F(ClientTreeTest, iterateDirectory)
+{
+    tree.makeDirectoryEx("/d/x");
+    for (int i = 0; i < 7; ++i)
+        tree.writeEx(format("/d/%d", i), "");
+    std::vector<std::string> children;
+    Client::DirectoryIterator it = tree.iterateDirectory("/d", "", 3);
+    while (it.hasNext())
+        children.push_back(it.next());
+    EXPECT_EQ(tree.listDirectoryEx("/d"), children);
+    EXPECT_EQ(8U, children.size());
+
+    children.clear();
+    it = tree.iterateDirectory("/d", "x", 1);
+    while (it.hasNext())
+        children.push_back(it.next());
+    EXPECT_EQ((std::vector<std::string>{"x/"}),
+              children);
+
+    Client::DirectoryIterator it2 = tree.iterateDirectory("/nope");
+    EXPECT_THROW(it2.hasNext(), Client::LookupException);
+}
+
 TEST_F(ClientTreeTest, removeDirectory)
 {
     EXPECT_EQ(Status::INVALID_ARGUMENT,
@@ -227,6 +378,207 @@ TEST_F(ClientTreeTest, read)
     EXPECT_EQ("bar", contents);
 }
 
+TEST_F(ClientTreeTest, read_range)
+{
+    std::string contents;
+    uint64_t version;
+    uint64_t size;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.read("/..", 0, 0, contents, version, size).status);
+    EXPECT_OK(tree.write("/foo", "hello, world!"));
+    EXPECT_OK(tree.read("/foo", 7, 5, contents, version, size));
+    EXPECT_EQ("world", contents);
+    EXPECT_EQ(1U, version);
+    EXPECT_EQ(13U, size);
+}
+
+/**
+ * Answers ranged reads with the entire file, as a server that predates them
+ * would.
+ */
+class OldRangedReadCallbacks : public Client::TestingCallbacks {
+  public:
+    bool stateMachineQuery(
+            Protocol::Client::StateMachineQuery_Request& request,
+            Protocol::Client::StateMachineQuery_Response& response) {
+        if (!request.tree().has_read())
+            return false;
+        response.mutable_tree()->set_status(Protocol::Client::Status::OK);
+        response.mutable_tree()->mutable_read()->set_contents(
+            "hello, world!");
+        return true;
+    }
+};
+
+TEST_F(ClientTreeTest, read_range_oldServer)
+{
+    Client::Cluster cluster2(std::make_shared<OldRangedReadCallbacks>());
+    Client::Tree tree2 = cluster2.getTree();
+    std::string contents;
+    uint64_t version;
+    uint64_t size;
+    EXPECT_OK(tree2.read("/foo", 7, 5, contents, version, size));
+    EXPECT_EQ("world", contents);
+    EXPECT_EQ(13U, size);
+    EXPECT_OK(tree2.read("/foo", 20, 0, contents, version, size));
+    EXPECT_EQ("", contents);
+    std::ostringstream out;
+    EXPECT_OK(tree2.readStream("/foo", out, 5));
+    EXPECT_EQ("hello, world!", out.str());
+}
+
+/**
+ * Records the condition of each read, and can pretend that the file was
+ * modified before the Nth read.
+ */
+class ReadConditionCallbacks : public Client::TestingCallbacks {
+  public:
+    ReadConditionCallbacks()
+        : conditions()
+        , changeVersionOnRead(0)
+    {
+    }
+    bool stateMachineQuery(
+            Protocol::Client::StateMachineQuery_Request& request,
+            Protocol::Client::StateMachineQuery_Response& response) {
+        if (request.tree().has_read()) {
+            conditions.push_back(request.tree().has_condition()
+                ? Core::ProtoBuf::dumpString(request.tree().condition())
+                : "");
+            if (changeVersionOnRead > 0 && --changeVersionOnRead == 0) {
+                auto& read = *response.mutable_tree()->mutable_read();
+                response.mutable_tree()->set_status(
+                    Protocol::Client::Status::OK);
+                read.set_contents(", wor");
+                read.set_version(99);
+                read.set_size(13);
+                return true;
+            }
+        }
+        return false;
+    }
+    std::vector<std::string> conditions;
+    uint32_t changeVersionOnRead;
+};
+
+TEST_F(ClientTreeTest, readStream)
+{
+    auto callbacks = std::make_shared<ReadConditionCallbacks>();
+    Client::Cluster cluster2(callbacks);
+    Client::Tree tree2 = cluster2.getTree();
+    std::ostringstream out;
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree2.readStream("/foo", out).status);
+    tree2.writeEx("/foo", "");
+    EXPECT_OK(tree2.readStream("/foo", out));
+    EXPECT_EQ("", out.str());
+    tree2.writeEx("/foo", "hello, world!");
+    tree2.writeEx("/bar", "x");
+    tree2.setCondition("/bar", "x");
+    callbacks->conditions.clear();
+    EXPECT_OK(tree2.readStream("/foo", out, 5));
+    EXPECT_EQ("hello, world!", out.str());
+    // the caller's condition is checked on every piece
+    EXPECT_EQ((std::vector<std::string> {
+                  "path: \"/bar\"\ncontents: \"x\"\n",
+                  "path: \"/bar\"\ncontents: \"x\"\n",
+                  "path: \"/bar\"\ncontents: \"x\"\n",
+              }), callbacks->conditions);
+    tree2.setCondition("/foo", "bar");
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              tree2.readStream("/foo", out).status);
+    tree2.setCondition("", "");
+
+    // later pieces must come from the same version
+    callbacks->changeVersionOnRead = 2;
+    std::ostringstream out2;
+    Result result = tree2.readStream("/foo", out2, 5);
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Path '/foo' changed from version 2 to 99 while it was being "
+              "read", result.error);
+    EXPECT_EQ("hello", out2.str());
+    EXPECT_THROW(tree2.readStreamEx("/baz", out),
+                 Client::LookupException);
+}
+
+/**
+ * Records the condition of each append, and can have another writer modify
+ * the file just before the first append.
+ */
+class AppendConditionCallbacks : public Client::TestingCallbacks {
+  public:
+    AppendConditionCallbacks()
+        : conditions()
+        , intruder(NULL)
+    {
+    }
+    bool stateMachineCommand(
+            Protocol::Client::StateMachineCommand_Request& request,
+            Protocol::Client::StateMachineCommand_Response& response) {
+        if (request.tree().has_append()) {
+            conditions.push_back(request.tree().has_condition()
+                ? Core::ProtoBuf::dumpString(request.tree().condition())
+                : "");
+            if (intruder != NULL) {
+                intruder->writeEx(request.tree().append().path(), "other");
+                intruder = NULL;
+            }
+        }
+        return false;
+    }
+    std::vector<std::string> conditions;
+    Client::Tree* intruder;
+
+    // AppendConditionCallbacks is non-copyable.
+    AppendConditionCallbacks(const AppendConditionCallbacks&) = delete;
+    AppendConditionCallbacks&
+    operator=(const AppendConditionCallbacks&) = delete;
+};
+
+TEST_F(ClientTreeTest, writeStream_pinsVersion)
+{
+    auto callbacks = std::make_shared<AppendConditionCallbacks>();
+    Client::Cluster cluster2(callbacks);
+    Client::Tree tree2 = cluster2.getTree();
+    std::istringstream in("hello, world!");
+    EXPECT_OK(tree2.writeStream("/foo", in, 5));
+    EXPECT_EQ("hello, world!", tree2.readEx("/foo"));
+    // each append requires the version left by the previous piece
+    EXPECT_EQ((std::vector<std::string> {
+                  "path: \"/foo\"\ncontents: \"\"\nversion: 1\n",
+                  "path: \"/foo\"\ncontents: \"\"\nversion: 2\n",
+              }), callbacks->conditions);
+
+    // another writer sneaks in before the first append
+    Client::Tree tree3 = cluster2.getTree();
+    callbacks->intruder = &tree3;
+    std::istringstream in2("0123456789");
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              tree2.writeStream("/foo", in2, 5).status);
+    EXPECT_EQ("other", tree2.readEx("/foo"));
+}
+
+TEST_F(ClientTreeTest, writeStream)
+{
+    std::istringstream empty("");
+    EXPECT_OK(tree.writeStream("/foo", empty, 5));
+    EXPECT_EQ("", tree.readEx("/foo"));
+    std::istringstream in("hello, world!");
+    EXPECT_OK(tree.writeStream("/foo", in, 5));
+    EXPECT_EQ("hello, world!", tree.readEx("/foo"));
+    std::istringstream in2("0123456789");
+    EXPECT_OK(tree.writeStream("/foo", in2, 5));
+    EXPECT_EQ("0123456789", tree.readEx("/foo"));
+
+    tree.setCondition("/foo", "bar");
+    std::istringstream in3("x");
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              tree.writeStream("/foo", in3).status);
+    tree.setCondition("", "");
+    std::istringstream in4("x");
+    EXPECT_THROW(tree.writeStreamEx("/a/b", in4),
+                 Client::LookupException);
+}
+
 TEST_F(ClientTreeTest, removeFile)
 {
     EXPECT_EQ(Status::INVALID_ARGUMENT,
@@ -276,6 +628,149 @@ TEST_F(ClientTreeTest, conditions)
               tree.removeFile("/b").status);
 }
 
+TEST_F(ClientTreeTest, conditions_version)
+{
+    std::string contents;
+    uint64_t version = 0;
+    EXPECT_EQ(Status::LOOKUP_ERROR,
+              tree.read("/a", contents, version).status);
+    tree.setCondition("/a", 0UL);
+    EXPECT_EQ((std::pair<std::string, std::string> {"/a", ""}),
+              tree.getCondition());
+    tree.writeEx("/a", "c");
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              tree.write("/a", "d").status);
+
+    tree.setCondition("", "");
+    EXPECT_EQ("c", tree.readEx("/a", version));
+    EXPECT_LT(0UL, version);
+    tree.setCondition("/a", version);
+    EXPECT_EQ(Status::OK,
+              tree.write("/a", "d").status);
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              tree.write("/a", "e").status);
+    tree.setCondition("", "");
+    EXPECT_EQ("d", tree.readEx("/a"));
+}
+
+TEST_F(ClientTreeTest, atomicOps)
+{
+    tree.setWorkingDirectory("/baz");
+    EXPECT_EQ(1, tree.incrementEx("count"));
+    EXPECT_EQ(4, tree.incrementEx("count", 3));
+    int64_t value = 0;
+    EXPECT_OK(tree.increment("/baz/count", -5, value));
+    EXPECT_EQ(-1, value);
+    EXPECT_EQ("-1", tree.readEx("count"));
+
+    tree.appendEx("log", "a");
+    tree.appendEx("log", "b");
+    EXPECT_EQ("ab", tree.readEx("log"));
+
+    tree.compareAndSwapEx("log", "ab", "c");
+    EXPECT_EQ("c", tree.readEx("log"));
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              tree.compareAndSwap("log", "ab", "d").status);
+    EXPECT_THROW(tree.compareAndSwapEx("log", "ab", "d"),
+                 Client::ConditionNotMetException);
+    EXPECT_EQ("c", tree.readEx("log"));
+
+    tree.setCondition("log", "x");
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              tree.append("log", "y").status);
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              tree.increment("count", 1, value).status);
+}
+
+TEST_F(ClientTreeTest, async)
+{
+    EXPECT_FALSE(Client::Future().valid());
+    EXPECT_EQ(Status::INVALID_ARGUMENT, Client::Future().wait().status);
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.writeAsync("/..", "bar").wait().status);
+
+    tree.setWorkingDirectory("/baz");
+    std::vector<Client::Future> futures;
+    futures.push_back(tree.makeDirectoryAsync("dir"));
+    futures.push_back(tree.writeAsync("foo", "bar"));
+    futures.push_back(tree.appendAsync("foo", "!"));
+    futures.push_back(tree.incrementAsync("count", 2));
+    futures.push_back(tree.compareAndSwapAsync("foo", "bar!", "baz"));
+    for (auto it = futures.begin(); it != futures.end(); ++it) {
+        EXPECT_TRUE(it->valid());
+        it->waitEx();
+    }
+    EXPECT_EQ(2, futures.at(3).getValue());
+
+    Client::Future read = tree.readAsync("foo");
+    EXPECT_EQ("baz", read.getContents());
+    EXPECT_LT(0U, read.getVersion());
+    Client::Future moved(std::move(read));
+    EXPECT_FALSE(read.valid());
+    EXPECT_EQ("baz", moved.getContents());
+
+    EXPECT_EQ((std::vector<std::string>{"dir/", "count", "foo"}),
+              tree.listDirectoryAsync(".").getChildren());
+    tree.removeDirectoryAsync("dir").waitEx();
+    tree.removeFileAsync("count").waitEx();
+    EXPECT_EQ((std::vector<std::string>{"foo"}),
+              tree.listDirectoryAsync(".").getChildren());
+
+    Client::Future missing = tree.readAsync("missing");
+    EXPECT_EQ(Status::LOOKUP_ERROR, missing.wait().status);
+    EXPECT_EQ("", missing.getContents());
+    EXPECT_THROW(missing.waitEx(), Client::LookupException);
+}
+
+TEST_F(ClientTreeTest, batchedWrites)
+{
+    Client::Cluster batching(std::make_shared<Client::TestingCallbacks>(),
+                             {{"writeBatchMaxOperations", "8"},
+                              {"writeBatchMicroseconds", "100"}});
+    Client::Tree batchingTree = batching.getTree();
+    std::vector<std::thread> threads;
+    for (uint64_t i = 0; i < 4; ++i) {
+        threads.emplace_back([&batchingTree, i] () {
+            for (uint64_t j = 0; j < 10; ++j) {
+                batchingTree.writeEx(format("/%lu-%lu", i, j), "x");
+                batchingTree.appendEx(format("/%lu-%lu", i, j), "y");
+            }
+        });
+    }
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+    EXPECT_EQ(40U, batchingTree.listDirectoryEx("/").size());
+    EXPECT_EQ("xy", batchingTree.readEx("/3-9"));
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              batchingTree.compareAndSwapAsync("/0-0", "x", "z")
+                .wait().status);
+}
+
+TEST_F(ClientTreeTest, readCache)
+{
+    Client::Cluster caching(std::make_shared<Client::TestingCallbacks>(),
+                            {{"readCache", "bounded"},
+                             {"readCacheMaxStalenessMilliseconds",
+                              "100000"}});
+    Client::Tree cachingTree = caching.getTree();
+    cachingTree.makeDirectoryEx("/d");
+    cachingTree.writeEx("/d/a", "x");
+    EXPECT_EQ("x", cachingTree.readEx("/d/a"));
+    EXPECT_EQ("x", cachingTree.readEx("/d/a"));
+    cachingTree.appendEx("/d/a", "y");
+    EXPECT_EQ("xy", cachingTree.readEx("/d/a"));
+    EXPECT_EQ("xy", cachingTree.readEx("/d/a"));
+    cachingTree.removeDirectoryEx("/d");
+    std::string contents;
+    EXPECT_EQ(Status::LOOKUP_ERROR,
+              cachingTree.read("/d/a", contents).status);
+    Client::ReadCacheStats stats = caching.getReadCacheStats();
+    EXPECT_EQ(2U, stats.hits);
+    EXPECT_EQ(3U, stats.misses);
+    EXPECT_EQ(2U, stats.invalidations);
+    EXPECT_EQ(0U, cluster.getReadCacheStats().misses);
+}
+
 TEST_F(ClientTreeTest, conditions_withWorkingDirectory)
 {
     tree.setWorkingDirectory("/baz");
@@ -15,10 +15,13 @@
  */
 
 #include <unistd.h>
+#include <algorithm>
 
 #include "Client/Backoff.h"
 #include "Client/LeaderRPC.h"
 #include "Core/Debug.h"
+#include "Core/Random.h"
+#include "Core/StringUtil.h"
 #include "Core/Util.h"
 #include "Protocol/Common.h"
 #include "RPC/ClientSession.h"
@@ -84,11 +87,13 @@ LeaderRPC::Call::start(OpCode opCode,
                        const google::protobuf::Message& request,
                        TimePoint timeout)
 {
+    // Hold off if a server recently said it was overloaded.
+    leaderRPC.overloadBackoff.delayAndBegin(timeout);
     // Save a reference to the leaderSession
     cachedSession = leaderRPC.getSession(timeout);
     rpc = RPC::ClientRPC(cachedSession,
                          Protocol::Common::ServiceId::CLIENT_SERVICE,
-                         1,
+                         2, // understands OVERLOADED errors
                          opCode,
                          request);
 }
@@ -124,6 +129,12 @@ LeaderRPC::Call::wait(google::protobuf::Message& response,
                         leaderRPC.reportNotLeader(cachedSession);
                     }
                     break;
+                case Protocol::Client::Error::OVERLOADED:
+                    // The server is the leader but has too much to do. Try
+                    // again on the same session after a while.
+                    leaderRPC.reportOverloaded(
+                        error.retry_after_milliseconds());
+                    break;
                 default:
                     // Hmm, we don't know what this server is trying to tell
                     // us, but something is wrong. The server shouldn't reply
@@ -154,8 +165,31 @@ LeaderRPC::Call::wait(google::protobuf::Message& response,
 }
 
 
+//// struct LeaderRPC::ProbeRound ////
+
+LeaderRPC::ProbeRound::ProbeRound()
+    : mutex()
+    , changed()
+    , outstanding(0)
+    , leader()
+    , leaderHint()
+    , anyServer()
+    , unreachable()
+{
+}
+
+//// struct LeaderRPC::Standby ////
+
+LeaderRPC::Standby::Standby()
+    : session()
+    , serverAddresses()
+{
+}
+
 //// class LeaderRPC ////
 
+const uint64_t LeaderRPC::MAX_RETRY_AFTER_MILLISECONDS;
+
 LeaderRPC::LeaderRPC(const RPC::Address& hosts,
                      SessionManager::ClusterUUID& clusterUUID,
                      Backoff& sessionCreationBackoff,
@@ -163,6 +197,7 @@ LeaderRPC::LeaderRPC(const RPC::Address& hosts,
     : clusterUUID(clusterUUID)
     , sessionCreationBackoff(sessionCreationBackoff)
     , sessionManager(sessionManager)
+    , overloadBackoff(1, 0) // not rate-limited, only delayed on request
     , mutex()
     , isConnecting(false)
     , connected()
@@ -170,11 +205,16 @@ LeaderRPC::LeaderRPC(const RPC::Address& hosts,
     , leaderHint()
     , leaderSession() // set by connect()
     , failuresSinceLastSuccess(0)
+    , alternatives(hosts.getAlternatives())
+    , standbys(alternatives.size())
+    , probeThreads()
 {
 }
 
 LeaderRPC::~LeaderRPC()
 {
+    for (auto it = probeThreads.begin(); it != probeThreads.end(); ++it)
+        it->join();
     leaderSession.reset();
 }
 
@@ -235,12 +275,22 @@ LeaderRPC::getSession(TimePoint timeout)
 
     // Determine which address to connect to while still holding the lock.
     RPC::Address address;
+    std::shared_ptr<RPC::ClientSession> session;
+    bool probe = false;
+    if (!leaderHint.empty() && isUnreachable(leaderHint)) {
+        // Followers keep naming a failed leader until they elect a new one.
+        leaderHint.clear();
+    }
     if (leaderHint.empty()) {
-        // Hope the next random host is the leader. If that turns out to be
+        // With several hosts, ask all of them who the leader is. Otherwise,
+        // hope the next random host is the leader. If that turns out to be
         // false, we will soon find out.
+        probe = (alternatives.size() > 1);
         address = hosts;
     } else {
-        // Connect to the leader given by 'leaderHint'.
+        // Connect to the leader given by 'leaderHint', unless there's already
+        // a session to it.
+        session = findStandby(leaderHint);
         address = RPC::Address(leaderHint, Protocol::Common::DEFAULT_PORT);
         // Don't clear leaderHint until down below, in case this thread times
         // out before making any use of it.
@@ -248,14 +298,27 @@ LeaderRPC::getSession(TimePoint timeout)
 
     // Don't hang onto the mutex for any of this blocking stuff (doing so would
     // delay other threads with shorter timeouts; see #173).
-    std::shared_ptr<RPC::ClientSession> session;
     bool usedHint = true;
-    {
+    if (!session) {
         Core::MutexUnlock<std::mutex> unlockGuard(lockGuard);
 
         // sleep if we've tried to connect too much recently
         sessionCreationBackoff.delayAndBegin(timeout);
-        if (Clock::now() > timeout) {
+        if (probe && Clock::now() <= timeout) {
+            std::string hint;
+            session = findLeader(timeout, hint);
+            if (!hint.empty()) {
+                std::lock_guard<std::mutex> relockGuard(mutex);
+                session = findStandby(hint);
+                if (!session) {
+                    address = RPC::Address(hint,
+                                           Protocol::Common::DEFAULT_PORT);
+                }
+            }
+        }
+        if (session) {
+            // Found by probing; nothing more to do.
+        } else if (Clock::now() > timeout) {
             session = RPC::ClientSession::makeErrorSession(
                     sessionManager.eventLoop,
                     "Failed to create session to leader: timeout expired");
@@ -280,6 +343,134 @@ LeaderRPC::getSession(TimePoint timeout)
     return leaderSession;
 }
 
+std::shared_ptr<RPC::ClientSession>
+LeaderRPC::findLeader(TimePoint timeout, std::string& hint)
+{
+    // Probes give up after this long, so that a host that doesn't respond
+    // can't hold up the next round (or the destructor) for long.
+    TimePoint probeTimeout = std::min(timeout,
+                                      Clock::now() + std::chrono::seconds(1));
+    std::vector<std::thread> oldThreads;
+    {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        oldThreads.swap(probeThreads);
+    }
+    for (auto it = oldThreads.begin(); it != oldThreads.end(); ++it)
+        it->join();
+
+    std::shared_ptr<ProbeRound> round = std::make_shared<ProbeRound>();
+    round->outstanding = alternatives.size();
+    {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        for (size_t i = 0; i < alternatives.size(); ++i) {
+            probeThreads.emplace_back(&LeaderRPC::probe, this,
+                                      i, round, probeTimeout);
+        }
+    }
+
+    std::unique_lock<std::mutex> lockGuard(round->mutex);
+    while (!round->leader &&
+           round->outstanding > 0 &&
+           Clock::now() < probeTimeout) {
+        round->changed.wait_until(lockGuard, probeTimeout);
+    }
+    if (round->leader) {
+        VERBOSE("Found leader by probing all servers: %s",
+                round->leader->toString().c_str());
+        return round->leader;
+    }
+    if (std::find(round->unreachable.begin(),
+                  round->unreachable.end(),
+                  round->leaderHint) == round->unreachable.end()) {
+        hint = round->leaderHint;
+    }
+    return round->anyServer;
+}
+
+void
+LeaderRPC::probe(size_t index,
+                 std::shared_ptr<ProbeRound> round,
+                 TimePoint timeout)
+{
+    std::shared_ptr<RPC::ClientSession> session;
+    {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        session = standbys.at(index).session;
+    }
+    if (!session || !session->getErrorMessage().empty()) {
+        RPC::Address address = alternatives.at(index);
+        address.refresh(timeout);
+        VERBOSE("Connecting to: %s", address.toString().c_str());
+        session = sessionManager.createSession(address,
+                                               timeout,
+                                               &clusterUUID);
+    }
+
+    Protocol::Client::GetServerInfo::Request request;
+    Protocol::Client::GetServerInfo::Response response;
+    bool ok = false;
+    if (session->getErrorMessage().empty()) {
+        RPC::ClientRPC rpc(session,
+                           Protocol::Common::ServiceId::CLIENT_SERVICE,
+                           1,
+                           OpCode::GET_SERVER_INFO,
+                           request);
+        ok = (rpc.waitForReply(&response, NULL, timeout) ==
+              RPC::ClientRPC::Status::OK);
+    }
+
+    std::string lostAddresses;
+    {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        Standby& standby = standbys.at(index);
+        if (ok) {
+            standby.session = session;
+            standby.serverAddresses = response.server_info().addresses();
+        } else {
+            // Keep the addresses so that hints to this server are recognized.
+            lostAddresses = standby.serverAddresses;
+            standby.session.reset();
+        }
+    }
+
+    std::lock_guard<std::mutex> lockGuard(round->mutex);
+    --round->outstanding;
+    if (!lostAddresses.empty())
+        round->unreachable.push_back(lostAddresses);
+    if (ok) {
+        if (response.is_leader() && !round->leader)
+            round->leader = session;
+        if (!response.leader_hint().empty() && round->leaderHint.empty())
+            round->leaderHint = response.leader_hint();
+        if (!round->anyServer)
+            round->anyServer = session;
+    }
+    round->changed.notify_all();
+}
+
+std::shared_ptr<RPC::ClientSession>
+LeaderRPC::findStandby(const std::string& serverAddresses)
+{
+    for (auto it = standbys.begin(); it != standbys.end(); ++it) {
+        if (it->session &&
+            it->serverAddresses == serverAddresses &&
+            it->session->getErrorMessage().empty()) {
+            return it->session;
+        }
+    }
+    return std::shared_ptr<RPC::ClientSession>();
+}
+
+bool
+LeaderRPC::isUnreachable(const std::string& serverAddresses)
+{
+    for (auto it = standbys.begin(); it != standbys.end(); ++it) {
+        if (!it->session && it->serverAddresses == serverAddresses)
+            return true;
+    }
+    return false;
+}
+
 void
 LeaderRPC::reportFailure(std::shared_ptr<RPC::ClientSession> cachedSession)
 {
@@ -361,6 +552,19 @@ LeaderRPC::reportSuccess(std::shared_ptr<RPC::ClientSession> cachedSession)
     }
 }
 
+void
+LeaderRPC::reportOverloaded(uint64_t retryAfterMilliseconds)
+{
+    if (retryAfterMilliseconds > MAX_RETRY_AFTER_MILLISECONDS)
+        retryAfterMilliseconds = MAX_RETRY_AFTER_MILLISECONDS;
+    std::chrono::nanoseconds delay(uint64_t(
+        double(retryAfterMilliseconds) * 1e6 *
+        Core::Random::randomRangeDouble(1.0, 1.5)));
+    VERBOSE("Leader is overloaded, waiting %s before retrying",
+            Core::StringUtil::toString(delay).c_str());
+    overloadBackoff.delayUntil(Clock::now() + delay);
+}
+
 
 } // namespace LogCabin::Client
 } // namespace LogCabin
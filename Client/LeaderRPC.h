@@ -18,8 +18,12 @@
 #include <deque>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "build/Protocol/Client.pb.h"
+#include "Client/Backoff.h"
 #include "Client/SessionManager.h"
 #include "Core/ConditionVariable.h"
 #include "RPC/Address.h"
@@ -220,6 +224,12 @@ class LeaderRPCBase {
 /**
  * This is the implementation of LeaderRPCBase that uses the RPC system.
  * (The other implementation, LeaderRPCMock, is only used for testing.)
+ *
+ * When it doesn't know who the leader is and several hosts are configured,
+ * this class asks all of them at once with GetServerInfo RPCs, rather than
+ * trying one random host at a time. It keeps the sessions opened this way to
+ * the other servers as warm standbys, so that after the leader fails, probing
+ * the remaining servers and following their hints needs no new connections.
  */
 class LeaderRPC : public LeaderRPCBase {
   public:
@@ -255,6 +265,13 @@ class LeaderRPC : public LeaderRPCBase {
 
   private:
 
+    /**
+     * The longest reportOverloaded() will honor a server's request to wait
+     * before retrying. A buggy or malicious server could otherwise stall
+     * this client for hours.
+     */
+    static const uint64_t MAX_RETRY_AFTER_MILLISECONDS = 5000;
+
     /// See LeaderRPCBase::Call.
     class Call : public LeaderRPCBase::Call {
       public:
@@ -278,6 +295,98 @@ class LeaderRPC : public LeaderRPCBase {
         RPC::ClientRPC rpc;
     };
 
+    /**
+     * Shared by the threads of one round of probes; see findLeader().
+     */
+    struct ProbeRound {
+        ProbeRound();
+        /**
+         * Protects all of the following member variables in this struct.
+         */
+        std::mutex mutex;
+        /**
+         * Notified whenever a probe completes.
+         */
+        Core::ConditionVariable changed;
+        /**
+         * The number of probes that have not yet completed.
+         */
+        uint64_t outstanding;
+        /**
+         * Session to the first server that claimed to be leader, if any.
+         */
+        std::shared_ptr<RPC::ClientSession> leader;
+        /**
+         * The first leader hint returned by any server, if any.
+         */
+        std::string leaderHint;
+        /**
+         * Session to the first server that responded at all, if any.
+         */
+        std::shared_ptr<RPC::ClientSession> anyServer;
+        /**
+         * The addresses of servers that were reachable before but didn't
+         * respond this time. Hints to them are ignored, since followers keep
+         * naming a failed leader until they elect a new one.
+         */
+        std::vector<std::string> unreachable;
+    };
+
+    /**
+     * A session to one of the configured hosts, kept open while it's not
+     * being used to reach the leader.
+     */
+    struct Standby {
+        Standby();
+        /**
+         * The session, or NULL.
+         */
+        std::shared_ptr<RPC::ClientSession> session;
+        /**
+         * The server's network addresses, as it reported them. These are the
+         * addresses that other servers will give as leader hints.
+         */
+        std::string serverAddresses;
+    };
+
+    /**
+     * Send a GetServerInfo RPC to every configured host concurrently, and
+     * wait until one of them claims to be leader or all of them respond.
+     * Called without holding #mutex, by the thread that set #isConnecting.
+     * \param timeout
+     *      After this time has elapsed, stop waiting.
+     * \param[out] hint
+     *      If no server claimed to be leader but one named a leader, set to
+     *      that leader's addresses.
+     * \return
+     *      A session to the server that claimed to be leader. Otherwise, a
+     *      session to any server that responded, or NULL if none did.
+     */
+    std::shared_ptr<RPC::ClientSession>
+    findLeader(TimePoint timeout, std::string& hint);
+
+    /**
+     * Body of a probe thread started by findLeader(). Sends a GetServerInfo
+     * RPC to alternatives[index], connecting first if no standby session is
+     * available, then records the result in #standbys and 'round'.
+     */
+    void probe(size_t index,
+               std::shared_ptr<ProbeRound> round,
+               TimePoint timeout);
+
+    /**
+     * Return a healthy standby session to the server with the given
+     * addresses, or NULL if there is none. Requires #mutex to be held.
+     */
+    std::shared_ptr<RPC::ClientSession>
+    findStandby(const std::string& serverAddresses);
+
+    /**
+     * Return true if the last probe of the server with the given addresses
+     * failed. Requires #mutex to be held.
+     */
+    bool isUnreachable(const std::string& serverAddresses);
+
     /**
      * Return a session connected to the most likely cluster leader, creating
      * it if necessary.
@@ -336,6 +445,18 @@ class LeaderRPC : public LeaderRPCBase {
     void
     reportSuccess(std::shared_ptr<RPC::ClientSession> cachedSession);
 
+    /**
+     * Notify this class that a server rejected an RPC because it was
+     * overloaded. This delays the start of new RPCs.
+     * \param retryAfterMilliseconds
+     *      How long the server asked the client to wait, capped at
+     *      #MAX_RETRY_AFTER_MILLISECONDS. This class waits somewhat longer,
+     *      chosen at random, so that the clients that were turned away don't
+     *      all come back at once.
+     */
+    void
+    reportOverloaded(uint64_t retryAfterMilliseconds);
+
     /**
      * Keeps track of the unique ID for this cluster, if known.
      */
@@ -352,6 +473,12 @@ class LeaderRPC : public LeaderRPCBase {
      */
     SessionManager& sessionManager;
 
+    /**
+     * Delays the start of RPCs after a server reports that it's overloaded.
+     * See reportOverloaded().
+     */
+    Backoff overloadBackoff;
+
     /**
      * Protects all of the following member variables in this class.
      */
@@ -395,6 +522,22 @@ class LeaderRPC : public LeaderRPCBase {
      * two.
      */
     uint64_t failuresSinceLastSuccess;
+
+    /**
+     * Each of the hosts in #hosts, separately. See findLeader().
+     */
+    const std::vector<RPC::Address> alternatives;
+
+    /**
+     * Sessions to each of #alternatives, by index. Written by probe threads.
+     */
+    std::vector<Standby> standbys;
+
+    /**
+     * Threads started by findLeader(). Each one exits within about a second,
+     * and they're joined at the start of the next round or on destruction.
+     */
+    std::vector<std::thread> probeThreads;
 };
 
 } // namespace LogCabin::Client
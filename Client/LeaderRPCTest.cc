@@ -235,6 +235,31 @@ TEST_F(ClientLeaderRPCTest, Call_wait_notLeader) {
     EXPECT_EQ(expResponse, response);
 }
 
+TEST_F(ClientLeaderRPCTest, Call_wait_overloaded) {
+    init();
+    Protocol::Client::Error error;
+    error.set_error_code(Protocol::Client::Error::OVERLOADED);
+    error.set_retry_after_milliseconds(20);
+    service->serviceSpecificError(OpCode::STATE_MACHINE_QUERY, request, error);
+    service->reply(OpCode::STATE_MACHINE_QUERY, request, expResponse);
+
+    std::unique_ptr<LeaderRPCBase::Call> call = leaderRPC->makeCall();
+    call->start(OpCode::STATE_MACHINE_QUERY, request, TimePoint::max());
+    EXPECT_EQ(LeaderRPCBase::Call::Status::RETRY,
+              call->wait(response, TimePoint::max()));
+    // keeps the session, since this is the leader
+    std::shared_ptr<RPC::ClientSession> session = leaderRPC->leaderSession;
+    EXPECT_TRUE(session.get());
+
+    TimePoint start = Clock::now();
+    call->start(OpCode::STATE_MACHINE_QUERY, request, TimePoint::max());
+    EXPECT_LE(start + std::chrono::milliseconds(20), Clock::now());
+    EXPECT_EQ(LeaderRPCBase::Call::Status::OK,
+              call->wait(response, TimePoint::max()));
+    EXPECT_EQ(session, leaderRPC->leaderSession);
+    EXPECT_EQ(expResponse, response);
+}
+
 TEST_F(ClientLeaderRPCTest, Call_wait_timeout) {
     std::unique_ptr<LeaderRPCBase::Call> call = leaderRPC->makeCall();
     call->start(OpCode::STATE_MACHINE_QUERY, request, TimePoint::max());
@@ -359,6 +384,127 @@ TEST_F(ClientLeaderRPCTest, reportRedirect) {
     EXPECT_EQ("", leaderRPC->leaderHint);
 }
 
+TEST_F(ClientLeaderRPCTest, reportOverloaded) {
+    TimePoint start = Clock::now();
+    leaderRPC->reportOverloaded(20);
+    TimePoint notBefore = leaderRPC->overloadBackoff.notBefore;
+    EXPECT_LE(start + std::chrono::milliseconds(20), notBefore);
+    EXPECT_GE(Clock::now() + std::chrono::milliseconds(30), notBefore);
+
+    // absurd requests are capped
+    leaderRPC->overloadBackoff.notBefore = TimePoint::min();
+    start = Clock::now();
+    leaderRPC->reportOverloaded(~0UL);
+    notBefore = leaderRPC->overloadBackoff.notBefore;
+    std::chrono::milliseconds max(LeaderRPC::MAX_RETRY_AFTER_MILLISECONDS);
+    EXPECT_LE(start + max, notBefore);
+    EXPECT_GE(Clock::now() + max * 3 / 2, notBefore);
+    leaderRPC->overloadBackoff.notBefore = TimePoint::min();
+}
+
+class ClientLeaderRPCProbeTest : public ClientLeaderRPCTest {
+  public:
+    ClientLeaderRPCProbeTest()
+        : service2(std::make_shared<RPC::ServiceMock>())
+        , server2(new RPC::Server(eventLoop,
+                                  Protocol::Common::MAX_MESSAGE_LENGTH))
+        , probingRPC()
+        , infoRequest()
+        , info1()
+        , info2()
+    {
+        RPC::Address address("127.0.0.1",
+                             Protocol::Common::DEFAULT_PORT + 1);
+        address.refresh(RPC::Address::TimePoint::max());
+        EXPECT_EQ("", server2->bind(address));
+        server2->registerService(Protocol::Common::ServiceId::CLIENT_SERVICE,
+                                 service2, 1);
+        probingRPC.reset(new LeaderRPC(
+            RPC::Address("127.0.0.1:5254,127.0.0.1:5255", 0),
+            clusterUUID,
+            sessionCreationBackoff,
+            sessionManager));
+        info1.mutable_server_info()->set_server_id(1);
+        info1.mutable_server_info()->set_addresses("127.0.0.1:5254");
+        info2.mutable_server_info()->set_server_id(2);
+        info2.mutable_server_info()->set_addresses("127.0.0.1:5255");
+        init();
+    }
+    ~ClientLeaderRPCProbeTest()
+    {
+        probingRPC.reset();
+        eventLoop.exit();
+        eventLoopThread.join();
+    }
+
+    std::shared_ptr<RPC::ServiceMock> service2;
+    std::unique_ptr<RPC::Server> server2;
+    std::unique_ptr<LeaderRPC> probingRPC;
+    Protocol::Client::GetServerInfo::Request infoRequest;
+    Protocol::Client::GetServerInfo::Response info1;
+    Protocol::Client::GetServerInfo::Response info2;
+};
+
+TEST_F(ClientLeaderRPCProbeTest, findLeader) {
+    info1.set_is_leader(false);
+    info1.set_leader_hint("127.0.0.1:5255");
+    service->reply(OpCode::GET_SERVER_INFO, infoRequest, info1);
+    info2.set_is_leader(true);
+    service2->reply(OpCode::GET_SERVER_INFO, infoRequest, info2);
+    service2->reply(OpCode::STATE_MACHINE_QUERY, request, expResponse);
+    EXPECT_EQ(LeaderRPC::Status::OK,
+              probingRPC->call(OpCode::STATE_MACHINE_QUERY, request, response,
+                               TimePoint::max()));
+    EXPECT_EQ(expResponse, response);
+    EXPECT_EQ(probingRPC->standbys.at(1).session, probingRPC->leaderSession);
+    EXPECT_EQ("127.0.0.1:5255", probingRPC->standbys.at(1).serverAddresses);
+}
+
+TEST_F(ClientLeaderRPCProbeTest, findLeader_hint) {
+    // Servers that don't say whether they're leader, but one gives a hint.
+    info1.set_leader_hint("127.0.0.1:5255");
+    service->reply(OpCode::GET_SERVER_INFO, infoRequest, info1);
+    service2->reply(OpCode::GET_SERVER_INFO, infoRequest, info2);
+    service2->reply(OpCode::STATE_MACHINE_QUERY, request, expResponse);
+    EXPECT_EQ(LeaderRPC::Status::OK,
+              probingRPC->call(OpCode::STATE_MACHINE_QUERY, request, response,
+                               TimePoint::max()));
+    EXPECT_EQ(expResponse, response);
+    // reused the standby session rather than connecting again
+    EXPECT_EQ(probingRPC->standbys.at(1).session, probingRPC->leaderSession);
+    EXPECT_EQ("", probingRPC->leaderHint);
+}
+
+TEST_F(ClientLeaderRPCProbeTest, findLeader_noneResponds) {
+    server2.reset();
+    service->closeSession(OpCode::GET_SERVER_INFO, infoRequest);
+    std::string hint;
+    EXPECT_FALSE(probingRPC->findLeader(TimePoint::max(), hint).get());
+    EXPECT_EQ("", hint);
+    EXPECT_FALSE(probingRPC->standbys.at(0).session.get());
+    EXPECT_FALSE(probingRPC->standbys.at(1).session.get());
+}
+
+TEST_F(ClientLeaderRPCProbeTest, getSession_redirectToStandby) {
+    service->reply(OpCode::GET_SERVER_INFO, infoRequest, info1);
+    service2->reply(OpCode::GET_SERVER_INFO, infoRequest, info2);
+    std::string hint;
+    std::shared_ptr<RPC::ClientSession> session =
+        probingRPC->findLeader(TimePoint::max(), hint);
+    EXPECT_TRUE(session.get());
+    EXPECT_EQ("", hint);
+    probingRPC->leaderHint = "127.0.0.1:5254";
+    EXPECT_EQ(probingRPC->standbys.at(0).session,
+              probingRPC->getSession(TimePoint::max()));
+    EXPECT_EQ("", probingRPC->leaderHint);
+
+    // hints to servers that stopped responding aren't followed
+    EXPECT_FALSE(probingRPC->isUnreachable("127.0.0.1:5255"));
+    probingRPC->standbys.at(1).session.reset();
+    EXPECT_TRUE(probingRPC->isUnreachable("127.0.0.1:5255"));
+    EXPECT_FALSE(probingRPC->isUnreachable("127.0.0.1:5254"));
+}
+
 } // namespace LogCabin::Client::<anonymous>
 } // namespace LogCabin::Client
 } // namespace LogCabin
@@ -55,6 +55,7 @@ class TreeLeaderRPC : public LeaderRPCBase {
         : mutex()
         , callbacks(callbacks)
         , tree()
+        , lastIndex(0)
     {
     }
     Status call(OpCode opCode,
@@ -62,6 +63,10 @@ class TreeLeaderRPC : public LeaderRPCBase {
               google::protobuf::Message& response,
               TimePoint timeout) {
         std::lock_guard<std::recursive_mutex> lockGuard(mutex);
+        // Expire files against the local clock in place of cluster time.
+        tree.setCurrentTime(uint64_t(std::chrono::nanoseconds(
+            Clock::now().time_since_epoch()).count()));
+        tree.removeExpiredFiles();
         if (opCode == OpCode::STATE_MACHINE_QUERY) {
             PC::StateMachineQuery::Request qrequest;
             qrequest.CopyFrom(request);
@@ -94,14 +99,25 @@ class TreeLeaderRPC : public LeaderRPCBase {
             if (timeout < Clock::now())
                 return Status::TIMEOUT;
             if (crequest.has_tree()) {
+                tree.setCurrentIndex(++lastIndex);
                 LogCabin::Tree::ProtoBuf::readWriteTreeRPC(
                     tree, crequest.tree(), *cresponse.mutable_tree());
                 return Status::OK;
+            } else if (crequest.tree_batch_size() > 0) {
+                tree.setCurrentIndex(++lastIndex);
+                for (int i = 0; i < crequest.tree_batch_size(); ++i) {
+                    LogCabin::Tree::ProtoBuf::readWriteTreeRPC(
+                        tree, crequest.tree_batch(i),
+                        *cresponse.add_tree_batch());
+                }
+                return Status::OK;
             } else if (crequest.has_open_session()) {
                 cresponse.mutable_open_session()->
                     set_client_id(1);
                 return Status::OK;
             } else if (crequest.has_close_session()) {
+                tree.setCurrentIndex(++lastIndex);
+                tree.removeOwnedFiles(crequest.close_session().client_id());
                 return Status::OK;
             }
         }
@@ -130,7 +146,14 @@ class TreeLeaderRPC : public LeaderRPCBase {
         }
         Status wait(google::protobuf::Message& response,
                     TimePoint timeout) {
-            leaderRPC.call(opCode, *request, response, timeout);
+            switch (leaderRPC.call(opCode, *request, response, timeout)) {
+                case LeaderRPCBase::Status::OK:
+                    break;
+                case LeaderRPCBase::Status::TIMEOUT:
+                    return Status::TIMEOUT;
+                case LeaderRPCBase::Status::INVALID_REQUEST:
+                    return Status::INVALID_REQUEST;
+            }
             return Status::OK;
         }
         TreeLeaderRPC& leaderRPC;
@@ -154,10 +177,18 @@ class TreeLeaderRPC : public LeaderRPCBase {
     std::recursive_mutex mutex;
     std::shared_ptr<TestingCallbacks> callbacks;
     LogCabin::Tree::Tree tree;
+    /**
+     * Counts read-write tree commands, standing in for the log index so that
+     * the tree assigns versions to files and directories.
+     */
+    uint64_t lastIndex;
 };
 } // anonymous namespace
 
-MockClientImpl::MockClientImpl(std::shared_ptr<TestingCallbacks> callbacks)
+MockClientImpl::MockClientImpl(std::shared_ptr<TestingCallbacks> callbacks,
+                               const std::map<std::string, std::string>&
+                                    options)
+    : ClientImpl(options)
 {
     leaderRPC.reset(new TreeLeaderRPC(callbacks));
 }
@@ -32,7 +32,8 @@ namespace Client {
 class MockClientImpl : public ClientImpl {
   public:
     /// Constructor.
-    explicit MockClientImpl(std::shared_ptr<TestingCallbacks> callbacks);
+    MockClientImpl(std::shared_ptr<TestingCallbacks> callbacks,
+                   const std::map<std::string, std::string>& options);
     /// Destructor.
     ~MockClientImpl();
 
@@ -0,0 +1,170 @@
+/* Copyright (c) 2026 LogCabin contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "Client/ReadCache.h"
+#include "Core/Debug.h"
+#include "Core/StringUtil.h"
+
+namespace LogCabin {
+namespace Client {
+
+ReadCache::Mode
+ReadCache::parseMode(const std::string& name)
+{
+    if (name == "none")
+        return Mode::DISABLED;
+    if (name == "linearizable")
+        return Mode::LINEARIZABLE;
+    if (name == "bounded")
+        return Mode::BOUNDED_STALENESS;
+    PANIC("Unknown value for readCache option: '%s' (expected 'none', "
+          "'linearizable', or 'bounded')",
+          name.c_str());
+}
+
+ReadCache::ReadCache(Mode mode,
+                     std::chrono::nanoseconds maxStaleness,
+                     uint64_t maxEntries)
+    : mutex()
+    , mode(mode)
+    , maxStaleness(maxStaleness)
+    , maxEntries(maxEntries)
+    , entries()
+    , generation(0)
+    , stats()
+{
+}
+
+ReadCache::~ReadCache()
+{
+}
+
+ReadCache::Mode
+ReadCache::getMode() const
+{
+    return mode;
+}
+
+bool
+ReadCache::lookup(const std::string& path,
+                  std::string& contents,
+                  uint64_t& version)
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    auto it = entries.find(path);
+    if (it != entries.end()) {
+        if (Clock::now() < it->second.expires) {
+            contents = it->second.contents;
+            version = it->second.version;
+            ++stats.hits;
+            return true;
+        }
+        entries.erase(it);
+        ++stats.expirations;
+    }
+    ++stats.misses;
+    return false;
+}
+
+uint64_t
+ReadCache::beginFill()
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    return generation;
+}
+
+void
+ReadCache::fill(const std::string& path,
+                const std::string& contents,
+                uint64_t version,
+                uint64_t token,
+                TimePoint sentAt,
+                uint64_t leaseNanos)
+{
+    TimePoint expires;
+    switch (mode) {
+        case Mode::DISABLED:
+            return;
+        case Mode::LINEARIZABLE:
+            if (leaseNanos == 0)
+                return;
+            expires = sentAt + std::chrono::nanoseconds(leaseNanos);
+            break;
+        case Mode::BOUNDED_STALENESS:
+            expires = sentAt + maxStaleness;
+            break;
+    }
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    TimePoint now = Clock::now();
+    if (token != generation || expires <= now)
+        return;
+    if (entries.size() >= maxEntries && entries.find(path) == entries.end()) {
+        // Make room: drop expired entries, or else the one expiring soonest.
+        auto soonest = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); ) {
+            if (it->second.expires <= now) {
+                it = entries.erase(it);
+                ++stats.expirations;
+            } else {
+                if (soonest == entries.end() ||
+                    it->second.expires < soonest->second.expires) {
+                    soonest = it;
+                }
+                ++it;
+            }
+        }
+        if (entries.size() >= maxEntries) {
+            if (soonest == entries.end())
+                return; // maxEntries is 0
+            entries.erase(soonest);
+        }
+    }
+    Entry entry(contents, version, expires);
+    auto inserted = entries.insert({path, entry});
+    if (!inserted.second)
+        inserted.first->second = std::move(entry);
+}
+
+void
+ReadCache::invalidate(const std::string& path, bool recursive)
+{
+    if (mode == Mode::DISABLED)
+        return;
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    ++generation;
+    if (!recursive) {
+        stats.invalidations += entries.erase(path);
+        return;
+    }
+    std::string prefix = path;
+    if (!Core::StringUtil::endsWith(prefix, "/"))
+        prefix += "/";
+    auto it = entries.lower_bound(prefix);
+    while (it != entries.end() &&
+           Core::StringUtil::startsWith(it->first, prefix)) {
+        it = entries.erase(it);
+        ++stats.invalidations;
+    }
+}
+
+ReadCacheStats
+ReadCache::getStats() const
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    return stats;
+}
+
+} // namespace LogCabin::Client
+} // namespace LogCabin
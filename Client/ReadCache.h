@@ -0,0 +1,216 @@
+/* Copyright (c) 2026 LogCabin contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LOGCABIN_CLIENT_READCACHE_H
+#define LOGCABIN_CLIENT_READCACHE_H
+
+#include <cinttypes>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "include/LogCabin/Client.h"
+#include "Core/Time.h"
+
+namespace LogCabin {
+namespace Client {
+
+/**
+ * Caches the contents of files read from the cluster, so that repeated reads
+ * of the same files don't each need a round trip to the leader. Entries
+ * expire either when the read lease granted by the leader runs out
+ * (Mode::LINEARIZABLE) or after a fixed staleness bound
+ * (Mode::BOUNDED_STALENESS). Modifications made by this client drop the
+ * affected entries immediately.
+ *
+ * This class is implemented in a monitor style.
+ */
+class ReadCache {
+  public:
+    /// Clock used for expiring entries.
+    typedef Core::Time::SteadyClock Clock;
+    /// Point in time on #Clock.
+    typedef Clock::time_point TimePoint;
+
+    /**
+     * How entries are kept coherent with the cluster.
+     */
+    enum class Mode {
+        /**
+         * Nothing is cached.
+         */
+        DISABLED,
+        /**
+         * Entries are served only while the leader's read lease lasts, during
+         * which no modification to the file can commit.
+         */
+        LINEARIZABLE,
+        /**
+         * Entries are served for up to a fixed time after they were read.
+         */
+        BOUNDED_STALENESS,
+    };
+
+    /**
+     * Convert the value of the readCache client option to a Mode. PANICs on
+     * unknown values.
+     */
+    static Mode parseMode(const std::string& name);
+
+    /**
+     * Constructor.
+     * \param mode
+     *      See Mode.
+     * \param maxStaleness
+     *      How long entries last in Mode::BOUNDED_STALENESS.
+     * \param maxEntries
+     *      The most files kept at once.
+     */
+    ReadCache(Mode mode,
+              std::chrono::nanoseconds maxStaleness,
+              uint64_t maxEntries);
+
+    /**
+     * Destructor.
+     */
+    ~ReadCache();
+
+    /**
+     * Return the mode given to the constructor.
+     */
+    Mode getMode() const;
+
+    /**
+     * Look up a file, counting a hit or a miss.
+     * \param path
+     *      Canonical, absolute path of the file.
+     * \param[out] contents
+     *      Set to the cached contents on a hit.
+     * \param[out] version
+     *      Set to the cached version on a hit.
+     * \return
+     *      True on a hit, false on a miss.
+     */
+    bool lookup(const std::string& path,
+                std::string& contents,
+                uint64_t& version);
+
+    /**
+     * Call this before sending a read whose result will be passed to fill().
+     * \return
+     *      A token for fill(), which lets it drop results that may predate a
+     *      later invalidation.
+     */
+    uint64_t beginFill();
+
+    /**
+     * Store the result of a successful read.
+     * \param path
+     *      Canonical, absolute path of the file.
+     * \param contents
+     *      The file's contents.
+     * \param version
+     *      The file's version.
+     * \param token
+     *      Return value of beginFill() from before the read was sent.
+     * \param sentAt
+     *      When the read was sent. Entries expire relative to this.
+     * \param leaseNanos
+     *      The read lease granted by the leader, or 0 if none.
+     */
+    void fill(const std::string& path,
+              const std::string& contents,
+              uint64_t version,
+              uint64_t token,
+              TimePoint sentAt,
+              uint64_t leaseNanos);
+
+    /**
+     * Drop the entries that a modification by this client may have changed.
+     * \param path
+     *      Canonical, absolute path that was modified.
+     * \param recursive
+     *      If true, 'path' is a directory that was removed, and every file
+     *      below it is dropped.
+     */
+    void invalidate(const std::string& path, bool recursive);
+
+    /**
+     * Return a copy of the counters.
+     */
+    ReadCacheStats getStats() const;
+
+  private:
+    /**
+     * A cached file.
+     */
+    struct Entry {
+        Entry(const std::string& contents,
+              uint64_t version,
+              TimePoint expires)
+            : contents(contents)
+            , version(version)
+            , expires(expires)
+        {
+        }
+        /// The file's contents.
+        std::string contents;
+        /// The file's version.
+        uint64_t version;
+        /// When the entry may no longer be served.
+        TimePoint expires;
+    };
+
+    /**
+     * Protects all of the following member variables in this class.
+     */
+    mutable std::mutex mutex;
+
+    /**
+     * See constructor.
+     */
+    const Mode mode;
+
+    /**
+     * See constructor.
+     */
+    const std::chrono::nanoseconds maxStaleness;
+
+    /**
+     * See constructor.
+     */
+    const uint64_t maxEntries;
+
+    /**
+     * Cached files, keyed by path.
+     */
+    std::map<std::string, Entry> entries;
+
+    /**
+     * Incremented by invalidate(). fill() ignores results of reads that were
+     * sent before the latest invalidation.
+     */
+    uint64_t generation;
+
+    /**
+     * Counters returned by getStats().
+     */
+    ReadCacheStats stats;
+};
+
+} // namespace LogCabin::Client
+} // namespace LogCabin
+
+#endif /* LOGCABIN_CLIENT_READCACHE_H */
@@ -0,0 +1,150 @@
+/* Copyright (c) 2026 LogCabin contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "Client/ReadCache.h"
+
+namespace LogCabin {
+namespace Client {
+namespace {
+
+typedef ReadCache::Clock Clock;
+typedef ReadCache::TimePoint TimePoint;
+typedef ReadCache::Mode Mode;
+
+class ClientReadCacheTest : public ::testing::Test {
+  public:
+    ClientReadCacheTest()
+        : clockMocker()
+        , contents()
+        , version(0)
+    {
+    }
+
+    Clock::Mocker clockMocker;
+    std::string contents;
+    uint64_t version;
+};
+
+TEST_F(ClientReadCacheTest, parseMode) {
+    EXPECT_EQ(Mode::DISABLED, ReadCache::parseMode("none"));
+    EXPECT_EQ(Mode::LINEARIZABLE, ReadCache::parseMode("linearizable"));
+    EXPECT_EQ(Mode::BOUNDED_STALENESS, ReadCache::parseMode("bounded"));
+    EXPECT_DEATH(ReadCache::parseMode("sometimes"),
+                 "Unknown value for readCache option");
+}
+
+TEST_F(ClientReadCacheTest, lookup) {
+    ReadCache cache(Mode::BOUNDED_STALENESS, std::chrono::milliseconds(10),
+                    100);
+    EXPECT_FALSE(cache.lookup("/a", contents, version));
+    cache.fill("/a", "hello", 3, cache.beginFill(), Clock::now(), 0);
+    EXPECT_TRUE(cache.lookup("/a", contents, version));
+    EXPECT_EQ("hello", contents);
+    EXPECT_EQ(3U, version);
+
+    Clock::mockValue += std::chrono::milliseconds(10);
+    EXPECT_FALSE(cache.lookup("/a", contents, version));
+    EXPECT_FALSE(cache.lookup("/a", contents, version));
+    ReadCacheStats stats = cache.getStats();
+    EXPECT_EQ(1U, stats.hits);
+    EXPECT_EQ(3U, stats.misses);
+    EXPECT_EQ(1U, stats.expirations);
+    EXPECT_EQ(0U, stats.invalidations);
+}
+
+TEST_F(ClientReadCacheTest, fill_disabled) {
+    ReadCache cache(Mode::DISABLED, std::chrono::milliseconds(10), 100);
+    cache.fill("/a", "hello", 3, cache.beginFill(), Clock::now(), 1000000);
+    EXPECT_FALSE(cache.lookup("/a", contents, version));
+}
+
+TEST_F(ClientReadCacheTest, fill_linearizable) {
+    ReadCache cache(Mode::LINEARIZABLE, std::chrono::seconds(10), 100);
+    // no lease granted
+    cache.fill("/a", "hello", 3, cache.beginFill(), Clock::now(), 0);
+    EXPECT_FALSE(cache.lookup("/a", contents, version));
+    // the lease is counted from when the read was sent
+    TimePoint sentAt = Clock::now();
+    Clock::mockValue += std::chrono::milliseconds(2);
+    cache.fill("/a", "hello", 3, cache.beginFill(), sentAt, 5000000);
+    EXPECT_TRUE(cache.lookup("/a", contents, version));
+    Clock::mockValue += std::chrono::milliseconds(3);
+    EXPECT_FALSE(cache.lookup("/a", contents, version));
+    // lease already over by the time the response arrived
+    cache.fill("/a", "hello", 3, cache.beginFill(), sentAt, 5000000);
+    EXPECT_FALSE(cache.lookup("/a", contents, version));
+}
+
+TEST_F(ClientReadCacheTest, fill_staleToken) {
+    ReadCache cache(Mode::BOUNDED_STALENESS, std::chrono::milliseconds(10),
+                    100);
+    uint64_t token = cache.beginFill();
+    cache.invalidate("/b", false);
+    cache.fill("/a", "hello", 3, token, Clock::now(), 0);
+    EXPECT_FALSE(cache.lookup("/a", contents, version));
+}
+
+TEST_F(ClientReadCacheTest, fill_evict) {
+    ReadCache cache(Mode::BOUNDED_STALENESS, std::chrono::milliseconds(10),
+                    2);
+    cache.fill("/a", "a", 1, cache.beginFill(), Clock::now(), 0);
+    Clock::mockValue += std::chrono::milliseconds(1);
+    cache.fill("/b", "b", 1, cache.beginFill(), Clock::now(), 0);
+    // replacing an existing entry evicts nothing
+    cache.fill("/b", "b2", 2, cache.beginFill(), Clock::now(), 0);
+    // "/a" expires soonest
+    cache.fill("/c", "c", 1, cache.beginFill(), Clock::now(), 0);
+    EXPECT_FALSE(cache.lookup("/a", contents, version));
+    EXPECT_TRUE(cache.lookup("/b", contents, version));
+    EXPECT_EQ("b2", contents);
+    EXPECT_TRUE(cache.lookup("/c", contents, version));
+    // expired entries go first
+    Clock::mockValue += std::chrono::milliseconds(10);
+    cache.fill("/d", "d", 1, cache.beginFill(), Clock::now(), 0);
+    EXPECT_EQ(2U, cache.getStats().expirations);
+    EXPECT_TRUE(cache.lookup("/d", contents, version));
+
+    ReadCache none(Mode::BOUNDED_STALENESS, std::chrono::milliseconds(10),
+                   0);
+    none.fill("/a", "a", 1, none.beginFill(), Clock::now(), 0);
+    EXPECT_FALSE(none.lookup("/a", contents, version));
+}
+
+TEST_F(ClientReadCacheTest, invalidate) {
+    ReadCache cache(Mode::BOUNDED_STALENESS, std::chrono::milliseconds(10),
+                    100);
+    const char* paths[] = { "/a", "/a/b", "/a/c/d", "/ab", "/b" };
+    for (auto it = std::begin(paths); it != std::end(paths); ++it)
+        cache.fill(*it, "x", 1, cache.beginFill(), Clock::now(), 0);
+
+    cache.invalidate("/b", false);
+    EXPECT_FALSE(cache.lookup("/b", contents, version));
+    cache.invalidate("/a", true);
+    EXPECT_TRUE(cache.lookup("/a", contents, version));
+    EXPECT_FALSE(cache.lookup("/a/b", contents, version));
+    EXPECT_FALSE(cache.lookup("/a/c/d", contents, version));
+    EXPECT_TRUE(cache.lookup("/ab", contents, version));
+    EXPECT_EQ(3U, cache.getStats().invalidations);
+    cache.invalidate("/", true);
+    EXPECT_FALSE(cache.lookup("/a", contents, version));
+    EXPECT_FALSE(cache.lookup("/ab", contents, version));
+    EXPECT_EQ(5U, cache.getStats().invalidations);
+}
+
+} // namespace LogCabin::Client::<anonymous>
+} // namespace LogCabin::Client
+} // namespace LogCabin
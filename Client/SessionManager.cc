@@ -25,9 +25,11 @@ namespace LogCabin {
 namespace Client {
 
 SessionManager::SessionManager(Event::Loop& eventLoop,
-                               const Core::Config& config)
+                               const Core::Config& config,
+                               uint32_t maxMessageLength)
     : eventLoop(eventLoop)
     , config(config)
+    , maxMessageLength(maxMessageLength)
     , skipVerify(false)
 {
 }
@@ -42,7 +44,7 @@ SessionManager::createSession(const RPC::Address& address,
         RPC::ClientSession::makeSession(
                         eventLoop,
                         address,
-                        Protocol::Common::MAX_MESSAGE_LENGTH,
+                        maxMessageLength,
                         timeout,
                         config);
     if (!session->getErrorMessage().empty() || skipVerify)
@@ -21,6 +21,7 @@
 #include <mutex>
 #include <string>
 
+#include "Protocol/Common.h"
 #include "RPC/Address.h"
 
 namespace LogCabin {
@@ -138,9 +139,15 @@ class SessionManager {
      *      This object keeps a reference.
      * \param config
      *      General settings. This object keeps a reference.
+     * \param maxMessageLength
+     *      The maximum number of bytes per RPC request or response on the
+     *      sessions created. Servers raise this for sessions to each other
+     *      (see Protocol::Common::MAX_FRAGMENTED_MESSAGE_LENGTH).
      */
     SessionManager(Event::Loop& eventLoop,
-                   const Core::Config& config);
+                   const Core::Config& config,
+                   uint32_t maxMessageLength =
+                        Protocol::Common::MAX_MESSAGE_LENGTH);
 
 
     /**
@@ -166,6 +173,10 @@ class SessionManager {
     Event::Loop& eventLoop;
   private:
     const Core::Config& config;
+    /**
+     * See constructor.
+     */
+    const uint32_t maxMessageLength;
     /**
      * Used only for unit testing. Set to false, normally.
      */
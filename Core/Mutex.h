@@ -14,8 +14,10 @@
  */
 
 #include <cassert>
+#include <cstring>
 #include <functional>
 #include <mutex>
+#include <pthread.h>
 
 #include "Core/Debug.h"
 
@@ -86,6 +88,104 @@ class Mutex {
     friend class ConditionVariable;
 };
 
+/**
+ * A reader-writer lock: many threads may hold it in shared mode at once, or a
+ * single thread may hold it exclusively. Writers are preferred: once a thread
+ * is waiting to acquire the lock exclusively, new shared acquisitions wait, so
+ * a steady stream of readers cannot starve a writer.
+ *
+ * The interface to this class is the same as C++17's std::shared_mutex, so it
+ * can be used with std::lock_guard, std::unique_lock, and SharedLock.
+ */
+class SharedMutex {
+  public:
+    SharedMutex()
+        : rwlock()
+    {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(
+            &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        int r = pthread_rwlock_init(&rwlock, &attr);
+        if (r != 0)
+            PANIC("pthread_rwlock_init failed: %s", strerror(r));
+        pthread_rwlockattr_destroy(&attr);
+    }
+
+    ~SharedMutex()
+    {
+        pthread_rwlock_destroy(&rwlock);
+    }
+
+    void
+    lock() {
+        int r = pthread_rwlock_wrlock(&rwlock);
+        if (r != 0)
+            PANIC("pthread_rwlock_wrlock failed: %s", strerror(r));
+    }
+
+    bool
+    try_lock() {
+        return pthread_rwlock_trywrlock(&rwlock) == 0;
+    }
+
+    void
+    unlock() {
+        pthread_rwlock_unlock(&rwlock);
+    }
+
+    void
+    lock_shared() {
+        int r = pthread_rwlock_rdlock(&rwlock);
+        if (r != 0)
+            PANIC("pthread_rwlock_rdlock failed: %s", strerror(r));
+    }
+
+    bool
+    try_lock_shared() {
+        return pthread_rwlock_tryrdlock(&rwlock) == 0;
+    }
+
+    void
+    unlock_shared() {
+        pthread_rwlock_unlock(&rwlock);
+    }
+
+  private:
+    /// Underlying lock.
+    pthread_rwlock_t rwlock;
+
+    // SharedMutex is not copyable.
+    SharedMutex(const SharedMutex&) = delete;
+    SharedMutex& operator=(const SharedMutex&) = delete;
+};
+
+/**
+ * Acquires a mutex in shared mode upon construction, releases it upon
+ * destruction. This is a minimal version of C++14's std::shared_lock.
+ * \tparam Mutex
+ *      Type of mutex (usually Core::SharedMutex).
+ */
+template<typename Mutex>
+class SharedLock {
+  public:
+    explicit SharedLock(Mutex& mutex)
+        : mutex(mutex)
+    {
+        mutex.lock_shared();
+    }
+    ~SharedLock()
+    {
+        mutex.unlock_shared();
+    }
+  private:
+    Mutex& mutex;
+
+    // SharedLock is not copyable.
+    SharedLock(const SharedLock&) = delete;
+    SharedLock& operator=(const SharedLock&) = delete;
+};
+
 /**
  * Release a mutex upon construction, reacquires it upon destruction.
  * \tparam Mutex
@@ -0,0 +1,65 @@
+/* Copyright (c) 2026 LogCabin contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+#include <thread>
+
+#include "Core/Mutex.h"
+
+namespace LogCabin {
+namespace Core {
+namespace {
+
+TEST(CoreSharedMutexTest, exclusive)
+{
+    SharedMutex m;
+    m.lock();
+    EXPECT_FALSE(m.try_lock());
+    EXPECT_FALSE(m.try_lock_shared());
+    m.unlock();
+    EXPECT_TRUE(m.try_lock());
+    m.unlock();
+}
+
+TEST(CoreSharedMutexTest, shared)
+{
+    SharedMutex m;
+    {
+        SharedLock<SharedMutex> lockGuard(m);
+        EXPECT_TRUE(m.try_lock_shared());
+        EXPECT_FALSE(m.try_lock());
+        m.unlock_shared();
+    }
+    EXPECT_TRUE(m.try_lock());
+    m.unlock();
+}
+
+TEST(CoreSharedMutexTest, sharedAcrossThreads)
+{
+    SharedMutex m;
+    SharedLock<SharedMutex> lockGuard(m);
+    bool acquired = false;
+    std::thread t([&] () {
+        acquired = m.try_lock_shared();
+        if (acquired)
+            m.unlock_shared();
+    });
+    t.join();
+    EXPECT_TRUE(acquired);
+}
+
+} // namespace LogCabin::Core::<anonymous>
+} // namespace LogCabin::Core
+} // namespace LogCabin
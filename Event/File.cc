@@ -28,7 +28,7 @@ namespace Event {
 //// class File::Monitor ////
 
 File::Monitor::Monitor(Event::Loop& eventLoop, File& file, uint32_t fileEvents)
-    : eventLoop(eventLoop)
+    : eventLoop(&eventLoop)
     , mutex()
     , file(&file)
 {
@@ -55,8 +55,8 @@ File::Monitor::disableForever()
     std::lock_guard<std::mutex> mutexGuard(mutex);
     if (file == NULL)
         return;
-    Event::Loop::Lock lock(eventLoop);
-    int r = epoll_ctl(eventLoop.epollfd, EPOLL_CTL_DEL, file->fd, NULL);
+    Event::Loop::Lock lock(*eventLoop);
+    int r = epoll_ctl(eventLoop->epollfd, EPOLL_CTL_DEL, file->fd, NULL);
     if (r != 0) {
         PANIC("Removing file %d event with epoll_ctl failed: %s",
               file->fd, strerror(errno));
@@ -74,13 +74,45 @@ File::Monitor::setEvents(uint32_t fileEvents)
     memset(&event, 0, sizeof(event));
     event.events = fileEvents;
     event.data.ptr = file;
-    int r = epoll_ctl(eventLoop.epollfd, EPOLL_CTL_MOD, file->fd, &event);
+    int r = epoll_ctl(eventLoop->epollfd, EPOLL_CTL_MOD, file->fd, &event);
     if (r != 0) {
         PANIC("Modifying file %d event with epoll_ctl failed: %s",
               file->fd, strerror(errno));
     }
 }
 
+void
+File::Monitor::setEventLoop(Event::Loop& newEventLoop, uint32_t fileEvents)
+{
+    std::lock_guard<std::mutex> mutexGuard(mutex);
+    if (file == NULL || &newEventLoop == eventLoop)
+        return;
+    Event::Loop::Lock oldLock(*eventLoop);
+    Event::Loop::Lock newLock(newEventLoop);
+    int r = epoll_ctl(eventLoop->epollfd, EPOLL_CTL_DEL, file->fd, NULL);
+    if (r != 0) {
+        PANIC("Removing file %d event with epoll_ctl failed: %s",
+              file->fd, strerror(errno));
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = fileEvents;
+    event.data.ptr = file;
+    r = epoll_ctl(newEventLoop.epollfd, EPOLL_CTL_ADD, file->fd, &event);
+    if (r != 0) {
+        PANIC("Adding file %d event with epoll_ctl failed: %s",
+              file->fd, strerror(errno));
+    }
+    eventLoop = &newEventLoop;
+}
+
+Event::Loop&
+File::Monitor::getEventLoop()
+{
+    std::lock_guard<std::mutex> mutexGuard(mutex);
+    return *eventLoop;
+}
+
 //// class File ////
 
 File::File(int fd, Ownership ownership)
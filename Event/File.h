@@ -102,13 +102,32 @@ class File {
         void setEvents(uint32_t events);
 
         /**
-         * Event::Loop that will monitor the file.
+         * Move monitoring of the file to a different event loop. Once this
+         * returns, only the new event loop will call the File's event
+         * handler. This takes an Event::Loop::Lock on both event loops
+         * internally. It must be called with the old event loop locked or
+         * from its thread (for example, from the File's event handler).
+         * \param eventLoop
+         *      Event::Loop that will monitor the File object from now on.
+         * \param fileEvents
+         *      The events of interest for the file on the new event loop.
+         *      See setEvents().
+         */
+        void setEventLoop(Event::Loop& eventLoop, uint32_t fileEvents);
+
+        /**
+         * Return the Event::Loop that monitors the file.
          */
-        Event::Loop& eventLoop;
+        Event::Loop& getEventLoop();
 
       private:
         /**
-         * Protects #file from concurrent access/modification.
+         * Event::Loop that monitors the file. Protected by #mutex.
+         */
+        Event::Loop* eventLoop;
+
+        /**
+         * Protects #eventLoop and #file from concurrent access/modification.
          */
         std::mutex mutex;
 
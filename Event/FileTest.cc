@@ -123,6 +123,22 @@ TEST_F(EventFileTest, Monitor_setEventsAfterDestroy) {
     monitor.setEvents(EPOLLOUT|EPOLLONESHOT);
 }
 
+TEST_F(EventFileTest, Monitor_setEventLoop) {
+    Event::Loop loop2;
+    MyFile file(loop2, pipeFds[0]);
+    pipeFds[0] = -1;
+    File::Monitor monitor(loop, file, EPOLLIN|EPOLLONESHOT);
+    monitor.setEventLoop(loop2, EPOLLIN|EPOLLONESHOT);
+    EXPECT_EQ(&loop2, &monitor.getEventLoop());
+    EXPECT_EQ(1, write(pipeFds[1], "x", 1));
+    EXPECT_FALSE(hasPending());
+    loop2.runForever();
+    EXPECT_EQ(1U, file.triggerCount);
+    monitor.disableForever();
+    monitor.setEventLoop(loop, EPOLLIN);
+    EXPECT_EQ(&loop2, &monitor.getEventLoop());
+}
+
 TEST_F(EventFileTest, File_destructor_close_on_destroy) {
     {
         MyFile file(loop, pipeFds[0]);
@@ -27,6 +27,7 @@
 #endif
 #include <cassert>
 #include <ctime>
+#include <deque>
 #include <getopt.h>
 #include <iostream>
 #include <thread>
@@ -39,6 +40,7 @@
 namespace {
 
 using LogCabin::Client::Cluster;
+using LogCabin::Client::Future;
 using LogCabin::Client::Result;
 using LogCabin::Client::Status;
 using LogCabin::Client::Tree;
@@ -52,6 +54,8 @@ class OptionParser {
     OptionParser(int& argc, char**& argv)
         : argc(argc)
         , argv(argv)
+        , async(0)
+        , batch(1)
         , cluster("logcabin:5254")
         , logPolicy("")
         , size(1024)
@@ -61,6 +65,8 @@ class OptionParser {
     {
         while (true) {
             static struct option longOptions[] = {
+               {"async",  required_argument, NULL, 'a'},
+               {"batch",  required_argument, NULL, 'b'},
                {"cluster",  required_argument, NULL, 'c'},
                {"help",  no_argument, NULL, 'h'},
                {"size",  required_argument, NULL, 's'},
@@ -71,13 +77,20 @@ class OptionParser {
                {"verbosity",  required_argument, NULL, 256},
                {0, 0, 0, 0}
             };
-            int c = getopt_long(argc, argv, "c:hs:t:w:v", longOptions, NULL);
+            int c = getopt_long(argc, argv, "a:b:c:hs:t:w:v",
+                                longOptions, NULL);
 
             // Detect the end of the options.
             if (c == -1)
                 break;
 
             switch (c) {
+                case 'a':
+                    async = uint64_t(atol(optarg));
+                    break;
+                case 'b':
+                    batch = uint64_t(atol(optarg));
+                    break;
                 case 'c':
                     cluster = optarg;
                     break;
@@ -131,6 +144,23 @@ class OptionParser {
             << "Options:"
             << std::endl
 
+            << "  --async <num>           "
+            << "Number of writes each thread keeps in flight"
+            << std::endl
+            << "                          "
+            << "using the asynchronous API, or 0 to wait for"
+            << std::endl
+            << "                          "
+            << "each write before starting the next [default: 0]"
+            << std::endl
+
+            << "  --batch <num>           "
+            << "Coalesce up to this many concurrent writes into"
+            << std::endl
+            << "                          "
+            << "each command sent to the cluster [default: 1]"
+            << std::endl
+
             << "  -c <addresses>, --cluster=<addresses>  "
             << "Network addresses of the LogCabin"
             << std::endl
@@ -184,6 +214,8 @@ class OptionParser {
 
     int& argc;
     char**& argv;
+    uint64_t async;
+    uint64_t batch;
     std::string cluster;
     std::string logPolicy;
     uint64_t size;
@@ -222,11 +254,30 @@ writeThreadMain(uint64_t id,
     // assign any odd leftover writes in a balanced way
     if (options.totalWrites - numWrites * options.writers > id)
         numWrites += 1;
-    for (uint64_t i = 0; i < numWrites; ++i) {
-        if (exit)
+    if (options.async == 0) {
+        for (uint64_t i = 0; i < numWrites; ++i) {
+            if (exit)
+                break;
+            tree.writeEx(key, value);
+            writesDone = i + 1;
+        }
+        return;
+    }
+    // Keep up to options.async writes outstanding, waiting for the oldest.
+    std::deque<Future> inFlight;
+    uint64_t started = 0;
+    while (started < numWrites || !inFlight.empty()) {
+        while (!exit &&
+               started < numWrites &&
+               inFlight.size() < options.async) {
+            inFlight.push_back(tree.writeAsync(key, value));
+            ++started;
+        }
+        if (inFlight.empty())
             break;
-        tree.writeEx(key, value);
-        writesDone = i + 1;
+        inFlight.front().waitEx();
+        inFlight.pop_front();
+        ++writesDone;
     }
 }
 
@@ -274,7 +325,12 @@ main(int argc, char** argv)
         LogCabin::Client::Debug::setLogPolicy(
             LogCabin::Client::Debug::logPolicyFromString(
                 options.logPolicy));
-        Cluster cluster = Cluster(options.cluster);
+        Cluster::Options clusterOptions;
+        if (options.batch > 1) {
+            clusterOptions["writeBatchMaxOperations"] =
+                std::to_string(options.batch);
+        }
+        Cluster cluster = Cluster(options.cluster, clusterOptions);
         Tree tree = cluster.getTree();
 
         std::string key("/bench");
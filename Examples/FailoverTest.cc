@@ -14,7 +14,9 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <getopt.h>
 #include <iostream>
 #include <sstream>
@@ -39,18 +41,20 @@ class OptionParser {
         , argv(argv)
         , cluster("logcabin:5254")
         , logPolicy("")
+        , stallThreshold(parseNonNegativeDuration("100ms"))
         , timeout(parseNonNegativeDuration("10s"))
     {
         while (true) {
             static struct option longOptions[] = {
                {"cluster",  required_argument, NULL, 'c'},
                {"help",  no_argument, NULL, 'h'},
+               {"stall",  required_argument, NULL, 's'},
                {"timeout",  required_argument, NULL, 't'},
                {"verbose",  no_argument, NULL, 'v'},
                {"verbosity",  required_argument, NULL, 256},
                {0, 0, 0, 0}
             };
-            int c = getopt_long(argc, argv, "c:t:hv", longOptions, NULL);
+            int c = getopt_long(argc, argv, "c:s:t:hv", longOptions, NULL);
 
             // Detect the end of the options.
             if (c == -1)
@@ -60,6 +64,9 @@ class OptionParser {
                 case 'c':
                     cluster = optarg;
                     break;
+                case 's':
+                    stallThreshold = parseNonNegativeDuration(optarg);
+                    break;
                 case 't':
                     timeout = parseNonNegativeDuration(optarg);
                     break;
@@ -91,6 +98,11 @@ class OptionParser {
             << "scripts/failovertest.py, which kills LogCabin servers in the "
             << "meantime."
             << std::endl
+            << "Gaps between operations that exceed the stall threshold, such "
+            << "as during a leader"
+            << std::endl
+            << "failover, are reported with their length."
+            << std::endl
             << std::endl
             << "This program is subject to change (it is not part of "
             << "LogCabin's stable API)."
@@ -118,6 +130,13 @@ class OptionParser {
             << "Print this usage information"
             << std::endl
 
+            << "  -s <time>, --stall=<time>      "
+            << "Report gaps between operations longer"
+            << std::endl
+            << "                                 "
+            << "than this [default: 100ms]"
+            << std::endl
+
             << "  -t <time>, --timeout=<time>    "
             << "Set timeout for individual read and write"
             << std::endl
@@ -150,6 +169,7 @@ class OptionParser {
     char**& argv;
     std::string cluster;
     std::string logPolicy;
+    uint64_t stallThreshold;
     uint64_t timeout;
 };
 
@@ -171,24 +191,72 @@ toU64(const std::string& s)
     return strtoull(s.c_str(), NULL, 16);
 }
 
+/**
+ * Measures the gaps between consecutive operations and reports those longer
+ * than a threshold. These are most likely due to leader failovers, and they
+ * measure how long the client took to find the new leader and get through to
+ * it.
+ */
+class StallDetector {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    explicit StallDetector(uint64_t thresholdNanos)
+        : thresholdNanos(thresholdNanos)
+        , last(Clock::now())
+        , stalls(0)
+        , maxStallMs(0)
+    {
+    }
+
+    /**
+     * Call this after every operation completes.
+     */
+    void operationDone() {
+        Clock::time_point now = Clock::now();
+        uint64_t gap = uint64_t(std::chrono::nanoseconds(now - last).count());
+        last = now;
+        if (gap > thresholdNanos) {
+            uint64_t ms = gap / 1000 / 1000;
+            ++stalls;
+            maxStallMs = std::max(maxStallMs, ms);
+            std::cout << "stalled for " << ms << " ms" << std::endl;
+        }
+    }
+
+    const uint64_t thresholdNanos;
+    Clock::time_point last;
+    uint64_t stalls;
+    uint64_t maxStallMs;
+};
+
+std::string
+read(Tree& tree, StallDetector& stallDetector, const std::string& key)
+{
+    std::string contents = tree.readEx(key);
+    stallDetector.operationDone();
+    return contents;
+}
+
 void
-verify(Tree& tree)
+verify(Tree& tree, StallDetector& stallDetector)
 {
     std::vector<std::string> keys = tree.listDirectoryEx(".");
+    stallDetector.operationDone();
     assert(keys.size() >= 2);
     auto it = keys.begin();
     assert(*it == "0000000000000000");
-    assert(tree.readEx(*it) == "0000000000000001");
+    assert(read(tree, stallDetector, *it) == "0000000000000001");
     ++it;
     assert(*it == "0000000000000001");
-    assert(tree.readEx(*it) == "0000000000000001");
+    assert(read(tree, stallDetector, *it) == "0000000000000001");
     ++it;
     while (it != keys.end()) {
         std::string key = *it;
         uint64_t i = toU64(key);
-        uint64_t a = toU64(tree.readEx(toString(i - 2)));
-        uint64_t b = toU64(tree.readEx(toString(i - 1)));
-        assert(toU64(tree.readEx(key)) == a + b);
+        uint64_t a = toU64(read(tree, stallDetector, toString(i - 2)));
+        uint64_t b = toU64(read(tree, stallDetector, toString(i - 1)));
+        assert(toU64(read(tree, stallDetector, key)) == a + b);
         ++it;
     }
 }
@@ -210,16 +278,21 @@ main(int argc, char** argv)
         tree.setWorkingDirectoryEx("/failovertest");
         tree.writeEx("0000000000000000", "0000000000000001");
         tree.writeEx("0000000000000001", "0000000000000001");
+        StallDetector stallDetector(options.stallThreshold);
         uint64_t i = 2;
         while (true) {
             if ((i & (i-1)) == 0) { // powers of two
-                std::cout << "i=" << i << std::endl;
-                verify(tree);
+                std::cout << "i=" << i
+                          << " stalls=" << stallDetector.stalls
+                          << " maxStallMs=" << stallDetector.maxStallMs
+                          << std::endl;
+                verify(tree, stallDetector);
             }
             std::string key = toString(i);
-            uint64_t a = toU64(tree.readEx(toString(i - 2)));
-            uint64_t b = toU64(tree.readEx(toString(i - 1)));
+            uint64_t a = toU64(read(tree, stallDetector, toString(i - 2)));
+            uint64_t b = toU64(read(tree, stallDetector, toString(i - 1)));
             tree.writeEx(key, toString(a + b));
+            stallDetector.operationDone();
             ++i;
         }
 
@@ -0,0 +1,951 @@
+/* Copyright (c) 2026 LogCabin contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file
+ * This is an open-loop latency benchmark of LogCabin with a mix of
+ * operations. Unlike Benchmark.cc, which starts each write as soon as the
+ * previous one completes, this issues operations at a fixed average rate
+ * regardless of how quickly the cluster responds, and it measures each
+ * operation's latency from the time it was scheduled to start. That way, a
+ * slow cluster shows up as high latency rather than as fewer samples.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <LogCabin/Client.h>
+#include <LogCabin/Debug.h>
+#include <LogCabin/Util.h>
+
+namespace {
+
+using LogCabin::Client::Cluster;
+using LogCabin::Client::Result;
+using LogCabin::Client::Status;
+using LogCabin::Client::Tree;
+using LogCabin::Client::Util::parseNonNegativeDuration;
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * The kinds of operations the benchmark issues.
+ */
+enum OpType {
+    /// Tree::read() of one key.
+    READ = 0,
+    /// Tree::write() of one key.
+    WRITE = 1,
+    /// Tree::listDirectory() of the directory holding one key.
+    LIST = 2,
+    /// Tree::compareAndSwap() of one key, expecting the value the benchmark
+    /// last wrote there.
+    CAS = 3,
+    NUM_OP_TYPES = 4,
+};
+
+const char* const OP_NAMES[NUM_OP_TYPES] = { "read", "write", "list", "cas" };
+
+/**
+ * Number of keys stored in each directory of the key space.
+ */
+const uint64_t KEYS_PER_DIRECTORY = 100;
+
+/**
+ * Parse a string like "read:90,write:10" into relative weights for each
+ * operation type. Exits with an error message on malformed input.
+ */
+std::vector<uint64_t>
+parseMix(const std::string& description)
+{
+    std::vector<uint64_t> weights(NUM_OP_TYPES, 0);
+    std::istringstream in(description);
+    std::string item;
+    uint64_t total = 0;
+    while (std::getline(in, item, ',')) {
+        size_t colon = item.find(':');
+        std::string name = item.substr(0, colon);
+        uint64_t weight = 1;
+        if (colon != std::string::npos)
+            weight = uint64_t(atol(item.substr(colon + 1).c_str()));
+        const char* const* it = std::find(OP_NAMES,
+                                          OP_NAMES + NUM_OP_TYPES,
+                                          name);
+        if (it == OP_NAMES + NUM_OP_TYPES) {
+            std::cerr << "Unknown operation in mix: " << name << std::endl;
+            exit(1);
+        }
+        weights.at(size_t(it - OP_NAMES)) = weight;
+        total += weight;
+    }
+    if (total == 0) {
+        std::cerr << "Operation mix has no weight: " << description
+                  << std::endl;
+        exit(1);
+    }
+    return weights;
+}
+
+/**
+ * Parses argv for the main function.
+ */
+class OptionParser {
+  public:
+    OptionParser(int& argc, char**& argv)
+        : argc(argc)
+        , argv(argv)
+        , arrivals("poisson")
+        , cluster("logcabin:5254")
+        , distribution("uniform")
+        , duration(parseNonNegativeDuration("10s"))
+        , format("csv")
+        , interval(parseNonNegativeDuration("1s"))
+        , keys(1000)
+        , logPolicy("")
+        , mix(parseMix("read:90,write:10"))
+        , output("")
+        , rate(1000)
+        , threads(64)
+        , minValueSize(1024)
+        , maxValueSize(1024)
+        , zipfTheta(0.99)
+    {
+        while (true) {
+            static struct option longOptions[] = {
+               {"arrivals",  required_argument, NULL, 'a'},
+               {"cluster",  required_argument, NULL, 'c'},
+               {"distribution",  required_argument, NULL, 'k'},
+               {"duration",  required_argument, NULL, 'd'},
+               {"format",  required_argument, NULL, 'f'},
+               {"help",  no_argument, NULL, 'h'},
+               {"interval",  required_argument, NULL, 'i'},
+               {"keys",  required_argument, NULL, 'n'},
+               {"mix",  required_argument, NULL, 'm'},
+               {"output",  required_argument, NULL, 'o'},
+               {"rate",  required_argument, NULL, 'r'},
+               {"size",  required_argument, NULL, 's'},
+               {"threads",  required_argument, NULL, 't'},
+               {"zipf",  required_argument, NULL, 'z'},
+               {"verbose",  no_argument, NULL, 'v'},
+               {"verbosity",  required_argument, NULL, 256},
+               {0, 0, 0, 0}
+            };
+            int c = getopt_long(argc, argv, "c:d:hm:o:r:s:t:v",
+                                longOptions, NULL);
+
+            // Detect the end of the options.
+            if (c == -1)
+                break;
+
+            switch (c) {
+                case 'a':
+                    arrivals = optarg;
+                    break;
+                case 'c':
+                    cluster = optarg;
+                    break;
+                case 'd':
+                    duration = parseNonNegativeDuration(optarg);
+                    break;
+                case 'f':
+                    format = optarg;
+                    break;
+                case 'h':
+                    usage();
+                    exit(0);
+                case 'i':
+                    interval = parseNonNegativeDuration(optarg);
+                    break;
+                case 'k':
+                    distribution = optarg;
+                    break;
+                case 'm':
+                    mix = parseMix(optarg);
+                    break;
+                case 'n':
+                    keys = uint64_t(atol(optarg));
+                    break;
+                case 'o':
+                    output = optarg;
+                    break;
+                case 'r':
+                    rate = atof(optarg);
+                    break;
+                case 's': {
+                    std::string size = optarg;
+                    size_t dash = size.find('-');
+                    minValueSize = uint64_t(atol(size.substr(0, dash).c_str()));
+                    maxValueSize = minValueSize;
+                    if (dash != std::string::npos) {
+                        maxValueSize = uint64_t(atol(
+                            size.substr(dash + 1).c_str()));
+                    }
+                    break;
+                }
+                case 't':
+                    threads = uint64_t(atol(optarg));
+                    break;
+                case 'z':
+                    zipfTheta = atof(optarg);
+                    break;
+                case 'v':
+                    logPolicy = "VERBOSE";
+                    break;
+                case 256:
+                    logPolicy = optarg;
+                    break;
+                case '?':
+                default:
+                    // getopt_long already printed an error message.
+                    usage();
+                    exit(1);
+            }
+        }
+        if ((arrivals != "poisson" && arrivals != "fixed") ||
+            (distribution != "uniform" && distribution != "zipfian") ||
+            (format != "csv" && format != "json") ||
+            keys == 0 || rate <= 0 || threads == 0 || interval == 0 ||
+            minValueSize > maxValueSize ||
+            zipfTheta <= 0 || zipfTheta == 1) {
+            usage();
+            exit(1);
+        }
+    }
+
+    void usage() {
+        std::cout
+            << "Issues a mix of operations to LogCabin at a given average "
+            << "rate, regardless of"
+            << std::endl
+            << "how quickly they complete, and reports latency percentiles "
+            << "and throughput for"
+            << std::endl
+            << "each interval as CSV or JSON. Latency is measured from when "
+            << "each operation was"
+            << std::endl
+            << "scheduled to start, so queueing delays in the benchmark "
+            << "count against the"
+            << std::endl
+            << "cluster."
+            << std::endl
+            << std::endl
+            << "To run this against a local multi-server cluster, use "
+            << "scripts/smoketest.py:"
+            << std::endl
+            << "  scripts/smoketest.py --servers=3 --timeout=60 \\"
+            << std::endl
+            << "    --client='build/Examples/MixedBenchmark --duration=30s'"
+            << std::endl
+            << std::endl
+            << "This program is subject to change (it is not part of "
+            << "LogCabin's stable API)."
+            << std::endl
+            << std::endl
+
+            << "Usage: " << argv[0] << " [options]"
+            << std::endl
+            << std::endl
+
+            << "Options:"
+            << std::endl
+
+            << "  --arrivals=<process>    "
+            << "Time between operations: 'fixed' or"
+            << std::endl
+            << "                          "
+            << "exponentially distributed 'poisson'"
+            << std::endl
+            << "                          "
+            << "[default: poisson]"
+            << std::endl
+
+            << "  -c <addresses>, --cluster=<addresses>  "
+            << "Network addresses of the LogCabin"
+            << std::endl
+            << "                                         "
+            << "servers, comma-separated"
+            << std::endl
+            << "                                         "
+            << "[default: logcabin:5254]"
+            << std::endl
+
+            << "  --distribution=<dist>   "
+            << "How keys are chosen: 'uniform' or 'zipfian'"
+            << std::endl
+            << "                          "
+            << "[default: uniform]"
+            << std::endl
+
+            << "  -d <time>, --duration=<time>  "
+            << "Time to issue operations for [default: 10s]"
+            << std::endl
+
+            << "  --format=<format>       "
+            << "Output format: 'csv' or 'json', which prints"
+            << std::endl
+            << "                          "
+            << "one object per line [default: csv]"
+            << std::endl
+
+            << "  -h, --help              "
+            << "Print this usage information"
+            << std::endl
+
+            << "  --interval=<time>       "
+            << "Time between reports [default: 1s]"
+            << std::endl
+
+            << "  --keys=<num>            "
+            << "Number of keys, written before the benchmark"
+            << std::endl
+            << "                          "
+            << "starts [default: 1000]"
+            << std::endl
+
+            << "  -m <mix>, --mix=<mix>   "
+            << "Relative weights of 'read', 'write', 'list',"
+            << std::endl
+            << "                          "
+            << "and 'cas' (compare-and-swap) operations"
+            << std::endl
+            << "                          "
+            << "[default: read:90,write:10]"
+            << std::endl
+
+            << "  -o <file>, --output=<file>  "
+            << "Write reports to this file instead of stdout"
+            << std::endl
+
+            << "  -r <ops>, --rate=<ops>  "
+            << "Average operations started per second"
+            << std::endl
+            << "                          "
+            << "[default: 1000]"
+            << std::endl
+
+            << "  -s <bytes>, --size=<bytes>  "
+            << "Size of each value written, or"
+            << std::endl
+            << "                              "
+            << "<min>-<max> for uniformly distributed"
+            << std::endl
+            << "                              "
+            << "sizes [default: 1024]"
+            << std::endl
+
+            << "  -t <num>, --threads=<num>  "
+            << "Maximum operations in flight [default: 64]"
+            << std::endl
+
+            << "  --zipf=<theta>          "
+            << "Skew of the zipfian distribution [default: 0.99]"
+            << std::endl
+
+            << "  -v, --verbose           "
+            << "Same as --verbosity=VERBOSE"
+            << std::endl
+
+            << "  --verbosity=<policy>    "
+            << "Set which log messages are shown."
+            << std::endl
+            << "                          "
+            << "Comma-separated LEVEL or PATTERN@LEVEL rules."
+            << std::endl
+            << "                          "
+            << "Levels: SILENT, ERROR, WARNING, NOTICE, VERBOSE."
+            << std::endl
+            << "                          "
+            << "Patterns match filename prefixes or suffixes."
+            << std::endl
+            << "                          "
+            << "Example: Client@NOTICE,Test.cc@SILENT,VERBOSE."
+            << std::endl;
+    }
+
+    int& argc;
+    char**& argv;
+    std::string arrivals;
+    std::string cluster;
+    std::string distribution;
+    uint64_t duration;
+    std::string format;
+    uint64_t interval;
+    uint64_t keys;
+    std::string logPolicy;
+    std::vector<uint64_t> mix;
+    std::string output;
+    double rate;
+    uint64_t threads;
+    uint64_t minValueSize;
+    uint64_t maxValueSize;
+    double zipfTheta;
+};
+
+/**
+ * A histogram of latencies in the style of HdrHistogram: each power of two
+ * is split into SUB_BUCKETS linear buckets, so every recorded value is kept
+ * to within about 1.5% regardless of its magnitude, in constant space.
+ */
+class Histogram {
+  public:
+    Histogram()
+        : counts(64 * SUB_BUCKETS, 0)
+        , count(0)
+        , max(0)
+    {
+    }
+
+    /// Record one value, in nanoseconds.
+    void record(uint64_t value) {
+        ++counts.at(bucket(value));
+        ++count;
+        max = std::max(max, value);
+    }
+
+    /// Add all the values recorded in another histogram to this one.
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < counts.size(); ++i)
+            counts.at(i) += other.counts.at(i);
+        count += other.count;
+        max = std::max(max, other.max);
+    }
+
+    /**
+     * Return (approximately) the smallest recorded value that is at least as
+     * large as the given fraction of all recorded values.
+     */
+    uint64_t percentile(double fraction) const {
+        if (count == 0)
+            return 0;
+        uint64_t rank = uint64_t(std::ceil(fraction * double(count)));
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts.at(i);
+            if (seen >= rank)
+                return std::min(highestInBucket(i), max);
+        }
+        return max;
+    }
+
+    /// Number of linear buckets per power of two.
+    static const uint64_t SUB_BUCKETS = 64;
+    /// log2(SUB_BUCKETS).
+    static const uint64_t SUB_BUCKET_BITS = 6;
+
+    std::vector<uint64_t> counts;
+    uint64_t count;
+    uint64_t max;
+
+  private:
+    static size_t bucket(uint64_t value) {
+        uint64_t log2 = 63 - uint64_t(__builtin_clzll(value | 1));
+        uint64_t shift = 0;
+        if (log2 > SUB_BUCKET_BITS)
+            shift = log2 - SUB_BUCKET_BITS;
+        return size_t(shift * SUB_BUCKETS + (value >> shift));
+    }
+    static uint64_t highestInBucket(size_t index) {
+        if (index < 2 * SUB_BUCKETS)
+            return index;
+        uint64_t shift = index / SUB_BUCKETS - 1;
+        uint64_t base = index - shift * SUB_BUCKETS;
+        return ((base + 1) << shift) - 1;
+    }
+};
+
+/**
+ * Picks keys in [0, n) with a zipfian distribution, where key 0 is the most
+ * popular. This is the generator from Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases", as used by YCSB.
+ */
+class ZipfianGenerator {
+  public:
+    ZipfianGenerator(uint64_t n, double theta)
+        : n(n)
+        , theta(theta)
+        , alpha(1.0 / (1.0 - theta))
+        , zetan(zeta(n, theta))
+        , eta((1.0 - std::pow(2.0 / double(n), 1.0 - theta)) /
+              (1.0 - zeta(2, theta) / zetan))
+    {
+    }
+
+    template<typename Engine>
+    uint64_t operator()(Engine& engine) {
+        double u = std::uniform_real_distribution<double>(0, 1)(engine);
+        double uz = u * zetan;
+        if (uz < 1.0)
+            return 0;
+        if (uz < 1.0 + std::pow(0.5, theta))
+            return std::min<uint64_t>(1, n - 1);
+        uint64_t key = uint64_t(double(n) *
+                                std::pow(eta * u - eta + 1.0, alpha));
+        return std::min(key, n - 1);
+    }
+
+  private:
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i)
+            sum += 1.0 / std::pow(double(i), theta);
+        return sum;
+    }
+
+    const uint64_t n;
+    const double theta;
+    const double alpha;
+    const double zetan;
+    const double eta;
+};
+
+/**
+ * One operation scheduled by the dispatcher for a worker to carry out.
+ */
+struct Operation {
+    OpType type;
+    uint64_t key;
+    uint64_t valueSize;
+    Clock::time_point scheduled;
+};
+
+/**
+ * State shared between the dispatcher, the workers, and the reporter.
+ */
+class Benchmark {
+  public:
+    explicit Benchmark(const OptionParser& options)
+        : options(options)
+        , mutex()
+        , queueChanged()
+        , queue()
+        , exit(false)
+        , lastVersion(0)
+        , lastWritten(options.keys)
+        , interval(NUM_OP_TYPES)
+        , intervalErrors(NUM_OP_TYPES, 0)
+        , intervalConflicts(NUM_OP_TYPES, 0)
+        , total(NUM_OP_TYPES)
+        , totalErrors(NUM_OP_TYPES, 0)
+        , totalConflicts(NUM_OP_TYPES, 0)
+        , unstarted(0)
+    {
+    }
+
+    /// Return the path at which the given key is stored.
+    static std::string path(uint64_t key) {
+        std::ostringstream s;
+        s << directory(key) << "/" << key;
+        return s.str();
+    }
+
+    /// Return the directory in which the given key is stored.
+    static std::string directory(uint64_t key) {
+        std::ostringstream s;
+        s << "/mixedbench/" << key / KEYS_PER_DIRECTORY;
+        return s.str();
+    }
+
+    /**
+     * Return the contents for the given version of a key. The version makes
+     * values distinct, so compare-and-swap operations can tell them apart.
+     */
+    static std::string value(uint64_t version, uint64_t size) {
+        std::string value = std::to_string(version) + ":";
+        value.resize(std::max<size_t>(value.size(), size), 'v');
+        return value;
+    }
+
+    /**
+     * Carry out one operation, then record its latency.
+     */
+    void execute(Tree& tree, const Operation& op) {
+        Result result;
+        uint64_t version = 0;
+        if (op.type == WRITE || op.type == CAS) {
+            std::lock_guard<std::mutex> lockGuard(mutex);
+            version = ++lastVersion;
+        }
+        switch (op.type) {
+            case READ: {
+                std::string contents;
+                result = tree.read(path(op.key), contents);
+                break;
+            }
+            case WRITE: {
+                result = tree.write(path(op.key), value(version, op.valueSize));
+                break;
+            }
+            case LIST: {
+                std::vector<std::string> children;
+                result = tree.listDirectory(directory(op.key), children);
+                break;
+            }
+            case CAS: {
+                std::string expected;
+                {
+                    std::lock_guard<std::mutex> lockGuard(mutex);
+                    expected = value(lastWritten.at(op.key).first,
+                                     lastWritten.at(op.key).second);
+                }
+                result = tree.compareAndSwap(path(op.key), expected,
+                                             value(version, op.valueSize));
+                break;
+            }
+            case NUM_OP_TYPES:
+                assert(false);
+        }
+        uint64_t nanos = uint64_t(std::chrono::nanoseconds(
+            Clock::now() - op.scheduled).count());
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        if (result.status == Status::OK) {
+            interval.at(op.type).record(nanos);
+            if (version > 0)
+                lastWritten.at(op.key) = {version, op.valueSize};
+        } else if (result.status == Status::CONDITION_NOT_MET) {
+            // Another write to the same key got there first.
+            interval.at(op.type).record(nanos);
+            ++intervalConflicts.at(op.type);
+        } else {
+            ++intervalErrors.at(op.type);
+        }
+    }
+
+    /**
+     * Main function for worker threads: carry out operations from the queue
+     * until told to exit.
+     */
+    void workerMain(Tree tree) {
+        while (true) {
+            Operation op;
+            {
+                std::unique_lock<std::mutex> lockGuard(mutex);
+                while (!exit && queue.empty())
+                    queueChanged.wait(lockGuard);
+                if (exit)
+                    return;
+                op = queue.front();
+                queue.pop_front();
+            }
+            execute(tree, op);
+        }
+    }
+
+    /**
+     * Hand an operation to the workers.
+     */
+    void dispatch(const Operation& op) {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        queue.push_back(op);
+        queueChanged.notify_one();
+    }
+
+    /**
+     * Tell the workers to exit, abandoning any operations they haven't
+     * started.
+     */
+    void stop() {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        exit = true;
+        unstarted = queue.size();
+        queue.clear();
+        queueChanged.notify_all();
+    }
+
+    /**
+     * Print one report for each operation type and one for all of them,
+     * covering the latencies recorded since the last call, then fold those
+     * into the totals.
+     * \param out
+     *      Where to print.
+     * \param time
+     *      Label for the reports, usually the seconds since the benchmark
+     *      started.
+     * \param seconds
+     *      Length of the interval being reported on, used for throughput.
+     */
+    void report(std::ostream& out, const std::string& time, double seconds) {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        Histogram all;
+        uint64_t allErrors = 0;
+        uint64_t allConflicts = 0;
+        for (size_t i = 0; i < NUM_OP_TYPES; ++i) {
+            if (options.mix.at(i) == 0)
+                continue;
+            print(out, time, OP_NAMES[i], seconds, interval.at(i),
+                  intervalErrors.at(i), intervalConflicts.at(i));
+            all.merge(interval.at(i));
+            allErrors += intervalErrors.at(i);
+            allConflicts += intervalConflicts.at(i);
+            total.at(i).merge(interval.at(i));
+            totalErrors.at(i) += intervalErrors.at(i);
+            totalConflicts.at(i) += intervalConflicts.at(i);
+            interval.at(i) = Histogram();
+            intervalErrors.at(i) = 0;
+            intervalConflicts.at(i) = 0;
+        }
+        print(out, time, "all", seconds, all, allErrors, allConflicts);
+    }
+
+    /**
+     * Print reports covering the whole run.
+     */
+    void reportTotal(std::ostream& out, double seconds) {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        Histogram all;
+        uint64_t allErrors = 0;
+        uint64_t allConflicts = 0;
+        for (size_t i = 0; i < NUM_OP_TYPES; ++i) {
+            if (options.mix.at(i) == 0)
+                continue;
+            print(out, "total", OP_NAMES[i], seconds, total.at(i),
+                  totalErrors.at(i), totalConflicts.at(i));
+            all.merge(total.at(i));
+            allErrors += totalErrors.at(i);
+            allConflicts += totalConflicts.at(i);
+        }
+        print(out, "total", "all", seconds, all, allErrors, allConflicts);
+        if (unstarted > 0) {
+            std::cerr << unstarted << " operations were still queued when "
+                      << "the benchmark ended; the cluster could not keep up "
+                      << "with the requested rate" << std::endl;
+        }
+    }
+
+    /**
+     * Print the header line, if the output format has one.
+     */
+    void printHeader(std::ostream& out) {
+        if (options.format == "csv") {
+            out << "time,op,count,errors,conflicts,ops_per_sec,"
+                << "p50_us,p90_us,p99_us,p999_us,max_us"
+                << std::endl;
+        }
+    }
+
+    const OptionParser& options;
+    std::mutex mutex;
+    std::condition_variable queueChanged;
+    /// Operations waiting for a worker.
+    std::deque<Operation> queue;
+    /// Set to true to make workers exit.
+    bool exit;
+    /// The version of the last value the benchmark tried to write, counting
+    /// across all keys.
+    uint64_t lastVersion;
+    /// The version and size last written successfully to each key.
+    std::vector<std::pair<uint64_t, uint64_t>> lastWritten;
+    /// Latencies of successful operations in the current interval.
+    std::vector<Histogram> interval;
+    /// Operations in the current interval that failed.
+    std::vector<uint64_t> intervalErrors;
+    /// Operations in the current interval that returned CONDITION_NOT_MET.
+    /// These are also included in 'interval'.
+    std::vector<uint64_t> intervalConflicts;
+    /// Like interval, for the whole run so far.
+    std::vector<Histogram> total;
+    /// Like intervalErrors, for the whole run so far.
+    std::vector<uint64_t> totalErrors;
+    /// Like intervalConflicts, for the whole run so far.
+    std::vector<uint64_t> totalConflicts;
+    /// Operations that had not started when the benchmark ended.
+    uint64_t unstarted;
+
+  private:
+    void print(std::ostream& out,
+               const std::string& time,
+               const std::string& op,
+               double seconds,
+               const Histogram& histogram,
+               uint64_t errors,
+               uint64_t conflicts) {
+        double opsPerSec = double(histogram.count) / seconds;
+        double p50 = double(histogram.percentile(0.50)) / 1e3;
+        double p90 = double(histogram.percentile(0.90)) / 1e3;
+        double p99 = double(histogram.percentile(0.99)) / 1e3;
+        double p999 = double(histogram.percentile(0.999)) / 1e3;
+        double max = double(histogram.max) / 1e3;
+        if (options.format == "csv") {
+            out << time << "," << op << ","
+                << histogram.count << "," << errors << "," << conflicts << ","
+                << opsPerSec << ","
+                << p50 << "," << p90 << "," << p99 << "," << p999 << ","
+                << max
+                << std::endl;
+        } else {
+            out << "{\"time\": \"" << time << "\", "
+                << "\"op\": \"" << op << "\", "
+                << "\"count\": " << histogram.count << ", "
+                << "\"errors\": " << errors << ", "
+                << "\"conflicts\": " << conflicts << ", "
+                << "\"ops_per_sec\": " << opsPerSec << ", "
+                << "\"p50_us\": " << p50 << ", "
+                << "\"p90_us\": " << p90 << ", "
+                << "\"p99_us\": " << p99 << ", "
+                << "\"p999_us\": " << p999 << ", "
+                << "\"max_us\": " << max << "}"
+                << std::endl;
+        }
+    }
+};
+
+/**
+ * Write every key once, so that reads and compare-and-swaps find them.
+ */
+void
+populate(const OptionParser& options, Tree& tree, Benchmark& benchmark)
+{
+    for (uint64_t dir = 0; dir * KEYS_PER_DIRECTORY < options.keys; ++dir)
+        tree.makeDirectoryEx(Benchmark::directory(dir * KEYS_PER_DIRECTORY));
+    std::deque<LogCabin::Client::Future> inFlight;
+    for (uint64_t key = 0; key < options.keys; ++key) {
+        // Every key starts out at version 0.
+        benchmark.lastWritten.at(key) = {0, options.minValueSize};
+        inFlight.push_back(tree.writeAsync(
+            Benchmark::path(key),
+            Benchmark::value(0, options.minValueSize)));
+        if (inFlight.size() >= 100) {
+            inFlight.front().waitEx();
+            inFlight.pop_front();
+        }
+    }
+    while (!inFlight.empty()) {
+        inFlight.front().waitEx();
+        inFlight.pop_front();
+    }
+}
+
+/**
+ * Issue operations at the configured rate until the duration elapses.
+ */
+void
+dispatcherMain(const OptionParser& options,
+               Benchmark& benchmark,
+               Clock::time_point start)
+{
+    std::mt19937_64 random(std::random_device{}());
+    std::discrete_distribution<size_t> pickType(options.mix.begin(),
+                                                options.mix.end());
+    std::uniform_int_distribution<uint64_t> uniformKey(0, options.keys - 1);
+    ZipfianGenerator zipfianKey(options.keys, options.zipfTheta);
+    std::uniform_int_distribution<uint64_t> pickSize(options.minValueSize,
+                                                     options.maxValueSize);
+    std::exponential_distribution<double> poissonGap(options.rate);
+    Clock::time_point end = start + std::chrono::nanoseconds(options.duration);
+
+    double elapsed = 0; // seconds after start of next operation
+    while (true) {
+        Operation op;
+        op.type = OpType(pickType(random));
+        if (options.distribution == "zipfian")
+            op.key = zipfianKey(random);
+        else
+            op.key = uniformKey(random);
+        op.valueSize = pickSize(random);
+        op.scheduled = start + std::chrono::nanoseconds(
+                                    uint64_t(elapsed * 1e9));
+        if (op.scheduled >= end)
+            break;
+        std::this_thread::sleep_until(op.scheduled);
+        benchmark.dispatch(op);
+        if (options.arrivals == "poisson")
+            elapsed += poissonGap(random);
+        else
+            elapsed += 1.0 / options.rate;
+    }
+    std::this_thread::sleep_until(end);
+}
+
+} // anonymous namespace
+
+int
+main(int argc, char** argv)
+{
+    try {
+
+        OptionParser options(argc, argv);
+        LogCabin::Client::Debug::setLogPolicy(
+            LogCabin::Client::Debug::logPolicyFromString(
+                options.logPolicy));
+        std::ofstream outputFile;
+        if (!options.output.empty()) {
+            outputFile.open(options.output.c_str());
+            if (!outputFile) {
+                std::cerr << "Could not open " << options.output
+                          << std::endl;
+                exit(1);
+            }
+        }
+        std::ostream& out = options.output.empty() ? std::cout : outputFile;
+
+        Cluster cluster = Cluster(options.cluster);
+        Tree tree = cluster.getTree();
+        Benchmark benchmark(options);
+        populate(options, tree, benchmark);
+
+        std::vector<std::thread> workers;
+        for (uint64_t i = 0; i < options.threads; ++i)
+            workers.emplace_back(&Benchmark::workerMain, &benchmark, tree);
+
+        Clock::time_point start = Clock::now();
+        std::thread dispatcher(dispatcherMain, std::ref(options),
+                               std::ref(benchmark), start);
+        benchmark.printHeader(out);
+        Clock::time_point end =
+            start + std::chrono::nanoseconds(options.duration);
+        Clock::time_point lastReport = start;
+        while (lastReport < end) {
+            Clock::time_point next = std::min(
+                end,
+                lastReport + std::chrono::nanoseconds(options.interval));
+            std::this_thread::sleep_until(next);
+            std::chrono::nanoseconds elapsed = next - start;
+            std::chrono::nanoseconds length = next - lastReport;
+            benchmark.report(out,
+                             std::to_string(double(elapsed.count()) / 1e9),
+                             double(length.count()) / 1e9);
+            lastReport = next;
+        }
+        dispatcher.join();
+        benchmark.stop();
+        for (auto it = workers.begin(); it != workers.end(); ++it)
+            it->join();
+        // Operations that were in flight at the end land in the last
+        // interval; report them with the totals.
+        benchmark.report(out, "end", double(options.interval) / 1e9);
+        benchmark.reportTotal(out, double(options.duration) / 1e9);
+
+        tree.removeDirectory("/mixedbench");
+        return 0;
+
+    } catch (const LogCabin::Client::Exception& e) {
+        std::cerr << "Exiting due to LogCabin::Client::Exception: "
+                  << e.what()
+                  << std::endl;
+        exit(1);
+    }
+}
@@ -17,8 +17,8 @@
 #include <cassert>
 #include <getopt.h>
 #include <iostream>
-#include <iterator>
 #include <sstream>
+#include <streambuf>
 
 #include <LogCabin/Client.h>
 #include <LogCabin/Debug.h>
@@ -281,6 +281,45 @@ class OptionParser {
     uint64_t timeout;
 };
 
+/**
+ * Passes characters through to another stream buffer, remembering the last
+ * one. Used to end a streamed read with a newline if the file doesn't.
+ */
+class LastCharBuf : public std::streambuf {
+  public:
+    explicit LastCharBuf(std::streambuf* dest)
+        : dest(dest)
+        , last(traits_type::eof())
+    {
+    }
+    int_type overflow(int_type c) {
+        if (traits_type::eq_int_type(c, traits_type::eof()))
+            return traits_type::not_eof(c);
+        last = c;
+        return dest->sputc(traits_type::to_char_type(c));
+    }
+    std::streamsize xsputn(const char* s, std::streamsize n) {
+        if (n > 0)
+            last = traits_type::to_int_type(s[n - 1]);
+        return dest->sputn(s, n);
+    }
+    int sync() {
+        return dest->pubsync();
+    }
+    /**
+     * Where characters are passed to.
+     */
+    std::streambuf* dest;
+    /**
+     * The last character written, or EOF if none has been.
+     */
+    int_type last;
+
+    // LastCharBuf is non-copyable.
+    LastCharBuf(const LastCharBuf&) = delete;
+    LastCharBuf& operator=(const LastCharBuf&) = delete;
+};
+
 /**
  * Depth-first search tree traversal, dumping out contents of all files
  */
@@ -300,16 +339,6 @@ dumpTree(const Tree& tree, std::string path)
     }
 }
 
-std::string
-readStdin()
-{
-    std::cin >> std::noskipws;
-    std::istream_iterator<char> it(std::cin);
-    std::istream_iterator<char> end;
-    std::string results(it, end);
-    return results;
-}
-
 } // anonymous namespace
 
 int
@@ -359,13 +388,15 @@ main(int argc, char** argv)
                 tree.removeDirectoryEx(path);
                 break;
             case Command::WRITE:
-                tree.writeEx(path, readStdin());
+                // Streamed in pieces so that large values fit in requests.
+                tree.writeStreamEx(path, std::cin);
                 break;
             case Command::READ: {
-                std::string contents = tree.readEx(path);
-                std::cout << contents;
-                if (contents.empty() ||
-                    contents.at(contents.size() - 1) != '\n') {
+                // Streamed in pieces so that large values fit in responses.
+                LastCharBuf buf(std::cout.rdbuf());
+                std::ostream out(&buf);
+                tree.readStreamEx(path, out);
+                if (buf.last != '\n') {
                     std::cout << std::endl;
                 } else {
                     std::cout.flush();
@@ -56,7 +56,15 @@ enum {
  */
 namespace VersionMessage {
 struct Request {
-    // empty
+    /**
+     * The largest version of the MessageSocket framing protocol that the
+     * client understands. Once the server has seen this, it may send
+     * messages with any version up to this one. Big endian.
+     *
+     * Clients that predate framing version 2 send an empty request, which
+     * servers treat as version 1.
+     */
+    uint16_t maxVersionSupported;
 } __attribute__((packed));
 
 struct Response {
@@ -77,6 +85,16 @@ struct Response {
  */
 enum { MAX_MESSAGE_LENGTH = 1024 + 1024 * 1024 };
 
+/**
+ * The maximum number of bytes per RPC request or response, including these
+ * headers, that servers send each other. Only peers that speak version 3 of
+ * the MessageSocket framing protocol send messages longer than
+ * MAX_MESSAGE_LENGTH, which they split into fragments of about 1 MB. Servers
+ * use this to send larger chunks of snapshots to each other, and they only
+ * accept it on sessions that have called the Raft service.
+ */
+enum { MAX_FRAGMENTED_MESSAGE_LENGTH = 1024 + 64 * 1024 * 1024 };
+
 // This is not an enum class because it is usually used as a uint16_t;
 // enum class is too strict about conversions.
 namespace ServiceId {
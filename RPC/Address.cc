@@ -17,8 +17,10 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/ip.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include <sstream>
 #include <vector>
@@ -32,6 +34,21 @@
 namespace LogCabin {
 namespace RPC {
 
+namespace {
+
+/**
+ * Return true if the given host string names a Unix domain socket.
+ */
+bool
+isUnixHost(const std::string& host)
+{
+    return Core::StringUtil::startsWith(host, Address::UNIX_PREFIX);
+}
+
+} // anonymous namespace
+
+const char Address::UNIX_PREFIX[] = "unix:";
+
 Address::Address(const std::string& str, uint16_t defaultPort)
     : originalString(str)
     , hosts()
@@ -47,6 +64,12 @@ Address::Address(const std::string& str, uint16_t defaultPort)
         if (host.empty())
             continue;
 
+        // Unix domain socket paths have no port, and they may contain colons.
+        if (isUnixHost(host)) {
+            hosts.push_back({host, ""});
+            continue;
+        }
+
         size_t lastColon = host.rfind(':');
         if (lastColon != host.npos &&
             host.find(']', lastColon) == host.npos) {
@@ -141,6 +164,13 @@ Address::getResolvedString() const
             ret << be16toh(addr->sin6_port);
             break;
         }
+        case AF_UNIX: {
+            const sockaddr_un* addr =
+                reinterpret_cast<const sockaddr_un*>(getSockAddr());
+            ret << UNIX_PREFIX;
+            ret << addr->sun_path;
+            break;
+        }
         default:
             return "Unknown protocol";
     }
@@ -160,6 +190,23 @@ Address::toString() const
     }
 }
 
+std::vector<Address>
+Address::getAlternatives() const
+{
+    std::vector<Address> alternatives;
+    for (auto it = hosts.begin(); it != hosts.end(); ++it) {
+        if (isUnixHost(it->first)) {
+            alternatives.push_back(Address(it->first, 0));
+        } else if (it->first.find(':') != std::string::npos) {
+            alternatives.push_back(Address("[" + it->first + "]:" +
+                                           it->second, 0));
+        } else {
+            alternatives.push_back(Address(it->first + ":" + it->second, 0));
+        }
+    }
+    return alternatives;
+}
+
 void
 Address::refresh(TimePoint timeout)
 {
@@ -168,6 +215,26 @@ Address::refresh(TimePoint timeout)
     size_t hostIdx = Core::Random::random32() % hosts.size();
     const std::string& host = hosts.at(hostIdx).first;
     const std::string& port = hosts.at(hostIdx).second;
+
+    if (isUnixHost(host)) {
+        std::string path = host.substr(sizeof(UNIX_PREFIX) - 1);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        // Leave room for the terminating null character.
+        if (path.empty() || path.length() >= sizeof(addr.sun_path)) {
+            WARNING("Unix domain socket path is empty or too long: %s",
+                    path.c_str());
+            return;
+        }
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.length());
+        memset(&storage, 0, sizeof(storage));
+        memcpy(&storage, &addr, sizeof(addr));
+        len = socklen_t(offsetof(sockaddr_un, sun_path) + path.length() + 1);
+        VERBOSE("Result: %s", toString().c_str());
+        return;
+    }
+
     VERBOSE("Running getaddrinfo for host %s with port %s",
             host.c_str(), port.c_str());
 
@@ -28,8 +28,9 @@ namespace RPC {
 
 /**
  * This class resolves user-friendly addresses for services into socket-level
- * addresses. It supports DNS lookups for addressing hosts by name, and it
- * supports multiple (alternative) addresses.
+ * addresses. It supports DNS lookups for addressing hosts by name, Unix
+ * domain sockets for servers on the same host, and multiple (alternative)
+ * addresses.
  */
 class Address {
   public:
@@ -49,7 +50,9 @@ class Address {
      *          - IPv4Address
      *          - [IPv6Address]:port
      *          - [IPv6Address]
+     *          - unix:/path/to/socket
      *      Or a comma-delimited list of these to represent multiple hosts.
+     *      Unix domain socket paths may not contain commas.
      * \param defaultPort
      *      The port number to use if none is specified in str.
      */
@@ -106,7 +109,8 @@ class Address {
      * Convert (a random one of) the host(s) and port(s) to a sockaddr.
      * If the host is a name instead of numeric, this will run a DNS query and
      * select a random result. If this query fails, any previous sockaddr will
-     * be left intact.
+     * be left intact. Unix domain socket addresses are converted without any
+     * lookup.
      * \param timeout
      *      Not yet implemented.
      * \warning
@@ -115,6 +119,17 @@ class Address {
      */
     void refresh(TimePoint timeout);
 
+    /**
+     * Return a separate Address for each of the hosts given to the
+     * constructor, in order. The returned Addresses have not been refreshed.
+     */
+    std::vector<Address> getAlternatives() const;
+
+    /**
+     * The prefix that marks a host string as a Unix domain socket path.
+     */
+    static const char UNIX_PREFIX[];
+
   private:
 
     /**
@@ -126,8 +141,10 @@ class Address {
      * A list of (host, port) pairs as parsed from originalString.
      * - First component: the host name or numeric address as parsed from the
      *   string passed into the constructor. This has brackets stripped out of
-     *   IPv6 addresses and is in the form needed by getaddrinfo().
-     * - Second component: an ASCII representation of the port number to use.
+     *   IPv6 addresses and is in the form needed by getaddrinfo(). For Unix
+     *   domain sockets, this is the full string including UNIX_PREFIX.
+     * - Second component: an ASCII representation of the port number to use,
+     *   or empty for Unix domain sockets.
      *   It is stored in string form because that's sometimes how it comes into
      *   the constructor and always what refresh() needs to call getaddrinfo().
      */
@@ -72,6 +72,11 @@ TEST(RPCAddressTest, constructor) {
     EXPECT_EQ("80", ipv6Short.hosts.at(0).second);
     EXPECT_EQ("[::1]", ipv6Short.originalString);
 
+    // Unix domain socket
+    Address unix("unix:/tmp/logcabin:1.sock", 80);
+    EXPECT_EQ("unix:/tmp/logcabin:1.sock", unix.hosts.at(0).first);
+    EXPECT_EQ("", unix.hosts.at(0).second);
+
     // multiple hosts
     Address all("example.com,"
                 "example.com:80,"
@@ -79,7 +84,8 @@ TEST(RPCAddressTest, constructor) {
                 "1.2.3.4:80,"
                 "[1:2:3:4:5:6:7:8],"
                 "[1:2:3:4:5:6:7:8]:80,"
-                "[::1]", 80);
+                "[::1],"
+                "unix:/tmp/logcabin.sock", 80);
     all.refresh(TimePoint::max());
     EXPECT_EQ((std::vector<std::pair<std::string, std::string>> {
                 {"example.com", "80"},
@@ -89,6 +95,7 @@ TEST(RPCAddressTest, constructor) {
                 {"1:2:3:4:5:6:7:8", "80"},
                 {"1:2:3:4:5:6:7:8", "80"},
                 {"::1", "80"},
+                {"unix:/tmp/logcabin.sock", ""},
                }),
               all.hosts);
 
@@ -130,6 +137,25 @@ TEST(RPCAddressTest, isValid) {
     EXPECT_FALSE(b.isValid());
 }
 
+TEST(RPCAddressTest, refresh_unix) {
+    Address a("unix:/tmp/logcabin:1.sock", 80);
+    a.refresh(TimePoint::max());
+    ASSERT_TRUE(a.isValid());
+    EXPECT_EQ(AF_UNIX, a.getSockAddr()->sa_family);
+    EXPECT_EQ("unix:/tmp/logcabin:1.sock", a.getResolvedString());
+    Address b(a);
+    EXPECT_EQ(a.getSockAddrLen(), b.getSockAddrLen());
+    EXPECT_EQ("unix:/tmp/logcabin:1.sock", b.getResolvedString());
+
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    Address empty("unix:", 80);
+    empty.refresh(TimePoint::max());
+    EXPECT_FALSE(empty.isValid());
+    Address tooLong("unix:/" + std::string(200, 'x'), 80);
+    tooLong.refresh(TimePoint::max());
+    EXPECT_FALSE(tooLong.isValid());
+}
+
 TEST(RPCAddressTest, getResolvedString) {
     // getResolvedString is tested adequately in the refresh test.
 }
@@ -144,6 +170,20 @@ TEST(RPCAddressTest, toString) {
               a.toString());
 }
 
+TEST(RPCAddressTest, getAlternatives) {
+    EXPECT_EQ(0U, Address().getAlternatives().size());
+    Address a("a:1,,b,[::1]:3,unix:/tmp/c:d", 2);
+    std::vector<Address> alternatives = a.getAlternatives();
+    ASSERT_EQ(4U, alternatives.size());
+    EXPECT_EQ("a:1", alternatives.at(0).originalString);
+    EXPECT_EQ("b:2", alternatives.at(1).originalString);
+    EXPECT_EQ("[::1]:3", alternatives.at(2).originalString);
+    EXPECT_EQ("unix:/tmp/c:d", alternatives.at(3).originalString);
+    EXPECT_EQ((std::vector<std::pair<std::string, std::string>>{
+                   {"::1", "3"}}),
+              alternatives.at(2).hosts);
+}
+
 TEST(RPCAddressTest, refresh) {
     Address empty("", 80);
     empty.refresh(Address::TimePoint::max());
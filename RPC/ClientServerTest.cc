@@ -29,6 +29,7 @@
 #include "Event/Timer.h"
 #include "Protocol/Common.h"
 #include "RPC/ClientSession.h"
+#include "RPC/MessageSocket.h"
 #include "RPC/OpaqueClientRPC.h"
 #include "RPC/OpaqueServer.h"
 #include "RPC/OpaqueServerRPC.h"
@@ -144,6 +145,90 @@ TEST_F(RPCClientServerTest, echo) {
     }
 }
 
+// Flood the server with many small outstanding RPCs. They queue up while the
+// client's event loop is held, so the MessageSocket must then send them
+// MAX_MESSAGES_PER_SEND at a time.
+TEST_F(RPCClientServerTest, smallRPCFlood) {
+    // Get the session's version request out of the way first.
+    RPC::OpaqueClientRPC first = clientSession->sendRequest(Core::Buffer());
+    first.waitForReply(TimePoint::max());
+    EXPECT_EQ("", first.getErrorMessage());
+
+    const uint32_t numRPCs = 10 * RPC::MessageSocket::MAX_MESSAGES_PER_SEND;
+    std::vector<RPC::OpaqueClientRPC> rpcs;
+    {
+        // Hold the server's event loop too, so that only the client's sends
+        // are counted.
+        Event::Loop::Lock serverLock(serverEventLoop);
+        RPC::MessageSocket::Stats before = RPC::MessageSocket::getStats();
+        {
+            Event::Loop::Lock clientLock(clientEventLoop);
+            for (uint32_t i = 0; i < numRPCs; ++i) {
+                rpcs.push_back(clientSession->sendRequest(
+                    Core::Buffer(new uint32_t(i), sizeof(i),
+                                 Core::Buffer::deleteObjectFn<uint32_t*>)));
+            }
+        }
+        RPC::MessageSocket::Stats after = RPC::MessageSocket::getStats();
+        for (uint32_t i = 0; i < 10000; ++i) {
+            after = RPC::MessageSocket::getStats();
+            if (after.numMessagesSent - before.numMessagesSent >= numRPCs)
+                break;
+            usleep(1000);
+        }
+        EXPECT_EQ(numRPCs, after.numMessagesSent - before.numMessagesSent);
+        EXPECT_EQ(numRPCs / RPC::MessageSocket::MAX_MESSAGES_PER_SEND,
+                  after.numSendCalls - before.numSendCalls);
+    }
+    // Replies come back in order on the one connection, so once the last
+    // one has arrived, all of the others must have too.
+    rpcs.back().waitForReply(TimePoint::max());
+    for (uint32_t i = 0; i < numRPCs; ++i) {
+        ASSERT_EQ(RPC::OpaqueClientRPC::Status::OK, rpcs.at(i).getStatus())
+            << "RPC " << i << ": " << rpcs.at(i).getErrorMessage();
+        Core::Buffer& reply = *rpcs.at(i).peekReply();
+        ASSERT_EQ(sizeof(i), reply.getLength());
+        EXPECT_EQ(i, *static_cast<uint32_t*>(reply.getData()));
+    }
+}
+
+// Large messages are compressed in both directions once the client and
+// server have agreed on framing version 2.
+TEST_F(RPCClientServerTest, compression) {
+    RPC::Address address2("127.0.0.1", 5253);
+    address2.refresh(RPC::Address::TimePoint::max());
+    RPC::OpaqueServer server2(rpcHandler, serverEventLoop, 2048, {}, 100);
+    EXPECT_EQ("", server2.bind(address2));
+    config.set("rpcCompressionThresholdBytes", 100);
+    std::shared_ptr<RPC::ClientSession> session =
+        RPC::ClientSession::makeSession(
+            clientEventLoop, address2, 2048,
+            RPC::ClientSession::TimePoint::max(),
+            config);
+
+    // The reply to the version request arrives before this one.
+    RPC::OpaqueClientRPC rpc = session->sendRequest(Core::Buffer());
+    rpc.waitForReply(TimePoint::max());
+    EXPECT_EQ("", rpc.getErrorMessage());
+
+    std::string contents(2000, 'a');
+    RPC::OpaqueClientRPC rpc2 = session->sendRequest(
+        Core::Buffer(const_cast<char*>(contents.data()),
+                     contents.size(), NULL));
+    rpc2.waitForReply(TimePoint::max());
+    EXPECT_EQ("", rpc2.getErrorMessage());
+    Core::Buffer& reply = *rpc2.peekReply();
+    EXPECT_EQ(contents,
+              std::string(static_cast<const char*>(reply.getData()),
+                          reply.getLength()));
+    RPC::MessageSocket::CompressionStats stats =
+        session->getCompressionStats();
+    EXPECT_EQ(2000U, stats.sentBytesUncompressed);
+    EXPECT_GT(100U, stats.sentBytesCompressed);
+    EXPECT_EQ(2000U, stats.receivedBytesUncompressed);
+    EXPECT_GT(100U, stats.receivedBytesCompressed);
+}
+
 // Test the RPC timeout (ping) mechanism.
 TEST_F(RPCClientServerTest, timeout_TimingSensitive) {
     config.set("tcpHeartbeatTimeoutMilliseconds", 12);
@@ -20,6 +20,7 @@
 #include <unistd.h>
 
 #include "Core/Debug.h"
+#include "Core/Endian.h"
 #include "Core/StringUtil.h"
 #include "Event/File.h"
 #include "Event/Loop.h"
@@ -100,6 +101,26 @@ ClientSession::MessageSocketHandler::handleReceivedMessage(
         return;
     }
 
+    if (messageId == Protocol::Common::VERSION_MESSAGE_ID) {
+        using Protocol::Common::VersionMessage::Response;
+        if (message.getLength() < sizeof(Response)) {
+            WARNING("Ignoring version response from %s: it's only %lu "
+                    "bytes long",
+                    session.address.toString().c_str(),
+                    message.getLength());
+            return;
+        }
+        Response response;
+        memcpy(&response, message.getData(), sizeof(response));
+        uint16_t version = be16toh(response.maxVersionSupported);
+        VERBOSE("Server %s supports framing versions up to %u",
+                session.address.toString().c_str(),
+                version);
+        if (session.messageSocket)
+            session.messageSocket->setPeerVersion(version);
+        return;
+    }
+
     auto it = session.responses.find(messageId);
     if (it == session.responses.end()) {
         VERBOSE("Received an unexpected response with message ID %lu. "
@@ -127,6 +148,7 @@ ClientSession::MessageSocketHandler::handleReceivedMessage(
         session.timer.schedule(session.PING_TIMEOUT_NS);
 
     // Fill in the response
+    session.receivedReply = true;
     response.status = Response::HAS_REPLY;
     response.reply = std::move(message);
     response.ready.notify_all();
@@ -236,6 +258,7 @@ ClientSession::ClientSession(Event::Loop& eventLoop,
     , errorMessage()
     , numActiveRPCs(0)
     , activePing(false)
+    , receivedReply(false)
     , messageSocket()
     , timerMonitor(eventLoop, timer)
 {
@@ -260,7 +283,8 @@ ClientSession::ClientSession(Event::Loop& eventLoop,
     // Setting NONBLOCK here makes connect return right away with EINPROGRESS.
     // Then we can monitor the fd until it's writable to know when it's done,
     // along with a timeout. See man page for connect under EINPROGRESS.
-    int fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
+    int fd = socket(address.getSockAddr()->sa_family,
+                    SOCK_STREAM|SOCK_NONBLOCK, 0);
     if (fd < 0) {
         errorMessage = "Failed to create socket";
         return;
@@ -328,7 +352,23 @@ ClientSession::ClientSession(Event::Loop& eventLoop,
     }
 
     messageSocket.reset(new MessageSocket(
-        messageSocketHandler, eventLoop, fd, maxMessageLength));
+        messageSocketHandler, eventLoop, fd, maxMessageLength,
+        config.read<uint32_t>(
+            "rpcCompressionThresholdBytes",
+            MessageSocket::DEFAULT_COMPRESSION_THRESHOLD)));
+
+    // Tell the server which versions of the framing protocol this end
+    // understands, and find out which ones it does (see
+    // MessageSocketHandler::handleReceivedMessage). Until the reply arrives,
+    // messages are sent with version 1, which all servers understand.
+    using Protocol::Common::VersionMessage::Request;
+    Request* request = new Request();
+    request->maxVersionSupported =
+        htobe16(MessageSocket::MAX_VERSION_SUPPORTED);
+    messageSocket->sendMessage(
+        Protocol::Common::VERSION_MESSAGE_ID,
+        Core::Buffer(request, sizeof(*request),
+                     Core::Buffer::deleteObjectFn<Request*>));
 }
 
 std::shared_ptr<ClientSession>
@@ -408,6 +448,32 @@ ClientSession::getErrorMessage() const
     return errorMessage;
 }
 
+MessageSocket::CompressionStats
+ClientSession::getCompressionStats() const
+{
+    // messageSocket is only set in the constructor and cleared in the
+    // destructor, so this doesn't need the mutex.
+    if (messageSocket)
+        return messageSocket->getCompressionStats();
+    return MessageSocket::CompressionStats();
+}
+
+uint8_t
+ClientSession::getSendVersion() const
+{
+    // See getCompressionStats() for why this doesn't need the mutex.
+    if (messageSocket)
+        return messageSocket->getSendVersion();
+    return 1;
+}
+
+bool
+ClientSession::hasReceivedReply() const
+{
+    std::lock_guard<std::mutex> mutexGuard(mutex);
+    return receivedReply;
+}
+
 std::string
 ClientSession::toString() const
 {
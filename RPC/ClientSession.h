@@ -135,6 +135,30 @@ class ClientSession {
      */
     std::string getErrorMessage() const;
 
+    /**
+     * Return the compression counters for this session's connection. These
+     * are all zero if the session never connected.
+     * This method is safe to call from any thread.
+     */
+    MessageSocket::CompressionStats getCompressionStats() const;
+
+    /**
+     * Return the version of the MessageSocket framing protocol used to send
+     * requests, which depends on what the server said it supports. This is 1
+     * if the server hasn't said yet or the session never connected.
+     * This method is safe to call from any thread.
+     */
+    uint8_t getSendVersion() const;
+
+    /**
+     * Return true if the server has replied to at least one RPC on this
+     * session. This is useful when the server only relaxes some limits for
+     * the session once it has handled a request (see
+     * Server::registerService()).
+     * This method is safe to call from any thread.
+     */
+    bool hasReceivedReply() const;
+
     /**
      * Return a string describing this session. It will include the address of
      * the server and, if the session has an error, the error message.
@@ -294,6 +318,7 @@ class ClientSession {
      *  - #errorMessage
      *  - #numActiveRPCs
      *  - #activePing
+     *  - #receivedReply
      */
     mutable std::mutex mutex;
 
@@ -334,6 +359,11 @@ class ClientSession {
      */
     bool activePing;
 
+    /**
+     * Set once a reply to any RPC has arrived. See hasReceivedReply().
+     */
+    bool receivedReply;
+
     /**
      * The MessageSocket used to send RPC requests and receive RPC responses.
      * This may be NULL if the socket was never created. In this case,
@@ -26,6 +26,7 @@
 #include "Event/Timer.h"
 #include "Protocol/Common.h"
 #include "RPC/ClientSession.h"
+#include "Storage/FilesystemUtil.h"
 
 namespace LogCabin {
 namespace RPC {
@@ -124,6 +125,25 @@ TEST_F(RPCClientSessionTest, handleReceivedMessage_ping) {
     EXPECT_TRUE(session->timer.isScheduled());
 }
 
+TEST_F(RPCClientSessionTest, handleReceivedMessage_version) {
+    using Protocol::Common::VersionMessage::Response;
+    EXPECT_EQ(1U, session->messageSocket->sendVersion);
+
+    // too short
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    session->messageSocket->handler.handleReceivedMessage(
+        Protocol::Common::VERSION_MESSAGE_ID, buf("a"));
+    EXPECT_EQ(1U, session->messageSocket->sendVersion);
+
+    Response response;
+    response.maxVersionSupported = htobe16(2);
+    session->messageSocket->handler.handleReceivedMessage(
+        Protocol::Common::VERSION_MESSAGE_ID,
+        Core::Buffer(&response, sizeof(response), NULL));
+    EXPECT_EQ(2U, session->messageSocket->sendVersion);
+    EXPECT_EQ(0U, session->numActiveRPCs);
+}
+
 TEST_F(RPCClientSessionTest, handleDisconnect) {
     session->messageSocket->handler.handleDisconnect();
     EXPECT_EQ("Disconnected from server 127.0.0.1 (resolved to 127.0.0.1:0)",
@@ -188,6 +208,27 @@ TEST_F(RPCClientSessionTest, constructor) {
     EXPECT_FALSE(session3->messageSocket);
 }
 
+TEST_F(RPCClientSessionTest, constructor_unix) {
+    std::string tmpdir = Storage::FilesystemUtil::mkdtemp();
+    Address address("unix:" + tmpdir + "/server.sock", 0);
+    address.refresh(Address::TimePoint::max());
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_LE(0, listenFd);
+    ASSERT_EQ(0, bind(listenFd, address.getSockAddr(),
+                      address.getSockAddrLen()));
+    ASSERT_EQ(0, listen(listenFd, 1));
+    auto session2 = ClientSession::makeSession(eventLoop,
+                                               address,
+                                               1024,
+                                               TimePoint::max(),
+                                               Core::Config());
+    EXPECT_EQ("", session2->errorMessage);
+    EXPECT_TRUE(bool(session2->messageSocket));
+    session2.reset();
+    EXPECT_EQ(0, close(listenFd));
+    Storage::FilesystemUtil::remove(tmpdir);
+}
+
 struct ConnectInProgress
 {
     ConnectInProgress()
@@ -0,0 +1,255 @@
+/* Copyright (c) 2026 LogCabin contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file
+ * This is a microbenchmark for the RPC transport between processes on the
+ * same host. It runs an OpaqueServer that echoes every request back, then
+ * sends it a series of RPCs one at a time over TCP loopback and over a Unix
+ * domain socket, and reports the round-trip latency of each.
+ */
+
+#include <getopt.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "Core/Buffer.h"
+#include "Core/Config.h"
+#include "Core/Debug.h"
+#include "Core/StringUtil.h"
+#include "Core/ThreadId.h"
+#include "Core/Time.h"
+#include "Event/Loop.h"
+#include "RPC/Address.h"
+#include "RPC/ClientSession.h"
+#include "RPC/OpaqueClientRPC.h"
+#include "RPC/OpaqueServer.h"
+#include "RPC/OpaqueServerRPC.h"
+
+namespace {
+
+using namespace LogCabin;
+
+/**
+ * Parses argv for the main function.
+ */
+class OptionParser {
+  public:
+    OptionParser(int& argc, char**& argv)
+        : argc(argc)
+        , argv(argv)
+        , port(5260)
+        , rpcs(100000)
+        , size(64)
+        , socketPath(Core::StringUtil::format(
+                        "/tmp/logcabin-loopback-%d.sock", getpid()))
+    {
+        while (true) {
+            static struct option longOptions[] = {
+               {"help",  no_argument, NULL, 'h'},
+               {"port",  required_argument, NULL, 'p'},
+               {"rpcs",  required_argument, NULL, 'n'},
+               {"size",  required_argument, NULL, 's'},
+               {"socket",  required_argument, NULL, 'u'},
+               {0, 0, 0, 0}
+            };
+            int c = getopt_long(argc, argv, "hp:n:s:u:", longOptions, NULL);
+
+            // Detect the end of the options.
+            if (c == -1)
+                break;
+
+            switch (c) {
+                case 'h':
+                    usage();
+                    exit(0);
+                case 'p':
+                    port = uint16_t(atoi(optarg));
+                    break;
+                case 'n':
+                    rpcs = uint64_t(atol(optarg));
+                    break;
+                case 's':
+                    size = uint32_t(atol(optarg));
+                    break;
+                case 'u':
+                    socketPath = optarg;
+                    break;
+                case '?':
+                default:
+                    // getopt_long already printed an error message.
+                    usage();
+                    exit(1);
+            }
+        }
+        if (rpcs == 0) {
+            usage();
+            exit(1);
+        }
+    }
+
+    void usage() {
+        std::cout
+            << "Measures the round-trip latency of RPCs to a server on the "
+            << "same host, over TCP"
+            << std::endl
+            << "loopback and over a Unix domain socket."
+            << std::endl
+            << std::endl
+
+            << "Usage: " << argv[0] << " [options]"
+            << std::endl
+            << std::endl
+
+            << "Options:"
+            << std::endl
+
+            << "  -h, --help              "
+            << "Print this usage information"
+            << std::endl
+
+            << "  -n <num>, --rpcs=<num>  "
+            << "Number of RPCs to send over each transport "
+            << "[default: 100000]"
+            << std::endl
+
+            << "  -p <port>, --port=<port>  "
+            << "TCP port to listen on [default: 5260]"
+            << std::endl
+
+            << "  -s <bytes>, --size=<bytes>  "
+            << "Size of each request and reply [default: 64]"
+            << std::endl
+
+            << "  -u <path>, --socket=<path>  "
+            << "Unix domain socket to listen on "
+            << "[default: /tmp/logcabin-loopback-<pid>.sock]"
+            << std::endl;
+    }
+
+    int& argc;
+    char**& argv;
+    uint16_t port;
+    uint64_t rpcs;
+    uint32_t size;
+    std::string socketPath;
+};
+
+/**
+ * Sends every request straight back as the reply. This runs on the event loop
+ * thread, so the benchmark measures only the transport.
+ */
+class EchoHandler : public RPC::OpaqueServer::Handler {
+  public:
+    void handleRPC(RPC::OpaqueServerRPC serverRPC) {
+        serverRPC.response = std::move(serverRPC.request);
+        serverRPC.sendReply();
+    }
+};
+
+/**
+ * Send the configured number of RPCs one at a time to the given address and
+ * print latency statistics.
+ */
+void
+run(const std::string& name,
+    const OptionParser& options,
+    Event::Loop& eventLoop,
+    RPC::Address address)
+{
+    typedef Core::Time::SteadyClock Clock;
+    address.refresh(RPC::Address::TimePoint::max());
+    std::shared_ptr<RPC::ClientSession> session =
+        RPC::ClientSession::makeSession(eventLoop,
+                                        address,
+                                        options.size + 1024,
+                                        Clock::time_point::max(),
+                                        Core::Config());
+    if (!session->getErrorMessage().empty()) {
+        PANIC("Could not connect to %s: %s",
+              address.toString().c_str(),
+              session->getErrorMessage().c_str());
+    }
+
+    std::string payload(options.size, 'x');
+    std::vector<uint64_t> latencies;
+    latencies.reserve(options.rpcs);
+    // Warm up with a few RPCs that aren't counted.
+    uint64_t warmup = std::min<uint64_t>(1000, options.rpcs);
+    for (uint64_t i = 0; i < warmup + options.rpcs; ++i) {
+        Clock::time_point start = Clock::now();
+        RPC::OpaqueClientRPC rpc = session->sendRequest(
+            Core::Buffer(const_cast<char*>(payload.data()),
+                         payload.size(),
+                         NULL));
+        rpc.waitForReply(Clock::time_point::max());
+        if (rpc.getStatus() != RPC::OpaqueClientRPC::Status::OK) {
+            PANIC("RPC to %s failed: %s",
+                  address.toString().c_str(),
+                  rpc.getErrorMessage().c_str());
+        }
+        if (i >= warmup) {
+            latencies.push_back(uint64_t(
+                std::chrono::nanoseconds(Clock::now() - start).count()));
+        }
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t total = 0;
+    for (auto it = latencies.begin(); it != latencies.end(); ++it)
+        total += *it;
+    size_t n = latencies.size();
+    std::cout << name << ": "
+              << n << " RPCs of " << options.size << " bytes, "
+              << "mean " << total / n << " ns, "
+              << "p50 " << latencies.at(n / 2) << " ns, "
+              << "p99 " << latencies.at(n * 99 / 100) << " ns, "
+              << "max " << latencies.back() << " ns"
+              << std::endl;
+}
+
+} // anonymous namespace
+
+int
+main(int argc, char** argv)
+{
+    Core::ThreadId::setName("main");
+    OptionParser options(argc, argv);
+
+    Event::Loop eventLoop;
+    EchoHandler handler;
+    RPC::OpaqueServer server(handler, eventLoop, options.size + 1024);
+    RPC::Address tcpAddress("127.0.0.1", options.port);
+    tcpAddress.refresh(RPC::Address::TimePoint::max());
+    RPC::Address unixAddress("unix:" + options.socketPath, 0);
+    unixAddress.refresh(RPC::Address::TimePoint::max());
+    std::string error = server.bind(tcpAddress);
+    if (!error.empty())
+        PANIC("%s", error.c_str());
+    error = server.bind(unixAddress);
+    if (!error.empty())
+        PANIC("%s", error.c_str());
+    std::thread eventLoopThread(&Event::Loop::runForever, &eventLoop);
+
+    run("tcp", options, eventLoop, tcpAddress);
+    run("unix", options, eventLoop, unixAddress);
+
+    eventLoop.exit();
+    eventLoopThread.join();
+    return 0;
+}
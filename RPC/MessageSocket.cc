@@ -14,16 +14,21 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <climits>
 #include <errno.h>
 #include <netinet/in.h>
+#include <stdlib.h>
 #include <netinet/tcp.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#include "build/Protocol/ServerStats.pb.h"
 #include "Core/Debug.h"
 #include "Core/Endian.h"
 #include "Event/Loop.h"
@@ -44,8 +49,34 @@ dupOrPanic(int oldfd)
     return newfd;
 }
 
+/**
+ * Return true if the given file descriptor is a Unix domain socket, which has
+ * no use for TCP options like TCP_NODELAY.
+ */
+bool
+isUnixSocket(int fd)
+{
+    int domain = 0;
+    socklen_t len = sizeof(domain);
+    int r = getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+    return (r == 0 && domain == AF_UNIX);
+}
+
 } // anonymous namespace
 
+#ifdef IOV_MAX
+static_assert(2 * MessageSocket::MAX_MESSAGES_PER_SEND <= IOV_MAX,
+              "MAX_MESSAGES_PER_SEND needs more iovecs than IOV_MAX");
+#endif
+
+std::atomic<uint64_t> MessageSocket::numSendCalls(0);
+std::atomic<uint64_t> MessageSocket::numMessagesSent(0);
+std::atomic<uint64_t> MessageSocket::numBytesSent(0);
+std::atomic<uint64_t> MessageSocket::totalSentBytesUncompressed(0);
+std::atomic<uint64_t> MessageSocket::totalSentBytesCompressed(0);
+std::atomic<uint64_t> MessageSocket::totalReceivedBytesUncompressed(0);
+std::atomic<uint64_t> MessageSocket::totalReceivedBytesCompressed(0);
+
 ////////// MessageSocket::SendSocket //////////
 
 MessageSocket::SendSocket::SendSocket(int fd,
@@ -53,13 +84,16 @@ MessageSocket::SendSocket::SendSocket(int fd,
     : Event::File(fd)
     , messageSocket(messageSocket)
 {
-    int flag = 1;
-    int r = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
-    if (r < 0) {
-        // This should be a warning, but some unit tests pass weird types of
-        // file descriptors in here. It's not very important, anyhow.
-        NOTICE("Could not set TCP_NODELAY flag on sending socket %d: %s",
-               fd, strerror(errno));
+    if (!isUnixSocket(fd)) {
+        int flag = 1;
+        int r = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+                           &flag, sizeof(flag));
+        if (r < 0) {
+            // This should be a warning, but some unit tests pass weird types
+            // of file descriptors in here. It's not very important, anyhow.
+            NOTICE("Could not set TCP_NODELAY flag on sending socket %d: %s",
+                   fd, strerror(errno));
+        }
     }
 }
 
@@ -82,13 +116,16 @@ MessageSocket::ReceiveSocket::ReceiveSocket(int fd,
 {
     // I don't know that TCP_NODELAY has any effect if we're only reading from
     // this file descriptor, but I guess it can't hurt.
-    int flag = 1;
-    int r = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
-    if (r < 0) {
-        // This should be a warning, but some unit tests pass weird types of
-        // file descriptors in here. It's not very important, anyhow.
-        NOTICE("Could not set TCP_NODELAY flag on receiving socket %d: %s",
-                fd, strerror(errno));
+    if (!isUnixSocket(fd)) {
+        int flag = 1;
+        int r = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+                           &flag, sizeof(flag));
+        if (r < 0) {
+            // This should be a warning, but some unit tests pass weird types
+            // of file descriptors in here. It's not very important, anyhow.
+            NOTICE("Could not set TCP_NODELAY flag on receiving socket %d: "
+                   "%s", fd, strerror(errno));
+        }
     }
 }
 
@@ -102,13 +139,33 @@ MessageSocket::ReceiveSocket::handleFileEvent(uint32_t events)
     messageSocket.readable();
 }
 
+////////// MessageSocket::CompressionStats //////////
+
+void
+MessageSocket::CompressionStats::updateProtoBuf(
+        LogCabin::Protocol::CompressionStats& message) const
+{
+    message.set_sent_bytes_uncompressed(sentBytesUncompressed);
+    message.set_sent_bytes_compressed(sentBytesCompressed);
+    message.set_received_bytes_uncompressed(receivedBytesUncompressed);
+    message.set_received_bytes_compressed(receivedBytesCompressed);
+}
+
 ////////// MessageSocket::Header //////////
 
+MessageSocket::Header::Header()
+    : fixed(0)
+    , flags(0)
+    , version(0)
+    , payloadLength(0)
+    , messageId(0)
+{
+}
+
 void
 MessageSocket::Header::fromBigEndian()
 {
     fixed = be16toh(fixed);
-    version = be16toh(version);
     payloadLength = be32toh(payloadLength);
     messageId = be64toh(messageId);
 }
@@ -117,17 +174,111 @@ void
 MessageSocket::Header::toBigEndian()
 {
     fixed = htobe16(fixed);
-    version = htobe16(version);
     payloadLength = htobe32(payloadLength);
     messageId = htobe64(messageId);
 }
 
+////////// MessageSocket::ReceiveChunk //////////
+
+struct MessageSocket::ReceiveChunk {
+    /**
+     * Return a chunk with a reference count of 1, from the pool if possible.
+     */
+    static ReceiveChunk* get();
+
+    /**
+     * Drop a reference to the chunk, returning it to the pool if this was
+     * the last one.
+     */
+    void release();
+
+    /**
+     * Core::Buffer deleter for messages received into a chunk. readable()
+     * overwrites the header preceding each such message with a pointer to
+     * its chunk, which is how this finds the chunk to release.
+     */
+    static void releaseMessage(void* data);
+
+    /**
+     * Maximum number of free chunks kept in #pool.
+     */
+    enum { MAX_POOLED = 32 };
+
+    /**
+     * The number of references to this chunk.
+     */
+    std::atomic<uint64_t> refCount;
+
+    /**
+     * Received data.
+     */
+    char data[RECEIVE_CHUNK_BYTES];
+
+    /**
+     * Protects #pool.
+     */
+    static Core::Mutex poolMutex;
+
+    /**
+     * Free chunks that may be reused.
+     */
+    static std::vector<ReceiveChunk*> pool;
+};
+
+Core::Mutex MessageSocket::ReceiveChunk::poolMutex;
+std::vector<MessageSocket::ReceiveChunk*> MessageSocket::ReceiveChunk::pool;
+
+MessageSocket::ReceiveChunk*
+MessageSocket::ReceiveChunk::get()
+{
+    ReceiveChunk* chunk = NULL;
+    {
+        std::lock_guard<Core::Mutex> lockGuard(poolMutex);
+        if (!pool.empty()) {
+            chunk = pool.back();
+            pool.pop_back();
+        }
+    }
+    if (chunk == NULL)
+        chunk = new ReceiveChunk();
+    chunk->refCount = 1;
+    return chunk;
+}
+
+void
+MessageSocket::ReceiveChunk::release()
+{
+    if (--refCount > 0)
+        return;
+    {
+        std::lock_guard<Core::Mutex> lockGuard(poolMutex);
+        if (pool.size() < MAX_POOLED) {
+            pool.push_back(this);
+            return;
+        }
+    }
+    delete this;
+}
+
+void
+MessageSocket::ReceiveChunk::releaseMessage(void* data)
+{
+    static_assert(sizeof(Header) >= sizeof(ReceiveChunk*),
+                  "Header too small to hold a pointer");
+    ReceiveChunk* chunk;
+    memcpy(&chunk, static_cast<char*>(data) - sizeof(Header), sizeof(chunk));
+    chunk->release();
+}
+
 ////////// MessageSocket::Inbound //////////
 
 MessageSocket::Inbound::Inbound()
     : bytesRead(0)
     , header()
     , message()
+    , fragments(NULL)
+    , fragmentsLength(0)
+    , fragmentsMessageId(0)
 {
 }
 
@@ -137,6 +288,7 @@ MessageSocket::Outbound::Outbound()
     : bytesSent(0)
     , header()
     , message()
+    , fragmentOf()
 {
 }
 
@@ -144,17 +296,22 @@ MessageSocket::Outbound::Outbound(Outbound&& other)
     : bytesSent(other.bytesSent)
     , header(other.header)
     , message(std::move(other.message))
+    , fragmentOf(std::move(other.fragmentOf))
 {
 }
 
 MessageSocket::Outbound::Outbound(MessageId messageId,
-                                  Core::Buffer message)
+                                  Core::Buffer message,
+                                  uint8_t version,
+                                  uint8_t flags)
     : bytesSent(0)
     , header()
     , message(std::move(message))
+    , fragmentOf()
 {
     header.fixed = 0xdaf4;
-    header.version = 1;
+    header.flags = flags;
+    header.version = version;
     header.payloadLength = uint32_t(this->message.getLength());
     header.messageId = messageId;
     header.toBigEndian();
@@ -166,6 +323,7 @@ MessageSocket::Outbound::operator=(Outbound&& other)
     bytesSent = other.bytesSent;
     header = other.header;
     message = std::move(other.message);
+    fragmentOf = std::move(other.fragmentOf);
     return *this;
 }
 
@@ -173,11 +331,21 @@ MessageSocket::Outbound::operator=(Outbound&& other)
 
 MessageSocket::MessageSocket(Handler& handler,
                              Event::Loop& eventLoop, int fd,
-                             uint32_t maxMessageLength)
+                             uint32_t maxMessageLength,
+                             uint32_t compressionThreshold)
     : maxMessageLength(maxMessageLength)
+    , maxFragmentedMessageLength(maxMessageLength)
+    , compressionThreshold(compressionThreshold)
+    , sendVersion(1)
+    , sentBytesUncompressed(0)
+    , sentBytesCompressed(0)
+    , receivedBytesUncompressed(0)
+    , receivedBytesCompressed(0)
     , handler(handler)
-    , eventLoop(eventLoop)
+    , nextEventLoop(NULL)
     , inbound()
+    , receiveChunk(NULL)
+    , receiveOffset(0)
     , outboundQueueMutex()
     , outboundQueue()
     , receiveSocket(dupOrPanic(fd), *this)
@@ -189,6 +357,30 @@ MessageSocket::MessageSocket(Handler& handler,
 
 MessageSocket::~MessageSocket()
 {
+    if (receiveChunk != NULL)
+        receiveChunk->release();
+    free(inbound.fragments);
+}
+
+MessageSocket::Stats
+MessageSocket::getStats()
+{
+    Stats stats;
+    stats.numSendCalls = numSendCalls;
+    stats.numMessagesSent = numMessagesSent;
+    stats.numBytesSent = numBytesSent;
+    return stats;
+}
+
+MessageSocket::CompressionStats
+MessageSocket::getTotalCompressionStats()
+{
+    CompressionStats stats;
+    stats.sentBytesUncompressed = totalSentBytesUncompressed;
+    stats.sentBytesCompressed = totalSentBytesCompressed;
+    stats.receivedBytesUncompressed = totalReceivedBytesUncompressed;
+    stats.receivedBytesCompressed = totalReceivedBytesCompressed;
+    return stats;
 }
 
 void
@@ -199,7 +391,7 @@ MessageSocket::close()
 
     // Take an Event::Loop::Lock in case the handler assumes it's being
     // executed on the event loop thread.
-    Event::Loop::Lock lock(eventLoop);
+    Event::Loop::Lock lock(receiveSocketMonitor.getEventLoop());
     handler.handleDisconnect();
 }
 
@@ -213,17 +405,98 @@ MessageSocket::sendMessage(MessageId messageId, Core::Buffer contents)
               contents.getLength(), maxMessageLength);
     }
 
+    // Compress large messages on the calling thread, not the event loop.
+    uint8_t version = sendVersion;
+    uint8_t flags = 0;
+    if (version >= 2 &&
+        compressionThreshold > 0 &&
+        contents.getLength() >= compressionThreshold &&
+        compress(contents)) {
+        flags |= Header::COMPRESSED;
+    }
+
     bool kick;
-    { // Place the message on the outbound queue.
+    if (version >= 3 && contents.getLength() > MAX_FRAGMENT_BYTES) {
+        // Split long messages into fragments that share the original buffer.
+        std::shared_ptr<Core::Buffer> whole =
+            std::make_shared<Core::Buffer>(std::move(contents));
+        char* data = static_cast<char*>(whole->getData());
+        uint64_t length = whole->getLength();
+        std::vector<Outbound> fragments;
+        for (uint64_t offset = 0; offset < length;
+             offset += MAX_FRAGMENT_BYTES) {
+            uint64_t fragmentLength = std::min<uint64_t>(MAX_FRAGMENT_BYTES,
+                                                         length - offset);
+            uint8_t fragmentFlags = flags;
+            if (offset + fragmentLength < length)
+                fragmentFlags |= Header::FRAGMENT;
+            fragments.emplace_back(messageId,
+                                   Core::Buffer(data + offset,
+                                                fragmentLength,
+                                                NULL),
+                                   version,
+                                   fragmentFlags);
+            fragments.back().fragmentOf = whole;
+        }
+        // The fragments of a message must not be interleaved with other
+        // messages, so they're queued all at once.
+        std::lock_guard<Core::Mutex> lock(outboundQueueMutex);
+        kick = outboundQueue.empty();
+        for (auto it = fragments.begin(); it != fragments.end(); ++it)
+            outboundQueue.push_back(std::move(*it));
+    } else { // Place the message on the outbound queue.
         std::lock_guard<Core::Mutex> lock(outboundQueueMutex);
         kick = outboundQueue.empty();
-        outboundQueue.emplace_back(messageId, std::move(contents));
+        outboundQueue.emplace_back(messageId, std::move(contents),
+                                   version, flags);
     }
     // Make sure the SendSocket is set up to call writable().
     if (kick)
         sendSocketMonitor.setEvents(EPOLLOUT|EPOLLONESHOT);
 }
 
+void
+MessageSocket::setPeerVersion(uint16_t maxVersionSupported)
+{
+    sendVersion = uint8_t(std::min<uint16_t>(maxVersionSupported,
+                                             MAX_VERSION_SUPPORTED));
+}
+
+uint8_t
+MessageSocket::getSendVersion() const
+{
+    return sendVersion;
+}
+
+void
+MessageSocket::setMaxFragmentedMessageLength(uint32_t length)
+{
+    maxFragmentedMessageLength = std::max(length, maxMessageLength);
+}
+
+Event::Loop&
+MessageSocket::getEventLoop()
+{
+    return receiveSocketMonitor.getEventLoop();
+}
+
+void
+MessageSocket::setEventLoop(Event::Loop& eventLoop)
+{
+    nextEventLoop = &eventLoop;
+}
+
+MessageSocket::CompressionStats
+MessageSocket::getCompressionStats() const
+{
+    CompressionStats stats;
+    stats.sentBytesUncompressed = sentBytesUncompressed;
+    stats.sentBytesCompressed = sentBytesCompressed;
+    stats.receivedBytesUncompressed = receivedBytesUncompressed;
+    stats.receivedBytesCompressed = receivedBytesCompressed;
+    return stats;
+}
+
 void
 MessageSocket::disconnect()
 {
@@ -239,71 +512,222 @@ MessageSocket::readable()
 {
     // Try to read data from the kernel until there is no more left.
     while (true) {
-        if (inbound.bytesRead < sizeof(Header)) {
-            // Receiving header
+        if (inbound.message.getLength() > 0) {
+            // Receiving a long message directly into its own buffer
+            size_t payloadBytesRead = inbound.bytesRead - sizeof(Header);
             ssize_t bytesRead = read(
-                reinterpret_cast<char*>(&inbound.header) + inbound.bytesRead,
-                sizeof(Header) - inbound.bytesRead);
+                (static_cast<char*>(inbound.message.getData()) +
+                 payloadBytesRead),
+                inbound.header.payloadLength - payloadBytesRead);
             if (bytesRead == -1) {
                 disconnect();
                 return;
             }
             inbound.bytesRead += size_t(bytesRead);
-            if (inbound.bytesRead < sizeof(Header))
+            if (inbound.bytesRead < (sizeof(Header) +
+                                     inbound.header.payloadLength)) {
+                break;
+            }
+            if (!receivedPayload(std::move(inbound.message)))
                 return;
-            // Transition to receiving data
-            inbound.header.fromBigEndian();
-            if (inbound.header.fixed != 0xdaf4) {
-                WARNING("Disconnecting since message doesn't start with magic "
-                        "0xdaf4 (first two bytes are 0x%02x)",
-                        inbound.header.fixed);
-                disconnect();
+            // Transition to receiving into chunks
+            inbound.bytesRead = 0;
+            continue;
+        }
+
+        // Make sure there's room to receive into the chunk. If it's full, a
+        // partially received message is copied to the start of a new one.
+        if (receiveChunk == NULL ||
+            receiveOffset + inbound.bytesRead == RECEIVE_CHUNK_BYTES) {
+            ReceiveChunk* chunk = ReceiveChunk::get();
+            if (receiveChunk != NULL) {
+                memcpy(chunk->data,
+                       receiveChunk->data + receiveOffset,
+                       inbound.bytesRead);
+                receiveChunk->release();
             }
-            if (inbound.header.version != 1) {
-                WARNING("Disconnecting since message uses version %u, but "
-                        "this code only understands version 1",
-                        inbound.header.version);
-                disconnect();
+            receiveChunk = chunk;
+            receiveOffset = 0;
+        }
+
+        // Receive as much as fits, then parse as many messages as arrived.
+        size_t end = receiveOffset + inbound.bytesRead;
+        ssize_t bytesRead = read(receiveChunk->data + end,
+                                 RECEIVE_CHUNK_BYTES - end);
+        if (bytesRead == -1) {
+            disconnect();
+            return;
+        }
+        inbound.bytesRead += size_t(bytesRead);
+        // Don't skip this when nothing was read: if there is a header with a
+        // length of 0, the socket won't be readable, but we still need to
+        // process the message.
+        if (!parseReceiveChunk())
+            return;
+        if (bytesRead == 0) {
+            // Idle sockets shouldn't each hold on to a chunk.
+            if (inbound.bytesRead == 0) {
+                receiveChunk->release();
+                receiveChunk = NULL;
             }
-            if (inbound.header.payloadLength > maxMessageLength) {
-                WARNING("Disconnecting since message is too long to receive "
-                        "(message is %u bytes, limit is %u bytes)",
-                        inbound.header.payloadLength, maxMessageLength);
+            break;
+        }
+    }
+
+    // Only now that this thread is done reading from the socket is it safe
+    // for another event loop to take over.
+    Event::Loop* eventLoop = nextEventLoop.exchange(NULL);
+    if (eventLoop != NULL) {
+        receiveSocketMonitor.setEventLoop(*eventLoop, EPOLLIN);
+        // Messages may be waiting to be sent. If not, writable() will return
+        // right away.
+        sendSocketMonitor.setEventLoop(*eventLoop, EPOLLOUT|EPOLLONESHOT);
+    }
+}
+
+bool
+MessageSocket::parseReceiveChunk()
+{
+    while (inbound.bytesRead >= sizeof(Header)) {
+        char* start = receiveChunk->data + receiveOffset;
+        memcpy(&inbound.header, start, sizeof(Header));
+        inbound.header.fromBigEndian();
+        if (inbound.header.fixed != 0xdaf4) {
+            WARNING("Disconnecting since message doesn't start with magic "
+                    "0xdaf4 (first two bytes are 0x%02x)",
+                    inbound.header.fixed);
+            disconnect();
+            return false;
+        }
+        if (inbound.header.version < 1 ||
+            inbound.header.version > MAX_VERSION_SUPPORTED ||
+            (inbound.header.version == 1 && inbound.header.flags != 0)) {
+            WARNING("Disconnecting since message uses version %u, but "
+                    "this code only understands versions 1 through %u",
+                    (inbound.header.flags << 8) | inbound.header.version,
+                    MAX_VERSION_SUPPORTED);
+            disconnect();
+            return false;
+        }
+        uint8_t knownFlags = Header::COMPRESSED;
+        if (inbound.header.version >= 3)
+            knownFlags |= Header::FRAGMENT;
+        if ((inbound.header.flags & ~knownFlags) != 0) {
+            WARNING("Disconnecting since message has unknown flags 0x%02x "
+                    "for version %u",
+                    inbound.header.flags, inbound.header.version);
+            disconnect();
+            return false;
+        }
+        if (inbound.fragments != NULL &&
+            inbound.header.messageId != inbound.fragmentsMessageId) {
+            WARNING("Disconnecting since message %lu arrived in the middle "
+                    "of the fragments of message %lu",
+                    inbound.header.messageId, inbound.fragmentsMessageId);
+            disconnect();
+            return false;
+        }
+        // Only messages that arrive in fragments may exceed maxMessageLength,
+        // and then no single fragment may be longer than MAX_FRAGMENT_BYTES.
+        // That way, the memory allocated below for a header's claimed length
+        // stays small until the data actually arrives.
+        bool fragment = (inbound.fragments != NULL ||
+                         (inbound.header.flags & Header::FRAGMENT));
+        uint32_t maxLength = maxMessageLength;
+        if (fragment) {
+            maxLength = maxFragmentedMessageLength;
+            if (inbound.header.payloadLength > MAX_FRAGMENT_BYTES) {
+                WARNING("Disconnecting since message fragment is too long "
+                        "to receive (fragment is %u bytes, limit is %u "
+                        "bytes)",
+                        inbound.header.payloadLength,
+                        uint32_t(MAX_FRAGMENT_BYTES));
                 disconnect();
-                return;
+                return false;
             }
+        }
+        if (inbound.header.payloadLength >
+            maxLength - inbound.fragmentsLength) {
+            WARNING("Disconnecting since message is too long to receive "
+                    "(message is %lu bytes, limit is %u bytes)",
+                    (inbound.fragmentsLength +
+                     inbound.header.payloadLength),
+                    maxLength);
+            disconnect();
+            return false;
+        }
+        size_t length = sizeof(Header) + inbound.header.payloadLength;
+        if (length > RECEIVE_CHUNK_BYTES) {
+            // The message can't fit in a chunk. Everything received so far
+            // belongs to it: move that into a buffer of its own and receive
+            // the rest directly into there.
             inbound.message.setData(new char[inbound.header.payloadLength],
                                     inbound.header.payloadLength,
                                     Core::Buffer::deleteArrayFn<char>);
+            memcpy(inbound.message.getData(),
+                   start + sizeof(Header),
+                   inbound.bytesRead - sizeof(Header));
+            receiveOffset += inbound.bytesRead;
+            return true;
         }
-        // Don't use 'else' here; we want to check this branch for two reasons:
-        // First, if there is a header with a length of 0, the socket won't be
-        // readable, but we still need to process the message. Second, most of
-        // the time the header will arrive with at least some data. It makes
-        // sense to go ahead and try a non-blocking read, rather than going
-        // back to the event loop.
-        if (inbound.bytesRead >= sizeof(Header)) {
-            // Receiving data
-            size_t payloadBytesRead = inbound.bytesRead - sizeof(Header);
-            ssize_t bytesRead = read(
-                (static_cast<char*>(inbound.message.getData()) +
-                 payloadBytesRead),
-                inbound.header.payloadLength - payloadBytesRead);
-            if (bytesRead == -1) {
-                disconnect();
-                return;
-            }
-            inbound.bytesRead += size_t(bytesRead);
-            if (inbound.bytesRead < (sizeof(Header) +
-                                     inbound.header.payloadLength)) {
-                return;
-            }
-            handler.handleReceivedMessage(inbound.header.messageId,
-                                          std::move(inbound.message));
-            // Transition to receiving header
-            inbound.bytesRead = 0;
+        if (inbound.bytesRead < length)
+            break;
+        Core::Buffer message;
+        if (inbound.header.payloadLength > 0) {
+            // The header has been parsed, so its space can be reused to
+            // point back to the chunk (see ReceiveChunk::releaseMessage()).
+            ++receiveChunk->refCount;
+            memcpy(start, &receiveChunk, sizeof(receiveChunk));
+            message.setData(start + sizeof(Header),
+                            inbound.header.payloadLength,
+                            ReceiveChunk::releaseMessage);
         }
+        receiveOffset += length;
+        inbound.bytesRead -= length;
+        if (!receivedPayload(std::move(message)))
+            return false;
     }
+    // If no messages refer to the chunk anymore, start over at its beginning.
+    if (inbound.bytesRead == 0 && receiveChunk->refCount == 1)
+        receiveOffset = 0;
+    return true;
+}
+
+bool
+MessageSocket::receivedPayload(Core::Buffer payload)
+{
+    if (inbound.fragments != NULL ||
+        (inbound.header.flags & Header::FRAGMENT)) {
+        // parseReceiveChunk() already checked that this fragment belongs to
+        // the same message as the others and that they fit in
+        // maxMessageLength together.
+        size_t length = inbound.fragmentsLength + payload.getLength();
+        char* fragments = static_cast<char*>(
+            realloc(inbound.fragments, std::max<size_t>(length, 1)));
+        if (fragments == NULL)
+            PANIC("Could not allocate %lu bytes for message", length);
+        if (payload.getLength() > 0) {
+            memcpy(fragments + inbound.fragmentsLength,
+                   payload.getData(),
+                   payload.getLength());
+        }
+        inbound.fragments = fragments;
+        inbound.fragmentsLength = length;
+        inbound.fragmentsMessageId = inbound.header.messageId;
+        if (inbound.header.flags & Header::FRAGMENT)
+            return true;
+        payload.setData(inbound.fragments, inbound.fragmentsLength, free);
+        inbound.fragments = NULL;
+        inbound.fragmentsLength = 0;
+    }
+    if ((inbound.header.flags & Header::COMPRESSED) &&
+        !decompress(payload)) {
+        disconnect();
+        return false;
+    }
+    handler.handleReceivedMessage(inbound.header.messageId,
+                                  std::move(payload));
+    return true;
 }
 
 ssize_t
@@ -321,56 +745,137 @@ MessageSocket::read(void* buf, size_t maxBytes)
     PANIC("Error while reading from socket: %s", strerror(errno));
 }
 
+bool
+MessageSocket::compress(Core::Buffer& contents)
+{
+    uLong length = contents.getLength();
+    uLongf compressedLength = compressBound(length);
+    char* data = new char[sizeof(uint32_t) + compressedLength];
+    uint32_t beLength = htobe32(uint32_t(length));
+    memcpy(data, &beLength, sizeof(beLength));
+    int r = compress2(reinterpret_cast<Bytef*>(data + sizeof(uint32_t)),
+                      &compressedLength,
+                      static_cast<const Bytef*>(contents.getData()),
+                      length,
+                      Z_BEST_SPEED);
+    if (r != Z_OK)
+        PANIC("Could not compress message: zlib error %d", r);
+    if (sizeof(uint32_t) + compressedLength >= length) {
+        // Not worth it.
+        delete[] data;
+        return false;
+    }
+    contents.setData(data, sizeof(uint32_t) + compressedLength,
+                     Core::Buffer::deleteArrayFn<char>);
+    sentBytesUncompressed += length;
+    sentBytesCompressed += contents.getLength();
+    totalSentBytesUncompressed += length;
+    totalSentBytesCompressed += contents.getLength();
+    return true;
+}
+
+bool
+MessageSocket::decompress(Core::Buffer& message)
+{
+    if (message.getLength() < sizeof(uint32_t)) {
+        WARNING("Disconnecting since compressed message is too short "
+                "(%lu bytes)", message.getLength());
+        return false;
+    }
+    const char* compressed = static_cast<const char*>(message.getData());
+    uint32_t length;
+    memcpy(&length, compressed, sizeof(length));
+    length = be32toh(length);
+    uint32_t maxLength = maxFragmentedMessageLength;
+    if (length > maxLength) {
+        WARNING("Disconnecting since message is too long to receive "
+                "(message is %u bytes uncompressed, limit is %u bytes)",
+                length, maxLength);
+        return false;
+    }
+    char* data = new char[length];
+    uLongf actualLength = length;
+    int r = uncompress(reinterpret_cast<Bytef*>(data),
+                       &actualLength,
+                       reinterpret_cast<const Bytef*>(compressed +
+                                                      sizeof(uint32_t)),
+                       message.getLength() - sizeof(uint32_t));
+    if (r != Z_OK || actualLength != length) {
+        WARNING("Disconnecting since compressed message is corrupt "
+                "(zlib error %d)", r);
+        delete[] data;
+        return false;
+    }
+    receivedBytesUncompressed += length;
+    receivedBytesCompressed += message.getLength();
+    totalReceivedBytesUncompressed += length;
+    totalReceivedBytesCompressed += message.getLength();
+    message.setData(data, length, Core::Buffer::deleteArrayFn<char>);
+    return true;
+}
+
 void
 MessageSocket::writable()
 {
-    // Each iteration of this loop tries to write one message
-    // from outboundQueue.
+    // Each iteration of this loop tries to write a batch of messages
+    // from outboundQueue with a single kernel call.
     while (true) {
 
-        // Get the next outbound message.
-        Outbound outbound;
+        // Get the next outbound messages.
+        std::vector<Outbound> batch;
         int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
         {
             std::lock_guard<Core::Mutex> lock(outboundQueueMutex);
             if (outboundQueue.empty())
                 return;
-            outbound = std::move(outboundQueue.front());
-            outboundQueue.pop_front();
+            size_t batchBytes = 0;
+            while (!outboundQueue.empty() &&
+                   batch.size() < MAX_MESSAGES_PER_SEND) {
+                Outbound& next = outboundQueue.front();
+                size_t bytes = (sizeof(Header) + next.message.getLength() -
+                                next.bytesSent);
+                if (!batch.empty() && batchBytes + bytes > MAX_BYTES_PER_SEND)
+                    break;
+                batchBytes += bytes;
+                batch.push_back(std::move(next));
+                outboundQueue.pop_front();
+            }
             if (!outboundQueue.empty())
                 flags |= MSG_MORE;
         }
 
-        // Use an iovec to send everything in one kernel call: one iov for the
-        // header, another for the payload.
-        enum { IOV_LEN = 2 };
-        struct iovec iov[IOV_LEN];
-        iov[0].iov_base = &outbound.header;
-        iov[0].iov_len = sizeof(Header);
-        iov[1].iov_base = outbound.message.getData();
-        iov[1].iov_len = outbound.message.getLength();
-
-        { // Skip the parts of the iovec that have already been sent.
-            size_t bytesSent = outbound.bytesSent;
-            for (uint32_t i = 0; i < IOV_LEN; ++i) {
-                iov[i].iov_base = (static_cast<char*>(iov[i].iov_base) +
-                                   bytesSent);
-                if (bytesSent < iov[i].iov_len) {
-                    iov[i].iov_len -= bytesSent;
-                    break;
-                } else {
-                    bytesSent -= iov[i].iov_len;
-                    iov[i].iov_len = 0;
-                }
+        // Use an iovec to send everything in one kernel call: one iov for
+        // each header, another for each payload. Skip the parts of each
+        // message that have already been sent.
+        struct iovec iov[2 * MAX_MESSAGES_PER_SEND];
+        size_t iovLen = 0;
+        for (auto it = batch.begin(); it != batch.end(); ++it) {
+            size_t bytesSent = it->bytesSent;
+            if (bytesSent < sizeof(Header)) {
+                iov[iovLen].iov_base = (reinterpret_cast<char*>(&it->header) +
+                                        bytesSent);
+                iov[iovLen].iov_len = sizeof(Header) - bytesSent;
+                ++iovLen;
+                bytesSent = 0;
+            } else {
+                bytesSent -= sizeof(Header);
+            }
+            if (bytesSent < it->message.getLength()) {
+                iov[iovLen].iov_base = (static_cast<char*>(
+                                            it->message.getData()) +
+                                        bytesSent);
+                iov[iovLen].iov_len = it->message.getLength() - bytesSent;
+                ++iovLen;
             }
         }
 
         struct msghdr msg;
         memset(&msg, 0, sizeof(msg));
         msg.msg_iov = iov;
-        msg.msg_iovlen = IOV_LEN;
+        msg.msg_iovlen = iovLen;
 
         // Do the actual send
+        ++numSendCalls;
         ssize_t bytesSent = sendmsg(sendSocket.fd, &msg, flags);
         if (bytesSent < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
@@ -388,14 +893,28 @@ MessageSocket::writable()
                       sendSocket.fd, strerror(errno));
             }
         }
-
-        // Sent successfully.
-        outbound.bytesSent += size_t(bytesSent);
-        if (outbound.bytesSent != (sizeof(Header) +
-                                   outbound.message.getLength())) {
+        numBytesSent += uint64_t(bytesSent);
+
+        // Sent successfully. Find the first message that wasn't sent in full.
+        size_t unsent = size_t(bytesSent);
+        size_t i = 0;
+        for (; i < batch.size(); ++i) {
+            Outbound& outbound = batch.at(i);
+            size_t remaining = (sizeof(Header) + outbound.message.getLength() -
+                                outbound.bytesSent);
+            if (unsent < remaining) {
+                outbound.bytesSent += unsent;
+                break;
+            }
+            unsent -= remaining;
+        }
+        numMessagesSent += i;
+        if (i < batch.size()) {
+            // Put the rest back on the front of the queue, in order.
             sendSocketMonitor.setEvents(EPOLLOUT|EPOLLONESHOT);
             std::lock_guard<Core::Mutex> lockGuard(outboundQueueMutex);
-            outboundQueue.emplace_front(std::move(outbound));
+            for (size_t j = batch.size(); j > i; --j)
+                outboundQueue.emplace_front(std::move(batch.at(j - 1)));
             return;
         }
     }
@@ -15,8 +15,11 @@
  */
 
 #include <deque>
+#include <memory>
 #include <vector>
 
+#include "Core/CompatAtomic.h"
+
 #include "Core/Buffer.h"
 #include "Core/Mutex.h"
 #include "Event/File.h"
@@ -26,10 +29,13 @@
 
 namespace LogCabin {
 
-// forward declaration
+// forward declarations
 namespace Event {
 class Loop;
 }
+namespace Protocol {
+class CompressionStats;
+}
 
 namespace RPC {
 
@@ -40,9 +46,15 @@ namespace RPC {
  * side and on the server side.
  *
  * On the wire, this adds a 16-byte header on all messages:
- *     | 0xdaf4 | version | length | messageId |
+ *     | 0xdaf4 | flags | version | length | messageId |
  * See Header for more details. Following the header, the data is sent as an
- * opaque binary string.
+ * opaque binary string, which version 2 of the framing protocol may compress.
+ * Version 3 may split long messages into several fragments, so that neither
+ * side needs to handle them in one piece.
+ *
+ * Each side sends version 1 until it learns through setPeerVersion() that the
+ * other side understands something newer. Clients find out with a
+ * Protocol::Common::VERSION_MESSAGE_ID exchange when they connect.
  */
 class MessageSocket {
   public:
@@ -55,8 +67,94 @@ class MessageSocket {
 
     /**
      * Largest version of the framing protocol supported by this code.
+     * Version 2 adds Header::flags, which can mark a payload as compressed.
+     * Version 3 adds Header::FRAGMENT.
+     */
+    enum { MAX_VERSION_SUPPORTED = 3 };
+
+    /**
+     * Once the other side of the socket understands version 3, payloads
+     * longer than this are sent as a series of fragments of at most this many
+     * bytes each. The receiver only allocates memory for a fragment once its
+     * header arrives, rather than for the entire message up front.
+     */
+    enum { MAX_FRAGMENT_BYTES = 1024 * 1024 };
+
+    /**
+     * Payloads of at least this many bytes are compressed by default, once
+     * the other side of the socket understands version 2. Smaller payloads
+     * aren't worth the CPU time.
+     */
+    enum { DEFAULT_COMPRESSION_THRESHOLD = 64 * 1024 };
+
+    /**
+     * writable() sends up to this many queued messages with a single
+     * sendmsg() call. Each message takes two iovec entries, so this must be
+     * at most IOV_MAX / 2.
+     */
+    enum { MAX_MESSAGES_PER_SEND = 64 };
+
+    /**
+     * writable() stops adding messages to a single sendmsg() call once it has
+     * gathered this many bytes (but it always includes at least one message).
+     */
+    enum { MAX_BYTES_PER_SEND = 256 * 1024 };
+
+    /**
+     * readable() receives into pooled chunks of this many bytes, then hands
+     * out each complete message as a Core::Buffer slice of the chunk. Messages
+     * longer than this (including the header) are received into buffers of
+     * their own instead.
      */
-    enum { MAX_VERSION_SUPPORTED = 1 };
+    enum { RECEIVE_CHUNK_BYTES = 64 * 1024 };
+
+    /**
+     * Counters for the sending side of all MessageSockets in this process.
+     * Dividing numSendCalls by numMessagesSent gives the number of system
+     * calls needed per message.
+     */
+    struct Stats {
+        /// Number of sendmsg() calls made, including ones that sent nothing.
+        uint64_t numSendCalls;
+        /// Number of messages whose last byte has been sent.
+        uint64_t numMessagesSent;
+        /// Number of bytes sent, including headers.
+        uint64_t numBytesSent;
+    };
+
+    /**
+     * Counters for the messages that were compressed. Messages sent or
+     * received uncompressed are not included.
+     */
+    struct CompressionStats {
+        /// Size of the payloads of compressed messages sent, before
+        /// compression.
+        uint64_t sentBytesUncompressed;
+        /// Size of the payloads of compressed messages sent, as sent.
+        uint64_t sentBytesCompressed;
+        /// Size of the payloads of compressed messages received, after
+        /// decompression.
+        uint64_t receivedBytesUncompressed;
+        /// Size of the payloads of compressed messages received, as received.
+        uint64_t receivedBytesCompressed;
+
+        /**
+         * Serialize all the stats into the given ProtoBuf message.
+         */
+        void updateProtoBuf(LogCabin::Protocol::CompressionStats& message)
+            const;
+    };
+
+    /**
+     * Return the current values of the process-wide send counters.
+     */
+    static Stats getStats();
+
+    /**
+     * Return the current values of the process-wide compression counters,
+     * summed over all MessageSockets.
+     */
+    static CompressionStats getTotalCompressionStats();
 
     /**
      * An interface for handling events generated by a MessageSocket.
@@ -111,11 +209,17 @@ class MessageSocket {
      *      exists to limit the amount of buffer space a single socket can use.
      *      Attempting to send longer messages will PANIC; attempting to
      *      receive longer messages will disconnect the socket.
+     * \param compressionThreshold
+     *      Payloads of at least this many bytes are sent compressed once the
+     *      other side of the socket understands version 2 (see
+     *      setPeerVersion()). 0 disables compression for sending; compressed
+     *      messages can always be received.
      */
     MessageSocket(Handler& handler,
                   Event::Loop& eventLoop,
                   int fd,
-                  uint32_t maxMessageLength);
+                  uint32_t maxMessageLength,
+                  uint32_t compressionThreshold = 0);
 
     /**
      * Destructor.
@@ -136,10 +240,58 @@ class MessageSocket {
      *      An opaque identifier for the message.
      * \param contents
      *      The data to send. This must be shorter than the maxMessageLength
-     *      argument given to the constructor.
+     *      argument given to the constructor. If it's longer than
+     *      MAX_FRAGMENT_BYTES and the other side understands version 3, it is
+     *      sent in fragments that refer to 'contents' without copying it.
      */
     void sendMessage(MessageId messageId, Core::Buffer contents);
 
+    /**
+     * Record the largest version of the framing protocol that the other side
+     * of this socket understands. Messages queued after this call use the
+     * largest version both sides support.
+     * This method is safe to call from any thread.
+     */
+    void setPeerVersion(uint16_t maxVersionSupported);
+
+    /**
+     * Return the version of the framing protocol used for messages queued
+     * now. This is 1 until setPeerVersion() is called.
+     * This method is safe to call from any thread.
+     */
+    uint8_t getSendVersion() const;
+
+    /**
+     * Let the other side of this socket send messages of up to 'length' bytes
+     * of payload, as long as they arrive in fragments (version 3). Messages
+     * sent in one piece are still limited to the maxMessageLength given to
+     * the constructor, and each fragment to MAX_FRAGMENT_BYTES, so a header
+     * alone can't make this allocate more than that.
+     * This method is safe to call from any thread.
+     */
+    void setMaxFragmentedMessageLength(uint32_t length);
+
+    /**
+     * Return the Event::Loop that handles this socket's events.
+     */
+    Event::Loop& getEventLoop();
+
+    /**
+     * Have a different Event::Loop handle this socket's events from now on.
+     * The current event loop's thread makes the move once it's done reading
+     * the data that has arrived on the socket, so that the two loops never
+     * read from the socket at the same time. Call this from
+     * Handler::handleReceivedMessage() for the move to happen right away;
+     * otherwise, it happens the next time the socket becomes readable.
+     */
+    void setEventLoop(Event::Loop& eventLoop);
+
+    /**
+     * Return the current values of this socket's compression counters.
+     * This method is safe to call from any thread.
+     */
+    CompressionStats getCompressionStats() const;
+
   private:
 
     /**
@@ -178,6 +330,30 @@ class MessageSocket {
      * This is the header that precedes every message across the TCP socket.
      */
     struct Header {
+        /**
+         * Bits in #flags.
+         */
+        enum {
+            /**
+             * The payload is a 4-byte big endian length of the original
+             * payload, followed by the original payload compressed with zlib.
+             */
+            COMPRESSED = 0x01,
+            /**
+             * More fragments of this message follow, each with the same
+             * message ID. The payload of the whole message is the
+             * concatenation of the fragments' payloads, and the flags of the
+             * last fragment (the one without this flag) apply to it. Only
+             * valid in version 3.
+             */
+            FRAGMENT = 0x02,
+        };
+
+        /**
+         * Constructor. Zeros out all fields.
+         */
+        Header();
+
         /**
          * Convert the contents to host order from big endian (how this header
          * should be transferred on the network).
@@ -195,9 +371,16 @@ class MessageSocket {
         uint16_t fixed;
 
         /**
-         * Currently only version 1 is defined and supported. Big endian.
+         * A combination of the bits defined above. This must be 0 in version
+         * 1, where flags and version together form a big endian 16-bit
+         * version number.
          */
-        uint16_t version;
+        uint8_t flags;
+
+        /**
+         * Versions 1 through 3 are defined and supported.
+         */
+        uint8_t version;
 
         /**
          * The length in bytes of the contents of the message, not including
@@ -211,6 +394,12 @@ class MessageSocket {
         uint64_t messageId;
     } __attribute__((packed));
 
+    /**
+     * A reference-counted, pooled block of memory that readable() receives
+     * into. Defined in MessageSocket.cc.
+     */
+    struct ReceiveChunk;
+
     /**
      * This class stages a message while it is being received.
      */
@@ -222,15 +411,33 @@ class MessageSocket {
          */
         size_t bytesRead;
         /**
-         * If bytesRead >= sizeof(header), the header has been fully received
-         * and its fields are in host order. Otherwise, the header is still
-         * being received here.
+         * The header of the last message parsed, in host order.
          */
         Header header;
         /**
-         * The contents of the message (after the header) are staged here.
+         * Empty unless the message is too long to fit in a ReceiveChunk, in
+         * which case the contents of the message (after the header) are
+         * staged here instead.
          */
         Core::Buffer message;
+        /**
+         * The payloads of the fragments received so far of a message sent
+         * in several fragments (see Header::FRAGMENT), allocated with
+         * malloc(). NULL if no such message is being received.
+         */
+        char* fragments;
+        /**
+         * The number of bytes in #fragments.
+         */
+        size_t fragmentsLength;
+        /**
+         * The message ID of the fragments in #fragments.
+         */
+        MessageId fragmentsMessageId;
+
+        // Inbound is non-copyable, since it owns #fragments.
+        Inbound(const Inbound&) = delete;
+        Inbound& operator=(const Inbound&) = delete;
     };
 
     /**
@@ -242,7 +449,8 @@ class MessageSocket {
         /// Move constructor.
         Outbound(Outbound&& other);
         /// Constructor.
-        Outbound(MessageId messageId, Core::Buffer message);
+        Outbound(MessageId messageId, Core::Buffer message,
+                 uint8_t version, uint8_t flags);
         /// Move assignment.
         Outbound& operator=(Outbound&& other);
         /**
@@ -258,6 +466,11 @@ class MessageSocket {
          * The contents of the message (after the header).
          */
         Core::Buffer message;
+        /**
+         * If this is one fragment of a longer message, this owns the entire
+         * message and #message refers to part of it. Otherwise, empty.
+         */
+        std::shared_ptr<Core::Buffer> fragmentOf;
     };
 
     /**
@@ -271,6 +484,29 @@ class MessageSocket {
      */
     void readable();
 
+    /**
+     * Hand all complete messages in #receiveChunk to the handler. Used by
+     * readable().
+     * \return
+     *      False if the socket was disconnected because of an invalid header,
+     *      in which case the caller must immediately return; true otherwise.
+     */
+    bool parseReceiveChunk();
+
+    /**
+     * Handle the payload of a message or fragment that has been received in
+     * full, as described by inbound.header. Fragments are collected in
+     * inbound.fragments; complete messages are decompressed if needed and
+     * passed to the handler. Used by readable() and parseReceiveChunk().
+     * \param payload
+     *      The data received after the header.
+     * \return
+     *      False if the socket was disconnected because the message was
+     *      malformed, in which case the caller must immediately return; true
+     *      otherwise.
+     */
+    bool receivedPayload(Core::Buffer payload);
+
     /**
      * Wrapper around recv(); used by readable().
      * \param buf
@@ -285,32 +521,141 @@ class MessageSocket {
      */
     ssize_t read(void* buf, size_t maxBytes);
 
+    /**
+     * Compress a payload that's about to be sent; used by sendMessage().
+     * \param[in,out] contents
+     *      The payload to compress. This is replaced with the compressed form
+     *      (see Header::COMPRESSED) if that is smaller.
+     * \return
+     *      True if contents was compressed, false if it was left alone.
+     */
+    bool compress(Core::Buffer& contents);
+
+    /**
+     * Decompress a payload that was received with Header::COMPRESSED set.
+     * \param[in,out] message
+     *      The payload as received. This is replaced with the original
+     *      payload if successful.
+     * \return
+     *      True if successful; false if the payload was malformed, in which
+     *      case the caller should disconnect.
+     */
+    bool decompress(Core::Buffer& message);
+
     /**
      * Called when the socket may be written to without blocking.
      */
     void writable();
 
+    /**
+     * See Stats::numSendCalls.
+     */
+    static std::atomic<uint64_t> numSendCalls;
+
+    /**
+     * See Stats::numMessagesSent.
+     */
+    static std::atomic<uint64_t> numMessagesSent;
+
+    /**
+     * See Stats::numBytesSent.
+     */
+    static std::atomic<uint64_t> numBytesSent;
+
+    /**
+     * See CompressionStats::sentBytesUncompressed. Process-wide.
+     */
+    static std::atomic<uint64_t> totalSentBytesUncompressed;
+
+    /**
+     * See CompressionStats::sentBytesCompressed. Process-wide.
+     */
+    static std::atomic<uint64_t> totalSentBytesCompressed;
+
+    /**
+     * See CompressionStats::receivedBytesUncompressed. Process-wide.
+     */
+    static std::atomic<uint64_t> totalReceivedBytesUncompressed;
+
+    /**
+     * See CompressionStats::receivedBytesCompressed. Process-wide.
+     */
+    static std::atomic<uint64_t> totalReceivedBytesCompressed;
+
     /**
      * The maximum number of bytes of payload to allow per message. This exists
      * to limit the amount of buffer space a single socket can use.
      */
     const uint32_t maxMessageLength;
 
+    /**
+     * The maximum number of bytes of payload to allow per message that
+     * arrives in fragments. This starts out at #maxMessageLength and may be
+     * raised by setMaxFragmentedMessageLength().
+     */
+    std::atomic<uint32_t> maxFragmentedMessageLength;
+
+    /**
+     * See constructor.
+     */
+    const uint32_t compressionThreshold;
+
+    /**
+     * The version of the framing protocol to use for outbound messages. This
+     * starts at 1 and is raised by setPeerVersion().
+     */
+    std::atomic<uint8_t> sendVersion;
+
+    /**
+     * See CompressionStats::sentBytesUncompressed.
+     */
+    std::atomic<uint64_t> sentBytesUncompressed;
+
+    /**
+     * See CompressionStats::sentBytesCompressed.
+     */
+    std::atomic<uint64_t> sentBytesCompressed;
+
+    /**
+     * See CompressionStats::receivedBytesUncompressed.
+     */
+    std::atomic<uint64_t> receivedBytesUncompressed;
+
+    /**
+     * See CompressionStats::receivedBytesCompressed.
+     */
+    std::atomic<uint64_t> receivedBytesCompressed;
+
     /**
      * Deals with received messages and disconnects.
      */
     Handler& handler;
 
     /**
-     * Used to find out when the socket is readable or writable.
+     * The event loop that setEventLoop() asked this socket to move to, or
+     * NULL. readable() moves the socket once it's done reading.
      */
-    Event::Loop& eventLoop;
+    std::atomic<Event::Loop*> nextEventLoop;
 
     /**
      * The current message that is being received.
      */
     Inbound inbound;
 
+    /**
+     * The chunk that readable() is currently receiving into, or NULL. The
+     * socket holds one reference to it, and each message handed out as a
+     * slice of it holds another.
+     */
+    ReceiveChunk* receiveChunk;
+
+    /**
+     * The offset into #receiveChunk where #inbound starts. Unless #inbound
+     * is being received into its own buffer, the first inbound.bytesRead bytes
+     * starting here have been received.
+     */
+    size_t receiveOffset;
+
     /**
      * Protects #outboundQueue only from concurrent modification.
      */
@@ -321,11 +666,9 @@ class MessageSocket {
      * middle of transmission, while the others have not yet started. This
      * queue is protected from concurrent modifications by #outboundQueueMutex.
      *
-     * It's important that this remains a std::deque (or std::queue) because
-     * writable() holds a pointer to the first element without the lock, while
-     * sendMessage() may concurrently push onto the queue. std::deques are
-     * guaranteed not to invalidate pointers while elements are pushed and
-     * popped from the ends.
+     * writable() takes a batch of messages off the front of the queue, then
+     * pushes back onto the front whatever it could not send, while
+     * sendMessage() may concurrently push onto the back.
      */
     std::deque<Outbound> outboundQueue;
 
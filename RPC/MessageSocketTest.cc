@@ -14,11 +14,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <memory>
 #include <gtest/gtest.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <zlib.h>
 
 #include "Core/Debug.h"
 #include "Event/Loop.h"
@@ -38,11 +40,16 @@ class MyMessageSocketHandler : public MessageSocket::Handler {
         : lastReceivedId(~0UL)
         , lastReceivedPayload()
         , disconnected(false)
+        , keepAll(false)
+        , received()
     {
     }
     void handleReceivedMessage(MessageId messageId, Buffer message) {
         lastReceivedId = messageId;
-        lastReceivedPayload = std::move(message);
+        if (keepAll)
+            received.emplace_back(messageId, std::move(message));
+        else
+            lastReceivedPayload = std::move(message);
     }
     void handleDisconnect() {
         EXPECT_FALSE(disconnected);
@@ -51,8 +58,62 @@ class MyMessageSocketHandler : public MessageSocket::Handler {
     MessageId lastReceivedId;
     Buffer lastReceivedPayload;
     bool disconnected;
+    /// If true, keep every message received in 'received'.
+    bool keepAll;
+    std::vector<std::pair<MessageId, Buffer>> received;
 };
 
+std::string
+makeFrame(MessageSocket::MessageId messageId, const std::string& contents,
+          uint8_t flags = 0, uint8_t version = 1)
+{
+    MessageSocket::Header header;
+    header.fixed = 0xdaf4;
+    header.flags = flags;
+    header.version = version;
+    header.payloadLength = uint32_t(contents.size());
+    header.messageId = messageId;
+    header.toBigEndian();
+    return (std::string(reinterpret_cast<char*>(&header), sizeof(header)) +
+            contents);
+}
+
+/**
+ * Build a version 2 frame with the given flags, whose payload is 'contents'
+ * compressed as described in MessageSocket::Header::COMPRESSED.
+ */
+std::string
+makeCompressedFrame(MessageSocket::MessageId messageId,
+                    const std::string& contents)
+{
+    uLongf length = compressBound(contents.size());
+    std::vector<char> compressed(length);
+    EXPECT_EQ(Z_OK,
+              compress2(reinterpret_cast<Bytef*>(compressed.data()), &length,
+                        reinterpret_cast<const Bytef*>(contents.data()),
+                        contents.size(), Z_BEST_SPEED));
+    uint32_t beLength = htobe32(uint32_t(contents.size()));
+    std::string payload(reinterpret_cast<char*>(&beLength), sizeof(beLength));
+    payload.append(compressed.data(), length);
+
+    MessageSocket::Header header;
+    header.fixed = 0xdaf4;
+    header.flags = MessageSocket::Header::COMPRESSED;
+    header.version = 2;
+    header.payloadLength = uint32_t(payload.size());
+    header.messageId = messageId;
+    header.toBigEndian();
+    return (std::string(reinterpret_cast<char*>(&header), sizeof(header)) +
+            payload);
+}
+
+std::string
+str(const Buffer& buffer)
+{
+    return std::string(static_cast<const char*>(buffer.getData()),
+                       buffer.getLength());
+}
+
 class RPCMessageSocketTest : public ::testing::Test {
     RPCMessageSocketTest()
         : loop()
@@ -184,10 +245,10 @@ TEST_F(RPCMessageSocketTest, readableAllAtOnce) {
     header.fromBigEndian();
     strncpy(buf + sizeof(header), payload, 64);
     EXPECT_EQ(ssize_t(sizeof(buf)), send(remote, buf, sizeof(buf), 0));
-    // will do one read for the header
+    // will read the header and data at once
     msgSocket->readable();
     ASSERT_FALSE(handler.disconnected);
-    // and a second read for the data
+    // spurious
     msgSocket->readable();
     ASSERT_FALSE(handler.disconnected);
     EXPECT_EQ(header.messageId, handler.lastReceivedId);
@@ -232,6 +293,89 @@ TEST_F(RPCMessageSocketTest, readableBytewise) {
     EXPECT_EQ(1U, msgSocket->inbound.bytesRead);
 }
 
+TEST_F(RPCMessageSocketTest, readableManyMessages) {
+    handler.keepAll = true;
+    std::string frames = (makeFrame(1, "one") +
+                          makeFrame(2, "") +
+                          makeFrame(3, "three"));
+    EXPECT_EQ(ssize_t(frames.size()),
+              send(remote, frames.data(), frames.size(), 0));
+    msgSocket->readable();
+    ASSERT_FALSE(handler.disconnected);
+    ASSERT_EQ(3U, handler.received.size());
+    EXPECT_EQ(1U, handler.received.at(0).first);
+    EXPECT_EQ("one", str(handler.received.at(0).second));
+    EXPECT_EQ(2U, handler.received.at(1).first);
+    EXPECT_EQ(0U, handler.received.at(1).second.getLength());
+    EXPECT_EQ(3U, handler.received.at(2).first);
+    EXPECT_EQ("three", str(handler.received.at(2).second));
+    // both slices of the same chunk
+    EXPECT_EQ(static_cast<char*>(handler.received.at(0).second.getData()) +
+              3 + 2 * sizeof(MessageSocket::Header),
+              handler.received.at(2).second.getData());
+    EXPECT_EQ(0U, msgSocket->inbound.bytesRead);
+    EXPECT_TRUE(msgSocket->receiveChunk == NULL);
+}
+
+TEST_F(RPCMessageSocketTest, readableSpanningChunks) {
+    // Messages stay valid while later ones are received, and messages that
+    // straddle the end of a chunk are moved into the next one.
+    handler.keepAll = true;
+    const uint64_t numMessages = 5000;
+    std::string frames;
+    for (uint64_t id = 0; id < numMessages; ++id)
+        frames += makeFrame(id, std::string(payload, id % 65));
+    size_t offset = 0;
+    while (offset < frames.size()) {
+        ssize_t bytes = send(remote, frames.data() + offset,
+                             std::min(frames.size() - offset, 1000UL),
+                             MSG_DONTWAIT);
+        if (bytes > 0)
+            offset += size_t(bytes);
+        msgSocket->readable();
+        ASSERT_FALSE(handler.disconnected);
+    }
+    msgSocket->readable();
+    ASSERT_EQ(numMessages, handler.received.size());
+    for (uint64_t id = 0; id < numMessages; ++id) {
+        EXPECT_EQ(id, handler.received.at(id).first);
+        EXPECT_EQ(std::string(payload, id % 65),
+                  str(handler.received.at(id).second));
+    }
+}
+
+TEST_F(RPCMessageSocketTest, readableLongMessage) {
+    int socketPair[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0,
+                            socketPair));
+    MyMessageSocketHandler longHandler;
+    longHandler.keepAll = true;
+    MessageSocket longSocket(longHandler, loop, socketPair[0],
+                             4 * MessageSocket::RECEIVE_CHUNK_BYTES);
+    std::string contents;
+    for (size_t i = 0; i < 3 * MessageSocket::RECEIVE_CHUNK_BYTES; ++i)
+        contents.push_back(char('a' + i % 26));
+    std::string frames = (makeFrame(1, "short") +
+                          makeFrame(2, contents) +
+                          makeFrame(3, "after"));
+    size_t offset = 0;
+    while (offset < frames.size()) {
+        ssize_t bytes = send(socketPair[1], frames.data() + offset,
+                             std::min(frames.size() - offset, 10000UL),
+                             MSG_DONTWAIT);
+        if (bytes > 0)
+            offset += size_t(bytes);
+        longSocket.readable();
+        ASSERT_FALSE(longHandler.disconnected);
+    }
+    longSocket.readable();
+    ASSERT_EQ(3U, longHandler.received.size());
+    EXPECT_EQ("short", str(longHandler.received.at(0).second));
+    EXPECT_TRUE(contents == str(longHandler.received.at(1).second));
+    EXPECT_EQ("after", str(longHandler.received.at(2).second));
+    EXPECT_EQ(0, close(socketPair[1]));
+}
+
 TEST_F(RPCMessageSocketTest, writableSpurious) {
     msgSocket->writable();
 }
@@ -275,6 +419,435 @@ TEST_F(RPCMessageSocketTest, writableNormal) {
     }
 }
 
+TEST_F(RPCMessageSocketTest, writableBatch) {
+    MessageSocket::Stats before = MessageSocket::getStats();
+    for (uint64_t id = 0; id < 3; ++id) {
+        msgSocket->sendMessage(id,
+                               Buffer(const_cast<char*>(payload), 64, NULL));
+    }
+    msgSocket->sendMessage(3, Buffer());
+    msgSocket->outboundQueue.front().bytesSent = 10;
+    msgSocket->writable();
+    ASSERT_FALSE(handler.disconnected);
+    ASSERT_EQ(0U, msgSocket->outboundQueue.size());
+    MessageSocket::Stats after = MessageSocket::getStats();
+    EXPECT_EQ(1U, after.numSendCalls - before.numSendCalls);
+    EXPECT_EQ(4U, after.numMessagesSent - before.numMessagesSent);
+    size_t expectedBytes = 4 * sizeof(MessageSocket::Header) + 3 * 64 - 10;
+    EXPECT_EQ(expectedBytes, after.numBytesSent - before.numBytesSent);
+    char buf[1024];
+    EXPECT_EQ(ssize_t(expectedBytes), recv(remote, buf, sizeof(buf), 0));
+}
+
+TEST_F(RPCMessageSocketTest, writablePartialBatches) {
+    // Queue more than the socket can buffer, so that sends stop at arbitrary
+    // points within the batches.
+    const uint64_t numMessages = 20000;
+    for (uint64_t id = 0; id < numMessages; ++id) {
+        msgSocket->sendMessage(id,
+                               Buffer(const_cast<char*>(payload),
+                                      id % 65, NULL));
+    }
+    MessageSocket::Stats before = MessageSocket::getStats();
+    std::string received;
+    while (true) {
+        msgSocket->writable();
+        ASSERT_FALSE(handler.disconnected);
+        char buf[64 * 1024];
+        ssize_t bytes = recv(remote, buf, sizeof(buf), MSG_DONTWAIT);
+        if (bytes > 0)
+            received.append(buf, size_t(bytes));
+        else if (msgSocket->outboundQueue.empty())
+            break;
+    }
+    MessageSocket::Stats after = MessageSocket::getStats();
+    EXPECT_EQ(numMessages, after.numMessagesSent - before.numMessagesSent);
+    EXPECT_GT(after.numMessagesSent - before.numMessagesSent,
+              after.numSendCalls - before.numSendCalls);
+    EXPECT_EQ(received.size(), after.numBytesSent - before.numBytesSent);
+
+    size_t offset = 0;
+    for (uint64_t id = 0; id < numMessages; ++id) {
+        MessageSocket::Header header;
+        ASSERT_LE(offset + sizeof(header), received.size());
+        memcpy(&header, received.data() + offset, sizeof(header));
+        header.fromBigEndian();
+        ASSERT_EQ(0xdaf4U, header.fixed);
+        ASSERT_EQ(id, header.messageId);
+        ASSERT_EQ(id % 65, header.payloadLength);
+        offset += sizeof(header);
+        ASSERT_EQ(0, memcmp(payload, received.data() + offset,
+                            header.payloadLength));
+        offset += header.payloadLength;
+    }
+    EXPECT_EQ(received.size(), offset);
+}
+
+TEST_F(RPCMessageSocketTest, setPeerVersion) {
+    EXPECT_EQ(1U, msgSocket->sendVersion);
+    msgSocket->setPeerVersion(2);
+    EXPECT_EQ(2U, msgSocket->sendVersion);
+    msgSocket->setPeerVersion(1000);
+    EXPECT_EQ(uint8_t(MessageSocket::MAX_VERSION_SUPPORTED),
+              msgSocket->sendVersion);
+    msgSocket->setPeerVersion(1);
+    EXPECT_EQ(1U, msgSocket->sendVersion);
+}
+
+TEST_F(RPCMessageSocketTest, sendMessage_compressed) {
+    int socketPair[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0,
+                            socketPair));
+    MessageSocket sender(handler, loop, socketPair[0], 4096, 100);
+    std::string contents(1000, 'a');
+
+    // The peer hasn't said it understands version 2 yet.
+    sender.sendMessage(1, Buffer(const_cast<char*>(contents.data()),
+                                 contents.size(), NULL));
+    ASSERT_EQ(1U, sender.outboundQueue.size());
+    EXPECT_EQ(1U, sender.outboundQueue.back().header.version);
+    EXPECT_EQ(0U, sender.outboundQueue.back().header.flags);
+
+    sender.setPeerVersion(2);
+    // Below the threshold.
+    sender.sendMessage(2, Buffer(const_cast<char*>(contents.data()),
+                                 99, NULL));
+    EXPECT_EQ(2U, sender.outboundQueue.back().header.version);
+    EXPECT_EQ(0U, sender.outboundQueue.back().header.flags);
+    // Doesn't get any smaller.
+    sender.sendMessage(3, Buffer(const_cast<char*>(payload), 64, NULL));
+    EXPECT_EQ(0U, sender.outboundQueue.back().header.flags);
+    MessageSocket::CompressionStats totalBefore =
+        MessageSocket::getTotalCompressionStats();
+    sender.sendMessage(4, Buffer(const_cast<char*>(contents.data()),
+                                 contents.size(), NULL));
+    MessageSocket::Outbound& outbound = sender.outboundQueue.back();
+    EXPECT_EQ(2U, outbound.header.version);
+    EXPECT_EQ(MessageSocket::Header::COMPRESSED, outbound.header.flags);
+    EXPECT_GT(100U, outbound.message.getLength());
+
+    MessageSocket::CompressionStats stats = sender.getCompressionStats();
+    EXPECT_EQ(1000U, stats.sentBytesUncompressed);
+    EXPECT_EQ(outbound.message.getLength(), stats.sentBytesCompressed);
+    EXPECT_EQ(0U, stats.receivedBytesUncompressed);
+    MessageSocket::CompressionStats totalAfter =
+        MessageSocket::getTotalCompressionStats();
+    EXPECT_EQ(1000U, (totalAfter.sentBytesUncompressed -
+                      totalBefore.sentBytesUncompressed));
+
+    // The other end gets back what was sent.
+    MyMessageSocketHandler receiveHandler;
+    receiveHandler.keepAll = true;
+    MessageSocket receiver(receiveHandler, loop, socketPair[1], 4096);
+    sender.writable();
+    receiver.readable();
+    ASSERT_FALSE(receiveHandler.disconnected);
+    ASSERT_EQ(4U, receiveHandler.received.size());
+    EXPECT_EQ(4U, receiveHandler.received.at(3).first);
+    EXPECT_EQ(contents, str(receiveHandler.received.at(3).second));
+    EXPECT_EQ(std::string(payload, 64),
+              str(receiveHandler.received.at(2).second));
+    stats = receiver.getCompressionStats();
+    EXPECT_EQ(1000U, stats.receivedBytesUncompressed);
+    EXPECT_EQ(sender.getCompressionStats().sentBytesCompressed,
+              stats.receivedBytesCompressed);
+}
+
+TEST_F(RPCMessageSocketTest, sendMessage_fragmented) {
+    int socketPair[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0,
+                            socketPair));
+    const uint32_t fragmentBytes = MessageSocket::MAX_FRAGMENT_BYTES;
+    MessageSocket sender(handler, loop, socketPair[0], 3 * fragmentBytes);
+    std::string contents(2 * fragmentBytes + 10, 'a');
+    for (size_t i = 0; i < contents.size(); i += 1000)
+        contents.at(i) = char('0' + i % 7);
+
+    // The peer hasn't said it understands version 3 yet.
+    sender.setPeerVersion(2);
+    sender.sendMessage(1, Buffer(const_cast<char*>(contents.data()),
+                                 contents.size(), NULL));
+    ASSERT_EQ(1U, sender.outboundQueue.size());
+    EXPECT_EQ(0U, sender.outboundQueue.back().header.flags);
+    EXPECT_EQ(contents.size(), sender.outboundQueue.back().message.getLength());
+    sender.outboundQueue.clear();
+
+    sender.setPeerVersion(3);
+    sender.sendMessage(2, Buffer(const_cast<char*>(contents.data()),
+                                 fragmentBytes, NULL));
+    ASSERT_EQ(1U, sender.outboundQueue.size());
+    EXPECT_EQ(0U, sender.outboundQueue.back().header.flags);
+    char* data = new char[contents.size()];
+    memcpy(data, contents.data(), contents.size());
+    sender.sendMessage(3, Buffer(data, contents.size(),
+                                 Buffer::deleteArrayFn<char>));
+    ASSERT_EQ(4U, sender.outboundQueue.size());
+    for (size_t i = 1; i < 4; ++i) {
+        MessageSocket::Outbound& outbound = sender.outboundQueue.at(i);
+        EXPECT_EQ(3U, outbound.header.version);
+        EXPECT_EQ(i < 3 ? MessageSocket::Header::FRAGMENT : 0,
+                  outbound.header.flags);
+        EXPECT_EQ(data + (i - 1) * fragmentBytes,
+                  outbound.message.getData());
+        EXPECT_EQ(i < 3 ? fragmentBytes : 10U, outbound.message.getLength());
+    }
+
+    // The other end gets back what was sent.
+    MyMessageSocketHandler receiveHandler;
+    receiveHandler.keepAll = true;
+    MessageSocket receiver(receiveHandler, loop, socketPair[1],
+                           3 * fragmentBytes);
+    while (receiveHandler.received.size() < 2 &&
+           !receiveHandler.disconnected) {
+        sender.writable();
+        receiver.readable();
+    }
+    ASSERT_FALSE(receiveHandler.disconnected);
+    ASSERT_EQ(2U, receiveHandler.received.size());
+    EXPECT_EQ(2U, receiveHandler.received.at(0).first);
+    EXPECT_EQ(3U, receiveHandler.received.at(1).first);
+    EXPECT_TRUE(contents == str(receiveHandler.received.at(1).second));
+    EXPECT_TRUE(sender.outboundQueue.empty());
+}
+
+TEST_F(RPCMessageSocketTest, readableFragments) {
+    const uint8_t fragment = MessageSocket::Header::FRAGMENT;
+    std::string frames = (makeFrame(1, "abc", fragment, 3) +
+                          makeFrame(1, "", fragment, 3) +
+                          makeFrame(1, "defg", 0, 3) +
+                          makeFrame(2, "hi", 0, 3) +
+                          makeFrame(3, "", fragment, 3) +
+                          makeFrame(3, "", 0, 3));
+    EXPECT_EQ(ssize_t(frames.size()),
+              send(remote, frames.data(), frames.size(), 0));
+    handler.keepAll = true;
+    msgSocket->readable();
+    EXPECT_FALSE(handler.disconnected);
+    ASSERT_EQ(3U, handler.received.size());
+    EXPECT_EQ(1U, handler.received.at(0).first);
+    EXPECT_EQ("abcdefg", str(handler.received.at(0).second));
+    EXPECT_EQ(2U, handler.received.at(1).first);
+    EXPECT_EQ("hi", str(handler.received.at(1).second));
+    EXPECT_EQ(3U, handler.received.at(2).first);
+    EXPECT_EQ("", str(handler.received.at(2).second));
+    EXPECT_TRUE(msgSocket->inbound.fragments == NULL);
+}
+
+TEST_F(RPCMessageSocketTest, readableFragmentsLong) {
+    int socketPair[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0,
+                            socketPair));
+    MyMessageSocketHandler longHandler;
+    MessageSocket longSocket(longHandler, loop, socketPair[0],
+                             2 * MessageSocket::RECEIVE_CHUNK_BYTES);
+    // The first fragment is received into a buffer of its own.
+    std::string contents(MessageSocket::RECEIVE_CHUNK_BYTES, 'x');
+    std::string frames = (makeFrame(1, contents,
+                                    MessageSocket::Header::FRAGMENT, 3) +
+                          makeFrame(1, "yz", 0, 3));
+    EXPECT_EQ(ssize_t(frames.size()),
+              send(socketPair[1], frames.data(), frames.size(), 0));
+    longSocket.readable();
+    EXPECT_FALSE(longHandler.disconnected);
+    EXPECT_EQ(1U, longHandler.lastReceivedId);
+    EXPECT_TRUE(contents + "yz" == str(longHandler.lastReceivedPayload));
+    EXPECT_EQ(0, close(socketPair[1]));
+}
+
+TEST_F(RPCMessageSocketTest, readableFragmentsCompressed) {
+    // The compressed form of the message is split across the fragments.
+    std::string compressed = makeCompressedFrame(1, std::string(60, 'q'))
+                                .substr(sizeof(MessageSocket::Header));
+    std::string frames = (makeFrame(1, compressed.substr(0, 5),
+                                    (MessageSocket::Header::FRAGMENT |
+                                     MessageSocket::Header::COMPRESSED), 3) +
+                          makeFrame(1, compressed.substr(5),
+                                    MessageSocket::Header::COMPRESSED, 3));
+    EXPECT_EQ(ssize_t(frames.size()),
+              send(remote, frames.data(), frames.size(), 0));
+    msgSocket->readable();
+    EXPECT_FALSE(handler.disconnected);
+    EXPECT_EQ(1U, handler.lastReceivedId);
+    EXPECT_EQ(std::string(60, 'q'), str(handler.lastReceivedPayload));
+}
+
+TEST_F(RPCMessageSocketTest, readableFragmentsInterleaved) {
+    std::string frames = (makeFrame(1, "abc",
+                                    MessageSocket::Header::FRAGMENT, 3) +
+                          makeFrame(2, "def", 0, 3));
+    EXPECT_EQ(ssize_t(frames.size()),
+              send(remote, frames.data(), frames.size(), 0));
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    msgSocket->readable();
+    EXPECT_TRUE(handler.disconnected);
+    EXPECT_EQ(~0UL, handler.lastReceivedId);
+}
+
+TEST_F(RPCMessageSocketTest, readableFragmentsTooLong) {
+    std::string frames = (makeFrame(1, std::string(40, 'a'),
+                                    MessageSocket::Header::FRAGMENT, 3) +
+                          makeFrame(1, std::string(25, 'b'), 0, 3));
+    EXPECT_EQ(ssize_t(frames.size()),
+              send(remote, frames.data(), frames.size(), 0));
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    msgSocket->readable();
+    EXPECT_TRUE(handler.disconnected);
+    EXPECT_EQ(~0UL, handler.lastReceivedId);
+}
+
+TEST_F(RPCMessageSocketTest, setMaxFragmentedMessageLength) {
+    msgSocket->setMaxFragmentedMessageLength(128);
+    const uint8_t fragment = MessageSocket::Header::FRAGMENT;
+    std::string frames = (makeFrame(1, std::string(40, 'a'), fragment, 3) +
+                          makeFrame(1, std::string(40, 'b'), fragment, 3) +
+                          makeFrame(1, std::string(40, 'c'), 0, 3));
+    EXPECT_EQ(ssize_t(frames.size()),
+              send(remote, frames.data(), frames.size(), 0));
+    msgSocket->readable();
+    EXPECT_FALSE(handler.disconnected);
+    EXPECT_EQ(1U, handler.lastReceivedId);
+    EXPECT_EQ(120U, handler.lastReceivedPayload.getLength());
+
+    // Messages in one piece are still limited to maxMessageLength.
+    frames = makeFrame(2, std::string(65, 'd'), 0, 3);
+    EXPECT_EQ(ssize_t(frames.size()),
+              send(remote, frames.data(), frames.size(), 0));
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    msgSocket->readable();
+    EXPECT_TRUE(handler.disconnected);
+    EXPECT_EQ(1U, handler.lastReceivedId);
+}
+
+TEST_F(RPCMessageSocketTest, setEventLoop) {
+    Event::Loop loop2;
+    msgSocket->setEventLoop(loop2);
+    // The move waits until the socket is done reading.
+    EXPECT_EQ(&loop, &msgSocket->getEventLoop());
+    std::string frame = makeFrame(1, "hello");
+    EXPECT_EQ(ssize_t(frame.size()),
+              send(remote, frame.data(), frame.size(), 0));
+    msgSocket->readable();
+    EXPECT_EQ(1U, handler.lastReceivedId);
+    EXPECT_EQ(&loop2, &msgSocket->getEventLoop());
+    EXPECT_EQ(&loop2, &msgSocket->sendSocketMonitor.getEventLoop());
+    EXPECT_TRUE(msgSocket->nextEventLoop == NULL);
+    msgSocket.reset();
+}
+
+TEST_F(RPCMessageSocketTest, readableFragmentTooLong) {
+    msgSocket->setMaxFragmentedMessageLength(~0U);
+    // Only the header is sent: it must be rejected before anything is
+    // allocated for the length it claims.
+    MessageSocket::Header header;
+    header.fixed = 0xdaf4;
+    header.flags = MessageSocket::Header::FRAGMENT;
+    header.version = 3;
+    header.payloadLength = MessageSocket::MAX_FRAGMENT_BYTES + 1;
+    header.messageId = 0;
+    header.toBigEndian();
+    EXPECT_EQ(ssize_t(sizeof(header)),
+              send(remote, &header, sizeof(header), 0));
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    msgSocket->readable();
+    EXPECT_TRUE(handler.disconnected);
+    EXPECT_EQ(0U, msgSocket->inbound.message.getLength());
+}
+
+TEST_F(RPCMessageSocketTest, readableCompressed) {
+    std::string frames = (makeCompressedFrame(1, "") +
+                          makeCompressedFrame(2, std::string(64, 'x')));
+    EXPECT_EQ(ssize_t(frames.size()),
+              send(remote, frames.data(), frames.size(), 0));
+    handler.keepAll = true;
+    msgSocket->readable();
+    ASSERT_FALSE(handler.disconnected);
+    ASSERT_EQ(2U, handler.received.size());
+    EXPECT_EQ("", str(handler.received.at(0).second));
+    EXPECT_EQ(std::string(64, 'x'), str(handler.received.at(1).second));
+    EXPECT_EQ(64U, msgSocket->getCompressionStats().receivedBytesUncompressed);
+}
+
+TEST_F(RPCMessageSocketTest, readableCompressedLongMessage) {
+    int socketPair[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0,
+                            socketPair));
+    MyMessageSocketHandler longHandler;
+    MessageSocket longSocket(longHandler, loop, socketPair[0],
+                             4 * MessageSocket::RECEIVE_CHUNK_BYTES);
+    // Random-ish contents so that the compressed form is still too big to
+    // fit in a chunk.
+    std::string contents;
+    uint32_t x = 1;
+    for (size_t i = 0; i < 3 * MessageSocket::RECEIVE_CHUNK_BYTES; ++i) {
+        x = x * 1103515245 + 12345;
+        contents.push_back(char(x >> 24));
+    }
+    std::string frame = makeCompressedFrame(2, contents);
+    ASSERT_LT(size_t(MessageSocket::RECEIVE_CHUNK_BYTES), frame.size());
+    size_t offset = 0;
+    while (offset < frame.size()) {
+        ssize_t bytes = send(socketPair[1], frame.data() + offset,
+                             std::min(frame.size() - offset, 10000UL),
+                             MSG_DONTWAIT);
+        if (bytes > 0)
+            offset += size_t(bytes);
+        longSocket.readable();
+        ASSERT_FALSE(longHandler.disconnected);
+    }
+    longSocket.readable();
+    EXPECT_EQ(2U, longHandler.lastReceivedId);
+    EXPECT_TRUE(contents == str(longHandler.lastReceivedPayload));
+    EXPECT_EQ(0, close(socketPair[1]));
+}
+
+TEST_F(RPCMessageSocketTest, readableCompressedCorrupt) {
+    std::string frame = makeCompressedFrame(1, std::string(64, 'x'));
+    frame.at(frame.size() - 3) ^= 0x55;
+    EXPECT_EQ(ssize_t(frame.size()),
+              send(remote, frame.data(), frame.size(), 0));
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    msgSocket->readable();
+    EXPECT_TRUE(handler.disconnected);
+}
+
+TEST_F(RPCMessageSocketTest, readableCompressedTooLong) {
+    std::string frame = makeCompressedFrame(1, std::string(65, 'a'));
+    EXPECT_EQ(ssize_t(frame.size()),
+              send(remote, frame.data(), frame.size(), 0));
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    msgSocket->readable();
+    EXPECT_TRUE(handler.disconnected);
+}
+
+TEST_F(RPCMessageSocketTest, readableBadVersion) {
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    uint8_t cases[][2] = {
+        // {flags, version}
+        {0, 0},
+        {0, 4},
+        {MessageSocket::Header::COMPRESSED, 1},
+        {MessageSocket::Header::FRAGMENT, 2},
+        {0x80, 3},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        int socketPair[2];
+        EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK, 0,
+                                socketPair));
+        MyMessageSocketHandler badHandler;
+        MessageSocket badSocket(badHandler, loop, socketPair[0], 64);
+        MessageSocket::Header header;
+        header.fixed = 0xdaf4;
+        header.flags = cases[i][0];
+        header.version = cases[i][1];
+        header.toBigEndian();
+        EXPECT_EQ(ssize_t(sizeof(header)),
+                  send(socketPair[1], &header, sizeof(header), 0));
+        badSocket.readable();
+        EXPECT_TRUE(badHandler.disconnected) << i;
+        EXPECT_EQ(0, close(socketPair[1]));
+    }
+}
+
 } // namespace LogCabin::RPC::<anonymous>
 } // namespace LogCabin::RPC
 } // namespace LogCabin
@@ -18,7 +18,9 @@
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "Core/Debug.h"
@@ -31,6 +33,48 @@
 namespace LogCabin {
 namespace RPC {
 
+namespace {
+
+/**
+ * Return the filesystem path of a Unix domain socket address.
+ */
+std::string
+getUnixPath(const Address& address)
+{
+    const sockaddr_un* addr =
+        reinterpret_cast<const sockaddr_un*>(address.getSockAddr());
+    return addr->sun_path;
+}
+
+/**
+ * If a Unix domain socket file is left over from a server that's no longer
+ * running, remove it so that bind() can create a new one. Nothing is removed
+ * if a server is still accepting connections on the socket.
+ */
+void
+removeStaleUnixSocket(const Address& address)
+{
+    // Only ever remove sockets: connect() fails with ECONNREFUSED on a
+    // regular file too, and that file might be someone's data.
+    std::string path = getUnixPath(address);
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0 || !S_ISSOCK(st.st_mode))
+        return;
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        PANIC("Could not create new Unix domain socket");
+    int r = connect(fd, address.getSockAddr(), address.getSockAddrLen());
+    if (r != 0 && errno == ECONNREFUSED) {
+        NOTICE("Removing stale Unix domain socket %s", path.c_str());
+        if (unlink(path.c_str()) != 0) {
+            WARNING("Could not remove stale Unix domain socket %s: %s",
+                    path.c_str(), strerror(errno));
+        }
+    }
+    close(fd);
+}
+
+} // anonymous namespace
 
 ////////// OpaqueServer::MessageSocketHandler //////////
 
@@ -63,7 +107,16 @@ OpaqueServer::MessageSocketHandler::handleReceivedMessage(
                 VERBOSE("Responding to version request "
                         "(this server supports max version %u)",
                         MessageSocket::MAX_VERSION_SUPPORTED);
+                using Protocol::Common::VersionMessage::Request;
                 using Protocol::Common::VersionMessage::Response;
+                // Older clients send an empty request; they only understand
+                // version 1.
+                if (message.getLength() >= sizeof(Request)) {
+                    Request request;
+                    memcpy(&request, message.getData(), sizeof(request));
+                    socketRef->monitor.setPeerVersion(
+                        be16toh(request.maxVersionSupported));
+                }
                 Response* response = new Response();
                 response->maxVersionSupported =
                     htobe16(MessageSocket::MAX_VERSION_SUPPORTED);
@@ -91,6 +144,7 @@ OpaqueServer::MessageSocketHandler::handleDisconnect()
         // This drops the reference count on the socket. It may cause the
         // SocketWithHandler object (which includes this object) to be
         // destroyed when 'socketRef' goes out of scope.
+        std::lock_guard<Core::Mutex> lockGuard(server->socketsMutex);
         server->sockets.erase(socketRef);
         server = NULL;
     }
@@ -102,17 +156,29 @@ OpaqueServer::MessageSocketHandler::handleDisconnect()
 std::shared_ptr<OpaqueServer::SocketWithHandler>
 OpaqueServer::SocketWithHandler::make(OpaqueServer* server, int fd)
 {
+    uint64_t n = server->numSocketsCreated++;
+    Event::Loop& eventLoop =
+        *server->socketEventLoops.at(n % server->socketEventLoops.size());
+    // The socket's event loop may handle its events as soon as the
+    // MessageSocket is constructed, so hold the loop's lock until the
+    // handler's self field is set. Lock the sockets set too, in case the
+    // loop disconnects the socket before it's in the set.
+    Event::Loop::Lock loopGuard(eventLoop);
+    std::lock_guard<Core::Mutex> lockGuard(server->socketsMutex);
     std::shared_ptr<SocketWithHandler> socket(
-        new SocketWithHandler(server, fd));
+        new SocketWithHandler(server, fd, eventLoop));
     socket->handler.self = socket;
+    server->sockets.insert(socket);
     return socket;
 }
 
 OpaqueServer::SocketWithHandler::SocketWithHandler(
         OpaqueServer* server,
-        int fd)
+        int fd,
+        Event::Loop& eventLoop)
     : handler(server)
-    , monitor(handler, server->eventLoop, fd, server->maxMessageLength)
+    , monitor(handler, eventLoop, fd, server->maxMessageLength,
+              server->compressionThreshold)
 {
 }
 
@@ -128,9 +194,11 @@ OpaqueServer::SocketWithHandler::~SocketWithHandler() {
 
 OpaqueServer::BoundListener::BoundListener(
         OpaqueServer& server,
-        int fd)
+        int fd,
+        const std::string& unixPath)
     : Event::File(fd)
     , server(server)
+    , unixPath(unixPath)
 {
 }
 
@@ -143,7 +211,7 @@ OpaqueServer::BoundListener::handleFileEvent(uint32_t events)
               fd, strerror(errno));
     }
 
-    server.sockets.insert(SocketWithHandler::make(&server, clientfd));
+    SocketWithHandler::make(&server, clientfd);
 }
 
 
@@ -151,14 +219,20 @@ OpaqueServer::BoundListener::handleFileEvent(uint32_t events)
 
 OpaqueServer::BoundListenerWithMonitor::BoundListenerWithMonitor(
         OpaqueServer& server,
-        int fd)
-    : handler(server, fd)
+        int fd,
+        const std::string& unixPath)
+    : handler(server, fd, unixPath)
     , monitor(server.eventLoop, handler, EPOLLIN)
 {
 }
 
 OpaqueServer::BoundListenerWithMonitor::~BoundListenerWithMonitor()
 {
+    if (!handler.unixPath.empty() &&
+        unlink(handler.unixPath.c_str()) != 0) {
+        WARNING("Could not remove Unix domain socket %s: %s",
+                handler.unixPath.c_str(), strerror(errno));
+    }
 }
 
 
@@ -166,11 +240,21 @@ OpaqueServer::BoundListenerWithMonitor::~BoundListenerWithMonitor()
 
 OpaqueServer::OpaqueServer(Handler& handler,
                            Event::Loop& eventLoop,
-                           uint32_t maxMessageLength)
+                           uint32_t maxMessageLength,
+                           const std::vector<Event::Loop*>& socketEventLoops,
+                           uint32_t compressionThreshold,
+                           Event::Loop* peerEventLoop)
     : rpcHandler(handler)
     , eventLoop(eventLoop)
+    , socketEventLoops(socketEventLoops.empty()
+                            ? std::vector<Event::Loop*>{&eventLoop}
+                            : socketEventLoops)
+    , peerEventLoop(peerEventLoop)
+    , numSocketsCreated(0)
     , maxMessageLength(maxMessageLength)
+    , compressionThreshold(compressionThreshold)
     , sockets()
+    , socketsMutex()
     , boundListenersMutex()
     , boundListeners()
 {
@@ -188,8 +272,16 @@ OpaqueServer::~OpaqueServer()
     // 'sockets' set. They may continue to process existing RPCs, though
     // idle sockets will be destroyed here.
     {
-        // Block the event loop to operate on 'sockets' safely.
-        Event::Loop::Lock lockGuard(eventLoop);
+        // Block the event loops to operate on the sockets safely.
+        std::vector<std::unique_ptr<Event::Loop::Lock>> loopLocks;
+        for (auto it = socketEventLoops.begin();
+             it != socketEventLoops.end();
+             ++it) {
+            loopLocks.emplace_back(new Event::Loop::Lock(**it));
+        }
+        if (peerEventLoop != NULL)
+            loopLocks.emplace_back(new Event::Loop::Lock(*peerEventLoop));
+        std::lock_guard<Core::Mutex> lockGuard(socketsMutex);
         for (auto it = sockets.begin(); it != sockets.end(); ++it) {
             std::shared_ptr<SocketWithHandler> socket = *it;
             socket->handler.server = NULL;
@@ -208,19 +300,26 @@ OpaqueServer::bind(const Address& listenAddress)
                       listenAddress.toString().c_str());
     }
 
-    int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    int family = listenAddress.getSockAddr()->sa_family;
+    int fd = socket(family, SOCK_STREAM|SOCK_CLOEXEC, 0);
     if (fd < 0)
-        PANIC("Could not create new TCP socket");
-
-    int flag = 1;
-    int r = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+        PANIC("Could not create new socket: %s", strerror(errno));
+
+    std::string unixPath;
+    int r;
+    if (family == AF_UNIX) {
+        unixPath = getUnixPath(listenAddress);
+        removeStaleUnixSocket(listenAddress);
+    } else {
+        int flag = 1;
+        r = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
                        &flag, sizeof(flag));
-    if (r < 0) {
-        PANIC("Could not set SO_REUSEADDR on socket: %s",
-              strerror(errno));
+        if (r < 0) {
+            PANIC("Could not set SO_REUSEADDR on socket: %s",
+                  strerror(errno));
+        }
     }
 
-
     r = ::bind(fd, listenAddress.getSockAddr(),
                    listenAddress.getSockAddrLen());
     if (r != 0) {
@@ -246,7 +345,7 @@ OpaqueServer::bind(const Address& listenAddress)
     }
 
     std::lock_guard<Core::Mutex> lock(boundListenersMutex);
-    boundListeners.emplace_back(*this, fd);
+    boundListeners.emplace_back(*this, fd, unixPath);
     return "";
 }
 
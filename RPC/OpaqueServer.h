@@ -18,8 +18,11 @@
 #include <memory>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
+#include "Core/CompatAtomic.h"
 #include "Core/CompatHash.h"
+#include "Core/Mutex.h"
 #include "RPC/MessageSocket.h"
 
 #ifndef LOGCABIN_RPC_OPAQUESERVER_H
@@ -44,9 +47,13 @@ class Address;
 class OpaqueServerRPC;
 
 /**
- * An OpaqueServer listens for incoming RPCs over TCP connections.
+ * An OpaqueServer listens for incoming RPCs over TCP or Unix domain socket
+ * connections.
  * OpaqueServers can be created from any thread, but they will always run on
- * the thread running the Event::Loop.
+ * the threads running the Event::Loops: the listening sockets run on the main
+ * event loop, and accepted connections are spread round-robin across the
+ * socket event loops (if any were given). Connections from peers may later
+ * move to a peer event loop of their own.
  */
 class OpaqueServer {
   public:
@@ -84,10 +91,25 @@ class OpaqueServer {
      *      exists to limit the amount of buffer space a single RPC can use.
      *      Attempting to send longer responses will PANIC; attempting to
      *      receive longer requests will disconnect the underlying socket.
+     * \param socketEventLoops
+     *      Event::Loops to run accepted connections on, each normally with a
+     *      thread of its own. If empty, connections run on 'eventLoop'. These
+     *      must outlive the OpaqueServer.
+     * \param compressionThreshold
+     *      Responses of at least this many bytes are compressed for clients
+     *      that support it; 0 disables compression. See MessageSocket.
+     * \param peerEventLoop
+     *      If not NULL, an Event::Loop, normally with a thread of its own,
+     *      that connections are moved to once they're known to come from
+     *      peers (see OpaqueServerRPC::moveToPeerEventLoop()). This must
+     *      outlive the OpaqueServer.
      */
     OpaqueServer(Handler& handler,
                  Event::Loop& eventLoop,
-                 uint32_t maxMessageLength);
+                 uint32_t maxMessageLength,
+                 const std::vector<Event::Loop*>& socketEventLoops = {},
+                 uint32_t compressionThreshold = 0,
+                 Event::Loop* peerEventLoop = NULL);
 
     /**
      * Destructor. OpaqueServerRPC objects originating from this OpaqueServer
@@ -103,7 +125,8 @@ class OpaqueServer {
      * error.)
      * This method is thread-safe.
      * \param listenAddress
-     *      The TCP address on listen for new client connections.
+     *      The TCP or Unix domain socket address on which to listen for new
+     *      client connections.
      * \return
      *      An error message if this was not able to listen on the given
      *      address; the empty string otherwise.
@@ -130,9 +153,9 @@ class OpaqueServer {
          * server's rpcHandler when receiving an RPC request, or to drop the
          * server's reference to this socket when disconnecting.
          *
-         * May only be accessed with an Event::Loop::Lock or from the event
-         * loop, since the OpaqueServer may set this to NULL under the same
-         * rules.
+         * May only be accessed with an Event::Loop::Lock or from the socket's
+         * event loop, since the OpaqueServer may set this to NULL under the
+         * same rules.
          */
         OpaqueServer* server;
 
@@ -161,7 +184,9 @@ class OpaqueServer {
       public:
         /**
          * Return a newly constructed SocketWithHandler, with the handler's
-         * self field pointing to itself.
+         * self field pointing to itself, after adding it to the server's
+         * sockets. It runs on the server's next socket event loop in
+         * round-robin order.
          * \param server
          *      Server that owns this object. Held by MessageSocketHandler.
          * \param fd
@@ -175,7 +200,8 @@ class OpaqueServer {
         MessageSocket monitor;
 
       private:
-        SocketWithHandler(OpaqueServer* server, int fd);
+        SocketWithHandler(OpaqueServer* server, int fd,
+                          Event::Loop& eventLoop);
     };
 
     /**
@@ -190,10 +216,19 @@ class OpaqueServer {
          * \param fd
          *      The underlying socket that is listening on a particular
          *      address.
+         * \param unixPath
+         *      The filesystem path of the socket if it's a Unix domain
+         *      socket, or empty otherwise.
          */
-        BoundListener(OpaqueServer& server, int fd);
+        BoundListener(OpaqueServer& server, int fd,
+                      const std::string& unixPath);
         void handleFileEvent(uint32_t events);
         OpaqueServer& server;
+        /**
+         * The filesystem path of the socket if it's a Unix domain socket, or
+         * empty otherwise. This is removed when the listener is destroyed.
+         */
+        const std::string unixPath;
     };
 
     /**
@@ -202,7 +237,8 @@ class OpaqueServer {
      */
     struct BoundListenerWithMonitor {
         /// Constructor. See BoundListener.
-        BoundListenerWithMonitor(OpaqueServer& server, int fd);
+        BoundListenerWithMonitor(OpaqueServer& server, int fd,
+                                 const std::string& unixPath);
 
         /// Destructor.
         ~BoundListenerWithMonitor();
@@ -225,15 +261,38 @@ class OpaqueServer {
     Handler& rpcHandler;
 
     /**
-     * The event loop that is used for non-blocking I/O.
+     * The event loop that is used for non-blocking I/O on the listening
+     * sockets.
      */
     Event::Loop& eventLoop;
 
+    /**
+     * The event loops that accepted sockets are assigned to. This contains
+     * just #eventLoop if the constructor wasn't given any others.
+     */
+    const std::vector<Event::Loop*> socketEventLoops;
+
+    /**
+     * See constructor.
+     */
+    Event::Loop* const peerEventLoop;
+
+    /**
+     * Incremented for every socket created; used to assign sockets to
+     * #socketEventLoops in round-robin order.
+     */
+    std::atomic<uint64_t> numSocketsCreated;
+
     /**
      * The maximum number of bytes to allow per request/response.
      */
     const uint32_t maxMessageLength;
 
+    /**
+     * See constructor.
+     */
+    const uint32_t compressionThreshold;
+
     /**
      * Every open socket is referenced here so that it can be cleaned up when
      * this OpaqueServer is destroyed. These are reference-counted: the
@@ -241,13 +300,17 @@ class OpaqueServer {
      * OpaqueServer if it is being actively used to send out a OpaqueServerRPC
      * response when the OpaqueServer is destroyed.
      *
-     * This may only be accessed from the Event::Loop or while holding an
-     * Event::Loop::Lock (it's almost entirely accessed from event handlers, so
-     * it's convenient to rely on the Event::Loop::Lock for mutual exclusion
-     * during OpauqeServer's destructor as well).
+     * Since sockets run on different event loops, this is protected by
+     * #socketsMutex.
      */
     std::unordered_set<std::shared_ptr<SocketWithHandler>> sockets;
 
+    /**
+     * Protects #sockets. When both are needed, acquire an Event::Loop::Lock
+     * (or run on the event loop) before acquiring this.
+     */
+    Core::Mutex socketsMutex;
+
     /**
      * Lock to prevent concurrent modification of #boundListeners.
      */
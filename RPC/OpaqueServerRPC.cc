@@ -73,6 +73,28 @@ OpaqueServerRPC::closeSession()
     responseTarget = NULL;
 }
 
+void
+OpaqueServerRPC::setMaxFragmentedMessageLength(uint32_t length)
+{
+    std::shared_ptr<OpaqueServer::SocketWithHandler> socketRef = socket.lock();
+    if (socketRef)
+        socketRef->monitor.setMaxFragmentedMessageLength(length);
+}
+
+void
+OpaqueServerRPC::moveToPeerEventLoop()
+{
+    std::shared_ptr<OpaqueServer::SocketWithHandler> socketRef = socket.lock();
+    // The server only detaches its sockets with their event loops locked,
+    // so this thread may read handler.server.
+    if (socketRef &&
+        socketRef->handler.server != NULL &&
+        socketRef->handler.server->peerEventLoop != NULL) {
+        socketRef->monitor.setEventLoop(
+            *socketRef->handler.server->peerEventLoop);
+    }
+}
+
 void
 OpaqueServerRPC::sendReply()
 {
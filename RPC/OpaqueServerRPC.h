@@ -78,6 +78,22 @@ class OpaqueServerRPC {
      */
     void closeSession();
 
+    /**
+     * Let the session on which this request originated send fragmented
+     * messages of up to 'length' bytes from now on. See
+     * MessageSocket::setMaxFragmentedMessageLength().
+     */
+    void setMaxFragmentedMessageLength(uint32_t length);
+
+    /**
+     * Move the session on which this request originated to the
+     * OpaqueServer's peer event loop, if it has one, so that its messages no
+     * longer wait behind those of other sessions. See
+     * MessageSocket::setEventLoop(). This must be called from the session's
+     * event loop thread, as OpaqueServer::Handler::handleRPC() is.
+     */
+    void moveToPeerEventLoop();
+
     /**
      * Send the response back to the client.
      * This will reset #response to an empty state, and further replies on this
@@ -14,7 +14,9 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <fcntl.h>
 #include <gtest/gtest.h>
+#include <sys/stat.h>
 #include <thread>
 
 #include "Core/Debug.h"
@@ -23,6 +25,7 @@
 #include "RPC/Address.h"
 #include "RPC/OpaqueServer.h"
 #include "RPC/OpaqueServerRPC.h"
+#include "Storage/FilesystemUtil.h"
 
 namespace LogCabin {
 namespace RPC {
@@ -71,7 +74,6 @@ class RPCOpaqueServerTest : public ::testing::Test {
 
 TEST_F(RPCOpaqueServerTest, MessageSocketHandler_handleReceivedMessage) {
     auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1);
-    server.sockets.insert(socket);
     fd1 = -1;
     socket->handler.handleReceivedMessage(1, Core::Buffer(NULL, 3, NULL));
     ASSERT_TRUE(rpcHandler.lastRPC.get());
@@ -83,7 +85,6 @@ TEST_F(RPCOpaqueServerTest, MessageSocketHandler_handleReceivedMessage) {
 
 TEST_F(RPCOpaqueServerTest, MessageSocketHandler_handleReceivedMessage_ping) {
     auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1);
-    server.sockets.insert(socket);
     fd1 = -1;
     socket->handler.handleReceivedMessage(
         Protocol::Common::PING_MESSAGE_ID, Core::Buffer());
@@ -96,7 +97,6 @@ TEST_F(RPCOpaqueServerTest, MessageSocketHandler_handleReceivedMessage_ping) {
 TEST_F(RPCOpaqueServerTest,
        MessageSocketHandler_handleReceivedMessage_version) {
     auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1);
-    server.sockets.insert(socket);
     fd1 = -1;
     socket->handler.handleReceivedMessage(
         Protocol::Common::VERSION_MESSAGE_ID, Core::Buffer());
@@ -106,13 +106,24 @@ TEST_F(RPCOpaqueServerTest,
     using Protocol::Common::VersionMessage::Response;
     EXPECT_EQ(sizeof(Response), buf.getLength());
     Response* response = static_cast<Response*>(buf.getData());
-    EXPECT_EQ(1U, be16toh(response->maxVersionSupported));
+    EXPECT_EQ(uint16_t(MessageSocket::MAX_VERSION_SUPPORTED),
+              be16toh(response->maxVersionSupported));
+    // Older clients send an empty request and only understand version 1.
+    EXPECT_EQ(1U, socket->monitor.sendVersion);
+
+    using Protocol::Common::VersionMessage::Request;
+    Request request;
+    request.maxVersionSupported = htobe16(2);
+    socket->handler.handleReceivedMessage(
+        Protocol::Common::VERSION_MESSAGE_ID,
+        Core::Buffer(&request, sizeof(request), NULL));
+    EXPECT_EQ(2U, socket->monitor.outboundQueue.size());
+    EXPECT_EQ(2U, socket->monitor.sendVersion);
 }
 
 
 TEST_F(RPCOpaqueServerTest, MessageSocketHandler_handleDisconnect) {
     auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1);
-    server.sockets.insert(socket);
     fd1 = -1;
     socket->handler.handleDisconnect();
     EXPECT_EQ(0U, server.sockets.size());
@@ -123,7 +134,7 @@ TEST_F(RPCOpaqueServerTest, MessageSocketHandler_handleDisconnect) {
 void
 clientMain(int& fd, Address& address, OpaqueServer& server)
 {
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    fd = socket(address.getSockAddr()->sa_family, SOCK_STREAM, 0);
     int r = connect(fd,
                     address.getSockAddr(),
                     address.getSockAddrLen());
@@ -145,6 +156,72 @@ TEST_F(RPCOpaqueServerTest, BoundListener_handleFileEvent) {
     close(clientFd);
 }
 
+TEST_F(RPCOpaqueServerTest, SocketWithHandler_make) {
+    auto socket = OpaqueServer::SocketWithHandler::make(&server, fd1);
+    fd1 = -1;
+    EXPECT_EQ(socket, socket->handler.self.lock());
+    EXPECT_EQ(1U, server.sockets.count(socket));
+}
+
+TEST_F(RPCOpaqueServerTest, SocketWithHandler_make_roundRobin) {
+    EXPECT_EQ((std::vector<Event::Loop*>{&loop}), server.socketEventLoops);
+    Event::Loop loop1;
+    Event::Loop loop2;
+    OpaqueServer server2(rpcHandler, loop, 1024, {&loop1, &loop2});
+    std::vector<Event::Loop*> assigned;
+    for (uint32_t i = 0; i < 3; ++i) {
+        int fds[2];
+        EXPECT_EQ(0, pipe(fds));
+        EXPECT_EQ(0, close(fds[1]));
+        auto socket = OpaqueServer::SocketWithHandler::make(&server2, fds[0]);
+        assigned.push_back(&socket->monitor.getEventLoop());
+        socket->monitor.close();
+    }
+    EXPECT_EQ((std::vector<Event::Loop*>{&loop1, &loop2, &loop1}), assigned);
+}
+
+TEST_F(RPCOpaqueServerTest, socketEventLoops) {
+    // Sockets running on other event loops still serve RPCs.
+    Event::Loop loop1;
+    std::thread loop1Thread(&Event::Loop::runForever, &loop1);
+    Address address2("127.0.0.1", 5253);
+    address2.refresh(Address::TimePoint::max());
+    {
+        OpaqueServer server2(rpcHandler, loop, 1024, {&loop1});
+        EXPECT_EQ("", server2.bind(address2));
+        int clientFd = -1;
+        // Exit the event loop only once the listener has accepted the
+        // connection; clientMain's exit can otherwise win the race.
+        std::thread clientThread([&] () {
+            clientFd = socket(AF_INET, SOCK_STREAM, 0);
+            ASSERT_EQ(0, connect(clientFd,
+                                 address2.getSockAddr(),
+                                 address2.getSockAddrLen()));
+            while (true) {
+                {
+                    std::lock_guard<Core::Mutex> lockGuard(
+                        server2.socketsMutex);
+                    if (!server2.sockets.empty())
+                        break;
+                }
+                usleep(1000);
+            }
+            loop.exit();
+        });
+        loop.runForever();
+        clientThread.join();
+        {
+            std::lock_guard<Core::Mutex> lockGuard(server2.socketsMutex);
+            ASSERT_EQ(1U, server2.sockets.size());
+            EXPECT_EQ(&loop1,
+                      &(*server2.sockets.begin())->monitor.getEventLoop());
+        }
+        EXPECT_EQ(0, close(clientFd));
+    }
+    loop1.exit();
+    loop1Thread.join();
+}
+
 TEST_F(RPCOpaqueServerTest, bind_good) {
     Address address2("127.0.0.1", 5253);
     address2.refresh(Address::TimePoint::max());
@@ -170,6 +247,77 @@ TEST_F(RPCOpaqueServerTest, bind_portTaken) {
         << error;
 }
 
+TEST_F(RPCOpaqueServerTest, bind_unix) {
+    std::string tmpdir = Storage::FilesystemUtil::mkdtemp();
+    std::string path = tmpdir + "/server.sock";
+    Address address2("unix:" + path, 0);
+    address2.refresh(Address::TimePoint::max());
+    {
+        OpaqueServer server2(rpcHandler, loop, 1024);
+        EXPECT_EQ("", server2.bind(address2));
+        struct stat st;
+        ASSERT_EQ(0, stat(path.c_str(), &st));
+        EXPECT_TRUE(S_ISSOCK(st.st_mode));
+
+        // A live socket is never replaced.
+        std::string error = server2.bind(address2);
+        EXPECT_TRUE(error.find("Address already in use") != error.npos)
+            << error;
+
+        int clientFd = -1;
+        std::thread clientThread(clientMain,
+                                 std::ref(clientFd),
+                                 std::ref(address2),
+                                 std::ref(server2));
+        loop.runForever();
+        clientThread.join();
+        EXPECT_LE(1U, server2.sockets.size());
+        EXPECT_EQ(0, close(clientFd));
+    }
+    // The socket file is removed when the server stops listening.
+    EXPECT_EQ(-1, access(path.c_str(), F_OK));
+    Storage::FilesystemUtil::remove(tmpdir);
+}
+
+TEST_F(RPCOpaqueServerTest, bind_unixStale) {
+    std::string tmpdir = Storage::FilesystemUtil::mkdtemp();
+    std::string path = tmpdir + "/server.sock";
+    Address address2("unix:" + path, 0);
+    address2.refresh(Address::TimePoint::max());
+    // Leave a socket file behind with nobody listening on it.
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_LE(0, fd);
+    ASSERT_EQ(0, ::bind(fd, address2.getSockAddr(),
+                        address2.getSockAddrLen()));
+    EXPECT_EQ(0, close(fd));
+    LogCabin::Core::Debug::setLogPolicy({{"", "WARNING"}});
+    EXPECT_EQ("", server.bind(address2));
+    server.boundListeners.clear();
+    Storage::FilesystemUtil::remove(tmpdir);
+}
+
+TEST_F(RPCOpaqueServerTest, bind_unixNotSocket) {
+    std::string tmpdir = Storage::FilesystemUtil::mkdtemp();
+    std::string path = tmpdir + "/server.sock";
+    Address address2("unix:" + path, 0);
+    address2.refresh(Address::TimePoint::max());
+    // A regular file at the path must not be removed.
+    int fd = open(path.c_str(), O_WRONLY|O_CREAT, 0644);
+    ASSERT_LE(0, fd);
+    ASSERT_EQ(5, write(fd, "hello", 5));
+    EXPECT_EQ(0, close(fd));
+    size_t numListeners = server.boundListeners.size();
+    std::string error = server.bind(address2);
+    EXPECT_TRUE(error.find("Could not bind") != error.npos)
+        << error;
+    EXPECT_EQ(numListeners, server.boundListeners.size());
+    struct stat st;
+    ASSERT_EQ(0, lstat(path.c_str(), &st));
+    EXPECT_TRUE(S_ISREG(st.st_mode));
+    EXPECT_EQ(5, st.st_size);
+    Storage::FilesystemUtil::remove(tmpdir);
+}
+
 } // namespace LogCabin::RPC::<anonymous>
 } // namespace LogCabin::RPC
 } // namespace LogCabin
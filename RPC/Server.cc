@@ -13,6 +13,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
+
 #include "RPC/OpaqueServerRPC.h"
 #include "RPC/Server.h"
 #include "RPC/ServerRPC.h"
@@ -43,12 +45,25 @@ Server::RPCHandler::handleRPC(OpaqueServerRPC opaqueRPC)
         return;
     }
     std::shared_ptr<Service> service;
+    uint32_t maxFragmentedMessageLength = 0;
+    bool peer = false;
     {
         std::lock_guard<std::mutex> lockGuard(server.mutex);
         auto it = server.services.find(rpc.getService());
         if (it != server.services.end())
             service = it->second;
+        auto lengthIt =
+            server.maxFragmentedMessageLengths.find(rpc.getService());
+        if (lengthIt != server.maxFragmentedMessageLengths.end())
+            maxFragmentedMessageLength = lengthIt->second;
+        peer = (server.peerServices.count(rpc.getService()) > 0);
+    }
+    if (maxFragmentedMessageLength > 0) {
+        rpc.opaqueRPC.setMaxFragmentedMessageLength(
+            maxFragmentedMessageLength);
     }
+    if (peer)
+        rpc.opaqueRPC.moveToPeerEventLoop();
     if (service)
         service->handleRPC(std::move(rpc));
     else
@@ -57,11 +72,17 @@ Server::RPCHandler::handleRPC(OpaqueServerRPC opaqueRPC)
 
 ////////// Server //////////
 
-Server::Server(Event::Loop& eventLoop, uint32_t maxMessageLength)
+Server::Server(Event::Loop& eventLoop, uint32_t maxMessageLength,
+               const std::vector<Event::Loop*>& socketEventLoops,
+               uint32_t compressionThreshold,
+               Event::Loop* peerEventLoop)
     : mutex()
     , services()
+    , maxFragmentedMessageLengths()
+    , peerServices()
     , rpcHandler(*this)
-    , opaqueServer(rpcHandler, eventLoop, maxMessageLength)
+    , opaqueServer(rpcHandler, eventLoop, maxMessageLength, socketEventLoops,
+                   compressionThreshold, peerEventLoop)
 {
 }
 
@@ -78,11 +99,44 @@ Server::bind(const Address& listenAddress)
 void
 Server::registerService(uint16_t serviceId,
                         std::shared_ptr<Service> service,
-                        uint32_t maxThreads)
+                        uint32_t maxThreads,
+                        int niceness,
+                        uint32_t maxFragmentedMessageLength)
 {
     std::lock_guard<std::mutex> lockGuard(mutex);
     services[serviceId] =
-        std::make_shared<ThreadDispatchService>(service, 0, maxThreads);
+        std::make_shared<ThreadDispatchService>(service, 0, maxThreads,
+                                                niceness);
+    if (maxFragmentedMessageLength > 0)
+        maxFragmentedMessageLengths[serviceId] = maxFragmentedMessageLength;
+    else
+        maxFragmentedMessageLengths.erase(serviceId);
+}
+
+void
+Server::setPeerService(uint16_t serviceId)
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    peerServices.insert(serviceId);
+}
+
+void
+Server::updateServerStats(LogCabin::Protocol::ServerStats& serverStats)
+{
+    std::vector<std::pair<uint16_t,
+                          std::shared_ptr<ThreadDispatchService>>> copy;
+    {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        copy.assign(services.begin(), services.end());
+    }
+    std::sort(copy.begin(), copy.end());
+    typedef LogCabin::Protocol::ServerStats::RPC RPCStats;
+    RPCStats& rpcStats = *serverStats.mutable_rpc();
+    for (auto it = copy.begin(); it != copy.end(); ++it) {
+        RPCStats::Service& stats = *rpcStats.add_service();
+        stats.set_service_id(it->first);
+        it->second->updateServerStats(stats);
+    }
 }
 
 } // namespace LogCabin::RPC
@@ -18,7 +18,10 @@
 #include <memory>
 #include <mutex>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "build/Protocol/ServerStats.pb.h"
 #include "RPC/OpaqueServer.h"
 #include "RPC/Service.h"
 
@@ -28,6 +31,9 @@
 namespace LogCabin {
 namespace RPC {
 
+// forward declaration
+class ThreadDispatchService;
+
 /**
  * A Server listens for incoming RPCs over TCP connections and dispatches these
  * to Services.
@@ -48,8 +54,17 @@ class Server {
      *      exists to limit the amount of buffer space a single RPC can use.
      *      Attempting to send longer responses will PANIC; attempting to
      *      receive longer requests will disconnect the underlying socket.
+     * \param socketEventLoops
+     *      See OpaqueServer::OpaqueServer().
+     * \param compressionThreshold
+     *      See OpaqueServer::OpaqueServer().
+     * \param peerEventLoop
+     *      See OpaqueServer::OpaqueServer() and setPeerService().
      */
-    Server(Event::Loop& eventLoop, uint32_t maxMessageLength);
+    Server(Event::Loop& eventLoop, uint32_t maxMessageLength,
+           const std::vector<Event::Loop*>& socketEventLoops = {},
+           uint32_t compressionThreshold = 0,
+           Event::Loop* peerEventLoop = NULL);
 
     /**
      * Destructor. ServerRPC objects originating from this Server may be kept
@@ -75,10 +90,38 @@ class Server {
      * \param maxThreads
      *      The maximum number of threads to execute RPCs concurrently inside
      *      the service.
+     * \param niceness
+     *      How much lower the CPU scheduling priority of the service's threads
+     *      should be. See ThreadDispatchService::ThreadDispatchService().
+     * \param maxFragmentedMessageLength
+     *      If nonzero, once a session sends an RPC to this service, it may
+     *      send fragmented requests of up to this many bytes (see
+     *      MessageSocket::setMaxFragmentedMessageLength()). Only services that
+     *      servers call on each other should set this; sessions that haven't
+     *      called such a service stay limited to the maxMessageLength given to
+     *      the constructor.
      */
     void registerService(uint16_t serviceId,
                          std::shared_ptr<Service> service,
-                         uint32_t maxThreads);
+                         uint32_t maxThreads,
+                         int niceness = 0,
+                         uint32_t maxFragmentedMessageLength = 0);
+
+    /**
+     * Mark a service as one that only peers call. Once a session sends an
+     * RPC to such a service, it's moved to the peer event loop given to the
+     * constructor (if any), so that reading and writing its messages doesn't
+     * wait behind other sessions. This may be called from any thread.
+     * \param serviceId
+     *      A unique ID for the service. See Protocol::Common::ServiceId.
+     */
+    void setPeerService(uint16_t serviceId);
+
+    /**
+     * Add information about each registered service's thread pool to the
+     * given structure.
+     */
+    void updateServerStats(LogCabin::Protocol::ServerStats& serverStats);
 
   private:
     /**
@@ -105,7 +148,21 @@ class Server {
      * Maps from service IDs to ThreadDispatchService instances.
      * Protected by #mutex.
      */
-    std::unordered_map<uint16_t, std::shared_ptr<Service>> services;
+    std::unordered_map<uint16_t,
+                       std::shared_ptr<ThreadDispatchService>> services;
+
+    /**
+     * Maps from service IDs to the maxFragmentedMessageLength given to
+     * registerService(), for those services where that was nonzero.
+     * Protected by #mutex.
+     */
+    std::unordered_map<uint16_t, uint32_t> maxFragmentedMessageLengths;
+
+    /**
+     * The service IDs given to setPeerService().
+     * Protected by #mutex.
+     */
+    std::unordered_set<uint16_t> peerServices;
 
     /**
      * Deals with RPCs created by #opaqueServer.
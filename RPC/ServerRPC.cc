@@ -128,6 +128,14 @@ ServerRPC::getRequest(Core::Buffer& buffer) const
     return true;
 }
 
+uint64_t
+ServerRPC::getRequestLength() const
+{
+    if (!active)
+        return 0;
+    return opaqueRPC.request.getLength() - sizeof(RequestHeaderVersion1);
+}
+
 void
 ServerRPC::reply(const google::protobuf::Message& payload)
 {
@@ -99,6 +99,12 @@ class ServerRPC {
         return opCode;
     }
 
+    /**
+     * Return the length of the request in bytes, not including the RPC
+     * header, or 0 if the RPC is no longer active.
+     */
+    uint64_t getRequestLength() const;
+
     /**
      * Parse the request out of the RPC.
      * \param[out] request
@@ -123,6 +123,15 @@ TEST_F(RPCServerRPCTest, constructor_normal) {
 // destructor: nothing to test
 // move assignment: nothing to test
 
+TEST_F(RPCServerRPCTest, getRequestLength) {
+    serializeRequestPayload(payload);
+    fillRequestHeader(1, 2, 3, 4);
+    call();
+    EXPECT_EQ(uint64_t(payload.ByteSize()), serverRPC.getRequestLength());
+    serverRPC.closeSession();
+    EXPECT_EQ(0U, serverRPC.getRequestLength());
+}
+
 TEST_F(RPCServerRPCTest, getRequest_normal) {
     serializeRequestPayload(payload);
     fillRequestHeader(1, 2, 3, 4);
@@ -15,6 +15,7 @@
 
 #include <gtest/gtest.h>
 #include <thread>
+#include <unistd.h>
 
 #include "build/Core/ProtoBufTest.pb.h"
 #include "Core/Buffer.h"
@@ -32,6 +33,7 @@ namespace RPC {
 namespace {
 
 using LogCabin::Protocol::Common::DEFAULT_PORT;
+using LogCabin::Protocol::Common::MAX_FRAGMENTED_MESSAGE_LENGTH;
 using LogCabin::Protocol::Common::MAX_MESSAGE_LENGTH;
 typedef ClientSession::TimePoint TimePoint;
 
@@ -107,6 +109,44 @@ TEST_F(RPCServerTest, handleRPC_badService) {
               rpc.waitForReply(NULL, NULL, TimePoint::max()));
 }
 
+TEST_F(RPCServerTest, handleRPC_clientMessageTooLong) {
+    server.registerService(1, service1, 1);
+    session = ClientSession::makeSession(
+                    eventLoop,
+                    address,
+                    MAX_FRAGMENTED_MESSAGE_LENGTH,
+                    RPC::ClientSession::TimePoint::max(),
+                    Core::Config());
+    request.set_field_d(std::string(MAX_MESSAGE_LENGTH, 'x'));
+    LogCabin::Core::Debug::setLogPolicy({{"", "ERROR"}});
+    ClientRPC rpc(session, 1, 1, 0, request);
+    EXPECT_EQ(ClientRPC::Status::RPC_FAILED,
+              rpc.waitForReply(NULL, NULL, TimePoint::max()));
+}
+
+TEST_F(RPCServerTest, handleRPC_maxFragmentedMessageLength) {
+    server.registerService(1, service1, 1, 0, MAX_FRAGMENTED_MESSAGE_LENGTH);
+    session = ClientSession::makeSession(
+                    eventLoop,
+                    address,
+                    MAX_FRAGMENTED_MESSAGE_LENGTH,
+                    RPC::ClientSession::TimePoint::max(),
+                    Core::Config());
+    // The first RPC to the service lets the session send long messages. Its
+    // reply also follows the server's version reply, so the long request
+    // below is sent in fragments.
+    service1->reply(0, request, reply);
+    ClientRPC rpc(session, 1, 1, 0, request);
+    EXPECT_EQ(ClientRPC::Status::OK,
+              rpc.waitForReply(NULL, NULL, TimePoint::max()));
+    EXPECT_EQ(3U, session->getSendVersion());
+    request.set_field_d(std::string(2 * MAX_MESSAGE_LENGTH, 'x'));
+    service1->reply(0, request, reply);
+    rpc = ClientRPC(session, 1, 1, 0, request);
+    EXPECT_EQ(ClientRPC::Status::OK,
+              rpc.waitForReply(NULL, NULL, TimePoint::max()));
+}
+
 // constructor: nothing to test
 
 // destructor: nothing to test
@@ -128,6 +168,88 @@ TEST_F(RPCServerTest, registerService) {
               rpc.waitForReply(NULL, NULL, TimePoint::max()));
 }
 
+TEST_F(RPCServerTest, setPeerService) {
+    Event::Loop peerEventLoop;
+    std::thread peerEventLoopThread(&Event::Loop::runForever,
+                                    &peerEventLoop);
+    {
+        Address address2("127.0.0.1", DEFAULT_PORT + 1);
+        address2.refresh(Address::TimePoint::max());
+        Server server2(eventLoop, MAX_MESSAGE_LENGTH, {}, 0, &peerEventLoop);
+        EXPECT_EQ("", server2.bind(address2));
+        server2.registerService(1, service1, 1);
+        server2.registerService(2, service2, 1);
+        server2.setPeerService(2);
+        session = ClientSession::makeSession(
+                        eventLoop,
+                        address2,
+                        MAX_MESSAGE_LENGTH,
+                        RPC::ClientSession::TimePoint::max(),
+                        Core::Config());
+        auto getSocketEventLoop = [&server2] () {
+            std::lock_guard<Core::Mutex> lockGuard(
+                server2.opaqueServer.socketsMutex);
+            EXPECT_EQ(1U, server2.opaqueServer.sockets.size());
+            return &(*server2.opaqueServer.sockets.begin())->
+                monitor.getEventLoop();
+        };
+
+        service1->reply(0, request, reply);
+        ClientRPC rpc(session, 1, 1, 0, request);
+        EXPECT_EQ(ClientRPC::Status::OK,
+                  rpc.waitForReply(NULL, NULL, TimePoint::max()));
+        EXPECT_EQ(&eventLoop, getSocketEventLoop());
+
+        service2->reply(0, request, reply);
+        rpc = ClientRPC(session, 2, 1, 0, request);
+        EXPECT_EQ(ClientRPC::Status::OK,
+                  rpc.waitForReply(NULL, NULL, TimePoint::max()));
+        // The socket moves once the event loop is done reading from it,
+        // which may be just after the reply arrives.
+        for (uint32_t i = 0; i < 1000; ++i) {
+            if (getSocketEventLoop() == &peerEventLoop)
+                break;
+            usleep(1000);
+        }
+        EXPECT_EQ(&peerEventLoop, getSocketEventLoop());
+
+        // The session still works on its new event loop.
+        service1->reply(0, request, reply);
+        rpc = ClientRPC(session, 1, 1, 0, request);
+        EXPECT_EQ(ClientRPC::Status::OK,
+                  rpc.waitForReply(NULL, NULL, TimePoint::max()));
+        session.reset();
+    }
+    peerEventLoop.exit();
+    peerEventLoopThread.join();
+}
+
+TEST_F(RPCServerTest, updateServerStats) {
+    server.registerService(2, service2, 3, 1);
+    server.registerService(1, service1, 1);
+    service1->reply(0, request, reply);
+    ClientRPC rpc(session, 1, 1, 0, request);
+    EXPECT_EQ(ClientRPC::Status::OK,
+              rpc.waitForReply(NULL, NULL, TimePoint::max()));
+    LogCabin::Protocol::ServerStats stats;
+    // workers report queue waits once they run out of work
+    for (uint32_t i = 0; i < 1000; ++i) {
+        stats.Clear();
+        server.updateServerStats(stats);
+        if (stats.rpc().service(0).queue_wait_nanos().count() == 1)
+            break;
+        usleep(1000);
+    }
+    ASSERT_EQ(2, stats.rpc().service_size());
+    EXPECT_EQ(1U, stats.rpc().service(0).service_id());
+    EXPECT_EQ(0, stats.rpc().service(0).niceness());
+    EXPECT_EQ(1U, stats.rpc().service(0).num_threads());
+    EXPECT_EQ(1U, stats.rpc().service(0).queue_wait_nanos().count());
+    EXPECT_EQ(2U, stats.rpc().service(1).service_id());
+    EXPECT_EQ(1, stats.rpc().service(1).niceness());
+    EXPECT_EQ(0U, stats.rpc().service(1).num_threads());
+}
+
 } // namespace LogCabin::RPC::<anonymous>
 } // namespace LogCabin::RPC
 } // namespace LogCabin
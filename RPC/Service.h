@@ -46,6 +46,19 @@ class Service {
      */
     virtual void handleRPC(ServerRPC serverRPC) = 0;
 
+    /**
+     * This may be overridden by a subclass to turn RPCs away before they are
+     * queued for handleRPC(). ThreadDispatchService calls it on the
+     * Event::Loop thread as each RPC arrives, so it must be quick and must
+     * not block.
+     * \param serverRPC
+     *      The newly arrived RPC.
+     * \return
+     *      True if the RPC should be passed on to handleRPC(); false if this
+     *      method has already replied to it.
+     */
+    virtual bool admitRPC(ServerRPC& serverRPC) { return true; }
+
     /**
      * Return a short name for this service which can be used in things like
      * log messages.
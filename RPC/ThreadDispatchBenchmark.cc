@@ -0,0 +1,317 @@
+/* Copyright (c) 2026 LogCabin contributors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * \file
+ * This is a microbenchmark for RPC::ThreadDispatchService. It hands empty
+ * RPCs to a dispatch service from several threads, standing in for event loop
+ * threads, and measures how quickly worker threads get through them. For
+ * comparison, it runs the same workload through a single shared queue, which
+ * is how ThreadDispatchService used to work.
+ */
+
+#include <getopt.h>
+#include <iostream>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "Core/CompatAtomic.h"
+#include "Core/ConditionVariable.h"
+#include "Core/ThreadId.h"
+#include "Core/Time.h"
+#include "RPC/ThreadDispatchService.h"
+
+namespace {
+
+using namespace LogCabin;
+
+/**
+ * Parses argv for the main function.
+ */
+class OptionParser {
+  public:
+    OptionParser(int& argc, char**& argv)
+        : argc(argc)
+        , argv(argv)
+        , producers(2)
+        , threads(16)
+        , rpcs(1000000)
+        , workNanos(0)
+    {
+        while (true) {
+            static struct option longOptions[] = {
+               {"help",  no_argument, NULL, 'h'},
+               {"producers",  required_argument, NULL, 'p'},
+               {"rpcs",  required_argument, NULL, 'n'},
+               {"threads",  required_argument, NULL, 't'},
+               {"work",  required_argument, NULL, 'w'},
+               {0, 0, 0, 0}
+            };
+            int c = getopt_long(argc, argv, "hp:n:t:w:", longOptions, NULL);
+
+            // Detect the end of the options.
+            if (c == -1)
+                break;
+
+            switch (c) {
+                case 'h':
+                    usage();
+                    exit(0);
+                case 'p':
+                    producers = uint32_t(atol(optarg));
+                    break;
+                case 'n':
+                    rpcs = uint64_t(atol(optarg));
+                    break;
+                case 't':
+                    threads = uint32_t(atol(optarg));
+                    break;
+                case 'w':
+                    workNanos = uint64_t(atol(optarg));
+                    break;
+                case '?':
+                default:
+                    // getopt_long already printed an error message.
+                    usage();
+                    exit(1);
+            }
+        }
+        if (producers == 0 || threads == 0) {
+            usage();
+            exit(1);
+        }
+    }
+
+    void usage() {
+        std::cout
+            << "Measures the throughput of RPC::ThreadDispatchService and of "
+            << "a single shared"
+            << std::endl
+            << "queue protected by one mutex."
+            << std::endl
+            << std::endl
+
+            << "Usage: " << argv[0] << " [options]"
+            << std::endl
+            << std::endl
+
+            << "Options:"
+            << std::endl
+
+            << "  -h, --help             "
+            << "Print this usage information"
+            << std::endl
+
+            << "  -n <num>, --rpcs=<num> "
+            << "Total number of RPCs to dispatch [default: 1000000]"
+            << std::endl
+
+            << "  -p <num>, --producers=<num>  "
+            << "Number of threads handing off RPCs [default: 2]"
+            << std::endl
+
+            << "  -t <num>, --threads=<num>    "
+            << "Maximum number of worker threads [default: 16]"
+            << std::endl
+
+            << "  -w <ns>, --work=<ns>   "
+            << "Nanoseconds each RPC keeps its worker busy [default: 0]"
+            << std::endl;
+    }
+
+    int& argc;
+    char**& argv;
+    uint32_t producers;
+    uint32_t threads;
+    uint64_t rpcs;
+    uint64_t workNanos;
+};
+
+/**
+ * Service that busy-waits for a configurable amount of time per RPC, then
+ * counts it.
+ */
+class SpinService : public RPC::Service {
+  public:
+    explicit SpinService(uint64_t workNanos)
+        : workNanos(workNanos)
+        , count(0)
+    {
+    }
+    void handleRPC(RPC::ServerRPC serverRPC) {
+        if (workNanos > 0) {
+            Core::Time::SteadyClock::time_point end =
+                Core::Time::SteadyClock::now() +
+                std::chrono::nanoseconds(workNanos);
+            while (Core::Time::SteadyClock::now() < end) {
+                // spin
+            }
+        }
+        ++count;
+    }
+    std::string getName() const {
+        return "SpinService";
+    }
+    const uint64_t workNanos;
+    std::atomic<uint64_t> count;
+};
+
+/**
+ * A thread pool with one queue shared by all workers, protected by a single
+ * mutex and condition variable. This is how ThreadDispatchService worked
+ * before it had per-worker queues, and it's here only for comparison.
+ */
+class SharedQueueDispatchService : public RPC::Service {
+  public:
+    SharedQueueDispatchService(std::shared_ptr<RPC::Service> service,
+                               uint32_t maxThreads)
+        : service(service)
+        , maxThreads(maxThreads)
+        , mutex()
+        , threads()
+        , numFreeWorkers(0)
+        , conditionVariable()
+        , exit(false)
+        , rpcQueue()
+    {
+    }
+    ~SharedQueueDispatchService() {
+        {
+            std::lock_guard<std::mutex> lockGuard(mutex);
+            exit = true;
+            conditionVariable.notify_all();
+        }
+        while (!threads.empty()) {
+            threads.back().join();
+            threads.pop_back();
+        }
+    }
+    void handleRPC(RPC::ServerRPC serverRPC) {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        rpcQueue.push(std::move(serverRPC));
+        if (numFreeWorkers == 0 && threads.size() < maxThreads)
+            threads.emplace_back(&SharedQueueDispatchService::workerMain,
+                                 this);
+        conditionVariable.notify_one();
+    }
+    std::string getName() const {
+        return service->getName();
+    }
+    void workerMain() {
+        while (true) {
+            RPC::ServerRPC rpc;
+            {
+                std::unique_lock<std::mutex> lockGuard(mutex);
+                ++numFreeWorkers;
+                while (!exit && rpcQueue.empty())
+                    conditionVariable.wait(lockGuard);
+                --numFreeWorkers;
+                if (exit)
+                    return;
+                rpc = std::move(rpcQueue.front());
+                rpcQueue.pop();
+            }
+            service->handleRPC(std::move(rpc));
+        }
+    }
+    std::shared_ptr<RPC::Service> service;
+    const uint32_t maxThreads;
+    std::mutex mutex;
+    std::vector<std::thread> threads;
+    uint32_t numFreeWorkers;
+    Core::ConditionVariable conditionVariable;
+    bool exit;
+    std::queue<RPC::ServerRPC> rpcQueue;
+};
+
+/**
+ * Hand off the configured number of RPCs to the given dispatcher, and wait
+ * for the service to execute all of them.
+ * \return
+ *      Elapsed time in seconds.
+ */
+double
+run(const OptionParser& options,
+    RPC::Service& dispatcher,
+    SpinService& service)
+{
+    typedef Core::Time::SteadyClock Clock;
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread> producers;
+    for (uint32_t i = 0; i < options.producers; ++i) {
+        uint64_t n = options.rpcs / options.producers;
+        if (i < options.rpcs % options.producers)
+            ++n;
+        producers.emplace_back([&dispatcher, n] () {
+            for (uint64_t j = 0; j < n; ++j)
+                dispatcher.handleRPC(RPC::ServerRPC());
+        });
+    }
+    for (auto it = producers.begin(); it != producers.end(); ++it)
+        it->join();
+    while (service.count < options.rpcs)
+        std::this_thread::yield();
+    std::chrono::nanoseconds elapsed = Clock::now() - start;
+    return double(elapsed.count()) / 1e9;
+}
+
+void
+report(const std::string& name, const OptionParser& options, double seconds)
+{
+    std::cout << name << ": "
+              << options.rpcs << " RPCs in " << seconds << " s ("
+              << uint64_t(double(options.rpcs) / seconds) << " RPCs/s)"
+              << std::endl;
+}
+
+} // anonymous namespace
+
+int
+main(int argc, char** argv)
+{
+    Core::ThreadId::setName("main");
+    OptionParser options(argc, argv);
+    std::cout << options.producers << " producers, "
+              << options.threads << " max workers, "
+              << options.workNanos << " ns of work per RPC"
+              << std::endl;
+
+    {
+        std::shared_ptr<SpinService> service =
+            std::make_shared<SpinService>(options.workNanos);
+        SharedQueueDispatchService dispatcher(service, options.threads);
+        report("shared queue", options, run(options, dispatcher, *service));
+    }
+
+    {
+        std::shared_ptr<SpinService> service =
+            std::make_shared<SpinService>(options.workNanos);
+        RPC::ThreadDispatchService dispatcher(service, 0, options.threads);
+        double seconds = run(options, dispatcher, *service);
+        report("work stealing", options, seconds);
+        // Workers report queue waits once they run out of work.
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        Protocol::ServerStats::RPC::Service stats;
+        dispatcher.updateServerStats(stats);
+        std::cout << "work stealing stats: "
+                  << "threads: " << stats.num_threads() << ", "
+                  << "steals: " << stats.num_steals() << ", "
+                  << "mean queue wait: "
+                  << uint64_t(stats.queue_wait_nanos().average()) << " ns"
+                  << std::endl;
+    }
+    return 0;
+}
@@ -14,7 +14,14 @@
  */
 
 #include <assert.h>
+#include <functional>
+#include <errno.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
+#include "Core/Debug.h"
 #include "Core/StringUtil.h"
 #include "Core/ThreadId.h"
 #include "RPC/ThreadDispatchService.h"
@@ -22,56 +29,137 @@
 namespace LogCabin {
 namespace RPC {
 
+const std::chrono::milliseconds
+ThreadDispatchService::QUEUE_WAIT_THRESHOLD(10);
+
+////////// ThreadDispatchService::Worker //////////
+
+ThreadDispatchService::Worker::Worker(uint32_t index)
+    : index(index)
+    , mutex()
+    , wakeup()
+    , state(State::STOPPED)
+    , exit(false)
+    , queue()
+    , thread()
+{
+}
+
+////////// ThreadDispatchService //////////
+
 ThreadDispatchService::ThreadDispatchService(
         std::shared_ptr<Service> threadSafeService,
         uint32_t minThreads,
-        uint32_t maxThreads)
+        uint32_t maxThreads,
+        int niceness)
     : threadSafeService(threadSafeService)
+    , minThreads(minThreads)
     , maxThreads(maxThreads)
+    , niceness(niceness)
+    , spinTimeout(std::chrono::microseconds(50))
+    , idleTimeout(std::chrono::seconds(60))
+    , workers()
+    , nextWorker(0)
+    , numThreads(0)
+    , numSteals(0)
+    , numThreadsExited(0)
+    , exiting(false)
     , mutex()
-    , threads()
-    , numFreeWorkers(0)
-    , conditionVariable()
-    , exit(false)
-    , rpcQueue()
+    , statsMutex()
+    , queueWaitNanos()
 {
     assert(minThreads <= maxThreads);
     assert(0 < maxThreads);
-    for (uint32_t i = 0; i < minThreads; ++i)
-        threads.emplace_back(&ThreadDispatchService::workerMain, this);
+    for (uint32_t i = 0; i < maxThreads; ++i)
+        workers.emplace_back(new Worker(i));
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    for (uint32_t i = 0; i < minThreads; ++i) {
+        std::lock_guard<std::mutex> workerLockGuard(workers.at(i)->mutex);
+        startWorker(*workers.at(i));
+    }
 }
 
 ThreadDispatchService::~ThreadDispatchService()
 {
+    exiting = true;
+
     // Signal the threads to exit.
-    {
-        std::lock_guard<std::mutex> lockGuard(mutex);
-        exit = true;
-        conditionVariable.notify_all();
+    for (auto it = workers.begin(); it != workers.end(); ++it) {
+        Worker& worker = **it;
+        std::lock_guard<std::mutex> lockGuard(worker.mutex);
+        worker.exit = true;
+        worker.wakeup.notify_all();
     }
 
     // Join the threads.
-    while (!threads.empty()) {
-        threads.back().join();
-        threads.pop_back();
+    {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        for (auto it = workers.begin(); it != workers.end(); ++it) {
+            if ((*it)->thread.joinable())
+                (*it)->thread.join();
+        }
     }
 
     // Close the sessions of any remaining RPCs that didn't get processed.
-    while (!rpcQueue.empty()) {
-        rpcQueue.front().closeSession();
-        rpcQueue.pop();
+    for (auto it = workers.begin(); it != workers.end(); ++it) {
+        Worker& worker = **it;
+        while (!worker.queue.empty()) {
+            worker.queue.front().second.closeSession();
+            worker.queue.pop_front();
+        }
     }
 }
 
 void
 ThreadDispatchService::handleRPC(ServerRPC serverRPC)
 {
-    std::lock_guard<std::mutex> lockGuard(mutex);
-    assert(!exit);
-    rpcQueue.push(std::move(serverRPC));
-    if (numFreeWorkers == 0 && threads.size() < maxThreads)
-        threads.emplace_back(&ThreadDispatchService::workerMain, this);
-    conditionVariable.notify_one();
+    assert(!exiting);
+    if (!threadSafeService->admitRPC(serverRPC))
+        return;
+    typedef Worker::State State;
+    QueuedRPC rpc(Clock::now(), std::move(serverRPC));
+    uint32_t start = nextWorker.fetch_add(1) % maxThreads;
+    while (true) {
+        // Prefer an idle worker, so that only that one thread wakes up.
+        for (uint32_t i = 0; i < maxThreads; ++i) {
+            Worker& worker = *workers.at((start + i) % maxThreads);
+            State state = worker.state;
+            if (state != State::SPINNING && state != State::PARKED)
+                continue;
+            std::lock_guard<std::mutex> lockGuard(worker.mutex);
+            state = worker.state;
+            if (state != State::SPINNING && state != State::PARKED)
+                continue;
+            worker.queue.push_back(std::move(rpc));
+            worker.state = State::RUNNING;
+            if (state == State::PARKED)
+                worker.wakeup.notify_one();
+            return;
+        }
+
+        // Otherwise, start a new worker if allowed.
+        if (numThreads < maxThreads) {
+            std::lock_guard<std::mutex> lockGuard(mutex);
+            for (uint32_t i = 0; i < maxThreads; ++i) {
+                Worker& worker = *workers.at((start + i) % maxThreads);
+                if (worker.state != State::STOPPED)
+                    continue;
+                std::lock_guard<std::mutex> workerLockGuard(worker.mutex);
+                if (worker.state != State::STOPPED)
+                    continue;
+                worker.queue.push_back(std::move(rpc));
+                startWorker(worker);
+                return;
+            }
+        }
+
+        // Otherwise, queue it behind a busy worker.
+        if (queueBehindBusyWorker(rpc, start))
+            return;
+
+        // Every worker exited while we were looking; try again, which will
+        // start one.
+    }
 }
 
 std::string
@@ -81,28 +169,244 @@ ThreadDispatchService::getName() const
 }
 
 void
-ThreadDispatchService::workerMain()
+ThreadDispatchService::updateServerStats(
+        LogCabin::Protocol::ServerStats::RPC::Service& stats)
 {
+    typedef Worker::State State;
+    uint64_t numFreeWorkers = 0;
+    uint64_t queueLength = 0;
+    for (auto it = workers.begin(); it != workers.end(); ++it) {
+        Worker& worker = **it;
+        std::lock_guard<std::mutex> lockGuard(worker.mutex);
+        if (worker.state == State::SPINNING || worker.state == State::PARKED)
+            ++numFreeWorkers;
+        queueLength += worker.queue.size();
+    }
+    stats.set_name(getName());
+    stats.set_niceness(niceness);
+    stats.set_num_threads(numThreads);
+    stats.set_num_free_workers(numFreeWorkers);
+    stats.set_queue_length(queueLength);
+    stats.set_num_steals(numSteals);
+    stats.set_num_threads_exited(numThreadsExited);
+    std::lock_guard<std::mutex> lockGuard(statsMutex);
+    queueWaitNanos.updateProtoBuf(*stats.mutable_queue_wait_nanos());
+}
+
+void
+ThreadDispatchService::startWorker(Worker& worker)
+{
+    assert(worker.state == Worker::State::STOPPED);
+    // A thread that exited on its own may not have been joined yet. It
+    // no longer needs worker.mutex, so this can't deadlock.
+    if (worker.thread.joinable())
+        worker.thread.join();
+    worker.state = Worker::State::RUNNING;
+    worker.exit = false;
+    ++numThreads;
+    worker.thread = std::thread(&ThreadDispatchService::workerMain,
+                                this, std::ref(worker));
+}
+
+bool
+ThreadDispatchService::queueBehindBusyWorker(QueuedRPC& rpc, uint32_t start)
+{
+    typedef Worker::State State;
+    bool queued = false;
+    for (uint32_t i = 0; i < maxThreads && !queued; ++i) {
+        Worker& worker = *workers.at((start + i) % maxThreads);
+        if (worker.state == State::STOPPED)
+            continue;
+        std::lock_guard<std::mutex> lockGuard(worker.mutex);
+        if (worker.state == State::STOPPED)
+            continue;
+        worker.queue.push_back(std::move(rpc));
+        queued = true;
+        if (worker.state == State::SPINNING ||
+            worker.state == State::PARKED) {
+            // It went idle after all, so it will run the RPC itself.
+            if (worker.state == State::PARKED)
+                worker.wakeup.notify_one();
+            worker.state = State::RUNNING;
+            return true;
+        }
+    }
+    if (!queued)
+        return false;
+
+    // Another worker may have gone idle since handleRPC() looked, and parked
+    // workers don't steal. Nudge one to come and steal the RPC. Any worker
+    // that is still busy now will look in the other queues before it parks.
+    for (uint32_t i = 0; i < maxThreads; ++i) {
+        Worker& worker = *workers.at((start + i) % maxThreads);
+        State state = worker.state;
+        if (state != State::SPINNING && state != State::PARKED)
+            continue;
+        std::lock_guard<std::mutex> lockGuard(worker.mutex);
+        state = worker.state;
+        if (state != State::SPINNING && state != State::PARKED)
+            continue;
+        worker.state = State::RUNNING;
+        if (state == State::PARKED)
+            worker.wakeup.notify_one();
+        break;
+    }
+    return true;
+}
+
+bool
+ThreadDispatchService::steal(Worker& self, QueuedRPC& rpc)
+{
+    for (uint32_t i = 1; i < maxThreads; ++i) {
+        Worker& victim = *workers.at((self.index + i) % maxThreads);
+        if (victim.state == Worker::State::STOPPED)
+            continue;
+        std::unique_lock<std::mutex> lockGuard(victim.mutex,
+                                               std::try_to_lock);
+        if (!lockGuard.owns_lock() || victim.queue.empty())
+            continue;
+        rpc = std::move(victim.queue.front());
+        victim.queue.pop_front();
+        ++numSteals;
+        return true;
+    }
+    return false;
+}
+
+void
+ThreadDispatchService::flushStats(
+        std::vector<std::pair<TimePoint, TimePoint>>& samples)
+{
+    if (samples.empty())
+        return;
+    std::lock_guard<std::mutex> lockGuard(statsMutex);
+    for (auto it = samples.begin(); it != samples.end(); ++it) {
+        std::chrono::nanoseconds wait = it->second - it->first;
+        queueWaitNanos.push(uint64_t(wait.count()));
+        if (wait > QUEUE_WAIT_THRESHOLD)
+            queueWaitNanos.noteExceptional(it->first, uint64_t(wait.count()));
+    }
+    samples.clear();
+}
+
+void
+ThreadDispatchService::workerMain(Worker& self)
+{
+    typedef Worker::State State;
     Core::ThreadId::setName(
         Core::StringUtil::format("%s(%lu)",
                                  threadSafeService->getName().c_str(),
                                  Core::ThreadId::getId()));
+    if (niceness != 0) {
+        // On Linux, nice values are per-thread, and PRIO_PROCESS with a
+        // thread ID applies to just that thread.
+        pid_t tid = pid_t(syscall(SYS_gettid));
+        errno = 0;
+        int current = getpriority(PRIO_PROCESS, id_t(tid));
+        if (errno != 0 ||
+            setpriority(PRIO_PROCESS, id_t(tid), current + niceness) != 0) {
+            WARNING("Could not change nice value of %s worker by %d: %s",
+                    threadSafeService->getName().c_str(),
+                    niceness,
+                    strerror(errno));
+        }
+    }
+
+    std::vector<std::pair<TimePoint, TimePoint>> samples;
+    samples.reserve(STATS_BATCH);
     while (true) {
-        ServerRPC rpc;
-        { // find an RPC to process
-            std::unique_lock<std::mutex> lockGuard(mutex);
-            ++numFreeWorkers;
-            while (!exit && rpcQueue.empty())
-                conditionVariable.wait(lockGuard);
-            --numFreeWorkers;
-            if (exit)
-                return;
-            rpc = std::move(rpcQueue.front());
-            rpcQueue.pop();
+        QueuedRPC rpc;
+        bool found = false;
+
+        // Look in this worker's queue, then in the others'.
+        {
+            std::lock_guard<std::mutex> lockGuard(self.mutex);
+            if (self.exit)
+                break;
+            if (!self.queue.empty()) {
+                rpc = std::move(self.queue.front());
+                self.queue.pop_front();
+                found = true;
+            }
         }
+        if (!found)
+            found = steal(self, rpc);
+
+        if (!found) {
+            flushStats(samples);
+            // Spin for a while, announcing that this worker is idle.
+            {
+                std::lock_guard<std::mutex> lockGuard(self.mutex);
+                if (self.queue.empty() && !self.exit)
+                    self.state = State::SPINNING;
+            }
+            TimePoint spinEnd = Clock::now() + spinTimeout;
+            while (!found && Clock::now() < spinEnd) {
+                {
+                    std::lock_guard<std::mutex> lockGuard(self.mutex);
+                    if (self.exit)
+                        break;
+                    if (!self.queue.empty()) {
+                        rpc = std::move(self.queue.front());
+                        self.queue.pop_front();
+                        found = true;
+                        break;
+                    }
+                }
+                found = steal(self, rpc);
+                if (!found)
+                    std::this_thread::yield();
+            }
+
+            // Park until an RPC is queued here, exiting if that takes
+            // too long. If handleRPC() marks this worker RUNNING without
+            // queueing anything here, it queued an RPC behind a busy worker
+            // and wants this one to steal it.
+            std::unique_lock<std::mutex> lockGuard(self.mutex);
+            bool nudged = false;
+            while (!found && self.queue.empty() && !self.exit) {
+                if (self.state == State::RUNNING) {
+                    nudged = true;
+                    break;
+                }
+                self.state = State::PARKED;
+                TimePoint idleEnd = Clock::now() + idleTimeout;
+                self.wakeup.wait_until(lockGuard, idleEnd);
+                if (self.state == State::PARKED &&
+                    self.queue.empty() && !self.exit &&
+                    Clock::now() >= idleEnd) {
+                    uint32_t n = numThreads;
+                    while (n > minThreads) {
+                        if (numThreads.compare_exchange_weak(n, n - 1)) {
+                            self.state = State::STOPPED;
+                            ++numThreadsExited;
+                            return;
+                        }
+                    }
+                }
+            }
+            self.state = State::RUNNING;
+            if (self.exit) {
+                // Leave the RPC for the destructor to close.
+                if (found)
+                    self.queue.push_front(std::move(rpc));
+                break;
+            }
+            if (!found) {
+                if (nudged)
+                    continue;
+                rpc = std::move(self.queue.front());
+                self.queue.pop_front();
+            }
+        }
+
         // execute RPC handler
-        threadSafeService->handleRPC(std::move(rpc));
+        samples.emplace_back(rpc.first, Clock::now());
+        if (samples.size() >= STATS_BATCH)
+            flushStats(samples);
+        threadSafeService->handleRPC(std::move(rpc.second));
     }
+    flushStats(samples);
 }
 
 } // namespace LogCabin::RPC
@@ -14,12 +14,18 @@
  */
 
 #include <cinttypes>
+#include <deque>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <utility>
 #include <vector>
 
+#include "build/Protocol/ServerStats.pb.h"
+#include "Core/CompatAtomic.h"
 #include "Core/ConditionVariable.h"
+#include "Core/RollingStat.h"
+#include "Core/Time.h"
 #include "RPC/ServerRPC.h"
 #include "RPC/Service.h"
 
@@ -35,6 +41,13 @@ namespace RPC {
  * Event::Loop thread. You provide it with another Service on the constructor,
  * and the job of this class is to manage a thread pool on which to call
  * your Service's handleRPC() method.
+ *
+ * Each worker thread has its own queue and lock, so that event loop threads
+ * handing off RPCs and workers picking them up rarely contend with each
+ * other. New RPCs go to an idle worker if there is one, waking up only that
+ * worker. Workers that run out of work steal queued RPCs from other workers,
+ * spin for a short while, then park. Workers that stay parked for
+ * #idleTimeout exit, down to 'minThreads'.
  */
 class ThreadDispatchService : public Service {
   public:
@@ -45,15 +58,22 @@ class ThreadDispatchService : public Service {
      *      threads spawned by this class.
      * \param minThreads
      *      The number of threads with which to start the thread pool.
-     *      These will be created in the constructor.
+     *      These will be created in the constructor, and the pool will not
+     *      shrink below this size.
      * \param maxThreads
      *      The maximum number of threads this class is allowed to use for its
      *      thread pool. The thread pool dynamically grows as needed up until
      *      this limit. This should be set to at least 'minThreads' and more
      *      than 0.
+     * \param niceness
+     *      How much to raise the nice value of worker threads above that of
+     *      the thread that starts them. Positive values give this pool's
+     *      workers a smaller share of the CPU when it is oversubscribed; they
+     *      do not keep the workers from running.
      */
     ThreadDispatchService(std::shared_ptr<Service> threadSafeService,
-                          uint32_t minThreads, uint32_t maxThreads);
+                          uint32_t minThreads, uint32_t maxThreads,
+                          int niceness = 0);
 
     /**
      * Destructor. This will attempt to join all threads and will close
@@ -64,11 +84,144 @@ class ThreadDispatchService : public Service {
     void handleRPC(ServerRPC serverRPC);
     std::string getName() const;
 
+    /**
+     * Add information about the thread pool and its queues to the given
+     * structure.
+     */
+    void updateServerStats(
+        LogCabin::Protocol::ServerStats::RPC::Service& stats);
+
+    /**
+     * RPCs that wait in the queue for longer than this are reported as
+     * exceptional in #queueWaitNanos.
+     */
+    static const std::chrono::milliseconds QUEUE_WAIT_THRESHOLD;
+
   private:
+    /**
+     * Clock used to measure how long RPCs wait in queues and how long
+     * workers stay idle.
+     */
+    typedef Core::Time::SteadyClock Clock;
+
+    /**
+     * Time point for #Clock.
+     */
+    typedef Clock::time_point TimePoint;
+
+    /**
+     * An RPC waiting for a worker, along with the time it was enqueued.
+     */
+    typedef std::pair<TimePoint, ServerRPC> QueuedRPC;
+
+    /**
+     * Workers accumulate up to this many queue wait samples before adding
+     * them to #queueWaitNanos, to avoid taking #statsMutex for every RPC.
+     */
+    enum { STATS_BATCH = 64 };
+
+    /**
+     * A slot for one worker thread and its queue. There are 'maxThreads' of
+     * these, allocated up front, and threads come and go within them.
+     */
+    struct Worker {
+        /**
+         * What the worker thread is currently doing.
+         */
+        enum class State {
+            /// No thread is running in this slot.
+            STOPPED,
+            /// The thread is executing or looking for RPCs.
+            RUNNING,
+            /// The thread found no work and is polling for more.
+            SPINNING,
+            /// The thread is waiting on #wakeup.
+            PARKED,
+        };
+
+        explicit Worker(uint32_t index);
+
+        /**
+         * Position of this worker in #workers.
+         */
+        const uint32_t index;
+
+        /**
+         * Protects the members of this struct defined below.
+         */
+        std::mutex mutex;
+
+        /**
+         * Notified when an RPC is queued for a parked worker or #exit is set.
+         */
+        Core::ConditionVariable wakeup;
+
+        /**
+         * See State. This is only changed with #mutex held, but it may be
+         * read without #mutex to skip over busy workers quickly.
+         */
+        std::atomic<State> state;
+
+        /**
+         * Set when the thread should exit.
+         */
+        bool exit;
+
+        /**
+         * RPCs assigned to this worker. Idle workers steal from the front of
+         * other workers' queues.
+         */
+        std::deque<QueuedRPC> queue;
+
+        /**
+         * The thread running in this slot, or the last one that did. This is
+         * protected by ThreadDispatchService::mutex, not Worker::mutex.
+         */
+        std::thread thread;
+    };
+
+    /**
+     * Start a thread in the given worker slot.
+     * \pre
+     *      Caller holds #mutex and worker.mutex, and the worker is STOPPED.
+     */
+    void startWorker(Worker& worker);
+
+    /**
+     * Queue an RPC behind the first running worker at or after 'start', then
+     * nudge an idle worker (if any) to come steal it. This covers a worker
+     * that went idle after handleRPC() last looked at it.
+     * \param rpc
+     *      The RPC to queue; moved from if this returns true.
+     * \param start
+     *      Index of the first worker to consider.
+     * \return
+     *      True if the RPC was queued, false if every worker is STOPPED.
+     */
+    bool queueBehindBusyWorker(QueuedRPC& rpc, uint32_t start);
+
+    /**
+     * Take an RPC from the front of another worker's queue.
+     * \param self
+     *      The worker looking for something to do.
+     * \param[out] rpc
+     *      Set to the stolen RPC if this returns true.
+     * \return
+     *      True if an RPC was stolen, false otherwise.
+     */
+    bool steal(Worker& self, QueuedRPC& rpc);
+
+    /**
+     * Add queue wait samples to #queueWaitNanos and clear them.
+     * \param samples
+     *      Pairs of enqueue and dequeue times.
+     */
+    void flushStats(std::vector<std::pair<TimePoint, TimePoint>>& samples);
+
     /**
      * The main loop executed in workers.
      */
-    void workerMain();
+    void workerMain(Worker& self);
 
     /**
      * The service that will handle RPCs inside of worker thread spawned by
@@ -76,6 +229,11 @@ class ThreadDispatchService : public Service {
      */
     std::shared_ptr<Service> threadSafeService;
 
+    /**
+     * The number of threads below which the thread pool will not shrink.
+     */
+    const uint32_t minThreads;
+
     /**
      * The maximum number of threads this class is allowed to use for its
      * thread pool.
@@ -83,38 +241,71 @@ class ThreadDispatchService : public Service {
     const uint32_t maxThreads;
 
     /**
-     * This mutex protects all of the members of this class defined below this
-     * point.
+     * Amount to raise the nice value of each worker thread by.
+     * See constructor.
      */
-    std::mutex mutex;
+    const int niceness;
+
+    /**
+     * How long a worker that runs out of work polls for more before parking.
+     * This is not const so that unit tests can change it.
+     */
+    std::chrono::nanoseconds spinTimeout;
 
     /**
-     * The thread pool of workers that process RPCs.
+     * How long a worker stays parked before it exits.
+     * This is not const so that unit tests can change it.
      */
-    std::vector<std::thread> threads;
+    std::chrono::nanoseconds idleTimeout;
 
     /**
-     * The number of workers that are waiting for work (on the condition
-     * variable). This is used to dynamically launch new workers when
-     * necessary.
+     * Worker slots, one per possible thread. The vector itself never
+     * changes after construction.
      */
-    uint32_t numFreeWorkers;
+    std::vector<std::unique_ptr<Worker>> workers;
 
     /**
-     * Notifies workers that there are available RPCs to process or #exit has
-     * been set. To wait on this, one needs to hold #mutex.
+     * Used to spread RPCs across workers round-robin.
      */
-    Core::ConditionVariable conditionVariable;
+    std::atomic<uint32_t> nextWorker;
+
+    /**
+     * The number of worker slots that are not STOPPED.
+     */
+    std::atomic<uint32_t> numThreads;
+
+    /**
+     * The number of RPCs that workers took from other workers' queues.
+     */
+    std::atomic<uint64_t> numSteals;
+
+    /**
+     * The number of worker threads that exited after staying idle for
+     * #idleTimeout.
+     */
+    std::atomic<uint64_t> numThreadsExited;
+
+    /**
+     * Set in the destructor, for assertions.
+     */
+    std::atomic<bool> exiting;
+
+    /**
+     * Serializes starting workers and joining their threads. This is acquired
+     * before any Worker::mutex.
+     */
+    std::mutex mutex;
 
     /**
-     * A flag to tell workers that they should exit.
+     * Protects #queueWaitNanos.
      */
-    bool exit;
+    std::mutex statsMutex;
 
     /**
-     * The queue of work that worker threads pull from.
+     * Time RPCs spent in queues before a worker picked them up, in
+     * nanoseconds. Protected by #statsMutex.
      */
-    std::queue<ServerRPC> rpcQueue;
+    Core::RollingStat queueWaitNanos;
 
     // ThreadDispatchService is non-copyable.
     ThreadDispatchService(const ThreadDispatchService&) = delete;
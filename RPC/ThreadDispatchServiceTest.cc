@@ -14,6 +14,8 @@
  */
 
 #include <gtest/gtest.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "Core/CompatAtomic.h"
@@ -26,26 +28,50 @@ namespace {
 class EchoService : public RPC::Service {
     EchoService()
         : sleepMicros(0)
+        , blockFirst(false)
+        , unblock(false)
         , count(0)
+        , niceValue(0)
     {
     }
     void handleRPC(RPC::ServerRPC serverRPC) {
+        if (blockFirst.exchange(false)) {
+            while (!unblock)
+                usleep(100);
+        }
         usleep(sleepMicros);
+        niceValue = getpriority(PRIO_PROCESS, id_t(syscall(SYS_gettid)));
         ++count;
     }
     std::string getName() const {
         return "EchoService";
     }
     std::atomic<uint32_t> sleepMicros;
+    /// If true, the next RPC blocks until 'unblock' is set.
+    std::atomic<bool> blockFirst;
+    std::atomic<bool> unblock;
     std::atomic<uint32_t> count;
+    std::atomic<int> niceValue;
 };
 
 
 class RPCThreadDispatchServiceTest : public ::testing::Test {
+    typedef ThreadDispatchService::Worker::State State;
     RPCThreadDispatchServiceTest()
         : echoService(std::make_shared<EchoService>())
     {
     }
+    uint32_t countWorkers(ThreadDispatchService& dispatchService,
+                          State state) {
+        uint32_t n = 0;
+        for (auto it = dispatchService.workers.begin();
+             it != dispatchService.workers.end();
+             ++it) {
+            if ((*it)->state == state)
+                ++n;
+        }
+        return n;
+    }
     std::shared_ptr<EchoService> echoService;
 };
 
@@ -54,17 +80,14 @@ TEST_F(RPCThreadDispatchServiceTest, constructor)
     ThreadDispatchService dispatchService(echoService,
                                           5, 6);
     // Give the threads a chance to start up
-    for (uint32_t i = 0; i < 10; ++i) {
-        {
-            std::lock_guard<std::mutex> lockGuard(dispatchService.mutex);
-            if (dispatchService.numFreeWorkers == 5)
-                break;
-        }
+    for (uint32_t i = 0; i < 100; ++i) {
+        if (countWorkers(dispatchService, State::PARKED) == 5)
+            break;
         usleep(1000);
     }
-    std::lock_guard<std::mutex> lockGuard(dispatchService.mutex);
-    EXPECT_EQ(5U, dispatchService.threads.size());
-    EXPECT_EQ(5U, dispatchService.numFreeWorkers);
+    EXPECT_EQ(5U, dispatchService.numThreads);
+    EXPECT_EQ(5U, countWorkers(dispatchService, State::PARKED));
+    EXPECT_EQ(1U, countWorkers(dispatchService, State::STOPPED));
 }
 
 TEST_F(RPCThreadDispatchServiceTest, destructor)
@@ -88,7 +111,125 @@ TEST_F(RPCThreadDispatchServiceTest, handleRPC)
     while (echoService->count < 10)
         usleep(1000);
     EXPECT_EQ(10U, echoService->count);
-    EXPECT_EQ(2U, dispatchService.threads.size());
+    EXPECT_EQ(2U, dispatchService.numThreads);
+}
+
+TEST_F(RPCThreadDispatchServiceTest, handleRPC_idleWorker)
+{
+    ThreadDispatchService dispatchService(echoService,
+                                          3, 3);
+    for (uint32_t i = 0; i < 100; ++i) {
+        if (countWorkers(dispatchService, State::PARKED) == 3)
+            break;
+        usleep(1000);
+    }
+    ASSERT_EQ(3U, countWorkers(dispatchService, State::PARKED));
+    // only one worker should be woken up
+    echoService->sleepMicros = 50000;
+    dispatchService.handleRPC(ServerRPC());
+    EXPECT_EQ(1U, countWorkers(dispatchService, State::RUNNING));
+    EXPECT_EQ(2U, countWorkers(dispatchService, State::PARKED));
+    while (echoService->count < 1)
+        usleep(1000);
+    EXPECT_EQ(0U, dispatchService.numSteals);
+}
+
+TEST_F(RPCThreadDispatchServiceTest, handleRPC_nudgeParkedWorker)
+{
+    ThreadDispatchService dispatchService(echoService,
+                                          2, 2);
+    for (uint32_t i = 0; i < 100; ++i) {
+        if (countWorkers(dispatchService, State::PARKED) == 2)
+            break;
+        usleep(1000);
+    }
+    ASSERT_EQ(2U, countWorkers(dispatchService, State::PARKED));
+    echoService->blockFirst = true;
+    dispatchService.handleRPC(ServerRPC());
+    for (uint32_t i = 0; i < 100; ++i) {
+        if (!echoService->blockFirst)
+            break;
+        usleep(1000);
+    }
+    ASSERT_FALSE(echoService->blockFirst);
+    uint32_t busy = 0;
+    if (dispatchService.workers.at(busy)->state != State::RUNNING)
+        busy = 1;
+    ASSERT_EQ(State::RUNNING, dispatchService.workers.at(busy)->state);
+    ASSERT_EQ(State::PARKED, dispatchService.workers.at(1 - busy)->state);
+
+    // Pretend the other worker parked just after handleRPC() checked it, so
+    // the RPC lands behind the blocked handler.
+    ThreadDispatchService::QueuedRPC rpc(
+        ThreadDispatchService::Clock::now(), ServerRPC());
+    EXPECT_TRUE(dispatchService.queueBehindBusyWorker(rpc, busy));
+    for (uint32_t i = 0; i < 1000; ++i) {
+        if (echoService->count == 1)
+            break;
+        usleep(1000);
+    }
+    // it ran while the first handler was still blocked
+    EXPECT_EQ(1U, echoService->count);
+    EXPECT_EQ(1U, dispatchService.numSteals);
+    EXPECT_EQ(0U, dispatchService.workers.at(busy)->queue.size());
+    echoService->unblock = true;
+    while (echoService->count < 2)
+        usleep(1000);
+}
+
+TEST_F(RPCThreadDispatchServiceTest, updateServerStats)
+{
+    ThreadDispatchService dispatchService(echoService, 0, 1, 2);
+    echoService->sleepMicros = 20000;
+    for (uint32_t i = 0; i < 3; ++i)
+        dispatchService.handleRPC(ServerRPC());
+    LogCabin::Protocol::ServerStats::RPC::Service stats;
+    // workers report queue waits once they run out of work
+    for (uint32_t i = 0; i < 1000; ++i) {
+        stats.Clear();
+        dispatchService.updateServerStats(stats);
+        if (stats.queue_wait_nanos().count() == 3)
+            break;
+        usleep(1000);
+    }
+    EXPECT_EQ("EchoService", stats.name());
+    EXPECT_EQ(2, stats.niceness());
+    EXPECT_EQ(1U, stats.num_threads());
+    EXPECT_EQ(0U, stats.queue_length());
+    EXPECT_EQ(0U, stats.num_steals());
+    EXPECT_EQ(3U, stats.queue_wait_nanos().count());
+    // the last RPC waited behind two 20ms RPCs
+    EXPECT_LE(30000000U, stats.queue_wait_nanos().max());
+    EXPECT_LE(1U, stats.queue_wait_nanos().exceptional_count());
+}
+
+TEST_F(RPCThreadDispatchServiceTest, steal)
+{
+    ThreadDispatchService dispatchService(echoService,
+                                          0, 3);
+    ThreadDispatchService::Worker& self = *dispatchService.workers.at(0);
+    ThreadDispatchService::Worker& other = *dispatchService.workers.at(2);
+    ThreadDispatchService::QueuedRPC rpc;
+    EXPECT_FALSE(dispatchService.steal(self, rpc));
+
+    // pretend 'other' is busy with two RPCs queued
+    ThreadDispatchService::TimePoint first =
+        ThreadDispatchService::Clock::now();
+    other.state = State::RUNNING;
+    other.queue.emplace_back(first, ServerRPC());
+    other.queue.emplace_back(first + std::chrono::seconds(1), ServerRPC());
+    EXPECT_TRUE(dispatchService.steal(self, rpc));
+    EXPECT_EQ(first, rpc.first); // oldest first
+    EXPECT_EQ(1U, other.queue.size());
+    EXPECT_EQ(1U, dispatchService.numSteals);
+
+    // can't steal from a worker whose lock is held
+    {
+        std::lock_guard<std::mutex> lockGuard(other.mutex);
+        EXPECT_FALSE(dispatchService.steal(self, rpc));
+    }
+    other.queue.clear();
+    other.state = State::STOPPED;
 }
 
 TEST_F(RPCThreadDispatchServiceTest, workerMain)
@@ -96,6 +237,49 @@ TEST_F(RPCThreadDispatchServiceTest, workerMain)
     // most of this is tested already in the other tests
 }
 
+TEST_F(RPCThreadDispatchServiceTest, workerMain_niceness)
+{
+    int base = getpriority(PRIO_PROCESS, id_t(syscall(SYS_gettid)));
+    if (base + 3 > 19)
+        return; // can't go any lower
+    ThreadDispatchService dispatchService(echoService, 0, 1, 3);
+    dispatchService.handleRPC(ServerRPC());
+    while (echoService->count < 1)
+        usleep(1000);
+    EXPECT_EQ(base + 3, echoService->niceValue);
+}
+
+TEST_F(RPCThreadDispatchServiceTest, workerMain_idleTimeout)
+{
+    ThreadDispatchService dispatchService(echoService,
+                                          1, 3);
+    dispatchService.idleTimeout = std::chrono::milliseconds(10);
+    echoService->sleepMicros = 20000;
+    for (uint32_t i = 0; i < 6; ++i)
+        dispatchService.handleRPC(ServerRPC());
+    EXPECT_EQ(3U, dispatchService.numThreads);
+    echoService->sleepMicros = 0;
+    // should shrink back down to minThreads
+    for (uint32_t i = 0; i < 1000; ++i) {
+        if (dispatchService.numThreads == 1)
+            break;
+        usleep(1000);
+    }
+    EXPECT_EQ(6U, echoService->count);
+    EXPECT_EQ(1U, dispatchService.numThreads);
+    EXPECT_EQ(2U, dispatchService.numThreadsExited);
+    EXPECT_EQ(2U, countWorkers(dispatchService, State::STOPPED));
+
+    // stopped slots can be reused
+    dispatchService.idleTimeout = std::chrono::seconds(60);
+    echoService->sleepMicros = 20000;
+    for (uint32_t i = 0; i < 3; ++i)
+        dispatchService.handleRPC(ServerRPC());
+    EXPECT_EQ(3U, dispatchService.numThreads);
+    while (echoService->count < 9)
+        usleep(1000);
+}
+
 } // namespace LogCabin::RPC::<anonymous>
 } // namespace LogCabin::RPC
 } // namespace LogCabin
@@ -15,11 +15,15 @@
  */
 
 #include <string.h>
+#include <algorithm>
+#include <thread>
 
 #include "build/Protocol/Client.pb.h"
 #include "Core/Buffer.h"
 #include "Core/ProtoBuf.h"
+#include "Core/StringUtil.h"
 #include "Core/Time.h"
+#include "Core/Util.h"
 #include "RPC/ServerRPC.h"
 #include "Server/RaftConsensus.h"
 #include "Server/ClientService.h"
@@ -30,9 +34,94 @@ namespace LogCabin {
 namespace Server {
 
 typedef RaftConsensus::ClientResult Result;
+namespace PC = Protocol::Client;
+typedef Core::Time::SteadyClock Clock;
+typedef Clock::time_point TimePoint;
+
+namespace {
+
+/**
+ * Append the paths that the given tree command may modify to 'paths'.
+ * Directories are given with a trailing slash, since removing one removes
+ * everything below it.
+ */
+void
+addModifiedPaths(const PC::ReadWriteTree::Request& request,
+                 std::vector<std::string>& paths)
+{
+    if (request.has_write()) {
+        paths.push_back(request.write().path());
+    } else if (request.has_append()) {
+        paths.push_back(request.append().path());
+    } else if (request.has_increment()) {
+        paths.push_back(request.increment().path());
+    } else if (request.has_compare_and_swap()) {
+        paths.push_back(request.compare_and_swap().path());
+    } else if (request.has_remove_file()) {
+        paths.push_back(request.remove_file().path());
+    } else if (request.has_remove_directory()) {
+        std::string path = request.remove_directory().path();
+        if (!Core::StringUtil::endsWith(path, "/"))
+            path += "/";
+        paths.push_back(path);
+    }
+}
+
+/**
+ * Return how long a client may trust a read lease that the leader honors
+ * for 'leaseDuration', leaving a margin (the config option
+ * readLeaseClockDriftMilliseconds) for the client's clock running slow
+ * relative to the leader's.
+ */
+std::chrono::nanoseconds
+clientLeaseDuration(std::chrono::nanoseconds leaseDuration,
+                    const Core::Config& config)
+{
+    using std::chrono::milliseconds;
+    milliseconds drift(config.read<uint64_t>(
+        "readLeaseClockDriftMilliseconds",
+        uint64_t(std::chrono::duration_cast<milliseconds>(
+            leaseDuration).count()) / 10));
+    if (drift >= leaseDuration)
+        return std::chrono::nanoseconds::zero();
+    return leaseDuration - drift;
+}
+
+} // anonymous namespace
 
 ClientService::ClientService(Globals& globals)
     : globals(globals)
+    , maxCommandsInFlight(
+        globals.config.read<uint64_t>("clientMaxCommandsInFlight", 1024))
+    , maxCommandBytesInFlight(
+        globals.config.read<uint64_t>("clientMaxCommandBytesInFlight",
+                                      64 * 1024 * 1024))
+    , overloadRetryMilliseconds(
+        globals.config.read<uint64_t>("clientOverloadRetryMilliseconds", 10))
+    , deferredCommandTimeout(
+        globals.config.read<uint64_t>(
+            "clientDeferredCommandTimeoutMilliseconds", 1000))
+    , readLeaseDuration(std::chrono::milliseconds(
+        globals.config.read<uint64_t>("readLeaseMilliseconds", 0)))
+    , readLeaseClientDuration(clientLeaseDuration(readLeaseDuration,
+                                                  globals.config))
+    , sessionRenewalWindow(std::chrono::milliseconds(
+        globals.config.read<uint64_t>("sessionRenewalBatchMilliseconds",
+                                      1000)))
+    , mutex()
+    , commandsInFlight(0)
+    , commandBytesInFlight(0)
+    , numCommandsOverloaded(0)
+    , numCommandsDeferred(0)
+    , readLeases()
+    , nextLeaseSweep(TimePoint::min())
+    , writesInFlight()
+    , numReadLeasesGranted(0)
+    , numCommandsDelayedByLeases(0)
+    , pendingRenewals()
+    , renewalBatchOpen(false)
+    , numSessionRenewals(0)
+    , numSessionRenewalBatches(0)
 {
 }
 
@@ -73,12 +162,238 @@ ClientService::handleRPC(RPC::ServerRPC rpc)
     }
 }
 
+bool
+ClientService::admitRPC(RPC::ServerRPC& rpc)
+{
+    if (rpc.getOpCode() != Protocol::Client::OpCode::STATE_MACHINE_COMMAND)
+        return true;
+    uint64_t bytes = rpc.getRequestLength();
+    {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        // Always admit a command if nothing else is in progress, so that
+        // commands larger than the byte limit can still get through. Older
+        // clients don't understand OVERLOADED errors, so they're never
+        // rejected (but they still count against the limits).
+        bool overloaded =
+            commandsInFlight > 0 &&
+            ((maxCommandsInFlight > 0 &&
+              commandsInFlight >= maxCommandsInFlight) ||
+             (maxCommandBytesInFlight > 0 &&
+              commandBytesInFlight + bytes > maxCommandBytesInFlight));
+        if (!overloaded || rpc.getServiceSpecificErrorVersion() < 2) {
+            ++commandsInFlight;
+            commandBytesInFlight += bytes;
+            return true;
+        }
+        ++numCommandsOverloaded;
+    }
+    Protocol::Client::Error error;
+    error.set_error_code(Protocol::Client::Error::OVERLOADED);
+    error.set_retry_after_milliseconds(overloadRetryMilliseconds);
+    rpc.returnError(error);
+    return false;
+}
+
 std::string
 ClientService::getName() const
 {
     return "ClientService";
 }
 
+void
+ClientService::updateServerStats(Protocol::ServerStats& serverStats) const
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    Protocol::ServerStats::ClientService& stats =
+        *serverStats.mutable_client_service();
+    stats.set_commands_in_flight(commandsInFlight);
+    stats.set_command_bytes_in_flight(commandBytesInFlight);
+    stats.set_num_commands_overloaded(numCommandsOverloaded);
+    stats.set_num_commands_deferred(numCommandsDeferred);
+    stats.set_num_read_leases_granted(numReadLeasesGranted);
+    stats.set_num_commands_delayed_by_leases(numCommandsDelayedByLeases);
+    stats.set_num_session_renewals(numSessionRenewals);
+    stats.set_num_session_renewal_batches(numSessionRenewalBatches);
+}
+
+void
+ClientService::finishCommand(uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    assert(commandsInFlight > 0);
+    assert(commandBytesInFlight >= bytes);
+    --commandsInFlight;
+    commandBytesInFlight -= bytes;
+}
+
+bool
+ClientService::grantReadLease(const std::string& path)
+{
+    if (readLeaseClientDuration.count() == 0)
+        return false;
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    if (writesInFlight.count(path) > 0)
+        return false;
+    for (size_t i = path.find('/');
+         i != std::string::npos;
+         i = path.find('/', i + 1)) {
+        if (writesInFlight.count(path.substr(0, i + 1)) > 0)
+            return false;
+    }
+    TimePoint now = Clock::now();
+    // Drop expired leases about once per lease duration.
+    if (now >= nextLeaseSweep) {
+        for (auto it = readLeases.begin(); it != readLeases.end(); ) {
+            if (it->second < now)
+                it = readLeases.erase(it);
+            else
+                ++it;
+        }
+        nextLeaseSweep = now + readLeaseDuration;
+    }
+    readLeases[path] = now + readLeaseDuration;
+    ++numReadLeasesGranted;
+    return true;
+}
+
+std::vector<std::string>
+ClientService::beginWrite(const PC::StateMachineCommand::Request& command)
+{
+    std::vector<std::string> paths;
+    if (readLeaseDuration.count() == 0)
+        return paths;
+    if (command.has_tree())
+        addModifiedPaths(command.tree(), paths);
+    for (auto it = command.tree_batch().begin();
+         it != command.tree_batch().end();
+         ++it) {
+        addModifiedPaths(*it, paths);
+    }
+    if (paths.empty())
+        return paths;
+
+    // Leases granted by a previous leader have expired once this server has
+    // been leader for readLeaseDuration.
+    TimePoint waitUntil = TimePoint::min();
+    TimePoint leaderSince = globals.raft->getLeaderSince();
+    if (leaderSince != TimePoint::max())
+        waitUntil = leaderSince + readLeaseDuration;
+
+    {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        TimePoint now = Clock::now();
+        for (auto it = paths.begin(); it != paths.end(); ++it) {
+            writesInFlight.insert(*it);
+            auto leaseIt = readLeases.lower_bound(*it);
+            while (leaseIt != readLeases.end() &&
+                   (leaseIt->first == *it ||
+                    (Core::StringUtil::endsWith(*it, "/") &&
+                     Core::StringUtil::startsWith(leaseIt->first, *it)))) {
+                if (leaseIt->second < now) {
+                    leaseIt = readLeases.erase(leaseIt);
+                } else {
+                    waitUntil = std::max(waitUntil, leaseIt->second);
+                    ++leaseIt;
+                }
+            }
+        }
+        if (waitUntil > now)
+            ++numCommandsDelayedByLeases;
+    }
+    // No new leases can be granted on these paths, so this doesn't need to
+    // check again after sleeping.
+    if (waitUntil != TimePoint::min())
+        Core::Time::sleep(waitUntil);
+    return paths;
+}
+
+void
+ClientService::finishWrite(const std::vector<std::string>& paths)
+{
+    if (paths.empty())
+        return;
+    std::lock_guard<std::mutex> lockGuard(mutex);
+    for (auto it = paths.begin(); it != paths.end(); ++it)
+        writesInFlight.erase(writesInFlight.find(*it));
+}
+
+void
+ClientService::renewSessions(RPC::ServerRPC rpc,
+                             const PC::RenewSessions::Request& request)
+{
+    {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        ++numSessionRenewals;
+        pendingRenewals.emplace_back(std::move(rpc), request);
+        if (renewalBatchOpen)
+            return; // another thread will reply
+        renewalBatchOpen = true;
+    }
+
+    std::this_thread::sleep_for(sessionRenewalWindow);
+    std::vector<std::pair<RPC::ServerRPC, PC::RenewSessions::Request>> batch;
+    {
+        std::lock_guard<std::mutex> lockGuard(mutex);
+        batch.swap(pendingRenewals);
+        renewalBatchOpen = false;
+        ++numSessionRenewalBatches;
+    }
+
+    // Map from client ID to the highest first outstanding RPC reported for
+    // it in this batch (0 if none was).
+    std::map<uint64_t, uint64_t> clientIds;
+    for (auto it = batch.begin(); it != batch.end(); ++it) {
+        const PC::RenewSessions::Request& request = it->second;
+        for (int i = 0; i < request.client_id_size(); ++i) {
+            uint64_t& first = clientIds[request.client_id(i)];
+            if (i < request.first_outstanding_rpc_size())
+                first = std::max(first, request.first_outstanding_rpc(i));
+        }
+    }
+    PC::StateMachineCommand::Request command;
+    PC::RenewSessions::Request& renew = *command.mutable_renew_sessions();
+    for (auto it = clientIds.begin(); it != clientIds.end(); ++it) {
+        renew.add_client_id(it->first);
+        renew.add_first_outstanding_rpc(it->second);
+    }
+    Core::Buffer cmdBuffer;
+    Core::ProtoBuf::serialize(command, cmdBuffer);
+    std::pair<Result, uint64_t> result = globals.raft->replicate(cmdBuffer);
+    if (result.first == Result::RETRY || result.first == Result::NOT_LEADER) {
+        PC::Error error;
+        error.set_error_code(PC::Error::NOT_LEADER);
+        std::string leaderHint = globals.raft->getLeaderHint();
+        if (!leaderHint.empty())
+            error.set_leader_hint(leaderHint);
+        for (auto it = batch.begin(); it != batch.end(); ++it)
+            it->first.returnError(error);
+        return;
+    }
+    assert(result.first == Result::SUCCESS);
+    PC::StateMachineCommand::Response response;
+    if (!globals.stateMachine->waitForResponse(result.second,
+                                               command, response)) {
+        for (auto it = batch.begin(); it != batch.end(); ++it)
+            it->first.rejectInvalidRequest();
+        return;
+    }
+    std::set<uint64_t> expired(
+        response.renew_sessions().expired_client_id().begin(),
+        response.renew_sessions().expired_client_id().end());
+    for (auto it = batch.begin(); it != batch.end(); ++it) {
+        PC::StateMachineCommand::Response reply;
+        PC::RenewSessions::Response& renewReply =
+            *reply.mutable_renew_sessions();
+        for (auto it2 = it->second.client_id().begin();
+             it2 != it->second.client_id().end();
+             ++it2) {
+            if (expired.count(*it2) > 0)
+                renewReply.add_expired_client_id(*it2);
+        }
+        it->first.reply(reply);
+    }
+}
+
 
 /**
  * Place this at the top of each RPC handler. Afterwards, 'request' will refer
@@ -101,6 +416,12 @@ ClientService::getServerInfo(RPC::ServerRPC rpc)
     Protocol::Client::Server& info = *response.mutable_server_info();
     info.set_server_id(globals.raft->serverId);
     info.set_addresses(globals.raft->serverAddresses);
+    // Clients probe every server with this RPC to find the leader quickly.
+    response.set_is_leader(
+        globals.raft->getLeaderSince() != RaftConsensus::TimePoint::max());
+    std::string leaderHint = globals.raft->getLeaderHint();
+    if (!leaderHint.empty())
+        response.set_leader_hint(leaderHint);
     rpc.reply(response);
 }
 
@@ -151,7 +472,16 @@ ClientService::setConfiguration(RPC::ServerRPC rpc)
 void
 ClientService::stateMachineCommand(RPC::ServerRPC rpc)
 {
+    // This command was counted in admitRPC().
+    uint64_t bytes = rpc.getRequestLength();
+    Core::Util::Finally _([this, bytes] () { finishCommand(bytes); });
     PRELUDE(StateMachineCommand);
+    if (request.has_renew_sessions()) {
+        renewSessions(std::move(rpc), request.renew_sessions());
+        return;
+    }
+    std::vector<std::string> paths = beginWrite(request);
+    Core::Util::Finally _2([this, &paths] () { finishWrite(paths); });
     Core::Buffer cmdBuffer;
     rpc.getRequest(cmdBuffer);
     std::pair<Result, uint64_t> result = globals.raft->replicate(cmdBuffer);
@@ -166,10 +496,48 @@ ClientService::stateMachineCommand(RPC::ServerRPC rpc)
     }
     assert(result.first == Result::SUCCESS);
     uint64_t logIndex = result.second;
-    if (!globals.stateMachine->waitForResponse(logIndex, request, response)) {
+    bool deferred;
+    if (!globals.stateMachine->waitForResponse(logIndex, request,
+                                               response, deferred)) {
         rpc.rejectInvalidRequest();
         return;
     }
+    if (deferred) {
+        // The client's session has too many cached responses, so the state
+        // machine is holding on to the command. It will apply it once a
+        // later command from the client releases some of those responses.
+        {
+            std::lock_guard<std::mutex> lockGuard(mutex);
+            ++numCommandsDeferred;
+        }
+        while (!globals.stateMachine->waitForDeferredResponse(
+                    request, response,
+                    Core::Time::SteadyClock::now() + deferredCommandTimeout)) {
+            if (rpc.getServiceSpecificErrorVersion() >= 2) {
+                // The client will send the command again, with its
+                // exactly-once RPC info updated to release the responses it
+                // has since received.
+                Protocol::Client::Error error;
+                error.set_error_code(Protocol::Client::Error::OVERLOADED);
+                error.set_retry_after_milliseconds(overloadRetryMilliseconds);
+                rpc.returnError(error);
+                return;
+            }
+            // Older clients don't understand OVERLOADED errors, so keep
+            // waiting for as long as this server leads. Once it doesn't, the
+            // client needs to find the new leader and send the command there.
+            result = globals.raft->getLastCommitIndex();
+            if (result.first != Result::SUCCESS) {
+                Protocol::Client::Error error;
+                error.set_error_code(Protocol::Client::Error::NOT_LEADER);
+                std::string leaderHint = globals.raft->getLeaderHint();
+                if (!leaderHint.empty())
+                    error.set_leader_hint(leaderHint);
+                rpc.returnError(error);
+                return;
+            }
+        }
+    }
     rpc.reply(response);
 }
 
@@ -177,6 +545,15 @@ void
 ClientService::stateMachineQuery(RPC::ServerRPC rpc)
 {
     PRELUDE(StateMachineQuery);
+    // The lease must be registered before the read executes, so that
+    // commands that could invalidate it are either seen by the read or wait.
+    // Ranged reads return only part of the file, so they aren't leased.
+    bool lease = false;
+    if (request.tree().read().lease() &&
+        !request.tree().read().has_offset() &&
+        !request.tree().read().has_length()) {
+        lease = grantReadLease(request.tree().read().path());
+    }
     std::pair<Result, uint64_t> result = globals.raft->getLastCommitIndex();
     if (result.first == Result::RETRY || result.first == Result::NOT_LEADER) {
         Protocol::Client::Error error;
@@ -192,6 +569,14 @@ ClientService::stateMachineQuery(RPC::ServerRPC rpc)
     globals.stateMachine->wait(logIndex);
     if (!globals.stateMachine->query(request, response))
         rpc.rejectInvalidRequest();
+    // Ephemeral and expiring files may disappear without a command that
+    // waits for leases, so their reads aren't leased.
+    if (lease && response.tree().has_read() &&
+        !response.tree().read().ephemeral() &&
+        !response.tree().read().expires()) {
+        response.mutable_tree()->mutable_read()->set_lease_nanos(
+            uint64_t(readLeaseClientDuration.count()));
+    }
     rpc.reply(response);
 }
 
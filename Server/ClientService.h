@@ -13,13 +13,22 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "RPC/ServerRPC.h"
 #include "RPC/Service.h"
 
 
 #include "build/Protocol/Client.pb.h"
+#include "build/Protocol/ServerStats.pb.h"
 #include "build/Protocol/Raft.pb.h"
 #include "Core/Debug.h"
 #include "Core/ProtoBuf.h"
+#include "Core/Time.h"
 #include "RPC/ClientRPC.h"
 #include "Protocol/Common.h"
 #include "RPC/ClientSession.h"
@@ -37,6 +46,23 @@ class Replication;
 /**
  * This is LogCabin's application-facing RPC service. As some of these RPCs may
  * be long-running, this is intended to run under a RPC::ThreadDispatchService.
+ *
+ * To keep memory use and commit latency bounded during write bursts, this
+ * limits how many state machine commands (and how many bytes of them) may be
+ * queued or in progress at once. Commands beyond those limits are turned away
+ * as they arrive with an OVERLOADED error, telling the client when to retry.
+ * Commands that the state machine defers because their client's session has
+ * too many cached responses get the same error if they're still deferred
+ * after clientDeferredCommandTimeoutMilliseconds, so that the client resends
+ * them with up-to-date exactly-once information.
+ *
+ * If readLeaseMilliseconds is set, the leader also grants read leases on files
+ * to clients that ask for them, so that the clients may cache what they read.
+ * A command that modifies a leased file waits until the lease expires before
+ * it is replicated, and no new leases are granted on files that commands in
+ * progress may modify. A new leader waits out the lease duration before
+ * replicating any modifications, since it doesn't know which leases its
+ * predecessors granted.
  */
 class ClientService : public RPC::Service {
   public:
@@ -47,9 +73,59 @@ class ClientService : public RPC::Service {
     ~ClientService();
 
     void handleRPC(RPC::ServerRPC rpc);
+    bool admitRPC(RPC::ServerRPC& rpc);
     std::string getName() const;
 
+    /**
+     * Add information about admission control to the given structure.
+     */
+    void updateServerStats(Protocol::ServerStats& serverStats) const;
+
   private:
+    /**
+     * Called when a command that admitRPC() let through has completed.
+     * \param bytes
+     *      The command's request length.
+     */
+    void finishCommand(uint64_t bytes);
+
+    /**
+     * Called before a read of the given file executes, if the client asked
+     * for a read lease.
+     * \return
+     *      True if the lease was granted, in which case commands that modify
+     *      the file will wait until readLeaseDuration from now (the client is
+     *      told to trust it for only readLeaseClientDuration). False if
+     *      leases are disabled or a command in progress may modify the file.
+     */
+    bool grantReadLease(const std::string& path);
+
+    /**
+     * Called before a command is replicated. Registers the files and
+     * directories the command may modify, so that no new read leases are
+     * granted on them, then waits for existing leases on them to expire.
+     * \return
+     *      The paths registered, to be passed to finishWrite().
+     */
+    std::vector<std::string> beginWrite(
+            const Protocol::Client::StateMachineCommand::Request& command);
+
+    /**
+     * Called when a command that beginWrite() registered has completed.
+     */
+    void finishWrite(const std::vector<std::string>& paths);
+
+    /**
+     * Handle a StateMachineCommand RPC carrying a RenewSessions command.
+     * Renewals that arrive within sessionRenewalWindow of each other are
+     * merged into a single command: the first one to arrive waits out the
+     * window, replicates the merged command, and replies to every RPC in it.
+     * The others return right away, leaving their RPCs to be answered by
+     * that thread.
+     */
+    void renewSessions(RPC::ServerRPC rpc,
+                       const Protocol::Client::RenewSessions::Request& request);
+
     ////////// RPC handlers //////////
 
     void getServerInfo(RPC::ServerRPC rpc);
@@ -64,6 +140,130 @@ class ClientService : public RPC::Service {
      */
     Globals& globals;
 
+    /**
+     * Commands are rejected once this many are queued or in progress, or 0
+     * for no limit. Set from the config option clientMaxCommandsInFlight.
+     */
+    const uint64_t maxCommandsInFlight;
+
+    /**
+     * Commands are rejected if admitting them would put more than this many
+     * request bytes in progress, or 0 for no limit. Set from the config option
+     * clientMaxCommandBytesInFlight.
+     */
+    const uint64_t maxCommandBytesInFlight;
+
+    /**
+     * How long clients are told to wait before retrying a rejected command.
+     * Set from the config option clientOverloadRetryMilliseconds.
+     */
+    const uint64_t overloadRetryMilliseconds;
+
+    /**
+     * How long to wait for the state machine to apply a deferred command
+     * before returning an OVERLOADED error, or, for clients that don't
+     * understand those, before checking that this server is still leader.
+     * Set from the config option clientDeferredCommandTimeoutMilliseconds.
+     */
+    const std::chrono::milliseconds deferredCommandTimeout;
+
+    /**
+     * How long read leases last, or 0 if they are never granted. Set from the
+     * config option readLeaseMilliseconds.
+     */
+    const std::chrono::nanoseconds readLeaseDuration;
+
+    /**
+     * How long clients are told they may trust their read leases:
+     * readLeaseDuration less the config option
+     * readLeaseClockDriftMilliseconds. Leases aren't granted if this is 0.
+     */
+    const std::chrono::nanoseconds readLeaseClientDuration;
+
+    /**
+     * How long to collect session renewals from clients before replicating
+     * them all in one log entry. Set from the config option
+     * sessionRenewalBatchMilliseconds.
+     */
+    const std::chrono::milliseconds sessionRenewalWindow;
+
+    /**
+     * Protects the members below.
+     */
+    mutable std::mutex mutex;
+
+    /**
+     * The number of commands that have been admitted but not yet completed.
+     */
+    uint64_t commandsInFlight;
+
+    /**
+     * The total request length of #commandsInFlight.
+     */
+    uint64_t commandBytesInFlight;
+
+    /**
+     * The number of commands rejected with OVERLOADED errors.
+     */
+    uint64_t numCommandsOverloaded;
+
+    /**
+     * The number of commands the state machine deferred because their
+     * client's session had too many cached responses.
+     */
+    uint64_t numCommandsDeferred;
+
+    /**
+     * When the read leases granted by this server expire, keyed by file path.
+     * Expired leases are removed lazily.
+     */
+    std::map<std::string, Core::Time::SteadyClock::time_point> readLeases;
+
+    /**
+     * When grantReadLease() should next remove expired leases.
+     */
+    Core::Time::SteadyClock::time_point nextLeaseSweep;
+
+    /**
+     * The paths that commands in progress may modify. Directory paths end in
+     * a slash and cover everything below them.
+     */
+    std::multiset<std::string> writesInFlight;
+
+    /**
+     * The number of read leases granted.
+     */
+    uint64_t numReadLeasesGranted;
+
+    /**
+     * The number of commands that had to wait for read leases to expire.
+     */
+    uint64_t numCommandsDelayedByLeases;
+
+    /**
+     * Session renewal RPCs waiting to be replicated, along with the sessions
+     * each one asked to renew.
+     */
+    std::vector<std::pair<RPC::ServerRPC,
+                          Protocol::Client::RenewSessions::Request>>
+        pendingRenewals;
+
+    /**
+     * True while some thread is collecting #pendingRenewals and will
+     * replicate them, false if the next renewal to arrive must do so.
+     */
+    bool renewalBatchOpen;
+
+    /**
+     * The number of session renewal RPCs received.
+     */
+    uint64_t numSessionRenewals;
+
+    /**
+     * The number of merged RenewSessions commands replicated.
+     */
+    uint64_t numSessionRenewalBatches;
+
     // ClientService is non-copyable.
     ClientService(const ClientService&) = delete;
     ClientService& operator=(const ClientService&) = delete;
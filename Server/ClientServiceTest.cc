@@ -15,6 +15,7 @@
  */
 
 #include <gtest/gtest.h>
+#include <unistd.h>
 #include <thread>
 
 #include "build/Protocol/Client.pb.h"
@@ -24,7 +25,13 @@
 #include "Protocol/Common.h"
 #include "RPC/ClientRPC.h"
 #include "RPC/ClientSession.h"
+#include "RPC/OpaqueServerRPC.h"
+#include "RPC/Protocol.h"
+#include "RPC/ServerRPC.h"
+#include "Server/ClientService.h"
 #include "Server/Globals.h"
+#include "Server/RaftConsensus.h"
+#include "Server/StateMachine.h"
 #include "Storage/FilesystemUtil.h"
 
 namespace LogCabin {
@@ -54,6 +61,8 @@ class ServerClientServiceTest : public ::testing::Test {
             globals->config.set("listenAddresses", "127.0.0.1");
             globals->config.set("serverId", "1");
             globals->config.set("storagePath", storagePath);
+            globals->config.set("clientDeferredCommandTimeoutMilliseconds",
+                                "50");
             globals->init();
             RPC::Address address("127.0.0.1", Protocol::Common::DEFAULT_PORT);
             address.refresh(RPC::Address::TimePoint::max());
@@ -89,6 +98,31 @@ class ServerClientServiceTest : public ::testing::Test {
             << rpc.getErrorMessage();
     }
 
+    // Build a STATE_MACHINE_COMMAND RPC without a real connection. Replies to
+    // it are stored in 'response'.
+    RPC::ServerRPC
+    makeCommand(uint8_t serviceSpecificErrorVersion,
+                uint64_t payloadBytes,
+                Core::Buffer& response)
+    {
+        typedef RPC::Protocol::RequestHeaderVersion1 Header;
+        uint64_t length = sizeof(Header) + payloadBytes;
+        char* data = new char[length];
+        memset(data, 0, length);
+        Header& header = *reinterpret_cast<Header*>(data);
+        header.prefix.version = 1;
+        header.prefix.toBigEndian();
+        header.service = Protocol::Common::ServiceId::CLIENT_SERVICE;
+        header.serviceSpecificErrorVersion = serviceSpecificErrorVersion;
+        header.opCode = OpCode::STATE_MACHINE_COMMAND;
+        header.toBigEndian();
+        RPC::OpaqueServerRPC opaqueRPC;
+        opaqueRPC.request.setData(data, length,
+                                  Core::Buffer::deleteArrayFn<char>);
+        opaqueRPC.responseTarget = &response;
+        return RPC::ServerRPC(std::move(opaqueRPC));
+    }
+
     // Because of the EXPECT_DEATH call below, we need to take extra care to
     // clean up the storagePath tmpdir: destructors in the child process won't
     // get a chance.
@@ -118,6 +152,19 @@ TEST_F(ServerClientServiceTest, handleRPCBadOpcode) {
 
 ////////// Tests for individual RPCs //////////
 
+TEST_F(ServerClientServiceTest, getServerInfo) {
+    init();
+    Protocol::Client::GetServerInfo::Request request;
+    Protocol::Client::GetServerInfo::Response response;
+    call(OpCode::GET_SERVER_INFO, request, response);
+    EXPECT_EQ("server_info { "
+              "  server_id: 1 "
+              "  addresses: '127.0.0.1' "
+              "} "
+              "is_leader: false ",
+              response);
+}
+
 TEST_F(ServerClientServiceTest, verifyRecipient) {
     init();
     globals->clusterUUID.clear();
@@ -159,6 +206,344 @@ TEST_F(ServerClientServiceTest, verifyRecipient) {
               response);
 }
 
+TEST_F(ServerClientServiceTest, admitRPC) {
+    Globals localGlobals;
+    localGlobals.config.set("clientMaxCommandsInFlight", "3");
+    localGlobals.config.set("clientMaxCommandBytesInFlight", "25");
+    localGlobals.config.set("clientOverloadRetryMilliseconds", "7");
+    ClientService service(localGlobals);
+    Core::Buffer response;
+    typedef RPC::Protocol::ResponseHeaderVersion1 ResponseHeader;
+
+    // other opcodes aren't limited
+    {
+        RPC::ServerRPC rpc = makeCommand(2, 0, response);
+        rpc.opCode = OpCode::STATE_MACHINE_QUERY;
+        EXPECT_TRUE(service.admitRPC(rpc));
+        rpc.closeSession();
+    }
+    EXPECT_EQ(0U, service.commandsInFlight);
+
+    RPC::ServerRPC a = makeCommand(2, 10, response);
+    RPC::ServerRPC b = makeCommand(2, 10, response);
+    RPC::ServerRPC c = makeCommand(2, 10, response);
+    EXPECT_TRUE(service.admitRPC(a));
+    EXPECT_TRUE(service.admitRPC(b));
+    EXPECT_EQ(2U, service.commandsInFlight);
+    EXPECT_EQ(20U, service.commandBytesInFlight);
+
+    // over the byte limit
+    EXPECT_FALSE(service.admitRPC(c));
+    EXPECT_FALSE(c.needsReply());
+    ASSERT_LE(sizeof(ResponseHeader), response.getLength());
+    ResponseHeader header =
+        *static_cast<const ResponseHeader*>(response.getData());
+    header.prefix.fromBigEndian();
+    EXPECT_EQ(RPC::Protocol::Status::SERVICE_SPECIFIC_ERROR,
+              header.prefix.status);
+    Protocol::Client::Error error;
+    EXPECT_TRUE(Core::ProtoBuf::parse(response, error,
+                                      sizeof(ResponseHeader)));
+    EXPECT_EQ("error_code: OVERLOADED "
+              "retry_after_milliseconds: 7 ",
+              error);
+
+    // old clients are admitted anyway
+    RPC::ServerRPC d = makeCommand(1, 10, response);
+    EXPECT_TRUE(service.admitRPC(d));
+    EXPECT_EQ(3U, service.commandsInFlight);
+
+    // over the command limit
+    RPC::ServerRPC e = makeCommand(2, 0, response);
+    EXPECT_FALSE(service.admitRPC(e));
+    EXPECT_EQ(2U, service.numCommandsOverloaded);
+
+    service.finishCommand(10);
+    service.finishCommand(10);
+    service.finishCommand(10);
+    EXPECT_EQ(0U, service.commandsInFlight);
+    EXPECT_EQ(0U, service.commandBytesInFlight);
+
+    // a large command is admitted when nothing else is in progress
+    RPC::ServerRPC f = makeCommand(2, 100, response);
+    EXPECT_TRUE(service.admitRPC(f));
+    EXPECT_EQ(100U, service.commandBytesInFlight);
+    service.finishCommand(100);
+
+    Protocol::ServerStats stats;
+    service.updateServerStats(stats);
+    EXPECT_EQ("commands_in_flight: 0 "
+              "command_bytes_in_flight: 0 "
+              "num_commands_overloaded: 2 "
+              "num_read_leases_granted: 0 "
+              "num_commands_delayed_by_leases: 0 "
+              "num_session_renewals: 0 "
+              "num_session_renewal_batches: 0 "
+              "num_commands_deferred: 0 ",
+              stats.client_service());
+    a.closeSession();
+    b.closeSession();
+    d.closeSession();
+    f.closeSession();
+}
+
+TEST_F(ServerClientServiceTest, readLeases) {
+    typedef Core::Time::SteadyClock Clock;
+    Globals localGlobals;
+    localGlobals.config.set("readLeaseMilliseconds", "10");
+    localGlobals.raft.reset(new RaftConsensus(localGlobals));
+    ClientService service(localGlobals);
+    Protocol::Client::StateMachineCommand::Request command;
+
+    // clients trust leases for a little less than the leader honors them
+    EXPECT_EQ(std::chrono::milliseconds(9), service.readLeaseClientDuration);
+
+    EXPECT_TRUE(service.grantReadLease("/a/b"));
+    EXPECT_TRUE(service.grantReadLease("/c"));
+    EXPECT_EQ(2U, service.readLeases.size());
+
+    // commands without paths don't wait
+    command.mutable_open_session();
+    EXPECT_EQ(std::vector<std::string>{}, service.beginWrite(command));
+
+    // writing an unleased file doesn't wait, but blocks new leases on it
+    command.Clear();
+    command.mutable_tree()->mutable_write()->set_path("/d");
+    std::vector<std::string> paths = service.beginWrite(command);
+    EXPECT_EQ(std::vector<std::string>{"/d"}, paths);
+    EXPECT_EQ(0U, service.numCommandsDelayedByLeases);
+    EXPECT_FALSE(service.grantReadLease("/d"));
+    service.finishWrite(paths);
+    EXPECT_TRUE(service.grantReadLease("/d"));
+
+    // removing a directory waits for leases below it
+    command.Clear();
+    command.mutable_tree()->mutable_remove_directory()->set_path("/a");
+    Clock::time_point start = Clock::now();
+    paths = service.beginWrite(command);
+    EXPECT_LE(start + std::chrono::milliseconds(9), Clock::now());
+    EXPECT_EQ(std::vector<std::string>{"/a/"}, paths);
+    EXPECT_EQ(1U, service.numCommandsDelayedByLeases);
+    EXPECT_FALSE(service.grantReadLease("/a/b/c"));
+    EXPECT_TRUE(service.grantReadLease("/ab"));
+    service.finishWrite(paths);
+    EXPECT_TRUE(service.grantReadLease("/a/b/c"));
+
+    Protocol::ServerStats stats;
+    service.updateServerStats(stats);
+    EXPECT_EQ(5U, stats.client_service().num_read_leases_granted());
+    EXPECT_EQ(1U, stats.client_service().num_commands_delayed_by_leases());
+
+    // a new leader waits out leases its predecessors may have granted
+    command.Clear();
+    command.mutable_tree_batch()->Add()->mutable_write()->set_path("/e");
+    localGlobals.raft->state = RaftConsensus::State::LEADER;
+    localGlobals.raft->leaderSince = Clock::now();
+    start = Clock::now();
+    service.finishWrite(service.beginWrite(command));
+    EXPECT_LE(start + std::chrono::milliseconds(9), Clock::now());
+    EXPECT_EQ(2U, service.numCommandsDelayedByLeases);
+    localGlobals.raft->state = RaftConsensus::State::FOLLOWER;
+}
+
+TEST_F(ServerClientServiceTest, readLeases_disabled) {
+    Globals localGlobals;
+    ClientService service(localGlobals);
+    Protocol::Client::StateMachineCommand::Request command;
+    command.mutable_tree()->mutable_write()->set_path("/a");
+    EXPECT_FALSE(service.grantReadLease("/a"));
+    EXPECT_EQ(std::vector<std::string>{}, service.beginWrite(command));
+}
+
+TEST_F(ServerClientServiceTest, readLeases_clockDrift) {
+    Globals localGlobals;
+    localGlobals.config.set("readLeaseMilliseconds", "1000");
+    localGlobals.config.set("readLeaseClockDriftMilliseconds", "250");
+    {
+        ClientService service(localGlobals);
+        EXPECT_EQ(std::chrono::milliseconds(1000), service.readLeaseDuration);
+        EXPECT_EQ(std::chrono::milliseconds(750),
+                  service.readLeaseClientDuration);
+        EXPECT_TRUE(service.grantReadLease("/a"));
+    }
+    // a margin that eats the whole lease disables leases
+    localGlobals.config.set("readLeaseClockDriftMilliseconds", "1000");
+    {
+        ClientService service(localGlobals);
+        EXPECT_EQ(0, service.readLeaseClientDuration.count());
+        EXPECT_FALSE(service.grantReadLease("/a"));
+    }
+}
+
+TEST_F(ServerClientServiceTest, stateMachineCommand_finishCommand) {
+    init();
+    Protocol::Client::StateMachineCommand::Request request;
+    Protocol::Client::StateMachineCommand::Response response;
+    Protocol::Client::Error error;
+    request.mutable_open_session();
+    RPC::ClientRPC rpc(session,
+                       Protocol::Common::ServiceId::CLIENT_SERVICE,
+                       2, OpCode::STATE_MACHINE_COMMAND, request);
+    // this server isn't leader
+    EXPECT_EQ(Status::SERVICE_SPECIFIC_ERROR,
+              rpc.waitForReply(&response, &error, TimePoint::max()))
+        << rpc.getErrorMessage();
+    EXPECT_EQ(Protocol::Client::Error::NOT_LEADER, error.error_code());
+    // The reply goes out just before the handler releases the command, so
+    // give the handler a moment to return.
+    Protocol::ServerStats stats;
+    for (uint64_t i = 0; i < 1000; ++i) {
+        globals->clientService->updateServerStats(stats);
+        if (stats.client_service().commands_in_flight() == 0)
+            break;
+        usleep(1000);
+    }
+    EXPECT_EQ(0U, stats.client_service().commands_in_flight());
+    EXPECT_EQ(0U, stats.client_service().command_bytes_in_flight());
+}
+
+class ServerClientServiceDeferredTest : public ServerClientServiceTest {
+  public:
+    ServerClientServiceDeferredTest()
+        : clientId(0)
+    {
+    }
+
+    // Open a session and make it look full, so that every command other than
+    // its first outstanding one is deferred.
+    void initDeferred() {
+        init();
+        globals->raft->bootstrapConfiguration();
+        for (uint64_t i = 0; i < 5000; ++i) {
+            if (globals->raft->getLeaderSince() !=
+                RaftConsensus::TimePoint::max()) {
+                break;
+            }
+            usleep(1000);
+        }
+        ASSERT_NE(RaftConsensus::TimePoint::max(),
+                  globals->raft->getLeaderSince());
+        Protocol::Client::StateMachineCommand::Request request;
+        Protocol::Client::StateMachineCommand::Response response;
+        request.mutable_open_session();
+        call(OpCode::STATE_MACHINE_COMMAND, request, response);
+        clientId = response.open_session().client_id();
+        setResponseBytes(StateMachine::MAX_RESPONSE_BYTES_PER_SESSION);
+    }
+
+    void setResponseBytes(uint64_t bytes) {
+        std::lock_guard<Core::Mutex> lockGuard(globals->stateMachine->mutex);
+        globals->stateMachine->sessions.at(clientId).responseBytes = bytes;
+    }
+
+    Protocol::Client::StateMachineCommand::Request
+    makeWrite(uint64_t firstOutstandingRPC, uint64_t rpcNumber,
+              const std::string& path) {
+        Protocol::Client::StateMachineCommand::Request request;
+        Protocol::Client::ReadWriteTree::Request& tree =
+            *request.mutable_tree();
+        tree.mutable_exactly_once()->set_client_id(clientId);
+        tree.mutable_exactly_once()->set_first_outstanding_rpc(
+            firstOutstandingRPC);
+        tree.mutable_exactly_once()->set_rpc_number(rpcNumber);
+        tree.mutable_write()->set_path(path);
+        tree.mutable_write()->set_contents("x");
+        return request;
+    }
+
+    uint64_t getNumCommandsDeferred() {
+        Protocol::ServerStats stats;
+        globals->clientService->updateServerStats(stats);
+        return stats.client_service().num_commands_deferred();
+    }
+
+    uint64_t clientId;
+};
+
+TEST_F(ServerClientServiceDeferredTest, stateMachineCommand_oldClient) {
+    initDeferred();
+    Protocol::Client::StateMachineCommand::Response response;
+    Protocol::Client::Error error;
+    RPC::ClientRPC rpc(session,
+                       Protocol::Common::ServiceId::CLIENT_SERVICE,
+                       1, OpCode::STATE_MACHINE_COMMAND,
+                       makeWrite(1, 2, "/a"));
+    for (uint64_t i = 0; i < 1000; ++i) {
+        if (getNumCommandsDeferred() == 1)
+            break;
+        usleep(1000);
+    }
+    ASSERT_EQ(1U, getNumCommandsDeferred());
+    uint64_t lastIndex = globals->raft->getLastCommitIndex().second;
+
+    // This client predates OVERLOADED errors, so the server keeps waiting
+    // past the timeout, without appending the command again.
+    usleep(150 * 1000);
+    EXPECT_FALSE(rpc.isReady());
+    EXPECT_EQ(lastIndex, globals->raft->getLastCommitIndex().second);
+
+    // Once the client has collected its earlier responses, its next command
+    // lets the state machine apply the deferred one.
+    setResponseBytes(0);
+    call(OpCode::STATE_MACHINE_COMMAND, makeWrite(2, 3, "/b"), response);
+    EXPECT_EQ(Protocol::Client::Status::OK, response.tree().status());
+    EXPECT_EQ(Status::OK,
+              rpc.waitForReply(&response, &error, TimePoint::max()))
+        << rpc.getErrorMessage();
+    EXPECT_EQ(Protocol::Client::Status::OK, response.tree().status());
+    EXPECT_EQ(1U, getNumCommandsDeferred());
+    std::string contents;
+    EXPECT_EQ(Tree::Status::OK,
+              globals->stateMachine->tree.read("/a", contents).status);
+}
+
+TEST_F(ServerClientServiceDeferredTest, stateMachineCommand_overloaded) {
+    initDeferred();
+    Protocol::Client::StateMachineCommand::Response response;
+    Protocol::Client::Error error;
+    RPC::ClientRPC rpc(session,
+                       Protocol::Common::ServiceId::CLIENT_SERVICE,
+                       2, OpCode::STATE_MACHINE_COMMAND,
+                       makeWrite(1, 2, "/a"));
+    EXPECT_EQ(Status::SERVICE_SPECIFIC_ERROR,
+              rpc.waitForReply(&response, &error, TimePoint::max()))
+        << rpc.getErrorMessage();
+    EXPECT_EQ(Protocol::Client::Error::OVERLOADED, error.error_code());
+    EXPECT_EQ(1U, getNumCommandsDeferred());
+    // The state machine still holds on to the command.
+    std::lock_guard<Core::Mutex> lockGuard(globals->stateMachine->mutex);
+    EXPECT_EQ(1U,
+              globals->stateMachine->sessions.at(clientId).deferred.size());
+}
+
+TEST_F(ServerClientServiceTest, renewSessions) {
+    init();
+    Protocol::Client::StateMachineCommand::Request request;
+    request.mutable_renew_sessions()->add_client_id(3);
+    RPC::ClientRPC rpc1(session,
+                        Protocol::Common::ServiceId::CLIENT_SERVICE,
+                        2, OpCode::STATE_MACHINE_COMMAND, request);
+    RPC::ClientRPC rpc2(session,
+                        Protocol::Common::ServiceId::CLIENT_SERVICE,
+                        2, OpCode::STATE_MACHINE_COMMAND, request);
+    // Both renewals go into the same batch, and both learn that this server
+    // isn't leader.
+    Protocol::Client::StateMachineCommand::Response response;
+    Protocol::Client::Error error;
+    EXPECT_EQ(Status::SERVICE_SPECIFIC_ERROR,
+              rpc1.waitForReply(&response, &error, TimePoint::max()))
+        << rpc1.getErrorMessage();
+    EXPECT_EQ(Protocol::Client::Error::NOT_LEADER, error.error_code());
+    EXPECT_EQ(Status::SERVICE_SPECIFIC_ERROR,
+              rpc2.waitForReply(&response, &error, TimePoint::max()))
+        << rpc2.getErrorMessage();
+    EXPECT_EQ(Protocol::Client::Error::NOT_LEADER, error.error_code());
+    Protocol::ServerStats stats;
+    globals->clientService->updateServerStats(stats);
+    EXPECT_EQ(2U, stats.client_service().num_session_renewals());
+    EXPECT_EQ(1U, stats.client_service().num_session_renewal_batches());
+}
+
 } // namespace LogCabin::Server::<anonymous>
 } // namespace LogCabin::Server
 } // namespace LogCabin
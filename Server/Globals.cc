@@ -19,6 +19,7 @@
 #include "Core/Debug.h"
 #include "Core/StringUtil.h"
 #include "Protocol/Common.h"
+#include "RPC/MessageSocket.h"
 #include "RPC/Server.h"
 #include "Server/ClientService.h"
 #include "Server/ControlService.h"
@@ -74,6 +75,8 @@ Globals::Globals()
     : config()
     , serverStats(*this)
     , eventLoop()
+    , socketEventLoops()
+    , peerEventLoop()
     , sigIntBlocker(SIGINT)
     , sigTermBlocker(SIGTERM)
     , sigUsr1Blocker(SIGUSR1)
@@ -84,6 +87,8 @@ Globals::Globals()
     , sigTermMonitor(eventLoop, sigTermHandler)
     , sigUsr2Handler(eventLoop, SIGUSR2)
     , sigUsr2Monitor(eventLoop, sigUsr2Handler)
+    , socketEventLoopThreads()
+    , peerEventLoopThread()
     , clusterUUID()
     , serverId(~0UL)
     , raft()
@@ -130,20 +135,43 @@ Globals::init()
     }
 
     if (!rpcServer) {
-        rpcServer.reset(new RPC::Server(eventLoop,
-                                        Protocol::Common::MAX_MESSAGE_LENGTH));
+        uint32_t numSocketEventLoops =
+            config.read<uint32_t>("eventLoopThreads", 0);
+        std::vector<Event::Loop*> loops;
+        for (uint32_t i = 0; i < numSocketEventLoops; ++i) {
+            socketEventLoops.emplace_back(new Event::Loop());
+            loops.push_back(socketEventLoops.back().get());
+        }
+        rpcServer.reset(new RPC::Server(
+            eventLoop,
+            Protocol::Common::MAX_MESSAGE_LENGTH,
+            loops,
+            config.read<uint32_t>(
+                "rpcCompressionThresholdBytes",
+                RPC::MessageSocket::DEFAULT_COMPRESSION_THRESHOLD),
+            &peerEventLoop));
 
         uint32_t maxThreads = config.read<uint16_t>("maxThreads", 16);
+        int clientServiceNiceness =
+            config.read<int>("clientServiceNiceness", 0);
         namespace ServiceId = Protocol::Common::ServiceId;
         rpcServer->registerService(ServiceId::CONTROL_SERVICE,
                                    controlService,
                                    maxThreads);
-        rpcServer->registerService(ServiceId::RAFT_SERVICE,
-                                   raftService,
-                                   maxThreads);
+        // Only other servers call the Raft service, and only they may send
+        // messages longer than MAX_MESSAGE_LENGTH (see
+        // RaftConsensus::SOFT_SNAPSHOT_CHUNK_SIZE_LIMIT).
+        rpcServer->registerService(
+            ServiceId::RAFT_SERVICE,
+            raftService,
+            maxThreads,
+            0,
+            Protocol::Common::MAX_FRAGMENTED_MESSAGE_LENGTH);
+        rpcServer->setPeerService(ServiceId::RAFT_SERVICE);
         rpcServer->registerService(ServiceId::CLIENT_SERVICE,
                                    clientService,
-                                   maxThreads);
+                                   maxThreads,
+                                   clientServiceNiceness);
 
         std::string listenAddressesStr =
             config.read<std::string>("listenAddresses");
@@ -194,7 +222,28 @@ Globals::leaveSignalsBlocked()
 void
 Globals::run()
 {
+    for (auto it = socketEventLoops.begin();
+         it != socketEventLoops.end();
+         ++it) {
+        socketEventLoopThreads.emplace_back(&Event::Loop::runForever,
+                                            it->get());
+    }
+    peerEventLoopThread = std::thread(&Event::Loop::runForever,
+                                      &peerEventLoop);
     eventLoop.runForever();
+    for (auto it = socketEventLoops.begin();
+         it != socketEventLoops.end();
+         ++it) {
+        (*it)->exit();
+    }
+    peerEventLoop.exit();
+    for (auto it = socketEventLoopThreads.begin();
+         it != socketEventLoopThreads.end();
+         ++it) {
+        it->join();
+    }
+    socketEventLoopThreads.clear();
+    peerEventLoopThread.join();
 }
 
 void
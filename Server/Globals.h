@@ -15,6 +15,8 @@
  */
 
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include "Client/SessionManager.h"
 #include "Core/Config.h"
@@ -129,6 +131,21 @@ class Globals {
      */
     Event::Loop eventLoop;
 
+    /**
+     * Additional event loops that the RPC server spreads incoming connections
+     * across (see the eventLoopThreads config option). Each runs on one of
+     * #socketEventLoopThreads while run() is active.
+     */
+    std::vector<std::unique_ptr<Event::Loop>> socketEventLoops;
+
+    /**
+     * The event loop for Raft traffic between servers: sessions to peers,
+     * and incoming connections once they've called the Raft service. This
+     * keeps heartbeats and replication from waiting behind client traffic.
+     * It runs on #peerEventLoopThread while run() is active.
+     */
+    Event::Loop peerEventLoop;
+
   private:
     /**
      * Block SIGINT, which is handled by sigIntHandler.
@@ -183,6 +200,16 @@ class Globals {
      */
     Event::Signal::Monitor sigUsr2Monitor;
 
+    /**
+     * Threads running #socketEventLoops.
+     */
+    std::vector<std::thread> socketEventLoopThreads;
+
+    /**
+     * Thread running #peerEventLoop.
+     */
+    std::thread peerEventLoopThread;
+
   public:
     /**
      * A unique ID for the cluster that this server may connect to. This is
@@ -219,6 +246,7 @@ class Globals {
      */
     std::shared_ptr<Server::RaftService> raftService;
 
+  public:
     /**
      * The application-facing facing RPC service.
      */
@@ -229,6 +257,8 @@ class Globals {
      */
     std::unique_ptr<RPC::Server> rpcServer;
 
+  private:
+
     // Globals is non-copyable.
     Globals(const Globals&) = delete;
     Globals& operator=(const Globals&) = delete;
@@ -36,6 +36,22 @@ TEST(ServerGlobalsTest, basics) {
     globals.run();
 }
 
+TEST(ServerGlobalsTest, eventLoopThreads) {
+    Globals globals;
+    globals.config.set("storageModule", "Memory");
+    globals.config.set("uuid", "my-fake-uuid-123");
+    globals.config.set("listenAddresses", "127.0.0.1");
+    globals.config.set("serverId", "1");
+    globals.config.set("use-temporary-storage", "true");
+    globals.config.set("eventLoopThreads", "2");
+    globals.init();
+    EXPECT_EQ(2U, globals.socketEventLoops.size());
+    EXPECT_EQ(2U, globals.rpcServer->opaqueServer.socketEventLoops.size());
+    globals.eventLoop.exit();
+    globals.run();
+    EXPECT_EQ(0U, globals.socketEventLoopThreads.size());
+}
+
 TEST(ServerGlobalsTest, initNoServers) {
     Globals globals;
     globals.config.set("storageModule", "Memory");
@@ -158,10 +158,41 @@ LocalServer::updatePeerStats(Protocol::ServerStats::Raft::Peer& peerStats,
 
 ////////// Peer //////////
 
+namespace {
+
+/**
+ * Return the average rate at which 'bytes' were transferred over the given
+ * time, or 0 if no time has passed.
+ */
+uint64_t
+bytesPerSecond(uint64_t bytes, std::chrono::nanoseconds elapsed)
+{
+    if (elapsed.count() <= 0)
+        return 0;
+    return uint64_t(double(bytes) * 1e9 / double(elapsed.count()));
+}
+
+} // anonymous namespace
+
+Peer::SnapshotChunk::SnapshotChunk(RPC::ClientRPC rpc,
+                                   uint64_t term,
+                                   uint64_t epoch,
+                                   TimePoint start,
+                                   uint64_t byteOffset,
+                                   uint64_t numDataBytes)
+    : rpc(std::move(rpc))
+    , term(term)
+    , epoch(epoch)
+    , start(start)
+    , byteOffset(byteOffset)
+    , numDataBytes(numDataBytes)
+{
+}
+
 Peer::Peer(uint64_t serverId, RaftConsensus& consensus)
     : Server(serverId)
     , consensus(consensus)
-    , eventLoop(consensus.globals.eventLoop)
+    , eventLoop(consensus.globals.peerEventLoop)
     , exiting(false)
     , requestVoteDone(false)
     , haveVote_(false)
@@ -183,6 +214,10 @@ Peer::Peer(uint64_t serverId, RaftConsensus& consensus)
     , isCaughtUp_(false)
     , snapshotFile()
     , snapshotFileOffset(0)
+    , snapshotFileSendOffset(0)
+    , snapshotChunksInFlight()
+    , snapshotTransferStart(TimePoint::min())
+    , lastSnapshotTransferBytesPerSecond(0)
     , lastSnapshotIndex(0)
     , session()
     , rpc()
@@ -208,6 +243,7 @@ Peer::beginLeadership()
     suppressBulkData = true;
     snapshotFile.reset();
     snapshotFileOffset = 0;
+    snapshotFileSendOffset = 0;
     lastSnapshotIndex = 0;
 }
 
@@ -240,6 +276,11 @@ void
 Peer::interrupt()
 {
     rpc.cancel();
+    for (auto it = snapshotChunksInFlight.begin();
+         it != snapshotChunksInFlight.end();
+         ++it) {
+        it->rpc.cancel();
+    }
 }
 
 bool
@@ -260,14 +301,28 @@ Peer::callRPC(Protocol::Raft::OpCode opCode,
               google::protobuf::Message& response,
               std::unique_lock<Mutex>& lockGuard)
 {
-    typedef RPC::ClientRPC::Status RPCStatus;
-    rpc = RPC::ClientRPC(getSession(lockGuard),
-                         Protocol::Common::ServiceId::RAFT_SERVICE,
-                         /* serviceSpecificErrorVersion = */ 0,
-                         opCode,
-                         request);
+    rpc = startRPC(opCode, request, lockGuard);
     // release lock for concurrency
     Core::MutexUnlock<Mutex> unlockGuard(lockGuard);
+    return waitForRPC(rpc, response);
+}
+
+RPC::ClientRPC
+Peer::startRPC(Protocol::Raft::OpCode opCode,
+               const google::protobuf::Message& request,
+               std::unique_lock<Mutex>& lockGuard)
+{
+    return RPC::ClientRPC(getSession(lockGuard),
+                          Protocol::Common::ServiceId::RAFT_SERVICE,
+                          /* serviceSpecificErrorVersion = */ 0,
+                          opCode,
+                          request);
+}
+
+Peer::CallStatus
+Peer::waitForRPC(RPC::ClientRPC& rpc, google::protobuf::Message& response)
+{
+    typedef RPC::ClientRPC::Status RPCStatus;
     switch (rpc.waitForReply(&response, NULL, TimePoint::max())) {
         case RPCStatus::OK:
             if (rpcFailuresSinceLastWarning > 0) {
@@ -301,6 +356,16 @@ Peer::callRPC(Protocol::Raft::OpCode opCode,
     PANIC("Unexpected RPC status");
 }
 
+bool
+Peer::acceptsFragmentedMessages() const
+{
+    // The follower only accepts long messages on a session once it has
+    // dispatched a Raft RPC from it, which a reply shows it has.
+    return (session &&
+            session->getSendVersion() >= 3 &&
+            session->hasReceivedReply());
+}
+
 void
 Peer::startThread(std::shared_ptr<Peer> self)
 {
@@ -373,6 +438,21 @@ Peer::updatePeerStats(Protocol::ServerStats::Raft::Peer& peerStats,
             peerStats.set_last_agree_index(matchIndex);
             peerStats.set_is_caught_up(isCaughtUp_);
             peerStats.set_next_heartbeat_at(time.unixNanos(nextHeartbeatTime));
+            if (snapshotFile) {
+                peerStats.set_snapshot_bytes(snapshotFile->getFileLength());
+                peerStats.set_snapshot_bytes_stored(snapshotFileOffset);
+                peerStats.set_snapshot_chunks_in_flight(
+                    snapshotChunksInFlight.size());
+                peerStats.set_snapshot_transfer_started_at(
+                    time.unixNanos(snapshotTransferStart));
+                peerStats.set_snapshot_transfer_bytes_per_second(
+                    bytesPerSecond(snapshotFileOffset,
+                                   Clock::now() - snapshotTransferStart));
+            }
+            if (lastSnapshotTransferBytesPerSecond > 0) {
+                peerStats.set_last_snapshot_transfer_bytes_per_second(
+                    lastSnapshotTransferBytesPerSecond);
+            }
             break;
     }
 
@@ -386,6 +466,11 @@ Peer::updatePeerStats(Protocol::ServerStats::Raft::Peer& peerStats,
             peerStats.set_backoff_until(time.unixNanos(backoffUntil));
             break;
     }
+
+    if (session) {
+        session->getCompressionStats().updateProtoBuf(
+            *peerStats.mutable_compression());
+    }
 }
 
 ////////// Configuration::SimpleConfiguration //////////
@@ -934,6 +1019,11 @@ RaftConsensus::RaftConsensus(Globals& globals)
         globals.config.read<uint64_t>(
             "maxLogEntriesPerRequest",
             5000))
+    , MAX_SNAPSHOT_CHUNKS_IN_FLIGHT(
+        std::max<uint64_t>(1,
+            globals.config.read<uint64_t>(
+                "maxSnapshotChunksInFlight",
+                4)))
     , RPC_FAILURE_BACKOFF(
         globals.config.keyExists("rpcFailureBackoffMilliseconds")
             ? std::chrono::nanoseconds(
@@ -947,12 +1037,14 @@ RaftConsensus::RaftConsensus(Globals& globals)
                 "stateMachineUpdaterBackoffMilliseconds",
                 10000)))
     , SOFT_RPC_SIZE_LIMIT(Protocol::Common::MAX_MESSAGE_LENGTH - 1024)
+    , SOFT_SNAPSHOT_CHUNK_SIZE_LIMIT(8 * 1024 * 1024)
     , serverId(0)
     , serverAddresses()
     , globals(globals)
     , storageLayout()
-    , sessionManager(globals.eventLoop,
-                     globals.config)
+    , sessionManager(globals.peerEventLoop,
+                     globals.config,
+                     Protocol::Common::MAX_FRAGMENTED_MESSAGE_LENGTH)
     , mutex()
     , stateChanged()
     , exiting(false)
@@ -970,6 +1062,7 @@ RaftConsensus::RaftConsensus(Globals& globals)
     , lastSnapshotBytes(0)
     , snapshotReader()
     , snapshotWriter()
+    , snapshotWriterLength(~0UL)
     , commitIndex(0)
     , leaderId(0)
     , votedFor(0)
@@ -977,6 +1070,7 @@ RaftConsensus::RaftConsensus(Globals& globals)
     , clusterClock()
     , startElectionAt(TimePoint::max())
     , withholdVotesUntil(TimePoint::min())
+    , leaderSince(TimePoint::max())
     , numEntriesTruncated(0)
     , leaderDiskThread()
     , timerThread()
@@ -1176,6 +1270,15 @@ RaftConsensus::getLeaderHint() const
     return configuration->lookupAddress(leaderId);
 }
 
+RaftConsensus::TimePoint
+RaftConsensus::getLeaderSince() const
+{
+    std::lock_guard<Mutex> lockGuard(mutex);
+    if (state != State::LEADER)
+        return TimePoint::max();
+    return leaderSince;
+}
+
 RaftConsensus::Entry
 RaftConsensus::getNextEntry(uint64_t lastIndex) const
 {
@@ -1448,9 +1551,24 @@ RaftConsensus::handleInstallSnapshot(
     if (!snapshotWriter) {
         snapshotWriter.reset(
             new Storage::SnapshotFile::Writer(storageLayout));
+        snapshotWriterLength = ~0UL;
     }
     response.set_bytes_stored(snapshotWriter->getBytesWritten());
 
+    if (request.byte_offset() > snapshotWriter->getBytesWritten() &&
+        request.has_version() && request.version() >= 3) {
+        // Version 3 leaders keep several chunks in flight, and these may be
+        // handled out of order. Store this one in place now; it counts
+        // towards bytes_stored once the chunks before it arrive.
+        snapshotWriter->writeRawAt(request.byte_offset(),
+                                   request.data().data(),
+                                   request.data().length());
+        if (request.done()) {
+            snapshotWriterLength = (request.byte_offset() +
+                                    request.data().length());
+        }
+        return;
+    }
     if (request.byte_offset() < snapshotWriter->getBytesWritten()) {
         WARNING("Ignoring stale snapshot chunk for byte offset %lu when the "
                 "next byte needed is %lu",
@@ -1479,10 +1597,18 @@ RaftConsensus::handleInstallSnapshot(
         }
         return;
     }
-    snapshotWriter->writeRaw(request.data().data(), request.data().length());
+    snapshotWriter->writeRawAt(request.byte_offset(),
+                               request.data().data(),
+                               request.data().length());
     response.set_bytes_stored(snapshotWriter->getBytesWritten());
-
     if (request.done()) {
+        snapshotWriterLength = (request.byte_offset() +
+                                request.data().length());
+    }
+
+    // This chunk may have filled the last gap before a final chunk that
+    // arrived earlier.
+    if (snapshotWriter->getBytesWritten() == snapshotWriterLength) {
         if (request.last_snapshot_index() < lastSnapshotIndex) {
             WARNING("The leader sent us a snapshot, but it's stale: it only "
                     "covers up through index %lu and we already have one "
@@ -2367,56 +2493,96 @@ void
 RaftConsensus::installSnapshot(std::unique_lock<Mutex>& lockGuard,
                                Peer& peer)
 {
-    // Build up request
-    Protocol::Raft::InstallSnapshot::Request request;
-    request.set_server_id(serverId);
-    request.set_term(currentTerm);
-    request.set_version(2);
-
     // Open the latest snapshot if we haven't already. Stash a copy of the
     // lastSnapshotIndex that goes along with the file, since it's possible
     // that this will change while we're transferring chunks).
     if (!peer.snapshotFile) {
         namespace FS = Storage::FilesystemUtil;
+        // Any chunks still in flight were for a previous file.
+        peer.snapshotChunksInFlight.clear();
         peer.snapshotFile.reset(new FS::FileContents(
             FS::openFile(storageLayout.snapshotDir, "snapshot", O_RDONLY)));
         peer.snapshotFileOffset = 0;
+        peer.snapshotFileSendOffset = 0;
+        peer.snapshotTransferStart = Clock::now();
         peer.lastSnapshotIndex = lastSnapshotIndex;
         NOTICE("Beginning to send snapshot of %lu bytes up through index %lu "
                "to follower",
                peer.snapshotFile->getFileLength(),
                lastSnapshotIndex);
     }
-    request.set_last_snapshot_index(peer.lastSnapshotIndex);
-    request.set_byte_offset(peer.snapshotFileOffset);
-    uint64_t numDataBytes = 0;
-    if (!peer.suppressBulkData) {
-        // The amount of data we can send is bounded by the remaining bytes in
-        // the file and the maximum length for RPCs.
-        numDataBytes = std::min(
-            peer.snapshotFile->getFileLength() - peer.snapshotFileOffset,
-            SOFT_RPC_SIZE_LIMIT);
-    }
-    request.set_data(peer.snapshotFile->get<char>(peer.snapshotFileOffset,
-                                                  numDataBytes),
-                     numDataBytes);
-    request.set_done(peer.snapshotFileOffset + numDataBytes ==
-                     peer.snapshotFile->getFileLength());
+    uint64_t fileLength = peer.snapshotFile->getFileLength();
+
+    // Send chunks until the window is full. While bulk data is suppressed,
+    // only send one chunk, with no data, to find out where the follower is.
+    while (peer.snapshotChunksInFlight.empty() ||
+           (!peer.suppressBulkData &&
+            (peer.snapshotChunksInFlight.size() <
+             MAX_SNAPSHOT_CHUNKS_IN_FLIGHT) &&
+            peer.snapshotFileSendOffset < fileLength)) {
+        // Build up request
+        Protocol::Raft::InstallSnapshot::Request request;
+        request.set_server_id(serverId);
+        request.set_term(currentTerm);
+        request.set_version(3);
+        request.set_last_snapshot_index(peer.lastSnapshotIndex);
+        request.set_byte_offset(peer.snapshotFileSendOffset);
+        uint64_t numDataBytes = 0;
+        if (!peer.suppressBulkData) {
+            // The amount of data we can send is bounded by the remaining
+            // bytes in the file and the maximum length for RPCs. Followers
+            // that can receive fragmented messages take much larger chunks.
+            uint64_t limit = SOFT_RPC_SIZE_LIMIT;
+            if (peer.acceptsFragmentedMessages())
+                limit = SOFT_SNAPSHOT_CHUNK_SIZE_LIMIT;
+            numDataBytes = std::min(fileLength - peer.snapshotFileSendOffset,
+                                    limit);
+        }
+        request.set_data(peer.snapshotFile->get<char>(
+                                peer.snapshotFileSendOffset,
+                                numDataBytes),
+                         numDataBytes);
+        request.set_done(peer.snapshotFileSendOffset + numDataBytes ==
+                         fileLength);
+
+        // Send RPC
+        uint64_t term = currentTerm;
+        TimePoint start = Clock::now();
+        RPC::ClientRPC rpc = peer.startRPC(
+            Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+            request,
+            lockGuard);
+        peer.snapshotChunksInFlight.emplace_back(std::move(rpc),
+                                                 term,
+                                                 currentEpoch,
+                                                 start,
+                                                 request.byte_offset(),
+                                                 numDataBytes);
+        peer.snapshotFileSendOffset += numDataBytes;
+        // startRPC() may have released the lock to connect.
+        if (currentTerm != term || peer.exiting)
+            break;
+    }
 
-    // Execute RPC
+    // Wait for the response to the oldest chunk.
     Protocol::Raft::InstallSnapshot::Response response;
-    TimePoint start = Clock::now();
-    uint64_t epoch = currentEpoch;
-    Peer::CallStatus status = peer.callRPC(
-                Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
-                request, response,
-                lockGuard);
+    Peer::CallStatus status;
+    {
+        Peer::SnapshotChunk& chunk = peer.snapshotChunksInFlight.front();
+        // release lock for concurrency
+        Core::MutexUnlock<Mutex> unlockGuard(lockGuard);
+        status = peer.waitForRPC(chunk.rpc, response);
+    }
+    Peer::SnapshotChunk chunk(std::move(peer.snapshotChunksInFlight.front()));
+    peer.snapshotChunksInFlight.pop_front();
     switch (status) {
         case Peer::CallStatus::OK:
             break;
         case Peer::CallStatus::FAILED:
             peer.suppressBulkData = true;
-            peer.backoffUntil = start + RPC_FAILURE_BACKOFF;
+            peer.backoffUntil = chunk.start + RPC_FAILURE_BACKOFF;
+            peer.snapshotChunksInFlight.clear();
+            peer.snapshotFileSendOffset = peer.snapshotFileOffset;
             return;
         case Peer::CallStatus::INVALID_REQUEST:
             PANIC("The server's RaftService doesn't support the "
@@ -2425,7 +2591,7 @@ RaftConsensus::installSnapshot(std::unique_lock<Mutex>& lockGuard,
 
     // Process response
 
-    if (currentTerm != request.term() || peer.exiting) {
+    if (currentTerm != chunk.term || peer.exiting) {
         // we don't care about result of RPC
         return;
     }
@@ -2437,36 +2603,60 @@ RaftConsensus::installSnapshot(std::unique_lock<Mutex>& lockGuard,
                "term %lu (this server's term was %lu)",
                 peer.serverId, response.term(), currentTerm);
         stepDown(response.term());
+        return;
+    }
+    assert(response.term() == currentTerm);
+    peer.lastAckEpoch = chunk.epoch;
+    stateChanged.notify_all();
+    peer.nextHeartbeatTime = chunk.start + HEARTBEAT_PERIOD;
+    peer.suppressBulkData = false;
+    uint64_t chunkEnd = chunk.byteOffset + chunk.numDataBytes;
+    if (!response.has_bytes_stored()) {
+        // This is the old path for InstallSnapshot version 1 followers
+        // only. The leader would just assume the snapshot chunk was always
+        // appended to the file if the terms matched.
+        peer.snapshotFileOffset = std::max(peer.snapshotFileOffset, chunkEnd);
+    } else if (chunk.numDataBytes > 0 &&
+               chunkEnd <= peer.snapshotFileOffset) {
+        // An earlier response already showed that the follower has this
+        // chunk. The follower handled this one first, so its bytes_stored
+        // is out of date.
     } else {
-        assert(response.term() == currentTerm);
-        peer.lastAckEpoch = epoch;
-        stateChanged.notify_all();
-        peer.nextHeartbeatTime = start + HEARTBEAT_PERIOD;
-        peer.suppressBulkData = false;
-        if (response.has_bytes_stored()) {
-            // Normal path (since InstallSnapshot version 2).
-            peer.snapshotFileOffset = response.bytes_stored();
+        // Normal path (since InstallSnapshot version 2).
+        peer.snapshotFileOffset = response.bytes_stored();
+        if (peer.snapshotFileOffset < chunkEnd) {
+            // The follower is missing data before or in this chunk. It may
+            // have restarted or, before InstallSnapshot version 3, dropped a
+            // chunk that arrived out of order. Resend from where it left off.
+            peer.snapshotChunksInFlight.clear();
+            peer.snapshotFileSendOffset = peer.snapshotFileOffset;
         } else {
-            // This is the old path for InstallSnapshot version 1 followers
-            // only. The leader would just assume the snapshot chunk was always
-            // appended to the file if the terms matched.
-            peer.snapshotFileOffset += numDataBytes;
-        }
-        if (peer.snapshotFileOffset == peer.snapshotFile->getFileLength()) {
-            NOTICE("Done sending snapshot through index %lu to follower",
-                   peer.lastSnapshotIndex);
-            peer.matchIndex = peer.lastSnapshotIndex;
-            peer.nextIndex = peer.lastSnapshotIndex + 1;
-            // These entries are already committed if they're in a snapshot, so
-            // the commitIndex shouldn't advance, but let's just follow the
-            // simple rule that bumping matchIndex should always be
-            // followed by a call to advanceCommitIndex():
-            advanceCommitIndex();
-            peer.snapshotFile.reset();
-            peer.snapshotFileOffset = 0;
-            peer.lastSnapshotIndex = 0;
+            peer.snapshotFileSendOffset = std::max(peer.snapshotFileSendOffset,
+                                                   peer.snapshotFileOffset);
         }
     }
+    if (peer.snapshotFileOffset == fileLength) {
+        peer.lastSnapshotTransferBytesPerSecond =
+            RaftConsensusInternal::bytesPerSecond(
+                fileLength,
+                Clock::now() - peer.snapshotTransferStart);
+        NOTICE("Done sending snapshot through index %lu to follower "
+               "(%lu bytes/s)",
+               peer.lastSnapshotIndex,
+               peer.lastSnapshotTransferBytesPerSecond);
+        peer.matchIndex = peer.lastSnapshotIndex;
+        peer.nextIndex = peer.lastSnapshotIndex + 1;
+        // These entries are already committed if they're in a snapshot, so
+        // the commitIndex shouldn't advance, but let's just follow the
+        // simple rule that bumping matchIndex should always be
+        // followed by a call to advanceCommitIndex():
+        advanceCommitIndex();
+        peer.snapshotChunksInFlight.clear();
+        peer.snapshotFile.reset();
+        peer.snapshotFileOffset = 0;
+        peer.snapshotFileSendOffset = 0;
+        peer.lastSnapshotIndex = 0;
+    }
 }
 
 void
@@ -2481,6 +2671,7 @@ RaftConsensus::becomeLeader()
     printElectionState();
     startElectionAt = TimePoint::max();
     withholdVotesUntil = TimePoint::max();
+    leaderSince = Clock::now();
 
     // Our local cluster time clock has been ticking ever since we got the last
     // log entry/snapshot. Set the clock back to when that happened, since we
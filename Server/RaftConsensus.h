@@ -320,6 +320,47 @@ class Peer : public Server {
             google::protobuf::Message& response,
             std::unique_lock<Mutex>& lockGuard);
 
+    /**
+     * Send a request to the server's RaftService without waiting for the
+     * response. callRPC() is simpler when only one RPC is outstanding at a
+     * time.
+     * \param[in] opCode
+     *      The RPC opcode to execute (see Protocol::Raft::OpCode).
+     * \param[in] request
+     *      The request to send.
+     * \param[in] lockGuard
+     *      The Raft lock, which may be released internally to allow for I/O
+     *      concurrency (if a new session needs to be created).
+     * \return
+     *      The RPC, to be passed to waitForRPC().
+     */
+    RPC::ClientRPC
+    startRPC(Protocol::Raft::OpCode opCode,
+             const google::protobuf::Message& request,
+             std::unique_lock<Mutex>& lockGuard);
+
+    /**
+     * Wait for the response to an RPC from startRPC(). This should be called
+     * without holding the Raft lock.
+     * \param[in] rpc
+     *      The RPC to wait for.
+     * \param[out] response
+     *      Where the reply should be placed, if status is OK.
+     * \return
+     *      See CallStatus.
+     */
+    CallStatus
+    waitForRPC(RPC::ClientRPC& rpc, google::protobuf::Message& response);
+
+    /**
+     * Return true if the current session to this server has established that
+     * it can receive messages up to
+     * Protocol::Common::MAX_FRAGMENTED_MESSAGE_LENGTH bytes long (which is
+     * the case once the server understands version 3 of the MessageSocket
+     * framing protocol and has replied to an RPC on the session).
+     */
+    bool acceptsFragmentedMessages() const;
+
     /**
      * Launch this Peer's thread, which should run
      * RaftConsensus::peerThreadMain.
@@ -351,7 +392,7 @@ class Peer : public Server {
     RaftConsensus& consensus;
 
     /**
-     * A reference to the server's event loop, needed to construct new
+     * A reference to the server's peer event loop, needed to construct new
      * sessions.
      */
     Event::Loop& eventLoop;
@@ -424,7 +465,7 @@ class Peer : public Server {
 
     /**
      * Counts RPC failures to issue fewer warnings.
-     * Accessed only from callRPC() without holding the lock.
+     * Accessed only from waitForRPC() without holding the lock.
      */
     uint64_t rpcFailuresSinceLastWarning;
 
@@ -446,9 +487,61 @@ class Peer : public Server {
     std::unique_ptr<Storage::FilesystemUtil::FileContents> snapshotFile;
     /**
      * The number of bytes of 'snapshotFile' that have been acknowledged by the
-     * follower already. Send starting here next time.
+     * follower already.
      */
     uint64_t snapshotFileOffset;
+    /**
+     * The byte offset in 'snapshotFile' at which the next chunk sent to the
+     * follower will start. This is at least #snapshotFileOffset, and it's
+     * further along when chunks are in flight.
+     */
+    uint64_t snapshotFileSendOffset;
+
+    /**
+     * An InstallSnapshot request that has been sent to the follower but whose
+     * response hasn't been processed yet.
+     */
+    struct SnapshotChunk {
+        /// Constructor.
+        SnapshotChunk(RPC::ClientRPC rpc,
+                      uint64_t term,
+                      uint64_t epoch,
+                      TimePoint start,
+                      uint64_t byteOffset,
+                      uint64_t numDataBytes);
+        /// The RPC, which interrupt() may cancel.
+        RPC::ClientRPC rpc;
+        /// The term in which the request was sent.
+        uint64_t term;
+        /// The value of RaftConsensus::currentEpoch when the request was sent.
+        uint64_t epoch;
+        /// When the request was sent.
+        TimePoint start;
+        /// The byte offset of the chunk's data in 'snapshotFile'.
+        uint64_t byteOffset;
+        /// The number of bytes of data in the chunk.
+        uint64_t numDataBytes;
+    };
+
+    /**
+     * InstallSnapshot requests that have been sent to the follower, oldest
+     * first. installSnapshot() keeps up to
+     * RaftConsensus::MAX_SNAPSHOT_CHUNKS_IN_FLIGHT of these outstanding and
+     * processes their responses in order. Only the peer thread adds and
+     * removes chunks.
+     */
+    std::deque<SnapshotChunk> snapshotChunksInFlight;
+
+    /**
+     * When the leader began sending 'snapshotFile' to the follower.
+     */
+    TimePoint snapshotTransferStart;
+
+    /**
+     * The average rate at which the follower acknowledged the bytes of the
+     * last snapshot it received in full, or 0 if none has been sent yet.
+     */
+    uint64_t lastSnapshotTransferBytesPerSecond;
     /**
      * The last log index that 'snapshotFile' corresponds to. This is used to
      * set the follower's #nextIndex accordingly after we're done sending it
@@ -1031,6 +1124,13 @@ class RaftConsensus {
      */
     std::string getLeaderHint() const;
 
+    /**
+     * Return the time when this server most recently became leader, or
+     * TimePoint::max() if it is not currently leader. ClientService uses this
+     * to let read leases granted by earlier leaders expire.
+     */
+    TimePoint getLeaderSince() const;
+
     /**
      * This returns the entry following lastIndex in the replicated log. Some
      * entries may be used internally by the consensus module. These will have
@@ -1431,6 +1531,15 @@ class RaftConsensus {
      */
     uint64_t MAX_LOG_ENTRIES_PER_REQUEST;
 
+    /**
+     * A leader will keep at most this many InstallSnapshot requests
+     * outstanding to a follower at a time. Sending the next chunk of the
+     * snapshot before the previous ones are acknowledged keeps the network
+     * busy on links with long round-trip times.
+     * Const except for unit tests.
+     */
+    uint64_t MAX_SNAPSHOT_CHUNKS_IN_FLIGHT;
+
     /**
      * A candidate or leader waits this long after an RPC fails before sending
      * another one, so as to not overwhelm the network with retries.
@@ -1453,6 +1562,16 @@ class RaftConsensus {
      */
     uint64_t SOFT_RPC_SIZE_LIMIT;
 
+    /**
+     * Prefer to keep InstallSnapshot requests under this size when the
+     * follower supports version 3 of the MessageSocket framing protocol, which
+     * lets servers send each other messages up to
+     * Protocol::Common::MAX_FRAGMENTED_MESSAGE_LENGTH. This is kept well
+     * under that because the chunk is copied while holding #mutex.
+     * Const except for unit tests.
+     */
+    uint64_t SOFT_SNAPSHOT_CHUNK_SIZE_LIMIT;
+
   public:
     /**
      * This server's unique ID. Not available until init() is called.
@@ -1618,6 +1737,13 @@ class RaftConsensus {
      */
     std::unique_ptr<Storage::SnapshotFile::Writer> snapshotWriter;
 
+    /**
+     * The total size of the snapshot being received in #snapshotWriter, which
+     * is known once the chunk marked 'done' arrives; ~0UL before then. The
+     * snapshot is loaded once all the bytes up to here have been written.
+     */
+    uint64_t snapshotWriterLength;
+
     /**
      * The largest entry ID for which a quorum is known to have stored the same
      * entry as this server has. Entries 1 through commitIndex as stored in
@@ -1681,6 +1807,11 @@ class RaftConsensus {
      */
     TimePoint withholdVotesUntil;
 
+    /**
+     * The time when this server last became leader (see getLeaderSince()).
+     */
+    TimePoint leaderSince;
+
     /**
      * The total number of entries ever truncated from the end of the log.
      * This happens only when a new leader tells this server to remove
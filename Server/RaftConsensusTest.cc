@@ -26,6 +26,7 @@
 #include "Core/Util.h"
 #include "Protocol/Common.h"
 #include "RPC/Address.h"
+#include "RPC/ClientSession.h"
 #include "RPC/ServiceMock.h"
 #include "RPC/Server.h"
 #include "Server/RaftConsensus.h"
@@ -532,6 +533,7 @@ class ServerRaftConsensusPTest : public ServerRaftConsensusTest {
         : peerService()
         , peerServer()
         , eventLoopThread()
+        , peerEventLoopThread()
     {
         consensus->sessionManager.skipVerify = true;
         peerService = std::make_shared<RPC::ServiceMock>();
@@ -545,16 +547,21 @@ class ServerRaftConsensusPTest : public ServerRaftConsensusTest {
                             peerService, 1);
         eventLoopThread = std::thread(&Event::Loop::runForever,
                                       &globals.eventLoop);
+        peerEventLoopThread = std::thread(&Event::Loop::runForever,
+                                          &globals.peerEventLoop);
     }
     ~ServerRaftConsensusPTest()
     {
         globals.eventLoop.exit();
+        globals.peerEventLoop.exit();
         eventLoopThread.join();
+        peerEventLoopThread.join();
     }
 
     std::shared_ptr<RPC::ServiceMock> peerService;
     std::unique_ptr<RPC::Server> peerServer;
     std::thread eventLoopThread;
+    std::thread peerEventLoopThread;
 };
 
 TEST_F(ServerRaftConsensusTest, init_blanklog)
@@ -1237,6 +1244,56 @@ TEST_F(ServerRaftConsensusTest, handleInstallSnapshot)
     // TODO(ongaro): Test that the configuration is update accordingly
 }
 
+TEST_F(ServerRaftConsensusTest, handleInstallSnapshot_outOfOrder)
+{
+    init();
+    consensus->stepDown(10);
+    consensus->append({&entry1});
+    consensus->commitIndex = 1;
+
+    // Take a snapshot, saving it directly instead of calling snapshotDone().
+    // This way, the consensus module does not know about the snapshot file.
+    std::unique_ptr<Storage::SnapshotFile::Writer> writer =
+        consensus->beginSnapshot(1);
+    writer->save();
+    std::string snapshotContents =
+        readEntireFileAsString(consensus->storageLayout.snapshotDir,
+                               "snapshot");
+
+    Protocol::Raft::InstallSnapshot::Request request;
+    Protocol::Raft::InstallSnapshot::Response response;
+    request.set_server_id(3);
+    request.set_term(10);
+    request.set_version(3);
+    request.set_last_snapshot_index(1);
+
+    // last chunk arrives first: stored, but not counted yet
+    request.set_byte_offset(snapshotContents.size());
+    request.set_data("hello world!");
+    request.set_done(true);
+    consensus->handleInstallSnapshot(request, response);
+    EXPECT_EQ("term: 10 "
+              "bytes_stored: 0", response);
+    EXPECT_EQ(0U, consensus->lastSnapshotIndex);
+    EXPECT_TRUE(bool(consensus->snapshotWriter));
+
+    // first chunk fills the gap, and the snapshot is loaded
+    request.set_byte_offset(0);
+    request.set_data(snapshotContents);
+    request.set_done(false);
+    consensus->handleInstallSnapshot(request, response);
+    EXPECT_EQ("term: 10 "
+              "bytes_stored: 49", response);
+    EXPECT_EQ(1U, consensus->lastSnapshotIndex);
+    EXPECT_FALSE(bool(consensus->snapshotWriter));
+    char helloWorld[13];
+    EXPECT_EQ(sizeof(helloWorld) - 1,
+              consensus->snapshotReader->readRaw(helloWorld,
+                                                 sizeof(helloWorld) - 1));
+    helloWorld[sizeof(helloWorld) - 1] = '\0';
+    EXPECT_STREQ("hello world!", helloWorld);
+}
+
 TEST_F(ServerRaftConsensusTest, handleInstallSnapshot_byteOffsetHigh)
 {
     init();
@@ -2486,6 +2543,8 @@ class ServerRaftConsensusPSTest : public ServerRaftConsensusPTest {
         EXPECT_EQ(State::LEADER, consensus->state);
         EXPECT_EQ(5U, consensus->currentTerm);
         peer = getPeerRef(2);
+        // Most tests expect one chunk at a time.
+        consensus->MAX_SNAPSHOT_CHUNKS_IN_FLIGHT = 1;
 
         // First create a snapshot file on disk.
         // Note that this one doesn't have a Raft header.
@@ -2500,7 +2559,7 @@ class ServerRaftConsensusPSTest : public ServerRaftConsensusPTest {
         request.set_byte_offset(0);
         request.set_data("hello, world!");
         request.set_done(true);
-        request.set_version(2);
+        request.set_version(3);
 
         response.set_term(5);
     }
@@ -2556,6 +2615,7 @@ TEST_F(ServerRaftConsensusPSTest, installSnapshot_ok)
 {
     peer->suppressBulkData = false;
     consensus->SOFT_RPC_SIZE_LIMIT = 7;
+    consensus->SOFT_SNAPSHOT_CHUNK_SIZE_LIMIT = 7;
     request.set_data("hello, ");
     request.set_done(false);
     peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
@@ -2580,10 +2640,26 @@ TEST_F(ServerRaftConsensusPSTest, installSnapshot_ok)
               peer->nextHeartbeatTime);
 }
 
+TEST_F(ServerRaftConsensusPSTest, installSnapshot_fragmentedChunks)
+{
+    peer->suppressBulkData = false;
+    consensus->SOFT_RPC_SIZE_LIMIT = 7;
+    consensus->SOFT_SNAPSHOT_CHUNK_SIZE_LIMIT = 13;
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    peer->getSession(lockGuard)->messageSocket->setPeerVersion(3);
+    peer->getSession(lockGuard)->receivedReply = true;
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(2U, peer->matchIndex);
+    EXPECT_FALSE(peer->snapshotFile);
+}
+
 TEST_F(ServerRaftConsensusPSTest, installSnapshot_suppressBulkData)
 {
     peer->suppressBulkData = true;
     consensus->SOFT_RPC_SIZE_LIMIT = 7;
+    consensus->SOFT_SNAPSHOT_CHUNK_SIZE_LIMIT = 7;
     request.set_data("");
     request.set_done(false);
     peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
@@ -2602,6 +2678,7 @@ TEST_F(ServerRaftConsensusPSTest, installSnapshot_notAllBytesStored)
 {
     peer->suppressBulkData = false;
     consensus->SOFT_RPC_SIZE_LIMIT = 7;
+    consensus->SOFT_SNAPSHOT_CHUNK_SIZE_LIMIT = 7;
     request.set_data("hello, ");
     request.set_done(false);
     response.set_bytes_stored(4);
@@ -2632,6 +2709,121 @@ TEST_F(ServerRaftConsensusPSTest, installSnapshot_notAllBytesStored)
     EXPECT_EQ(2U, peer->matchIndex);
 }
 
+TEST_F(ServerRaftConsensusPSTest, installSnapshot_window)
+{
+    peer->suppressBulkData = false;
+    consensus->MAX_SNAPSHOT_CHUNKS_IN_FLIGHT = 2;
+    consensus->SOFT_RPC_SIZE_LIMIT = 5;
+    consensus->SOFT_SNAPSHOT_CHUNK_SIZE_LIMIT = 5;
+    request.set_data("hello");
+    request.set_done(false);
+    response.set_bytes_stored(5);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+    request.set_byte_offset(5);
+    request.set_data(", wor");
+    response.set_bytes_stored(10);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+    request.set_byte_offset(10);
+    request.set_data("ld!");
+    request.set_done(true);
+    response.set_bytes_stored(13);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    // sends two chunks, waits for the first
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(5U, peer->snapshotFileOffset);
+    EXPECT_EQ(10U, peer->snapshotFileSendOffset);
+    EXPECT_EQ(1U, peer->snapshotChunksInFlight.size());
+    Protocol::ServerStats::Raft::Peer peerStats;
+    Core::Time::SteadyTimeConverter time;
+    peer->updatePeerStats(peerStats, time);
+    EXPECT_EQ(13U, peerStats.snapshot_bytes());
+    EXPECT_EQ(5U, peerStats.snapshot_bytes_stored());
+    EXPECT_EQ(1U, peerStats.snapshot_chunks_in_flight());
+    // sends the third chunk, waits for the second
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(10U, peer->snapshotFileOffset);
+    EXPECT_EQ(13U, peer->snapshotFileSendOffset);
+    EXPECT_EQ(1U, peer->snapshotChunksInFlight.size());
+    // waits for the third
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(2U, peer->matchIndex);
+    EXPECT_FALSE(peer->snapshotFile);
+    EXPECT_EQ(0U, peer->snapshotChunksInFlight.size());
+}
+
+TEST_F(ServerRaftConsensusPSTest, installSnapshot_windowRewind)
+{
+    peer->suppressBulkData = false;
+    consensus->MAX_SNAPSHOT_CHUNKS_IN_FLIGHT = 2;
+    consensus->SOFT_RPC_SIZE_LIMIT = 7;
+    consensus->SOFT_SNAPSHOT_CHUNK_SIZE_LIMIT = 7;
+    for (uint64_t i = 0; i < 2; ++i) {
+        request.set_byte_offset(0);
+        request.set_data("hello, ");
+        request.set_done(false);
+        // the first time, the follower has lost everything
+        response.set_bytes_stored(i == 0 ? 0 : 7);
+        peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                           request, response);
+        request.set_byte_offset(7);
+        request.set_data("world!");
+        request.set_done(true);
+        response.set_bytes_stored(13);
+        peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                           request, response);
+    }
+
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(0U, peer->snapshotFileOffset);
+    EXPECT_EQ(0U, peer->snapshotFileSendOffset);
+    EXPECT_EQ(0U, peer->snapshotChunksInFlight.size());
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(7U, peer->snapshotFileOffset);
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(2U, peer->matchIndex);
+    EXPECT_FALSE(peer->snapshotFile);
+}
+
+TEST_F(ServerRaftConsensusPSTest, installSnapshot_staleBytesStored)
+{
+    peer->suppressBulkData = false;
+    consensus->MAX_SNAPSHOT_CHUNKS_IN_FLIGHT = 2;
+    consensus->SOFT_RPC_SIZE_LIMIT = 5;
+    consensus->SOFT_SNAPSHOT_CHUNK_SIZE_LIMIT = 5;
+    request.set_data("hello");
+    request.set_done(false);
+    // the follower handled the second chunk first, then the first
+    response.set_bytes_stored(10);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+    request.set_byte_offset(5);
+    request.set_data(", wor");
+    response.set_bytes_stored(0);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+    request.set_byte_offset(10);
+    request.set_data("ld!");
+    request.set_done(true);
+    response.set_bytes_stored(13);
+    peerService->reply(Protocol::Raft::OpCode::INSTALL_SNAPSHOT,
+                       request, response);
+
+    std::unique_lock<Mutex> lockGuard(consensus->mutex);
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(10U, peer->snapshotFileOffset);
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(10U, peer->snapshotFileOffset);
+    EXPECT_EQ(13U, peer->snapshotFileSendOffset);
+    consensus->installSnapshot(lockGuard, *peer);
+    EXPECT_EQ(2U, peer->matchIndex);
+}
+
 
 TEST_F(ServerRaftConsensusTest, becomeLeader)
 {
@@ -2646,6 +2838,7 @@ TEST_F(ServerRaftConsensusTest, becomeLeader)
     peer.requestVoteDone = true;
     peer.haveVote_ = true;
     Clock::mockValue += std::chrono::hours(10);
+    EXPECT_EQ(TimePoint::max(), consensus->getLeaderSince());
     consensus->becomeLeader();
     EXPECT_EQ(State::LEADER, consensus->state);
     EXPECT_EQ(6U, consensus->currentTerm);
@@ -2660,6 +2853,7 @@ TEST_F(ServerRaftConsensusTest, becomeLeader)
     EXPECT_EQ(TimePoint::max(), consensus->startElectionAt);
     EXPECT_EQ(60U, consensus->clusterClock.clusterTimeAtEpoch);
     EXPECT_EQ(Clock::mockValue, consensus->clusterClock.localTimeAtEpoch);
+    EXPECT_EQ(Clock::mockValue, consensus->getLeaderSince());
 
     drainDiskQueue(*consensus);
     EXPECT_EQ(2U, consensus->configuration->localServer->lastSyncedIndex);
@@ -19,6 +19,9 @@
 #include "Core/ThreadId.h"
 #include "Core/Time.h"
 #include "Event/Signal.h"
+#include "RPC/MessageSocket.h"
+#include "RPC/Server.h"
+#include "Server/ClientService.h"
 #include "Server/Globals.h"
 #include "Server/RaftConsensus.h"
 #include "Server/StateMachine.h"
@@ -163,6 +166,16 @@ ServerStats::getCurrent(std::unique_lock<Core::Mutex>& lockGuard) const
         Core::MutexUnlock<Core::Mutex> unlockGuard(lockGuard);
         globals.raft->updateServerStats(copy);
         globals.stateMachine->updateServerStats(copy);
+        globals.rpcServer->updateServerStats(copy);
+        globals.clientService->updateServerStats(copy);
+        RPC::MessageSocket::Stats socketStats =
+            RPC::MessageSocket::getStats();
+        Protocol::ServerStats::RPC& rpcStats = *copy.mutable_rpc();
+        rpcStats.set_num_send_calls(socketStats.numSendCalls);
+        rpcStats.set_num_messages_sent(socketStats.numMessagesSent);
+        rpcStats.set_num_bytes_sent(socketStats.numBytesSent);
+        RPC::MessageSocket::getTotalCompressionStats().updateProtoBuf(
+            *rpcStats.mutable_compression());
     }
     copy.set_end_at(std::chrono::nanoseconds(
         Core::Time::SystemClock::now().time_since_epoch()).count());
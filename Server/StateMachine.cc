@@ -40,6 +40,8 @@ namespace PC = LogCabin::Protocol::Client;
 bool stateMachineSuppressThreads = false;
 uint32_t stateMachineChildSleepMs = 0;
 
+const uint64_t StateMachine::MAX_RESPONSE_BYTES_PER_SESSION;
+
 StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
                            Core::Config& config,
                            Globals& globals)
@@ -65,7 +67,11 @@ StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
     , unknownRequestMessageBackoff(std::chrono::milliseconds(
             config.read<uint64_t>("stateMachineUnknownRequestMessage"
                                   "BackoffMilliseconds", 10000)))
+    , expiryRetryBackoff(std::chrono::milliseconds(
+            config.read<uint64_t>("stateMachineExpiryRetry"
+                                  "BackoffMilliseconds", 1000)))
     , mutex()
+    , treeMutex()
     , entriesApplied()
     , snapshotSuggested()
     , snapshotStarted()
@@ -73,6 +79,8 @@ StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
     , exiting(false)
     , childPid(0)
     , lastApplied(0)
+    , lastAppliedClusterTime(0)
+    , lastAppliedAt(TimePoint::min())
     , lastUnknownRequestMessage(TimePoint::min())
     , numUnknownRequests(0)
     , numUnknownRequestsSinceLastMessage(0)
@@ -85,12 +93,14 @@ StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
     , isSnapshotRequested(false)
     , maySnapshotAt(TimePoint::min())
     , sessions()
+    , sessionExpiry()
     , tree()
     , versionHistory()
     , writer()
     , applyThread()
     , snapshotThread()
     , snapshotWatchdogThread()
+    , expiryThread()
 {
     versionHistory.insert({0, 1});
     consensus->setSupportedStateMachineVersions(MIN_SUPPORTED_VERSION,
@@ -100,6 +110,7 @@ StateMachine::StateMachine(std::shared_ptr<RaftConsensus> consensus,
         snapshotThread = std::thread(&StateMachine::snapshotThreadMain, this);
         snapshotWatchdogThread = std::thread(
                 &StateMachine::snapshotWatchdogThreadMain, this);
+        expiryThread = std::thread(&StateMachine::expiryThreadMain, this);
     }
 }
 
@@ -114,6 +125,8 @@ StateMachine::~StateMachine()
         snapshotThread.join();
     if (snapshotWatchdogThread.joinable())
         snapshotWatchdogThread.join();
+    if (expiryThread.joinable())
+        expiryThread.join();
     NOTICE("Joined with threads");
 }
 
@@ -121,13 +134,14 @@ bool
 StateMachine::query(const Query::Request& request,
                     Query::Response& response) const
 {
-    std::lock_guard<Core::Mutex> lockGuard(mutex);
     if (request.has_tree()) {
+        Core::SharedLock<Core::SharedMutex> treeGuard(treeMutex);
         Tree::ProtoBuf::readOnlyTreeRPC(tree,
                                         request.tree(),
                                         *response.mutable_tree());
         return true;
     }
+    std::lock_guard<Core::Mutex> lockGuard(mutex);
     warnUnknownRequest(request, "does not understand the given request");
     return false;
 }
@@ -143,6 +157,22 @@ StateMachine::updateServerStats(Protocol::ServerStats& serverStats) const
     smStats.set_snapshotting(childPid != 0);
     smStats.set_last_applied(lastApplied);
     smStats.set_num_sessions(sessions.size());
+    uint64_t numResponses = 0;
+    uint64_t responseBytes = 0;
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        numResponses += it->second.responses.size();
+        responseBytes += it->second.responseBytes;
+    }
+    smStats.set_num_session_responses(numResponses);
+    smStats.set_session_response_bytes(responseBytes);
+    // Rough estimate: ignores allocator and hash table bucket overhead.
+    smStats.set_session_table_bytes(
+        sessions.size() * (sizeof(std::pair<const uint64_t, Session>) +
+                           sizeof(std::pair<uint64_t, uint64_t>) +
+                           4 * sizeof(void*)) +
+        numResponses * (sizeof(std::pair<const uint64_t, std::string>) +
+                        4 * sizeof(void*)) +
+        responseBytes);
     smStats.set_num_unknown_requests(numUnknownRequests);
     smStats.set_num_snapshots_attempted(numSnapshotsAttempted);
     smStats.set_num_snapshots_failed(numSnapshotsFailed);
@@ -174,6 +204,17 @@ StateMachine::waitForResponse(uint64_t logIndex,
                               const Command::Request& command,
                               Command::Response& response) const
 {
+    bool deferred;
+    return waitForResponse(logIndex, command, response, deferred);
+}
+
+bool
+StateMachine::waitForResponse(uint64_t logIndex,
+                              const Command::Request& command,
+                              Command::Response& response,
+                              bool& deferred) const
+{
+    deferred = false;
     std::unique_lock<Core::Mutex> lockGuard(mutex);
     while (lastApplied < logIndex)
         entriesApplied.wait(lockGuard);
@@ -184,29 +225,20 @@ StateMachine::waitForResponse(uint64_t logIndex,
     // skip this check for now.
     uint16_t versionThen = getVersion(logIndex);
 
-    if (command.has_tree()) {
-        const PC::ExactlyOnceRPCInfo& rpcInfo = command.tree().exactly_once();
-        auto sessionIt = sessions.find(rpcInfo.client_id());
-        if (sessionIt == sessions.end()) {
-            WARNING("Client %lu session expired but client still active",
-                    rpcInfo.client_id());
-            response.mutable_tree()->
-                set_status(PC::Status::SESSION_EXPIRED);
-            return true;
-        }
-        const Session& session = sessionIt->second;
-        auto responseIt = session.responses.find(rpcInfo.rpc_number());
-        if (responseIt == session.responses.end()) {
-            // The response for this RPC has already been removed: the client
-            // is not waiting for it. This request is just a duplicate that is
-            // safe to drop.
-            WARNING("Client %lu asking for discarded response to RPC %lu",
-                    rpcInfo.client_id(), rpcInfo.rpc_number());
-            response.mutable_tree()->
-                set_status(PC::Status::SESSION_EXPIRED);
-            return true;
+    if (command.has_tree() ||
+        (versionThen >= 6 && command.tree_batch_size() > 0)) {
+        deferred = !findTreeResponses(command, response);
+        return true;
+    } else if (versionThen >= 7 && command.has_renew_sessions()) {
+        const PC::RenewSessions::Request& renew = command.renew_sessions();
+        PC::RenewSessions::Response& renewResponse =
+            *response.mutable_renew_sessions();
+        for (auto it = renew.client_id().begin();
+             it != renew.client_id().end();
+             ++it) {
+            if (sessions.find(*it) == sessions.end())
+                renewResponse.add_expired_client_id(*it);
         }
-        response = responseIt->second;
         return true;
     } else if (command.has_open_session()) {
         response.mutable_open_session()->
@@ -224,6 +256,81 @@ StateMachine::waitForResponse(uint64_t logIndex,
     return false;
 }
 
+bool
+StateMachine::waitForDeferredResponse(
+        const Command::Request& command,
+        Command::Response& response,
+        Core::Time::SteadyClock::time_point timeout) const
+{
+    std::unique_lock<Core::Mutex> lockGuard(mutex);
+    while (true) {
+        Command::Response found;
+        if (findTreeResponses(command, found)) {
+            response.Swap(&found);
+            return true;
+        }
+        if (exiting || Clock::now() >= timeout)
+            return false;
+        entriesApplied.wait_until(lockGuard, timeout);
+    }
+}
+
+bool
+StateMachine::findTreeResponses(const Command::Request& command,
+                                Command::Response& response) const
+{
+    bool applied = true;
+    if (command.has_tree()) {
+        if (!findTreeResponse(command.tree().exactly_once(),
+                              *response.mutable_tree())) {
+            applied = false;
+        }
+    }
+    for (int i = 0; i < command.tree_batch_size(); ++i) {
+        if (!findTreeResponse(command.tree_batch(i).exactly_once(),
+                              *response.add_tree_batch())) {
+            applied = false;
+        }
+    }
+    return applied;
+}
+
+bool
+StateMachine::findTreeResponse(const PC::ExactlyOnceRPCInfo& rpcInfo,
+                               PC::ReadWriteTree::Response& response) const
+{
+    auto sessionIt = sessions.find(rpcInfo.client_id());
+    if (sessionIt == sessions.end()) {
+        WARNING("Client %lu session expired but client still active",
+                rpcInfo.client_id());
+        response.set_status(PC::Status::SESSION_EXPIRED);
+        return true;
+    }
+    const Session& session = sessionIt->second;
+    auto responseIt = session.responses.find(rpcInfo.rpc_number());
+    if (responseIt == session.responses.end()) {
+        if (rpcInfo.rpc_number() >= session.firstOutstandingRPC) {
+            // The client is still waiting for this RPC, so it was deferred
+            // by applyTree() and hasn't been applied yet.
+            return false;
+        }
+        // The response for this RPC has already been removed: the client
+        // is not waiting for it. This request is just a duplicate that is
+        // safe to drop.
+        WARNING("Client %lu asking for discarded response to RPC %lu",
+                rpcInfo.client_id(), rpcInfo.rpc_number());
+        response.set_status(PC::Status::SESSION_EXPIRED);
+        return true;
+    }
+    Command::Response cached;
+    if (!cached.ParseFromString(responseIt->second)) {
+        PANIC("Failed to parse cached response to client %lu RPC %lu",
+              rpcInfo.client_id(), rpcInfo.rpc_number());
+    }
+    response.Swap(cached.mutable_tree());
+    return true;
+}
+
 bool
 StateMachine::isTakingSnapshot() const
 {
@@ -307,38 +414,52 @@ StateMachine::apply(const RaftConsensus::Entry& entry)
     }
     uint16_t runningVersion = getVersion(entry.index - 1);
     if (command.has_tree()) {
-        PC::ExactlyOnceRPCInfo rpcInfo = command.tree().exactly_once();
-        auto it = sessions.find(rpcInfo.client_id());
-        if (it == sessions.end()) {
-            // session does not exist
+        applyTree(entry, runningVersion, *command.mutable_tree());
+    } else if (command.tree_batch_size() > 0) {
+        if (runningVersion >= 6) {
+            for (int i = 0; i < command.tree_batch_size(); ++i) {
+                applyTree(entry, runningVersion,
+                          *command.mutable_tree_batch(i));
+            }
         } else {
-            // session exists
-            Session& session = it->second;
-            expireResponses(session, rpcInfo.first_outstanding_rpc());
-            if (rpcInfo.rpc_number() < session.firstOutstandingRPC) {
-                // response already discarded, do not re-apply
-            } else {
-                auto inserted = session.responses.insert(
-                                                {rpcInfo.rpc_number(), {}});
-                if (inserted.second) {
-                    // response not found, apply and save it
-                    Tree::ProtoBuf::readWriteTreeRPC(
-                        tree,
-                        command.tree(),
-                        *inserted.first->second.mutable_tree());
-                    session.lastModified = entry.clusterTime;
-                } else {
-                    // response exists, do not re-apply
+            // Command is ignored in version < 6.
+            warnUnknownRequest(command, "may not process the given request, "
+                               "which was introduced in version 6");
+        }
+    } else if (command.has_renew_sessions()) {
+        if (runningVersion >= 7) {
+            const PC::RenewSessions::Request& renew = command.renew_sessions();
+            for (int i = 0; i < renew.client_id_size(); ++i) {
+                uint64_t clientId = renew.client_id(i);
+                auto sessionIt = sessions.find(clientId);
+                if (sessionIt == sessions.end())
+                    continue;
+                Session& session = sessionIt->second;
+                touchSession(clientId, session, entry.clusterTime);
+                if (i < renew.first_outstanding_rpc_size()) {
+                    expireResponses(session, renew.first_outstanding_rpc(i));
+                    applyDeferred(entry, runningVersion, clientId, session);
                 }
             }
+        } else {
+            // Command is ignored in version < 7.
+            warnUnknownRequest(command, "may not process the given request, "
+                               "which was introduced in version 7");
+        }
+    } else if (command.has_advance_cluster_time()) {
+        if (runningVersion >= 9) {
+            // Nothing to do: expired files are removed after every entry.
+        } else {
+            // Command is ignored in version < 9.
+            warnUnknownRequest(command, "may not process the given request, "
+                               "which was introduced in version 9");
         }
     } else if (command.has_open_session()) {
-        uint64_t clientId = entry.index;
-        Session& session = sessions.insert({clientId, {}}).first->second;
-        session.lastModified = entry.clusterTime;
+        openSession(entry.index, entry.clusterTime);
     } else if (command.has_close_session()) {
         if (runningVersion >= 2) {
-            sessions.erase(command.close_session().client_id());
+            tree.setCurrentIndex(entry.index);
+            closeSession(command.close_session().client_id());
         } else {
             // Command is ignored in version < 2.
             warnUnknownRequest(command, "may not process the given request, "
@@ -382,6 +503,133 @@ StateMachine::apply(const RaftConsensus::Entry& entry)
     }
 }
 
+void
+StateMachine::applyTree(const RaftConsensus::Entry& entry,
+                        uint16_t runningVersion,
+                        PC::ReadWriteTree::Request& request)
+{
+    if (runningVersion >= 3) {
+        tree.setCurrentIndex(entry.index);
+    } else {
+        tree.setCurrentIndex(0);
+        if (request.condition().has_version()) {
+            // Versions < 3 compare contents, as if the field were unset.
+            warnUnknownRequest(request, "may not process the version "
+                               "condition, which was introduced in "
+                               "version 3");
+            request.mutable_condition()->clear_version();
+        }
+    }
+    if (runningVersion < 8 &&
+        (request.write().ephemeral() ||
+         request.compare_and_swap().ephemeral())) {
+        // Versions < 8 write regular files, as if the field were unset.
+        warnUnknownRequest(request, "may not make the file ephemeral, which "
+                           "was introduced in version 8");
+        if (request.has_write())
+            request.mutable_write()->clear_ephemeral();
+        if (request.has_compare_and_swap())
+            request.mutable_compare_and_swap()->clear_ephemeral();
+    }
+    if (runningVersion < 9 &&
+        (request.write().ttl_nanos() != 0 ||
+         request.compare_and_swap().ttl_nanos() != 0)) {
+        // Versions < 9 write files that don't expire, as if the field were
+        // unset.
+        warnUnknownRequest(request, "may not set the file's time-to-live, "
+                           "which was introduced in version 9");
+        if (request.has_write())
+            request.mutable_write()->clear_ttl_nanos();
+        if (request.has_compare_and_swap())
+            request.mutable_compare_and_swap()->clear_ttl_nanos();
+    }
+    tree.setCurrentTime(entry.clusterTime);
+    PC::ExactlyOnceRPCInfo rpcInfo = request.exactly_once();
+    auto it = sessions.find(rpcInfo.client_id());
+    if (it == sessions.end()) {
+        // session does not exist
+        return;
+    }
+    Session& session = it->second;
+    expireResponses(session, rpcInfo.first_outstanding_rpc());
+    applyDeferred(entry, runningVersion, rpcInfo.client_id(), session);
+    if (rpcInfo.rpc_number() < session.firstOutstandingRPC) {
+        // response already discarded, do not re-apply
+        return;
+    }
+    if (session.responses.find(rpcInfo.rpc_number()) !=
+        session.responses.end()) {
+        // response exists, do not re-apply
+        return;
+    }
+    if (runningVersion >= 5 &&
+        isSessionFull(session, rpcInfo.rpc_number())) {
+        // Hold on to the RPC without applying it; applyDeferred() will apply
+        // it once the client has collected some of its earlier responses.
+        session.deferred[rpcInfo.rpc_number()] = request.SerializeAsString();
+        return;
+    }
+    // response not found, apply and save it
+    executeTree(entry, runningVersion, rpcInfo.client_id(), session, request);
+}
+
+void
+StateMachine::applyDeferred(const RaftConsensus::Entry& entry,
+                            uint16_t runningVersion,
+                            uint64_t clientId,
+                            Session& session)
+{
+    // The client is no longer waiting for RPCs below its first outstanding
+    // one, so there's no need to apply them.
+    session.deferred.erase(
+        session.deferred.begin(),
+        session.deferred.lower_bound(session.firstOutstandingRPC));
+    while (!session.deferred.empty()) {
+        auto it = session.deferred.begin();
+        uint64_t rpcNumber = it->first;
+        if (isSessionFull(session, rpcNumber))
+            break;
+        PC::ReadWriteTree::Request request;
+        if (!request.ParseFromString(it->second)) {
+            PANIC("Failed to parse deferred request from client %lu RPC %lu",
+                  clientId, rpcNumber);
+        }
+        session.deferred.erase(it);
+        if (session.responses.find(rpcNumber) != session.responses.end())
+            continue;
+        tree.setCurrentIndex(entry.index);
+        tree.setCurrentTime(entry.clusterTime);
+        executeTree(entry, runningVersion, clientId, session, request);
+    }
+}
+
+void
+StateMachine::executeTree(const RaftConsensus::Entry& entry,
+                          uint16_t runningVersion,
+                          uint64_t clientId,
+                          Session& session,
+                          const PC::ReadWriteTree::Request& request)
+{
+    Command::Response response;
+    PC::ReadWriteTree::Response& treeResponse = *response.mutable_tree();
+    if (runningVersion < 4 &&
+        (request.has_increment() ||
+         request.has_append() ||
+         request.has_compare_and_swap())) {
+        // Operation is rejected in version < 4.
+        warnUnknownRequest(request, "may not process the given request, "
+                           "which was introduced in version 4");
+        treeResponse.set_status(PC::Status::INVALID_ARGUMENT);
+        treeResponse.set_error("The cluster does not yet support this "
+                               "operation (requires state machine version 4)");
+    } else {
+        std::lock_guard<Core::SharedMutex> treeGuard(treeMutex);
+        Tree::ProtoBuf::readWriteTreeRPC(tree, request, treeResponse);
+    }
+    saveResponse(session, request.exactly_once().rpc_number(), response);
+    touchSession(clientId, session, entry.clusterTime);
+}
+
 void
 StateMachine::applyThreadMain()
 {
@@ -403,8 +651,15 @@ StateMachine::applyThreadMain()
                     NOTICE("Done loading snapshot");
                     break;
             }
+            // Files removed along with expired sessions or because their
+            // time-to-live ended are versioned as modified by this entry.
+            tree.setCurrentIndex(entry.index);
+            tree.setCurrentTime(entry.clusterTime);
             expireSessions(entry.clusterTime);
+            expireFiles(entry.clusterTime);
             lastApplied = entry.index;
+            lastAppliedClusterTime = entry.clusterTime;
+            lastAppliedAt = Clock::now();
             entriesApplied.notify_all();
             if (shouldTakeSnapshot(lastApplied) &&
                 maySnapshotAt <= Clock::now()) {
@@ -437,47 +692,125 @@ StateMachine::serializeSessions(SnapshotStateMachine::Header& header) const
             SnapshotStateMachine::Response& response =
                 *session.add_rpc_response();
             response.set_rpc_number(it2->first);
-            *response.mutable_response() = it2->second;
+            if (!response.mutable_response()->ParseFromString(it2->second)) {
+                PANIC("Failed to parse cached response to client %lu RPC %lu",
+                      it->first, it2->first);
+            }
+        }
+        for (auto it2 = it->second.deferred.begin();
+             it2 != it->second.deferred.end();
+             ++it2) {
+            SnapshotStateMachine::DeferredRPC& deferred =
+                *session.add_deferred_rpc();
+            deferred.set_rpc_number(it2->first);
+            if (!deferred.mutable_request()->ParseFromString(it2->second)) {
+                PANIC("Failed to parse deferred request from client %lu "
+                      "RPC %lu", it->first, it2->first);
+            }
         }
     }
 }
 
+StateMachine::Session&
+StateMachine::openSession(uint64_t clientId, uint64_t clusterTime)
+{
+    auto inserted = sessions.insert({clientId, {}});
+    Session& session = inserted.first->second;
+    if (inserted.second) {
+        session.lastModified = clusterTime;
+        sessionExpiry.insert({clusterTime, clientId});
+    } else {
+        touchSession(clientId, session, clusterTime);
+    }
+    return session;
+}
+
+void
+StateMachine::touchSession(uint64_t clientId, Session& session,
+                           uint64_t clusterTime)
+{
+    sessionExpiry.erase({session.lastModified, clientId});
+    session.lastModified = clusterTime;
+    sessionExpiry.insert({clusterTime, clientId});
+}
+
+void
+StateMachine::closeSession(uint64_t clientId)
+{
+    auto it = sessions.find(clientId);
+    if (it == sessions.end())
+        return;
+    sessionExpiry.erase({it->second.lastModified, clientId});
+    sessions.erase(it);
+    std::lock_guard<Core::SharedMutex> treeGuard(treeMutex);
+    tree.removeOwnedFiles(clientId);
+}
+
+void
+StateMachine::saveResponse(Session& session, uint64_t rpcNumber,
+                           const Command::Response& response)
+{
+    std::string& bytes = session.responses[rpcNumber];
+    session.responseBytes -= bytes.size();
+    bytes = response.SerializeAsString();
+    bytes.shrink_to_fit();
+    session.responseBytes += bytes.size();
+}
+
+bool
+StateMachine::isSessionFull(const Session& session, uint64_t rpcNumber) const
+{
+    return (session.responseBytes >= MAX_RESPONSE_BYTES_PER_SESSION &&
+            rpcNumber != session.firstOutstandingRPC);
+}
+
 void
 StateMachine::expireResponses(Session& session, uint64_t firstOutstandingRPC)
 {
     if (session.firstOutstandingRPC >= firstOutstandingRPC)
         return;
     session.firstOutstandingRPC = firstOutstandingRPC;
-    auto it = session.responses.begin();
-    while (it != session.responses.end()) {
-        if (it->first < session.firstOutstandingRPC)
-            it = session.responses.erase(it);
-        else
-            ++it;
-    }
+    auto end = session.responses.lower_bound(firstOutstandingRPC);
+    for (auto it = session.responses.begin(); it != end; ++it)
+        session.responseBytes -= it->second.size();
+    session.responses.erase(session.responses.begin(), end);
 }
 
 void
 StateMachine::expireSessions(uint64_t clusterTime)
 {
-    auto it = sessions.begin();
-    while (it != sessions.end()) {
-        Session& session = it->second;
-        uint64_t expireTime = session.lastModified + sessionTimeoutNanos;
-        if (expireTime < clusterTime) {
-            uint64_t diffNanos = clusterTime - session.lastModified;
-            NOTICE("Expiring client %lu's session after %lu.%09lu seconds "
-                   "of cluster time due to inactivity",
-                   it->first,
-                   diffNanos / (1000 * 1000 * 1000UL),
-                   diffNanos % (1000 * 1000 * 1000UL));
-            it = sessions.erase(it);
-        } else {
-            ++it;
-        }
+    while (!sessionExpiry.empty()) {
+        auto it = sessionExpiry.begin();
+        uint64_t lastModified = it->first;
+        uint64_t clientId = it->second;
+        uint64_t expireTime = lastModified + sessionTimeoutNanos;
+        if (expireTime >= clusterTime)
+            break;
+        uint64_t diffNanos = clusterTime - lastModified;
+        NOTICE("Expiring client %lu's session after %lu.%09lu seconds "
+               "of cluster time due to inactivity",
+               clientId,
+               diffNanos / (1000 * 1000 * 1000UL),
+               diffNanos % (1000 * 1000 * 1000UL));
+        sessions.erase(clientId);
+        sessionExpiry.erase(it);
+        std::lock_guard<Core::SharedMutex> treeGuard(treeMutex);
+        tree.removeOwnedFiles(clientId);
     }
 }
 
+void
+StateMachine::expireFiles(uint64_t clusterTime)
+{
+    // Only this thread modifies the tree, so it's safe to check without
+    // treeMutex.
+    uint64_t nextExpiration = tree.getNextExpiration();
+    if (nextExpiration == 0 || nextExpiration > clusterTime)
+        return;
+    std::lock_guard<Core::SharedMutex> treeGuard(treeMutex);
+    tree.removeExpiredFiles();
+}
+
 uint16_t
 StateMachine::getVersion(uint64_t logIndex) const
 {
@@ -505,17 +838,22 @@ void
 StateMachine::loadSessions(const SnapshotStateMachine::Header& header)
 {
     sessions.clear();
+    sessionExpiry.clear();
     for (auto it = header.session().begin();
          it != header.session().end();
          ++it) {
-        Session& session = sessions.insert({it->client_id(), {}})
-                                                        .first->second;
-        session.lastModified = it->last_modified();
+        Session& session = openSession(it->client_id(), it->last_modified());
         session.firstOutstandingRPC = it->first_outstanding_rpc();
         for (auto it2 = it->rpc_response().begin();
              it2 != it->rpc_response().end();
              ++it2) {
-            session.responses.insert({it2->rpc_number(), it2->response()});
+            saveResponse(session, it2->rpc_number(), it2->response());
+        }
+        for (auto it2 = it->deferred_rpc().begin();
+             it2 != it->deferred_rpc().end();
+             ++it2) {
+            session.deferred[it2->rpc_number()] =
+                it2->request().SerializeAsString();
         }
     }
 }
@@ -548,6 +886,7 @@ StateMachine::loadSnapshot(Core::ProtoBuf::InputStream& stream)
     }
 
     // Load the tree's state
+    std::lock_guard<Core::SharedMutex> treeGuard(treeMutex);
     tree.loadSnapshot(stream);
 }
 
@@ -715,6 +1054,48 @@ StateMachine::snapshotWatchdogThreadMain()
     }
 }
 
+void
+StateMachine::expiryThreadMain()
+{
+    Core::ThreadId::setName("StateMachineExpiry");
+    std::unique_lock<Core::Mutex> lockGuard(mutex);
+    TimePoint backoffUntil = TimePoint::min();
+    while (!exiting) {
+        uint64_t nextExpiration = tree.getNextExpiration();
+        if (nextExpiration == 0) {
+            entriesApplied.wait(lockGuard);
+            continue;
+        }
+        // Cluster time advances at about the rate of the steady clock, so
+        // estimate when it will reach nextExpiration from the last entry.
+        TimePoint due = lastAppliedAt;
+        if (nextExpiration > lastAppliedClusterTime) {
+            due += std::chrono::nanoseconds(
+                        nextExpiration - lastAppliedClusterTime);
+        }
+        due = std::max(due, backoffUntil);
+        if (Clock::now() < due) {
+            entriesApplied.wait_until(lockGuard, due);
+            continue;
+        }
+        Command::Request command;
+        command.mutable_advance_cluster_time();
+        Core::Buffer cmdBuffer;
+        Core::ProtoBuf::serialize(command, cmdBuffer);
+        lockGuard.unlock();
+        std::pair<RaftConsensus::ClientResult, uint64_t> result =
+            consensus->replicate(cmdBuffer);
+        lockGuard.lock();
+        if (result.first == RaftConsensus::ClientResult::SUCCESS) {
+            // Wait for the entry to be applied, so as not to append another
+            // for the same file.
+            while (!exiting && lastApplied < result.second)
+                entriesApplied.wait(lockGuard);
+        } else {
+            backoffUntil = Clock::now() + expiryRetryBackoff;
+        }
+    }
+}
 
 void
 StateMachine::takeSnapshot(uint64_t lastIncludedIndex,
@@ -14,8 +14,10 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <thread>
 #include <unordered_map>
 
@@ -45,6 +47,24 @@ class RaftConsensus;
  * - Version 1 of the State Machine shipped with LogCabin v1.0.0.
  * - Version 2 added the CloseSession command, which clients can use when they
  *   gracefully shut down.
+ * - Version 3 records the log index of the last modification of each file and
+ *   directory in the Tree and honors version-based TreeConditions on
+ *   read-write commands.
+ * - Version 4 added the Increment, Append, and CompareAndSwap operations to
+ *   ReadWriteTree.
+ * - Version 5 limits the bytes of responses each session keeps cached for
+ *   exactly-once semantics, deferring read-write commands from sessions that
+ *   have too many (see MAX_RESPONSE_BYTES_PER_SESSION).
+ * - Version 6 added batched read-write tree commands (tree_batch), which
+ *   clients use to coalesce many small writes into a single log entry.
+ * - Version 7 added the RenewSessions command, which keeps any number of idle
+ *   clients' sessions from expiring, and discards the responses they have
+ *   already received, with a single log entry.
+ * - Version 8 added ephemeral files, which are owned by a client session and
+ *   are removed when that session is closed or expires.
+ * - Version 9 added time-to-live on written files, which are removed once
+ *   the cluster time passes their expiration, and the AdvanceClusterTime
+ *   command that the leader appends to make that happen on time.
  */
 class StateMachine {
   public:
@@ -61,9 +81,20 @@ class StateMachine {
          * This state machine code can behave like all versions between
          * MIN_SUPPORTED_VERSION and MAX_SUPPORTED_VERSION, inclusive.
          */
-        MAX_SUPPORTED_VERSION = 2,
+        MAX_SUPPORTED_VERSION = 9,
     };
 
+    /**
+     * In state machine version 5 and above, once a session's cached responses
+     * reach this many bytes, read-write commands from that session are
+     * deferred: the session holds on to them unapplied, and they're applied
+     * in RPC number order once the client has collected enough of its earlier
+     * responses to make room. The session's first outstanding RPC is never
+     * deferred, so the client can always make progress. Cached responses are
+     * only discarded once the client is no longer waiting for them.
+     */
+    static const uint64_t MAX_RESPONSE_BYTES_PER_SESSION = 1024 * 1024;
+
 
     StateMachine(std::shared_ptr<RaftConsensus> consensus,
                  Core::Config& config,
@@ -99,11 +130,47 @@ class StateMachine {
      * \param[out] response
      *      If the return value is true, the response will be filled in here.
      *      Otherwise, this will be unmodified.
+     * \param[out] deferred
+     *      Set to true if the command (or any command in a batch) was not
+     *      yet applied because its session had too many cached responses
+     *      (see MAX_RESPONSE_BYTES_PER_SESSION), false otherwise. Use
+     *      waitForDeferredResponse() to wait for it to be applied.
+     */
+    bool waitForResponse(uint64_t logIndex,
+                         const Command::Request& command,
+                         Command::Response& response,
+                         bool& deferred) const;
+
+    /**
+     * Like the above, for commands that are never deferred, such as those
+     * that open, renew, or close sessions.
      */
     bool waitForResponse(uint64_t logIndex,
                          const Command::Request& command,
                          Command::Response& response) const;
 
+    /**
+     * Wait for a command that waitForResponse() reported as deferred to be
+     * applied. The state machine applies it on its own once a later entry
+     * makes room in its session (for example, because the client sent another
+     * command with a newer first outstanding RPC).
+     * \param command
+     *      The request.
+     * \param[out] response
+     *      If the return value is true, the response will be filled in here.
+     *      Otherwise, this will be unmodified.
+     * \param timeout
+     *      When to give up.
+     * \return
+     *      True if the command has been applied (or can no longer be, because
+     *      its session expired), false if it was still deferred at the
+     *      timeout or the state machine is exiting.
+     */
+    bool waitForDeferredResponse(
+            const Command::Request& command,
+            Command::Response& response,
+            Core::Time::SteadyClock::time_point timeout) const;
+
     /**
      * Return true if the server is currently taking a snapshot and false
      * otherwise.
@@ -158,6 +225,73 @@ class StateMachine {
      */
     void apply(const RaftConsensus::Entry& entry);
 
+    /**
+     * Apply a single read-write tree operation, following the exactly-once
+     * rules of its session. Called from apply() for plain tree commands and
+     * once per element of batched ones.
+     * \param entry
+     *      Log entry containing the operation.
+     * \param runningVersion
+     *      State machine version in effect for this entry.
+     * \param request
+     *      The operation. Its version condition may be cleared if
+     *      runningVersion does not support it.
+     */
+    void applyTree(const RaftConsensus::Entry& entry,
+                   uint16_t runningVersion,
+                   Protocol::Client::ReadWriteTree::Request& request);
+
+    /**
+     * Apply the read-write tree operations that a session deferred, in RPC
+     * number order, for as long as the session has room for their responses.
+     * Deferred operations the client is no longer waiting for are dropped.
+     * Called whenever the session's first outstanding RPC may have advanced.
+     * \param entry
+     *      Log entry being applied, which the operations are applied as.
+     * \param runningVersion
+     *      State machine version in effect for this entry.
+     * \param clientId
+     *      ID of the session.
+     * \param session
+     *      Affected session.
+     */
+    void applyDeferred(const RaftConsensus::Entry& entry,
+                       uint16_t runningVersion,
+                       uint64_t clientId,
+                       Session& session);
+
+    /**
+     * Execute a read-write tree operation against the tree and cache its
+     * response in the session. The caller has already checked that the
+     * operation should be applied.
+     */
+    void executeTree(const RaftConsensus::Entry& entry,
+                     uint16_t runningVersion,
+                     uint64_t clientId,
+                     Session& session,
+                     const Protocol::Client::ReadWriteTree::Request& request);
+
+    /**
+     * Look up the cached responses to a read-write tree command or batch.
+     * \return
+     *      False if any of the operations was deferred rather than applied,
+     *      true otherwise.
+     */
+    bool findTreeResponses(const Command::Request& command,
+                           Command::Response& response) const;
+
+    /**
+     * Look up the cached response to a read-write tree operation once it has
+     * been applied. Sets SESSION_EXPIRED if the session or the response is
+     * gone.
+     * \return
+     *      False if the operation was deferred rather than applied (see
+     *      MAX_RESPONSE_BYTES_PER_SESSION), true otherwise.
+     */
+    bool findTreeResponse(
+            const Protocol::Client::ExactlyOnceRPCInfo& rpcInfo,
+            Protocol::Client::ReadWriteTree::Response& response) const;
+
     /**
      * Main function for thread that waits for new commands from Raft.
      */
@@ -169,6 +303,47 @@ class StateMachine {
      */
     void serializeSessions(SnapshotStateMachine::Header& header) const;
 
+    /**
+     * Create a new session and add it to the expiry index.
+     * \param clientId
+     *      ID of the new session.
+     * \param clusterTime
+     *      Initial value for the session's lastModified time.
+     * \return
+     *      The new session.
+     */
+    Session& openSession(uint64_t clientId, uint64_t clusterTime);
+
+    /**
+     * Set the session's lastModified time and update the expiry index.
+     */
+    void touchSession(uint64_t clientId, Session& session,
+                      uint64_t clusterTime);
+
+    /**
+     * Remove a session and its entry in the expiry index, if it exists,
+     * along with the ephemeral files it owns.
+     */
+    void closeSession(uint64_t clientId);
+
+    /**
+     * Cache a response in the session in its compact, serialized form.
+     */
+    void saveResponse(Session& session, uint64_t rpcNumber,
+                      const Command::Response& response);
+
+    /**
+     * Return true if a read-write command should be deferred because its
+     * session has MAX_RESPONSE_BYTES_PER_SESSION or more bytes of cached
+     * responses. Call this after expireResponses().
+     * \param session
+     *      Affected session.
+     * \param rpcNumber
+     *      RPC number of the command. The session's first outstanding RPC is
+     *      never deferred.
+     */
+    bool isSessionFull(const Session& session, uint64_t rpcNumber) const;
+
     /**
      * Update the session and clean up unnecessary responses.
      * \param session
@@ -179,13 +354,22 @@ class StateMachine {
     void expireResponses(Session& session, uint64_t firstOutstandingRPC);
 
     /**
-     * Remove old sessions.
+     * Remove old sessions. This walks #sessionExpiry in order, so it takes
+     * time proportional to the number of expired sessions.
      * \param clusterTime
      *      Sessions are kept if they have been modified during the last
      *      timeout period going backwards from the given time.
+     * Ephemeral files owned by expired sessions are removed from the tree.
      */
     void expireSessions(uint64_t clusterTime);
 
+    /**
+     * Remove the files whose time-to-live has ended by the given time.
+     * \param clusterTime
+     *      Time of the entry being applied, in nanoseconds of cluster time.
+     */
+    void expireFiles(uint64_t clusterTime);
+
     /**
      * Return the version of the state machine behavior as of the given log
      * index. Note that this is based on versionHistory internally, so if
@@ -241,6 +425,14 @@ class StateMachine {
      */
     void snapshotWatchdogThreadMain();
 
+    /**
+     * Main function for thread that appends an AdvanceClusterTime command
+     * when a file is due to expire but no other command has been applied
+     * since, so that files expire on time even without client traffic.
+     * This only succeeds on the leader; other servers back off.
+     */
+    void expiryThreadMain();
+
     /**
      * Called by snapshotThreadMain to actually take the snapshot.
      */
@@ -311,12 +503,31 @@ class StateMachine {
      */
     std::chrono::milliseconds unknownRequestMessageBackoff;
 
+    /**
+     * How long expiryThread waits before trying again after it failed to
+     * append an AdvanceClusterTime command (usually because this server isn't
+     * the leader).
+     */
+    std::chrono::milliseconds expiryRetryBackoff;
+
     /**
      * Protects against concurrent access for all members of this class (except
-     * 'consensus', which is itself a monitor.
+     * 'consensus', which is itself a monitor, and 'tree', which is protected
+     * by 'treeMutex' for readers).
      */
     mutable Core::Mutex mutex;
 
+    /**
+     * Protects 'tree' so that read-only queries need not acquire 'mutex'.
+     * Writers to the tree hold both 'mutex' and this lock exclusively (and
+     * must acquire them in that order); query() holds only this lock in
+     * shared mode. Thus queries run concurrently with each other and with
+     * everything the state machine does except applying an entry or loading
+     * a snapshot, and the writer preference of SharedMutex keeps a stream of
+     * queries from starving the apply thread.
+     */
+    mutable Core::SharedMutex treeMutex;
+
     /**
      * Notified when lastApplied changes after some entry got applied.
      * Also notified upon exiting.
@@ -368,6 +579,18 @@ class StateMachine {
      */
     uint64_t lastApplied;
 
+    /**
+     * The cluster time of the log entry at #lastApplied. Written by
+     * applyThread with 'mutex' held.
+     */
+    uint64_t lastAppliedClusterTime;
+
+    /**
+     * When applyThread applied the log entry at #lastApplied. Used with
+     * #lastAppliedClusterTime to estimate the current cluster time.
+     */
+    TimePoint lastAppliedAt;
+
     /**
      * The time when warnUnknownRequest() last printed a debug message. Used to
      * prevent spamming the debug log.
@@ -453,6 +676,8 @@ class StateMachine {
             : lastModified(0)
             , firstOutstandingRPC(0)
             , responses()
+            , responseBytes(0)
+            , deferred()
         {
         }
         /**
@@ -466,13 +691,24 @@ class StateMachine {
          */
         uint64_t firstOutstandingRPC;
         /**
-         * Maps from RPC numbers to responses.
+         * Maps from RPC numbers to serialized responses. Read-write responses
+         * are usually just a few bytes, which std::string stores inline
+         * without a separate heap allocation, so this is much more compact
+         * than keeping protobuf objects around.
          * Responses for RPCs numbered less that firstOutstandingRPC are
          * discarded from this map.
          */
-        std::unordered_map<uint64_t,
-                           Protocol::Client::StateMachineCommand::Response>
-            responses;
+        std::map<uint64_t, std::string> responses;
+        /**
+         * Total size of the strings in #responses.
+         */
+        uint64_t responseBytes;
+        /**
+         * Maps from RPC numbers to serialized read-write tree requests that
+         * were deferred (see MAX_RESPONSE_BYTES_PER_SESSION) and have yet to
+         * be applied. See applyDeferred().
+         */
+        std::map<uint64_t, std::string> deferred;
     };
 
     /**
@@ -480,6 +716,13 @@ class StateMachine {
      */
     std::unordered_map<uint64_t, Session> sessions;
 
+    /**
+     * Index of #sessions ordered by expiry: contains a
+     * (lastModified, client ID) pair for each session opened through
+     * openSession(). Used by expireSessions().
+     */
+    std::set<std::pair<uint64_t, uint64_t>> sessionExpiry;
+
     /**
      * The hierarchical key-value store. Used in readOnlyTreeRPC and
      * readWriteTreeRPC.
@@ -526,6 +769,11 @@ class StateMachine {
      * See https://github.com/logcabin/logcabin/issues/121 for more rationale.
      */
     std::thread snapshotWatchdogThread;
+
+    /**
+     * Appends AdvanceClusterTime commands as needed; see expiryThreadMain().
+     */
+    std::thread expiryThread;
 };
 
 } // namespace LogCabin::Server
@@ -15,9 +15,11 @@
  */
 
 #include <fcntl.h>
+#include <future>
 #include <gtest/gtest.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <thread>
 
 #include "build/Protocol/Raft.pb.h"
 #include "Core/Debug.h"
@@ -83,6 +85,14 @@ class ServerStateMachineTest : public ::testing::Test {
         return out;
     }
 
+    StateMachine::Command::Response
+    getResponse(uint64_t clientId, uint64_t rpcNumber) {
+        StateMachine::Command::Response response;
+        EXPECT_TRUE(response.ParseFromString(
+            stateMachine->sessions.at(clientId).responses.at(rpcNumber)));
+        return response;
+    }
+
     Globals globals;
     std::shared_ptr<RaftConsensus> consensus;
     std::unique_ptr<StateMachine> stateMachine;
@@ -100,6 +110,27 @@ TEST_F(ServerStateMachineTest, query_tree)
               response.tree().status());
 }
 
+TEST_F(ServerStateMachineTest, query_tree_doesNotTakeMutex)
+{
+    stateMachine->tree.write("/foo", "bar");
+    StateMachine::Query::Request request;
+    StateMachine::Query::Response response;
+    request.mutable_tree()->mutable_read()->set_path("/foo");
+    std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
+    std::packaged_task<bool()> task([&]() {
+        return stateMachine->query(request, response);
+    });
+    std::future<bool> result = task.get_future();
+    std::thread thread(std::move(task));
+    // would time out if query needed the exclusive mutex
+    EXPECT_EQ(std::future_status::ready,
+              result.wait_for(std::chrono::seconds(5)));
+    lockGuard.unlock();
+    thread.join();
+    EXPECT_TRUE(result.get());
+    EXPECT_EQ("bar", response.tree().read().contents());
+}
+
 TEST_F(ServerStateMachineTest, query_unknown)
 {
     StateMachine::Query::Request request;
@@ -142,34 +173,48 @@ TEST_F(ServerStateMachineTest, waitForResponse_wait)
     StateMachine::Command::Request request;
     request.mutable_open_session();
     StateMachine::Command::Response response;
+    bool deferred = false;
     WaitHelper helper(*stateMachine);
     stateMachine->entriesApplied.callback = std::ref(helper);
-    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response));
+    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response,
+                                              deferred));
     EXPECT_EQ(2U, helper.iter);
 }
 
 TEST_F(ServerStateMachineTest, waitForResponse_tree)
 {
     Core::Debug::setLogPolicy({{"Server/StateMachine.cc", "ERROR"}});
-    stateMachine->sessions.insert({1, {}});
+    stateMachine->openSession(1, 0);
     StateMachine::Session& session = stateMachine->sessions.at(1);
     StateMachine::Command::Response r1;
     StateMachine::Command::Response r2;
+    bool deferred = false;
     r1.mutable_tree()->set_status(Protocol::Client::Status::LOOKUP_ERROR);
-    session.responses.insert({1, r1});
+    stateMachine->saveResponse(session, 1, r1);
 
     StateMachine::Command::Request request;
     auto& exactlyOnce = *request.mutable_tree()->mutable_exactly_once();
     exactlyOnce.set_client_id(2);
     exactlyOnce.set_rpc_number(1);
-    EXPECT_TRUE(stateMachine->waitForResponse(0, request, r2));
+    EXPECT_TRUE(stateMachine->waitForResponse(0, request, r2,
+                                              deferred));
     EXPECT_EQ("tree { "
               "  status: SESSION_EXPIRED "
               "}", r2);
 
     exactlyOnce.set_client_id(1);
     exactlyOnce.set_rpc_number(2);
-    EXPECT_TRUE(stateMachine->waitForResponse(0, request, r2));
+    r2.Clear();
+    EXPECT_TRUE(stateMachine->waitForResponse(0, request, r2,
+                                              deferred));
+    EXPECT_TRUE(deferred);
+    EXPECT_EQ("tree { "
+              "}", r2);
+
+    session.firstOutstandingRPC = 3;
+    EXPECT_TRUE(stateMachine->waitForResponse(0, request, r2,
+                                              deferred));
+    EXPECT_FALSE(deferred);
     EXPECT_EQ("tree { "
               "  status: SESSION_EXPIRED "
               "}", r2);
@@ -177,17 +222,79 @@ TEST_F(ServerStateMachineTest, waitForResponse_tree)
     Core::Debug::setLogPolicy({{"", "WARNING"}});
     exactlyOnce.set_client_id(1);
     exactlyOnce.set_rpc_number(1);
-    EXPECT_TRUE(stateMachine->waitForResponse(0, request, r2));
+    EXPECT_TRUE(stateMachine->waitForResponse(0, request, r2,
+                                              deferred));
     EXPECT_EQ(r1, r2);
 }
 
+TEST_F(ServerStateMachineTest, waitForResponse_treeBatch)
+{
+    Core::Debug::setLogPolicy({{"Server/StateMachine.cc", "ERROR"}});
+    stateMachine->openSession(1, 0);
+    StateMachine::Session& session = stateMachine->sessions.at(1);
+    StateMachine::Command::Response r1;
+    r1.mutable_tree()->set_status(Protocol::Client::Status::LOOKUP_ERROR);
+    stateMachine->saveResponse(session, 1, r1);
+
+    StateMachine::Command::Request request =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree_batch { exactly_once { client_id: 1 rpc_number: 1 } } "
+            "tree_batch { exactly_once { client_id: 1 rpc_number: 2 } } "
+            "tree_batch { exactly_once { client_id: 1 rpc_number: 3 } } ");
+    StateMachine::Command::Response response;
+    bool deferred = false;
+    session.firstOutstandingRPC = 3;
+    stateMachine->lastApplied = 3;
+    stateMachine->versionHistory.insert({3, 5});
+    EXPECT_FALSE(stateMachine->waitForResponse(3, request, response,
+                                               deferred));
+    EXPECT_EQ("", response);
+
+    stateMachine->versionHistory.insert({2, 6});
+    EXPECT_TRUE(stateMachine->waitForResponse(2, request, response,
+                                              deferred));
+    EXPECT_TRUE(deferred);
+    EXPECT_EQ("tree_batch { status: LOOKUP_ERROR } "
+              "tree_batch { status: SESSION_EXPIRED } "
+              "tree_batch { } ",
+              response);
+}
+
+TEST_F(ServerStateMachineTest, waitForDeferredResponse)
+{
+    stateMachine->openSession(1, 0);
+    StateMachine::Session& session = stateMachine->sessions.at(1);
+    StateMachine::Command::Response r1;
+    r1.mutable_tree()->set_status(Protocol::Client::Status::LOOKUP_ERROR);
+    StateMachine::Command::Request request;
+    auto& exactlyOnce = *request.mutable_tree()->mutable_exactly_once();
+    exactlyOnce.set_client_id(1);
+    exactlyOnce.set_rpc_number(2);
+    StateMachine::Command::Response response;
+
+    // still deferred at the timeout
+    EXPECT_FALSE(stateMachine->waitForDeferredResponse(
+        request, response, Core::Time::SteadyClock::now()));
+    EXPECT_EQ("", response);
+
+    // applied while waiting
+    stateMachine->entriesApplied.callback = [&] () {
+        stateMachine->saveResponse(session, 2, r1);
+    };
+    EXPECT_TRUE(stateMachine->waitForDeferredResponse(
+        request, response, Core::Time::SteadyClock::time_point::max()));
+    EXPECT_EQ(r1, response);
+}
+
 TEST_F(ServerStateMachineTest, waitForResponse_openSession)
 {
     StateMachine::Command::Request request;
     request.mutable_open_session();
     StateMachine::Command::Response response;
+    bool deferred = false;
     stateMachine->lastApplied = 3;
-    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response));
+    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response,
+                                              deferred));
     EXPECT_EQ("open_session { "
               "  client_id: 3 "
               "}",
@@ -200,23 +307,49 @@ TEST_F(ServerStateMachineTest, waitForResponse_closeSession)
     StateMachine::Command::Request request;
     request.mutable_close_session()->set_client_id(3);
     StateMachine::Command::Response response;
+    bool deferred = false;
     stateMachine->versionHistory.insert({3, 2});
-    EXPECT_FALSE(stateMachine->waitForResponse(2, request, response));
+    EXPECT_FALSE(stateMachine->waitForResponse(2, request, response,
+                                               deferred));
     EXPECT_FALSE(response.has_close_session());
-    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response));
+    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response,
+                                              deferred));
     EXPECT_EQ("close_session { "
               "}",
               response);
 }
 
+TEST_F(ServerStateMachineTest, waitForResponse_renewSessions)
+{
+    stateMachine->openSession(2, 0);
+    stateMachine->lastApplied = 3;
+    StateMachine::Command::Request request =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "renew_sessions { client_id: 2 client_id: 3 }");
+    StateMachine::Command::Response response;
+    bool deferred = false;
+    stateMachine->versionHistory.insert({3, 7});
+    EXPECT_FALSE(stateMachine->waitForResponse(2, request, response,
+                                               deferred));
+    EXPECT_FALSE(response.has_renew_sessions());
+    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response,
+                                              deferred));
+    EXPECT_EQ("renew_sessions { "
+              "  expired_client_id: 3 "
+              "}",
+              response);
+}
+
 TEST_F(ServerStateMachineTest, waitForResponse_advanceVersion)
 {
     StateMachine::Command::Request request;
     request.mutable_advance_version()->
         set_requested_version(90);
     StateMachine::Command::Response response;
+    bool deferred = false;
     stateMachine->lastApplied = 3;
-    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response));
+    EXPECT_TRUE(stateMachine->waitForResponse(3, request, response,
+                                              deferred));
     EXPECT_EQ("advance_version { "
               "  running_version: 1 "
               "}",
@@ -227,8 +360,10 @@ TEST_F(ServerStateMachineTest, waitForResponse_unknown)
 {
     StateMachine::Command::Request request; // empty
     StateMachine::Command::Response response;
+    bool deferred = false;
     stateMachine->lastApplied = 3;
-    EXPECT_FALSE(stateMachine->waitForResponse(3, request, response));
+    EXPECT_FALSE(stateMachine->waitForResponse(3, request, response,
+                                               deferred));
     EXPECT_EQ("", response);
 }
 
@@ -405,7 +540,7 @@ TEST_F(ServerStateMachineTest, apply_tree)
     std::vector<std::string> children;
 
     // session does not exist
-    stateMachine->sessions.insert({1, {}});
+    stateMachine->openSession(1, 0);
     stateMachine->apply(entry);
     stateMachine->expireSessions(entry.clusterTime);
     stateMachine->tree.listDirectory("/", children);
@@ -413,8 +548,8 @@ TEST_F(ServerStateMachineTest, apply_tree)
     ASSERT_EQ(0U, stateMachine->sessions.size());
 
     // session exists and need to apply
-    stateMachine->sessions.insert({1, {}});
-    stateMachine->sessions.insert({39, {}});
+    stateMachine->openSession(1, 0);
+    stateMachine->openSession(39, 0);
     stateMachine->apply(entry);
     stateMachine->expireSessions(entry.clusterTime);
     stateMachine->tree.listDirectory("/", children);
@@ -423,7 +558,7 @@ TEST_F(ServerStateMachineTest, apply_tree)
     EXPECT_EQ(2U, stateMachine->sessions.at(39).lastModified);
 
     // session exists and response exists
-    stateMachine->sessions.insert({1, {}});
+    stateMachine->openSession(1, 0);
     stateMachine->tree.removeDirectory("/a");
     stateMachine->apply(entry);
     stateMachine->expireSessions(entry.clusterTime);
@@ -433,7 +568,7 @@ TEST_F(ServerStateMachineTest, apply_tree)
     EXPECT_EQ(2U, stateMachine->sessions.at(39).lastModified);
 
     // session exists but response discarded
-    stateMachine->sessions.insert({1, {}});
+    stateMachine->openSession(1, 0);
     stateMachine->expireResponses(stateMachine->sessions.at(39), 4);
     stateMachine->apply(entry);
     stateMachine->expireSessions(entry.clusterTime);
@@ -443,10 +578,297 @@ TEST_F(ServerStateMachineTest, apply_tree)
     EXPECT_EQ(2U, stateMachine->sessions.at(39).lastModified);
 }
 
+TEST_F(ServerStateMachineTest, apply_tree_version)
+{
+    stateMachine->openSession(39, 0);
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    entry.clusterTime = 2;
+    StateMachine::Command::Request command =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 1 "
+            "  rpc_number: 1 "
+            " } "
+            " condition { "
+            "  path: '/a' "
+            "  contents: '' "
+            "  version: 6 "
+            " } "
+            " write { "
+            "  path: '/a' "
+            "  contents: 'x' "
+            " } "
+            "}");
+    entry.command = serialize(command);
+    std::string contents;
+    uint64_t version = 0;
+
+    // version 2 ignores the version condition and does not assign versions
+    Core::Debug::setLogPolicy({
+        {"Server/StateMachine.cc", "ERROR"},
+        {"", "WARNING"},
+    });
+    stateMachine->versionHistory.insert({5, 2});
+    stateMachine->apply(entry);
+    Core::Debug::setLogPolicy({
+        {"", "WARNING"},
+    });
+    EXPECT_EQ(1U, stateMachine->numUnknownRequests);
+    stateMachine->tree.read("/a", contents, version);
+    EXPECT_EQ("x", contents);
+    EXPECT_EQ(0U, version);
+
+    // version 3 assigns the entry's index and checks the condition
+    stateMachine->versionHistory.insert({6, 3});
+    entry.index = 7;
+    command.mutable_tree()->mutable_exactly_once()->set_rpc_number(2);
+    command.mutable_tree()->mutable_write()->set_contents("y");
+    entry.command = serialize(command);
+    stateMachine->apply(entry);
+    EXPECT_EQ("status: CONDITION_NOT_MET "
+              "error: \"Path '/a' has version 0, not 6 as required\"",
+              getResponse(39, 2).tree());
+    // version 0 requires that the file not exist, even though the file
+    // written under version 2 has no version yet
+    command.mutable_tree()->mutable_condition()->set_version(0);
+    command.mutable_tree()->mutable_exactly_once()->set_rpc_number(3);
+    entry.command = serialize(command);
+    stateMachine->apply(entry);
+    EXPECT_EQ("status: CONDITION_NOT_MET "
+              "error: \"Path '/a' exists, but version 0 requires that it "
+              "does not\"",
+              getResponse(39, 3).tree());
+    command.mutable_tree()->clear_condition();
+    command.mutable_tree()->mutable_exactly_once()->set_rpc_number(4);
+    entry.command = serialize(command);
+    stateMachine->apply(entry);
+    stateMachine->tree.read("/a", contents, version);
+    EXPECT_EQ("y", contents);
+    EXPECT_EQ(7U, version);
+}
+
+TEST_F(ServerStateMachineTest, apply_tree_atomicOps)
+{
+    stateMachine->openSession(39, 0);
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    entry.clusterTime = 2;
+    StateMachine::Command::Request command =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 1 "
+            "  rpc_number: 1 "
+            " } "
+            " increment { "
+            "  path: '/a' "
+            "  delta: 3 "
+            " } "
+            "}");
+    entry.command = serialize(command);
+
+    // version 3 rejects the operation
+    Core::Debug::setLogPolicy({
+        {"Server/StateMachine.cc", "ERROR"},
+        {"", "WARNING"},
+    });
+    stateMachine->versionHistory.insert({5, 3});
+    stateMachine->apply(entry);
+    Core::Debug::setLogPolicy({
+        {"", "WARNING"},
+    });
+    EXPECT_EQ(1U, stateMachine->numUnknownRequests);
+    EXPECT_EQ("status: INVALID_ARGUMENT "
+              "error: 'The cluster does not yet support this operation "
+              "(requires state machine version 4)'",
+              getResponse(39, 1).tree());
+
+    // version 4 applies it
+    stateMachine->versionHistory.insert({6, 4});
+    entry.index = 7;
+    command.mutable_tree()->mutable_exactly_once()->set_rpc_number(2);
+    entry.command = serialize(command);
+    stateMachine->apply(entry);
+    EXPECT_EQ("status: OK "
+              "increment { value: 3 }",
+              getResponse(39, 2).tree());
+    std::string contents;
+    stateMachine->tree.read("/a", contents);
+    EXPECT_EQ("3", contents);
+}
+
+TEST_F(ServerStateMachineTest, apply_tree_ephemeral)
+{
+    stateMachine->openSession(39, 0);
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    entry.clusterTime = 2;
+    StateMachine::Command::Request command =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 1 "
+            "  rpc_number: 1 "
+            " } "
+            " write { "
+            "  path: '/a' "
+            "  contents: 'x' "
+            "  ephemeral: true "
+            " } "
+            "}");
+    entry.command = serialize(command);
+
+    // version 7 writes a regular file
+    Core::Debug::setLogPolicy({
+        {"Server/StateMachine.cc", "ERROR"},
+        {"", "WARNING"},
+    });
+    stateMachine->versionHistory.insert({5, 7});
+    stateMachine->apply(entry);
+    Core::Debug::setLogPolicy({
+        {"", "WARNING"},
+    });
+    EXPECT_EQ(1U, stateMachine->numUnknownRequests);
+    EXPECT_EQ("status: OK version: 6", getResponse(39, 1).tree());
+    EXPECT_TRUE(stateMachine->tree.ownedFiles.empty());
+
+    // version 8 makes it ephemeral
+    stateMachine->versionHistory.insert({6, 8});
+    entry.index = 7;
+    command.mutable_tree()->mutable_exactly_once()->set_rpc_number(2);
+    entry.command = serialize(command);
+    stateMachine->apply(entry);
+    EXPECT_EQ("status: OK version: 7", getResponse(39, 2).tree());
+    EXPECT_EQ((std::set<std::string> { "/a" }),
+              stateMachine->tree.ownedFiles[39]);
+}
+
+TEST_F(ServerStateMachineTest, apply_tree_ttl)
+{
+    stateMachine->openSession(39, 0);
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    entry.clusterTime = 2;
+    StateMachine::Command::Request command =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 1 "
+            "  rpc_number: 1 "
+            " } "
+            " write { "
+            "  path: '/a' "
+            "  contents: 'x' "
+            "  ttl_nanos: 10 "
+            " } "
+            "}");
+    entry.command = serialize(command);
+
+    // version 8 writes a file that doesn't expire
+    Core::Debug::setLogPolicy({
+        {"Server/StateMachine.cc", "ERROR"},
+        {"", "WARNING"},
+    });
+    stateMachine->versionHistory.insert({5, 8});
+    stateMachine->apply(entry);
+    Core::Debug::setLogPolicy({
+        {"", "WARNING"},
+    });
+    EXPECT_EQ(1U, stateMachine->numUnknownRequests);
+    EXPECT_EQ("status: OK version: 6", getResponse(39, 1).tree());
+    EXPECT_EQ(0U, stateMachine->tree.getNextExpiration());
+
+    // version 9 expires it on cluster time
+    stateMachine->versionHistory.insert({6, 9});
+    entry.index = 7;
+    entry.clusterTime = 5;
+    command.mutable_tree()->mutable_exactly_once()->set_rpc_number(2);
+    entry.command = serialize(command);
+    stateMachine->apply(entry);
+    EXPECT_EQ("status: OK version: 7", getResponse(39, 2).tree());
+    EXPECT_EQ(15U, stateMachine->tree.getNextExpiration());
+}
+
+TEST_F(ServerStateMachineTest, apply_treeBatch)
+{
+    stateMachine->openSession(39, 0);
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    entry.clusterTime = 2;
+    StateMachine::Command::Request command =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree_batch { "
+            " exactly_once { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 1 "
+            "  rpc_number: 1 "
+            " } "
+            " append { path: '/a' contents: 'x' } "
+            "} "
+            "tree_batch { "
+            " exactly_once { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 1 "
+            "  rpc_number: 2 "
+            " } "
+            " append { path: '/a' contents: 'y' } "
+            "}");
+    entry.command = serialize(command);
+    std::string contents;
+
+    // version 5 ignores the whole command
+    Core::Debug::setLogPolicy({
+        {"Server/StateMachine.cc", "ERROR"},
+        {"", "WARNING"},
+    });
+    stateMachine->versionHistory.insert({5, 5});
+    stateMachine->apply(entry);
+    Core::Debug::setLogPolicy({
+        {"", "WARNING"},
+    });
+    EXPECT_EQ(1U, stateMachine->numUnknownRequests);
+    EXPECT_EQ(0U, stateMachine->sessions.at(39).responses.size());
+
+    // version 6 applies each operation
+    stateMachine->versionHistory.insert({6, 6});
+    entry.index = 7;
+    stateMachine->apply(entry);
+    stateMachine->tree.read("/a", contents);
+    EXPECT_EQ("xy", contents);
+    EXPECT_EQ("status: OK version: 7",
+              getResponse(39, 1).tree());
+    EXPECT_EQ("status: OK version: 7",
+              getResponse(39, 2).tree());
+
+    // a retried batch only applies the operations not yet applied
+    StateMachine::Command::Request retry = command;
+    retry.mutable_tree_batch(0)->mutable_append()->set_contents("z");
+    retry.mutable_tree_batch(1)->mutable_exactly_once()->
+        set_first_outstanding_rpc(2);
+    retry.mutable_tree_batch(1)->mutable_exactly_once()->set_rpc_number(3);
+    entry.index = 8;
+    entry.command = serialize(retry);
+    stateMachine->apply(entry);
+    stateMachine->tree.read("/a", contents);
+    EXPECT_EQ("xyy", contents);
+    EXPECT_EQ(2U, stateMachine->sessions.at(39).responses.size());
+}
+
 TEST_F(ServerStateMachineTest, apply_openSession)
 {
     stateMachine->sessionTimeoutNanos = 1;
-    stateMachine->sessions.insert({1, {}});
+    stateMachine->openSession(1, 0);
     StateMachine::Command::Request command =
         Core::ProtoBuf::fromString<StateMachine::Command::Request>(
             "open_session: {}");
@@ -469,9 +891,9 @@ TEST_F(ServerStateMachineTest, apply_openSession)
 
 TEST_F(ServerStateMachineTest, apply_closeSession)
 {
-    stateMachine->sessions.insert({2, {}});
-    stateMachine->sessions.insert({3, {}});
-    stateMachine->sessions.insert({4, {}});
+    stateMachine->openSession(2, 0);
+    stateMachine->openSession(3, 0);
+    stateMachine->openSession(4, 0);
     StateMachine::Command::Request command;
     command.mutable_close_session()->set_client_id(3);
 
@@ -512,6 +934,54 @@ TEST_F(ServerStateMachineTest, apply_closeSession)
 }
 
 
+TEST_F(ServerStateMachineTest, apply_renewSessions)
+{
+    StateMachine::Session& session = stateMachine->openSession(2, 0);
+    stateMachine->openSession(3, 1);
+    StateMachine::Command::Response cached;
+    cached.mutable_tree()->set_status(Protocol::Client::Status::OK);
+    stateMachine->saveResponse(session, 1, cached);
+    stateMachine->saveResponse(session, 2, cached);
+    StateMachine::Command::Request command =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "renew_sessions { "
+            "  client_id: 2 client_id: 4 "
+            "  first_outstanding_rpc: 2 first_outstanding_rpc: 1 "
+            "}");
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    entry.command = serialize(command);
+    entry.clusterTime = 5;
+
+    // version 6 ignores the command
+    Core::Debug::setLogPolicy({
+        {"Server/StateMachine.cc", "ERROR"},
+        {"", "WARNING"},
+    });
+    stateMachine->versionHistory.insert({4, 6});
+    stateMachine->apply(entry);
+    EXPECT_EQ(0U, stateMachine->sessions.at(2).lastModified);
+    EXPECT_EQ((std::vector<uint64_t>{1U, 2U}),
+              Core::STLUtil::getKeys(session.responses));
+    Core::Debug::setLogPolicy({
+        {"", "WARNING"},
+    });
+
+    // version 7 renews existing sessions without opening new ones, and
+    // discards the responses their clients have received
+    stateMachine->versionHistory.insert({5, 7});
+    stateMachine->apply(entry);
+    EXPECT_EQ(5U, stateMachine->sessions.at(2).lastModified);
+    EXPECT_EQ(2U, session.firstOutstandingRPC);
+    EXPECT_EQ((std::vector<uint64_t>{2U}),
+              Core::STLUtil::getKeys(session.responses));
+    EXPECT_EQ(1U, stateMachine->sessions.at(3).lastModified);
+    EXPECT_EQ(0U, stateMachine->sessions.count(4));
+    EXPECT_EQ((std::set<std::pair<uint64_t, uint64_t>>{{1, 3}, {5, 2}}),
+              stateMachine->sessionExpiry);
+}
+
 TEST_F(ServerStateMachineTest, apply_advanceVersion)
 {
     RaftConsensus::Entry entry;
@@ -548,6 +1018,35 @@ TEST_F(ServerStateMachineTest, apply_advanceVersion)
     EXPECT_EQ(2U, stateMachine->getVersion(10000));
 }
 
+TEST_F(ServerStateMachineTest, apply_advanceClusterTime)
+{
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    entry.clusterTime = 2;
+    StateMachine::Command::Request command;
+    command.mutable_advance_cluster_time();
+    entry.command = serialize(command);
+
+    // version 8 doesn't know the command
+    Core::Debug::setLogPolicy({
+        {"Server/StateMachine.cc", "ERROR"},
+        {"", "WARNING"},
+    });
+    stateMachine->versionHistory.insert({5, 8});
+    stateMachine->apply(entry);
+    Core::Debug::setLogPolicy({
+        {"", "WARNING"},
+    });
+    EXPECT_EQ(1U, stateMachine->numUnknownRequests);
+
+    // version 9 accepts it silently
+    stateMachine->versionHistory.insert({6, 9});
+    entry.index = 7;
+    stateMachine->apply(entry);
+    EXPECT_EQ(1U, stateMachine->numUnknownRequests);
+}
+
 TEST_F(ServerStateMachineTest, apply_unknown)
 {
     StateMachine::Command::Request command =
@@ -601,27 +1100,29 @@ TEST_F(ServerStateMachineTest, serializeSessions)
     StateMachine::Command::Response r2;
     r2.mutable_tree()->set_status(Protocol::Client::Status::TYPE_ERROR);
 
-    StateMachine::Session s1;
-    s1.lastModified = 6;
+    StateMachine::Session& s1 = stateMachine->openSession(4, 6);
     s1.firstOutstandingRPC = 5;
-    s1.responses.insert({5, r1});
-    s1.responses.insert({7, r2});
-    stateMachine->sessions.insert({4, s1});
+    stateMachine->saveResponse(s1, 5, r1);
+    stateMachine->saveResponse(s1, 7, r2);
 
-    StateMachine::Session s2;
+    StateMachine::Session& s2 = stateMachine->openSession(80, 0);
     s2.firstOutstandingRPC = 9;
-    s2.responses.insert({10, r2});
-    s2.responses.insert({11, r1});
-    stateMachine->sessions.insert({80, s2});
+    stateMachine->saveResponse(s2, 10, r2);
+    stateMachine->saveResponse(s2, 11, r1);
 
-    StateMachine::Session s3;
+    StateMachine::Session& s3 = stateMachine->openSession(91, 0);
     s3.firstOutstandingRPC = 6;
-    stateMachine->sessions.insert({91, s3});
+    Protocol::Client::ReadWriteTree::Request deferred;
+    deferred.mutable_exactly_once()->set_client_id(91);
+    deferred.mutable_exactly_once()->set_first_outstanding_rpc(6);
+    deferred.mutable_exactly_once()->set_rpc_number(7);
+    deferred.mutable_make_directory()->set_path("/a");
+    s3.deferred[7] = deferred.SerializeAsString();
 
     SnapshotStateMachine::Header header;
     stateMachine->serializeSessions(header);
 
-    stateMachine->sessions.at(80).responses.at(10) = r1;
+    stateMachine->saveResponse(stateMachine->sessions.at(80), 10, r1);
     stateMachine->sessions.at(80).firstOutstandingRPC = 10;
 
     stateMachine->loadSessions(header);
@@ -637,18 +1138,30 @@ TEST_F(ServerStateMachineTest, serializeSessions)
               Core::STLUtil::sorted(
                 Core::STLUtil::getKeys(
                     stateMachine->sessions.at(4).responses)));
-    EXPECT_EQ(r1, stateMachine->sessions.at(4).responses.at(5));
-    EXPECT_EQ(r2, stateMachine->sessions.at(4).responses.at(7));
+    EXPECT_EQ(r1, getResponse(4, 5));
+    EXPECT_EQ(r2, getResponse(4, 7));
     EXPECT_EQ((std::vector<std::uint64_t>{10, 11}),
               Core::STLUtil::sorted(
                 Core::STLUtil::getKeys(
                     stateMachine->sessions.at(80).responses)));
-    EXPECT_EQ(r2, stateMachine->sessions.at(80).responses.at(10));
-    EXPECT_EQ(r1, stateMachine->sessions.at(80).responses.at(11));
+    EXPECT_EQ(r2, getResponse(80, 10));
+    EXPECT_EQ(r1, getResponse(80, 11));
+    EXPECT_EQ(stateMachine->sessions.at(80).responses.at(10).size() +
+              stateMachine->sessions.at(80).responses.at(11).size(),
+              stateMachine->sessions.at(80).responseBytes);
+    EXPECT_EQ((std::vector<std::uint64_t>{7}),
+              Core::STLUtil::getKeys(stateMachine->sessions.at(91).deferred));
+    EXPECT_EQ(deferred.SerializeAsString(),
+              stateMachine->sessions.at(91).deferred.at(7));
     EXPECT_EQ((std::vector<std::uint64_t>{}),
               Core::STLUtil::sorted(
                 Core::STLUtil::getKeys(
                     stateMachine->sessions.at(91).responses)));
+    stateMachine->sessionTimeoutNanos = 1;
+    stateMachine->expireSessions(5);
+    EXPECT_EQ((std::vector<std::uint64_t>{4}),
+              Core::STLUtil::sorted(
+                Core::STLUtil::getKeys(stateMachine->sessions)));
 }
 
 TEST_F(ServerStateMachineTest, serializeVersionHistory)
@@ -671,7 +1184,7 @@ TEST_F(ServerStateMachineTest, serializeVersionHistory)
 
 TEST_F(ServerStateMachineTest, expireResponses)
 {
-    stateMachine->sessions.insert({1, {}});
+    stateMachine->openSession(1, 0);
     StateMachine::Session& session = stateMachine->sessions.at(1);
     session.responses.insert({1, {}});
     session.responses.insert({2, {}});
@@ -685,22 +1198,181 @@ TEST_F(ServerStateMachineTest, expireResponses)
                   Core::STLUtil::getKeys(session.responses)));
 }
 
+TEST_F(ServerStateMachineTest, apply_tree_deferred)
+{
+    StateMachine::Session& session = stateMachine->openSession(39, 0);
+    StateMachine::Command::Response big;
+    big.mutable_tree()->set_status(Protocol::Client::Status::OK);
+    big.mutable_tree()->set_error(
+        std::string(StateMachine::MAX_RESPONSE_BYTES_PER_SESSION, 'x'));
+    stateMachine->saveResponse(session, 2, big);
+    uint64_t size = session.responses.at(2).size();
+    stateMachine->versionHistory.insert({5, 5});
+
+    RaftConsensus::Entry entry;
+    entry.index = 6;
+    entry.type = RaftConsensus::Entry::DATA;
+    entry.clusterTime = 2;
+    StateMachine::Command::Request command =
+        Core::ProtoBuf::fromString<StateMachine::Command::Request>(
+            "tree: { "
+            " exactly_once: { "
+            "  client_id: 39 "
+            "  first_outstanding_rpc: 1 "
+            "  rpc_number: 3 "
+            " } "
+            " make_directory { "
+            "  path: '/a' "
+            " } "
+            "}");
+    entry.command = serialize(command);
+    std::vector<std::string> children;
+    StateMachine::Command::Response response;
+    bool deferred = false;
+
+    // the session is full, so RPC 3 is deferred
+    stateMachine->apply(entry);
+    stateMachine->tree.listDirectory("/", children);
+    EXPECT_EQ((std::vector<std::string> {}), children);
+    EXPECT_EQ((std::vector<uint64_t>{2U}),
+              Core::STLUtil::getKeys(session.responses));
+    EXPECT_EQ((std::vector<uint64_t>{3U}),
+              Core::STLUtil::getKeys(session.deferred));
+    EXPECT_TRUE(stateMachine->waitForResponse(0, command, response,
+                                              deferred));
+    EXPECT_TRUE(deferred);
+
+    Protocol::ServerStats stats;
+    stateMachine->updateServerStats(stats);
+    EXPECT_EQ(1U, stats.state_machine().num_session_responses());
+    EXPECT_EQ(size, stats.state_machine().session_response_bytes());
+    EXPECT_LT(size, stats.state_machine().session_table_bytes());
+
+    // the first outstanding RPC is never deferred
+    command.mutable_tree()->mutable_exactly_once()->set_rpc_number(1);
+    command.mutable_tree()->mutable_make_directory()->set_path("/b");
+    entry.index = 7;
+    entry.command = serialize(command);
+    stateMachine->apply(entry);
+    EXPECT_EQ((std::vector<uint64_t>{1U, 2U}),
+              Core::STLUtil::getKeys(session.responses));
+    response.Clear();
+    EXPECT_TRUE(stateMachine->waitForResponse(0, command, response,
+                                              deferred));
+    EXPECT_FALSE(deferred);
+    EXPECT_EQ("tree { status: OK }", response);
+
+    // once the client is done with RPCs 1 and 2, its next command lets RPC 3
+    // be applied without being sent again
+    command.mutable_tree()->mutable_exactly_once()->set_rpc_number(4);
+    command.mutable_tree()->mutable_exactly_once()->
+        set_first_outstanding_rpc(3);
+    command.mutable_tree()->mutable_make_directory()->set_path("/c");
+    entry.index = 8;
+    entry.command = serialize(command);
+    stateMachine->apply(entry);
+    stateMachine->tree.listDirectory("/", children);
+    EXPECT_EQ((std::vector<std::string> {"a/", "b/", "c/"}), children);
+    EXPECT_EQ((std::vector<uint64_t>{3U, 4U}),
+              Core::STLUtil::getKeys(session.responses));
+    EXPECT_TRUE(session.deferred.empty());
+    command.mutable_tree()->mutable_exactly_once()->set_rpc_number(3);
+    response.Clear();
+    EXPECT_TRUE(stateMachine->waitForResponse(0, command, response,
+                                              deferred));
+    EXPECT_FALSE(deferred);
+    EXPECT_EQ("tree { status: OK }", response);
+}
+
+TEST_F(ServerStateMachineTest, applyDeferred)
+{
+    StateMachine::Session& session = stateMachine->openSession(39, 0);
+    StateMachine::Command::Response big;
+    big.mutable_tree()->set_error(
+        std::string(StateMachine::MAX_RESPONSE_BYTES_PER_SESSION, 'x'));
+    stateMachine->saveResponse(session, 6, big);
+    session.firstOutstandingRPC = 4;
+    for (uint64_t rpcNumber = 3; rpcNumber <= 8; ++rpcNumber) {
+        Protocol::Client::ReadWriteTree::Request request;
+        request.mutable_exactly_once()->set_client_id(39);
+        request.mutable_exactly_once()->set_first_outstanding_rpc(3);
+        request.mutable_exactly_once()->set_rpc_number(rpcNumber);
+        request.mutable_make_directory()->set_path(
+            "/" + std::to_string(rpcNumber));
+        session.deferred[rpcNumber] = request.SerializeAsString();
+    }
+
+    RaftConsensus::Entry entry;
+    entry.index = 9;
+    entry.clusterTime = 5;
+    stateMachine->applyDeferred(entry, 5, 39, session);
+    // RPC 3 is dropped, RPC 4 is applied since it's the first outstanding
+    // RPC, RPC 5 is deferred again since the session is full, and RPC 6
+    // already has a response.
+    std::vector<std::string> children;
+    stateMachine->tree.listDirectory("/", children);
+    EXPECT_EQ((std::vector<std::string> {"4/"}), children);
+    EXPECT_EQ((std::vector<uint64_t>{4U, 6U}),
+              Core::STLUtil::getKeys(session.responses));
+    EXPECT_EQ((std::vector<uint64_t>{5U, 6U, 7U, 8U}),
+              Core::STLUtil::getKeys(session.deferred));
+    EXPECT_EQ(5U, session.lastModified);
+
+    stateMachine->expireResponses(session, 7);
+    stateMachine->applyDeferred(entry, 5, 39, session);
+    stateMachine->tree.listDirectory("/", children);
+    EXPECT_EQ((std::vector<std::string> {"4/", "7/", "8/"}), children);
+    EXPECT_EQ((std::vector<uint64_t>{7U, 8U}),
+              Core::STLUtil::getKeys(session.responses));
+    EXPECT_TRUE(session.deferred.empty());
+}
+
 TEST_F(ServerStateMachineTest, expireSessions)
 {
+    std::string contents;
     stateMachine->sessionTimeoutNanos = 1;
-    stateMachine->sessions.insert({1, {}});
-    stateMachine->sessions.at(1).lastModified = 100;
-    stateMachine->sessions.insert({2, {}});
-    stateMachine->sessions.at(2).lastModified = 400;
-    stateMachine->sessions.insert({3, {}});
-    stateMachine->sessions.at(3).lastModified = 200;
-    stateMachine->sessions.insert({4, {}});
-    stateMachine->sessions.at(4).lastModified = 201;
-    stateMachine->sessions.insert({5, {}});
+    stateMachine->openSession(1, 100);
+    stateMachine->openSession(2, 400);
+    stateMachine->openSession(3, 0);
+    stateMachine->touchSession(3, stateMachine->sessions.at(3), 200);
+    stateMachine->openSession(4, 201);
+    stateMachine->openSession(5, 0);
+    stateMachine->openSession(6, 300);
+    stateMachine->tree.write("/a", "x", 1, 0);
+    stateMachine->tree.write("/b", "x", 4, 0);
+    stateMachine->tree.write("/c", "x", 6, 0);
+    stateMachine->closeSession(6);
+    EXPECT_EQ(Tree::Status::LOOKUP_ERROR,
+              stateMachine->tree.read("/c", contents).status);
     stateMachine->expireSessions(202);
     EXPECT_EQ((std::vector<uint64_t>{2U, 4U}),
               Core::STLUtil::sorted(
                   Core::STLUtil::getKeys(stateMachine->sessions)));
+    EXPECT_EQ((std::set<std::pair<uint64_t, uint64_t>>{{201, 4}, {400, 2}}),
+              stateMachine->sessionExpiry);
+    EXPECT_EQ(Tree::Status::LOOKUP_ERROR,
+              stateMachine->tree.read("/a", contents).status);
+    EXPECT_EQ(Tree::Status::OK,
+              stateMachine->tree.read("/b", contents).status);
+}
+
+TEST_F(ServerStateMachineTest, expireFiles)
+{
+    stateMachine->tree.setCurrentTime(0);
+    stateMachine->tree.write("/a", "x", 0, 5);
+    stateMachine->tree.write("/b", "x", 0, 10);
+    stateMachine->tree.write("/c", "x");
+    stateMachine->tree.setCurrentTime(7);
+    stateMachine->expireFiles(7);
+    std::vector<std::string> children;
+    EXPECT_EQ(Tree::Status::OK,
+              stateMachine->tree.listDirectory("/", children).status);
+    EXPECT_EQ((std::vector<std::string> {"b", "c"}), children);
+    stateMachine->tree.setCurrentTime(10);
+    stateMachine->expireFiles(10);
+    EXPECT_EQ(Tree::Status::OK,
+              stateMachine->tree.listDirectory("/", children).status);
+    EXPECT_EQ((std::vector<std::string> {"c"}), children);
 }
 
 TEST_F(ServerStateMachineTest, getVersion)
@@ -755,12 +1427,12 @@ TEST_F(ServerStateMachineTest, loadSnapshot_unknownFormatVersion)
 
 TEST_F(ServerStateMachineTest, loadVersionHistory_unknownVersion)
 {
-    stateMachine->versionHistory.insert({1, 3});
+    stateMachine->versionHistory.insert({1, 10});
     SnapshotStateMachine::Header header;
     stateMachine->serializeVersionHistory(header);
     EXPECT_DEATH(stateMachine->loadVersionHistory(header),
-                 "State machine version read from snapshot was 3, but this "
-                 "code only supports 1 through 2");
+                 "State machine version read from snapshot was 10, but this "
+                 "code only supports 1 through 9");
 }
 
 struct SnapshotThreadMainHelper {
@@ -924,11 +1596,51 @@ TEST_F(ServerStateMachineTest, snapshotWatchdogThreadMain)
     EXPECT_EQ(7U, helper.count);
 }
 
+struct ExpiryThreadMainHelper {
+    explicit ExpiryThreadMainHelper(StateMachine& stateMachine)
+        : stateMachine(stateMachine)
+        , iter(0)
+    {
+    }
+    void operator()() {
+        typedef Core::Time::SteadyClock Clock;
+        ++iter;
+        if (iter == 1) {
+            // waiting for the file to be due
+            EXPECT_EQ(Clock::mockValue + std::chrono::nanoseconds(50),
+                      stateMachine.entriesApplied.lastWaitUntil);
+            Clock::mockValue += std::chrono::nanoseconds(50);
+        } else if (iter == 2) {
+            // failed to append an AdvanceClusterTime command, backing off
+            EXPECT_EQ(Clock::mockValue + std::chrono::seconds(1),
+                      stateMachine.entriesApplied.lastWaitUntil);
+            stateMachine.exiting = true;
+        }
+    }
+    StateMachine& stateMachine;
+    uint64_t iter;
+};
+
+TEST_F(ServerStateMachineTest, expiryThreadMain)
+{
+    Core::Time::SteadyClock::mockValue = Core::Time::SteadyClock::now();
+    stateMachine->tree.setCurrentTime(50);
+    stateMachine->tree.write("/a", "x", 0, 50);
+    stateMachine->lastAppliedClusterTime = 50;
+    stateMachine->lastAppliedAt = Core::Time::SteadyClock::mockValue;
+    // replicate() returns NOT_LEADER once consensus is exiting
+    consensus->exit();
+    ExpiryThreadMainHelper helper(*stateMachine);
+    stateMachine->entriesApplied.callback = std::ref(helper);
+    stateMachine->expiryThreadMain();
+    EXPECT_EQ(2U, helper.iter);
+}
+
 TEST_F(ServerStateMachineTest, takeSnapshot)
 {
     EXPECT_EQ(0U, consensus->lastSnapshotIndex);
     stateMachine->tree.makeDirectory("/foo");
-    stateMachine->sessions.insert({4, {}});
+    stateMachine->openSession(4, 0);
     {
         std::unique_lock<Core::Mutex> lockGuard(stateMachine->mutex);
         stateMachine->takeSnapshot(1, lockGuard);
@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -165,6 +166,7 @@ Writer::Writer(const Storage::Layout& storageLayout)
     , stagingName()
     , file()
     , bytesWritten(0)
+    , rangesAhead()
     , sharedBytesWritten()
 {
     struct timespec now =
@@ -212,6 +214,10 @@ Writer::save()
 {
     if (file.fd < 0)
         PANIC("File already closed");
+    if (!rangesAhead.empty()) {
+        PANIC("Saving %s with a gap after byte %lu",
+              file.path.c_str(), bytesWritten);
+    }
     FilesystemUtil::fsync(file);
     uint64_t fileSize = FilesystemUtil::getSize(file);
     file.close();
@@ -259,6 +265,52 @@ Writer::writeRaw(const void* data, uint64_t length)
     *sharedBytesWritten.value += Core::Util::downCast<uint64_t>(r);
 }
 
+void
+Writer::writeRawAt(uint64_t offset, const void* data, uint64_t length)
+{
+    const char* bytes = static_cast<const char*>(data);
+    if (offset < bytesWritten) {
+        uint64_t overlap = std::min(length, bytesWritten - offset);
+        offset += overlap;
+        bytes += overlap;
+        length -= overlap;
+    }
+    if (length == 0)
+        return;
+    if (offset == bytesWritten && rangesAhead.empty()) {
+        writeRaw(bytes, length);
+        return;
+    }
+
+    if (lseek64(file.fd, Core::Util::downCast<off64_t>(offset),
+                SEEK_SET) < 0) {
+        PANIC("lseek failed: %s", strerror(errno));
+    }
+    ssize_t r = FilesystemUtil::write(file.fd, bytes, length);
+    if (r < 0) {
+        PANIC("Could not write raw data into %s: %s",
+              file.path.c_str(),
+              strerror(errno));
+    }
+    uint64_t& end = rangesAhead[offset];
+    end = std::max(end, offset + length);
+
+    // Advance over whatever is now contiguous, then put the file offset back
+    // where writeRaw() expects it. Only the bytes that extend the contiguous
+    // prefix count as progress, so chunks that arrive more than once don't
+    // inflate #sharedBytesWritten.
+    uint64_t before = bytesWritten;
+    while (!rangesAhead.empty() && rangesAhead.begin()->first <= bytesWritten) {
+        bytesWritten = std::max(bytesWritten, rangesAhead.begin()->second);
+        rangesAhead.erase(rangesAhead.begin());
+    }
+    *sharedBytesWritten.value += bytesWritten - before;
+    if (lseek64(file.fd, Core::Util::downCast<off64_t>(bytesWritten),
+                SEEK_SET) < 0) {
+        PANIC("lseek failed: %s", strerror(errno));
+    }
+}
+
 } // namespace LogCabin::Storage::SnapshotFile
 } // namespace LogCabin::Storage
 } // namespace LogCabin
@@ -15,6 +15,7 @@
  */
 
 #include <google/protobuf/message.h>
+#include <map>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -146,6 +147,20 @@ class Writer : public Core::ProtoBuf::OutputStream {
     void writeMessage(const google::protobuf::Message& message);
     // See Core::ProtoBuf::OutputStream.
     void writeRaw(const void* data, uint64_t length);
+    /**
+     * Write raw bytes at the given offset in the file, which may be past
+     * getBytesWritten(). Such data is written in place right away, but it
+     * only counts towards getBytesWritten() once the gap before it has been
+     * filled. Any part of the data before getBytesWritten() is skipped.
+     * This is used to receive a file whose chunks may arrive out of order.
+     * \param offset
+     *      Byte offset in the file at which 'data' belongs.
+     * \param data
+     *      The bytes to write.
+     * \param length
+     *      The number of bytes in 'data'.
+     */
+    void writeRawAt(uint64_t offset, const void* data, uint64_t length);
 
   private:
     /// A handle to the directory containing the snapshot. Used for renameat on
@@ -155,13 +170,18 @@ class Writer : public Core::ProtoBuf::OutputStream {
     std::string stagingName;
     /// Wraps the raw file descriptor; in charge of closing it when done.
     Storage::FilesystemUtil::File file;
-    /// The number of bytes accumulated in the file so far.
+    /// The number of bytes accumulated in the file so far, not counting
+    /// those in #rangesAhead.
     uint64_t bytesWritten;
+    /// Ranges of the file past #bytesWritten that writeRawAt() has filled in,
+    /// as a map from start offset to end offset. These may overlap.
+    std::map<uint64_t, uint64_t> rangesAhead;
   public:
     /**
-     * This value is incremented every time bytes are written to the Writer
-     * from any process holding this Writer. Used by Server/StateMachine to
-     * implement a watchdog that checks progress of a snapshotting process.
+     * This value is incremented every time the contiguous prefix of the file
+     * grows, from any process holding this Writer. Used by
+     * Server/StateMachine to implement a watchdog that checks progress of a
+     * snapshotting process.
      */
     SharedMMap<std::atomic<uint64_t>> sharedBytesWritten;
 
@@ -289,6 +289,47 @@ TEST_F(StorageSnapshotFileTest, sharedBytesWritten)
 
 }
 
+TEST_F(StorageSnapshotFileTest, writeRawAt)
+{
+    {
+        Writer writer(layout);
+        writer.writeRawAt(0, "he", 2);
+        EXPECT_EQ(2U, writer.getBytesWritten());
+        // ahead of the gap
+        writer.writeRawAt(7, "world", 5);
+        EXPECT_EQ(2U, writer.getBytesWritten());
+        writer.writeRawAt(9, "rld!", 4);
+        EXPECT_EQ(2U, writer.getBytesWritten());
+        EXPECT_EQ(2U, *writer.sharedBytesWritten.value);
+        // partly stale, fills the gap
+        writer.writeRawAt(1, "ello, ", 6);
+        EXPECT_EQ(13U, writer.getBytesWritten());
+        EXPECT_EQ(13U, *writer.sharedBytesWritten.value);
+        // entirely stale
+        writer.writeRawAt(3, "lo", 2);
+        EXPECT_EQ(13U, writer.getBytesWritten());
+        EXPECT_EQ(13U, *writer.sharedBytesWritten.value);
+        // in order again
+        writer.writeRaw("?", 1);
+        EXPECT_EQ(14U, writer.getBytesWritten());
+        EXPECT_EQ(14U, *writer.sharedBytesWritten.value);
+        writer.save();
+    }
+    {
+        Reader reader(layout);
+        char buf[15] = {0};
+        EXPECT_EQ(14U, reader.readRaw(buf, sizeof(buf)));
+        EXPECT_STREQ("hello, world!?", buf);
+    }
+}
+
+TEST_F(StorageSnapshotFileTest, writeRawAt_saveWithGap)
+{
+    Writer writer(layout);
+    writer.writeRawAt(3, "x", 1);
+    EXPECT_DEATH(writer.save(), "gap after byte 0");
+    writer.discard();
+}
 
 // writeMessage tested with readMessage above
 
@@ -23,6 +23,22 @@ namespace ProtoBuf {
 
 namespace PC = LogCabin::Protocol::Client;
 
+namespace {
+
+/**
+ * Evaluate the predicate from a request against the tree.
+ */
+Result
+checkCondition(const Tree& tree, const PC::TreeCondition& condition)
+{
+    if (condition.has_version())
+        return tree.checkCondition(condition.path(), condition.version());
+    else
+        return tree.checkCondition(condition.path(), condition.contents());
+}
+
+} // anonymous namespace
+
 void
 readOnlyTreeRPC(const Tree& tree,
                 const PC::ReadOnlyTree::Request& request,
@@ -30,21 +46,47 @@ readOnlyTreeRPC(const Tree& tree,
 {
     Result result;
     if (request.has_condition()) {
-        result = tree.checkCondition(request.condition().path(),
-                                     request.condition().contents());
+        result = checkCondition(tree, request.condition());
     }
     if (result.status != Status::OK) {
         // condition does not match, skip
     } else if (request.has_list_directory()) {
         std::vector<std::string> children;
+        bool more = false;
         result = tree.listDirectory(request.list_directory().path(),
-                                    children);
+                                    request.list_directory().start_after(),
+                                    request.list_directory().prefix(),
+                                    request.list_directory().limit(),
+                                    children,
+                                    more);
         for (auto it = children.begin(); it != children.end(); ++it)
             response.mutable_list_directory()->add_child(*it);
+        if (more)
+            response.mutable_list_directory()->set_more(true);
+    } else if (request.has_read() &&
+               (request.read().has_offset() || request.read().has_length())) {
+        uint64_t version;
+        uint64_t size;
+        result = tree.read(request.read().path(),
+                           request.read().offset(),
+                           request.read().length(),
+                           *response.mutable_read()->mutable_contents(),
+                           version, size);
+        response.mutable_read()->set_version(version);
+        response.mutable_read()->set_size(size);
     } else if (request.has_read()) {
-        std::string contents;
-        result = tree.read(request.read().path(), contents);
-        response.mutable_read()->set_contents(contents);
+        uint64_t version;
+        uint64_t owner;
+        uint64_t expiresAt;
+        // Read straight into the response to avoid copying large files twice.
+        result = tree.read(request.read().path(),
+                           *response.mutable_read()->mutable_contents(),
+                           version, owner, expiresAt);
+        response.mutable_read()->set_version(version);
+        if (owner != 0)
+            response.mutable_read()->set_ephemeral(true);
+        if (expiresAt != 0)
+            response.mutable_read()->set_expires(true);
     } else {
         PANIC("Unexpected request: %s",
               Core::ProtoBuf::dumpString(request).c_str());
@@ -61,8 +103,7 @@ readWriteTreeRPC(Tree& tree,
 {
     Result result;
     if (request.has_condition()) {
-        result = tree.checkCondition(request.condition().path(),
-                                     request.condition().contents());
+        result = checkCondition(tree, request.condition());
     }
     if (result.status != Status::OK) {
         // condition does not match, skip
@@ -72,16 +113,43 @@ readWriteTreeRPC(Tree& tree,
         result = tree.removeDirectory(request.remove_directory().path());
     } else if (request.has_write()) {
         result = tree.write(request.write().path(),
-                            request.write().contents());
+                            request.write().contents(),
+                            request.write().ephemeral()
+                                ? request.exactly_once().client_id()
+                                : 0,
+                            request.write().ttl_nanos());
     } else if (request.has_remove_file()) {
         result = tree.removeFile(request.remove_file().path());
+    } else if (request.has_increment()) {
+        int64_t value;
+        result = tree.increment(request.increment().path(),
+                                request.increment().delta(),
+                                value);
+        if (result.status == Status::OK)
+            response.mutable_increment()->set_value(value);
+    } else if (request.has_append()) {
+        result = tree.append(request.append().path(),
+                             request.append().contents());
+    } else if (request.has_compare_and_swap()) {
+        result = tree.compareAndSwap(
+                            request.compare_and_swap().path(),
+                            request.compare_and_swap().old_contents(),
+                            request.compare_and_swap().new_contents(),
+                            request.compare_and_swap().ephemeral()
+                                ? request.exactly_once().client_id()
+                                : 0,
+                            request.compare_and_swap().ttl_nanos());
     } else {
         PANIC("Unexpected request: %s",
               Core::ProtoBuf::dumpString(request).c_str());
     }
     response.set_status(static_cast<PC::Status>(result.status));
-    if (result.status != Status::OK)
+    if (result.status != Status::OK) {
         response.set_error(result.error);
+    } else if ((request.has_write() || request.has_append()) &&
+               tree.getCurrentIndex() != 0) {
+        response.set_version(tree.getCurrentIndex());
+    }
 }
 
 } // namespace LogCabin::Tree::ProtoBuf
@@ -14,7 +14,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <limits>
 
 #include "build/Protocol/ServerStats.pb.h"
 #include "build/Tree/Snapshot.pb.h"
@@ -65,8 +70,14 @@ namespace Internal {
 
 ////////// class File //////////
 
+const uint64_t File::CHUNK_SIZE;
+const uint64_t File::MAX_SIZE;
+
 File::File()
-    : contents()
+    : chunks()
+    , version(0)
+    , owner(0)
+    , expiresAt(0)
 {
 }
 
@@ -74,7 +85,14 @@ void
 File::dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const
 {
     Snapshot::File file;
-    file.set_contents(contents);
+    // The contents are written as a single field so that snapshots stay
+    // readable by older code.
+    file.set_contents(getContents());
+    file.set_version(version);
+    if (owner != 0)
+        file.set_owner(owner);
+    if (expiresAt != 0)
+        file.set_expires_at(expiresAt);
     stream.writeMessage(file);
 }
 
@@ -86,13 +104,89 @@ File::loadSnapshot(Core::ProtoBuf::InputStream& stream)
     if (!error.empty()) {
         PANIC("Couldn't read snapshot: %s", error.c_str());
     }
-    contents = node.contents();
+    setContents(node.contents());
+    version = node.version();
+    owner = node.owner();
+    expiresAt = node.expires_at();
+}
+
+std::string
+File::getContents() const
+{
+    std::string contents;
+    contents.reserve(getSize());
+    for (auto it = chunks.begin(); it != chunks.end(); ++it)
+        contents.append(*it);
+    return contents;
+}
+
+uint64_t
+File::getSize() const
+{
+    if (chunks.empty())
+        return 0;
+    return (chunks.size() - 1) * CHUNK_SIZE + chunks.back().size();
+}
+
+bool
+File::hasContents(const std::string& other) const
+{
+    if (getSize() != other.size())
+        return false;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (other.compare(i * CHUNK_SIZE, CHUNK_SIZE, chunks.at(i)) != 0)
+            return false;
+    }
+    return true;
+}
+
+void
+File::readContents(uint64_t offset,
+                   uint64_t length,
+                   std::string& out) const
+{
+    out.clear();
+    uint64_t size = getSize();
+    if (offset >= size)
+        return;
+    length = std::min(length, size - offset);
+    out.reserve(length);
+    size_t i = offset / CHUNK_SIZE;
+    uint64_t chunkOffset = offset % CHUNK_SIZE;
+    while (out.size() < length) {
+        const std::string& chunk = chunks.at(i);
+        out.append(chunk, chunkOffset, length - out.size());
+        chunkOffset = 0;
+        ++i;
+    }
+}
+
+void
+File::setContents(const std::string& contents)
+{
+    chunks.clear();
+    appendContents(contents);
+}
+
+void
+File::appendContents(const std::string& contents)
+{
+    size_t pos = 0;
+    if (!chunks.empty() && chunks.back().size() < CHUNK_SIZE) {
+        pos = std::min(contents.size(), CHUNK_SIZE - chunks.back().size());
+        chunks.back().append(contents, 0, pos);
+    }
+    while (pos < contents.size()) {
+        chunks.push_back(contents.substr(pos, CHUNK_SIZE));
+        pos += CHUNK_SIZE;
+    }
 }
 
 ////////// class Directory //////////
 
 Directory::Directory()
-    : directories()
+    : version(0)
+    , directories()
     , files()
 {
 }
@@ -108,6 +202,72 @@ Directory::getChildren() const
     return children;
 }
 
+namespace {
+
+/**
+ * Helper for Directory::getChildren() that lists a window of either the
+ * directories or the files map.
+ * \param map
+ *      Directory::directories or Directory::files.
+ * \param suffix
+ *      Appended to each name ("/" for directories).
+ * \param startAfter
+ *      Only names strictly greater than this are listed, or empty to start
+ *      at the beginning. This has no trailing slash.
+ * \param prefix
+ *      Only names beginning with this string are listed.
+ * \param limit
+ *      Stop once 'children' has this many entries, or 0 for no limit.
+ * \param[in,out] children
+ *      Names are appended to this.
+ * \return
+ *      True if the limit was reached with more names remaining.
+ */
+template<typename Map>
+bool
+listWindow(const Map& map,
+           const char* suffix,
+           const std::string& startAfter,
+           const std::string& prefix,
+           uint64_t limit,
+           std::vector<std::string>& children)
+{
+    auto it = (startAfter.empty() || startAfter < prefix)
+                    ? map.lower_bound(prefix)
+                    : map.upper_bound(startAfter);
+    for (; it != map.end(); ++it) {
+        if (!Core::StringUtil::startsWith(it->first, prefix))
+            break;
+        if (limit > 0 && children.size() >= limit)
+            return true;
+        children.push_back(it->first + suffix);
+    }
+    return false;
+}
+
+} // anonymous namespace
+
+bool
+Directory::getChildren(const std::string& startAfter,
+                       const std::string& prefix,
+                       uint64_t limit,
+                       std::vector<std::string>& children) const
+{
+    children.clear();
+    if (startAfter.empty() || Core::StringUtil::endsWith(startAfter, "/")) {
+        std::string dirStartAfter;
+        if (!startAfter.empty())
+            dirStartAfter = startAfter.substr(0, startAfter.size() - 1);
+        if (listWindow(directories, "/", dirStartAfter, prefix,
+                       limit, children)) {
+            return true;
+        }
+        return listWindow(files, "", "", prefix, limit, children);
+    } else {
+        return listWindow(files, "", startAfter, prefix, limit, children);
+    }
+}
+
 Directory*
 Directory::lookupDirectory(const std::string& name)
 {
@@ -181,6 +341,20 @@ Directory::removeFile(const std::string& name)
     return (files.erase(name) > 0);
 }
 
+void
+Directory::findTransientFiles(
+        const std::string& path,
+        std::vector<std::pair<std::string, const File*>>& found) const
+{
+    std::string prefix = (path == "/" ? path : path + "/");
+    for (auto it = directories.begin(); it != directories.end(); ++it)
+        it->second.findTransientFiles(prefix + it->first, found);
+    for (auto it = files.begin(); it != files.end(); ++it) {
+        if (it->second.owner != 0 || it->second.expiresAt != 0)
+            found.push_back({prefix + it->first, &it->second});
+    }
+}
+
 void
 Directory::dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const
 {
@@ -190,6 +364,7 @@ Directory::dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const
         dir.add_directories(it->first);
     for (auto it = files.begin(); it != files.end(); ++it)
         dir.add_files(it->first);
+    dir.set_version(version);
 
     // write dir into stream
     stream.writeMessage(dir);
@@ -209,6 +384,7 @@ Directory::loadSnapshot(Core::ProtoBuf::InputStream& stream)
     if (!error.empty()) {
         PANIC("Couldn't read snapshot: %s", error.c_str());
     }
+    version = dir.version();
     for (auto it = dir.directories().begin();
          it != dir.directories().end();
          ++it) {
@@ -273,12 +449,76 @@ Path::parentsThrough(std::vector<std::string>::const_iterator end) const
     return ret;
 }
 
+std::string
+Path::canonical() const
+{
+    if (parents.empty()) // target is "root"
+        return "/";
+    return parentsThrough(parents.end() - 1) +
+           (parents.size() == 1 ? "" : "/") + target;
+}
+
 } // LogCabin::Tree::Internal
 
+namespace {
+
+/**
+ * Parse the contents of a file as a decimal integer, as written by
+ * Tree::increment().
+ * \param contents
+ *      File contents. The empty string is treated as 0.
+ * \param[out] value
+ *      Set to the parsed integer upon success.
+ * \return
+ *      True if the contents are a well-formed integer that fits in an int64_t,
+ *      false otherwise.
+ */
+bool
+parseInteger(const std::string& contents, int64_t& value)
+{
+    if (contents.empty()) {
+        value = 0;
+        return true;
+    }
+    const char* start = contents.c_str();
+    if (!isdigit(start[0]) && start[0] != '-')
+        return false;
+    char* end = NULL;
+    errno = 0;
+    long long parsed = strtoll(start, &end, 10);
+    if (errno != 0 || end != start + contents.size())
+        return false;
+    value = parsed;
+    return true;
+}
+
+/**
+ * Shorten file contents for quoting in an error message, since files may be
+ * many megabytes long.
+ * \param contents
+ *      File contents.
+ * \return
+ *      The first bytes of contents, followed by "..." if any were left out.
+ */
+std::string
+excerpt(const std::string& contents)
+{
+    const size_t maxLength = 100;
+    if (contents.size() <= maxLength)
+        return contents;
+    return contents.substr(0, maxLength) + "...";
+}
+
+} // anonymous namespace
+
 ////////// class Tree //////////
 
 Tree::Tree()
     : superRoot()
+    , currentIndex(0)
+    , ownedFiles()
+    , currentTime(0)
+    , expiringFiles()
     , numConditionsChecked(0)
     , numConditionsFailed(0)
     , numMakeDirectoryAttempted(0)
@@ -299,6 +539,14 @@ Tree::Tree()
     , numRemoveFileTargetNotFound(0)
     , numRemoveFileDone(0)
     , numRemoveFileSuccess(0)
+    , numIncrementAttempted(0)
+    , numIncrementSuccess(0)
+    , numAppendAttempted(0)
+    , numAppendSuccess(0)
+    , numCompareAndSwapAttempted(0)
+    , numCompareAndSwapSuccess(0)
+    , numOwnedFilesRemoved(0)
+    , numExpiredFilesRemoved(0)
 {
     // Create the root directory so that users don't have to explicitly
     // call makeDirectory("/").
@@ -340,6 +588,33 @@ Tree::normalLookup(const Path& path, const Directory** parent) const
     return result;
 }
 
+Result
+Tree::lookupFile(const std::string& symbolicPath,
+                 const File** targetFile) const
+{
+    *targetFile = NULL;
+    Path path(symbolicPath);
+    if (path.result.status != Status::OK)
+        return path.result;
+    const Directory* parent;
+    Result result = normalLookup(path, &parent);
+    if (result.status != Status::OK)
+        return result;
+    *targetFile = parent->lookupFile(path.target);
+    if (*targetFile == NULL) {
+        if (parent->lookupDirectory(path.target) != NULL) {
+            result.status = Status::TYPE_ERROR;
+            result.error = format("%s is a directory",
+                                  path.symbolic.c_str());
+        } else {
+            result.status = Status::LOOKUP_ERROR;
+            result.error = format("%s does not exist",
+                                  path.symbolic.c_str());
+        }
+    }
+    return result;
+}
+
 Result
 Tree::mkdirLookup(const Path& path, Directory** parent)
 {
@@ -347,7 +622,7 @@ Tree::mkdirLookup(const Path& path, Directory** parent)
     Result result;
     Directory* current = &superRoot;
     for (auto it = path.parents.begin(); it != path.parents.end(); ++it) {
-        Directory* next = current->makeDirectory(*it);
+        Directory* next = makeChildDirectory(*current, *it);
         if (next == NULL) {
             result.status = Status::TYPE_ERROR;
             result.error = format("Parent %s of %s is a file",
@@ -361,6 +636,94 @@ Tree::mkdirLookup(const Path& path, Directory** parent)
     return result;
 }
 
+File*
+Tree::makeChildFile(Directory& parent, const std::string& name)
+{
+    File* child = parent.lookupFile(name);
+    if (child != NULL)
+        return child;
+    child = parent.makeFile(name);
+    if (child != NULL)
+        parent.version = currentIndex;
+    return child;
+}
+
+Directory*
+Tree::makeChildDirectory(Directory& parent, const std::string& name)
+{
+    Directory* child = parent.lookupDirectory(name);
+    if (child != NULL)
+        return child;
+    child = parent.makeDirectory(name);
+    if (child != NULL) {
+        child->version = currentIndex;
+        parent.version = currentIndex;
+    }
+    return child;
+}
+
+void
+Tree::setOwner(File& file, const std::string& path, uint64_t owner)
+{
+    if (file.owner == owner)
+        return;
+    if (file.owner != 0) {
+        auto it = ownedFiles.find(file.owner);
+        it->second.erase(path);
+        if (it->second.empty())
+            ownedFiles.erase(it);
+    }
+    if (owner != 0)
+        ownedFiles[owner].insert(path);
+    file.owner = owner;
+}
+
+uint64_t
+Tree::getExpiration(uint64_t ttlNanos) const
+{
+    if (ttlNanos == 0)
+        return 0;
+    if (ttlNanos > std::numeric_limits<uint64_t>::max() - currentTime)
+        return std::numeric_limits<uint64_t>::max();
+    return currentTime + ttlNanos;
+}
+
+void
+Tree::setExpiration(File& file, const std::string& path, uint64_t expiresAt)
+{
+    if (file.expiresAt == expiresAt)
+        return;
+    if (file.expiresAt != 0)
+        expiringFiles.erase({file.expiresAt, path});
+    if (expiresAt != 0)
+        expiringFiles.insert({expiresAt, path});
+    file.expiresAt = expiresAt;
+}
+
+void
+Tree::forgetFile(const File& file, const std::string& path)
+{
+    if (file.owner != 0) {
+        auto it = ownedFiles.find(file.owner);
+        it->second.erase(path);
+        if (it->second.empty())
+            ownedFiles.erase(it);
+    }
+    if (file.expiresAt != 0)
+        expiringFiles.erase({file.expiresAt, path});
+}
+
+void
+Tree::forgetTransientFiles(const Directory& dir, const std::string& path)
+{
+    if (ownedFiles.empty() && expiringFiles.empty())
+        return;
+    std::vector<std::pair<std::string, const File*>> found;
+    dir.findTransientFiles(path, found);
+    for (auto it = found.begin(); it != found.end(); ++it)
+        forgetFile(*it->second, it->first);
+}
+
 void
 Tree::dumpSnapshot(Core::ProtoBuf::OutputStream& stream) const
 {
@@ -375,6 +738,17 @@ Tree::loadSnapshot(Core::ProtoBuf::InputStream& stream)
 {
     superRoot = Directory();
     superRoot.loadSnapshot(stream);
+    ownedFiles.clear();
+    expiringFiles.clear();
+    std::vector<std::pair<std::string, const File*>> found;
+    superRoot.lookupDirectory("root")->findTransientFiles("/", found);
+    for (auto it = found.begin(); it != found.end(); ++it) {
+        const File& file = *it->second;
+        if (file.owner != 0)
+            ownedFiles[file.owner].insert(it->first);
+        if (file.expiresAt != 0)
+            expiringFiles.insert({file.expiresAt, it->first});
+    }
 }
 
 
@@ -394,8 +768,8 @@ Tree::checkCondition(const std::string& path,
             result.error = format("Path '%s' has value '%s', not '%s' as "
                                   "required",
                                   path.c_str(),
-                                  actualContents.c_str(),
-                                  contents.c_str());
+                                  excerpt(actualContents).c_str(),
+                                  excerpt(contents).c_str());
             ++numConditionsFailed;
             return result;
         }
@@ -411,6 +785,78 @@ Tree::checkCondition(const std::string& path,
     return result;
 }
 
+Result
+Tree::checkCondition(const std::string& symbolicPath,
+                     uint64_t version) const
+{
+    ++numConditionsChecked;
+    uint64_t actualVersion = 0;
+    Path path(symbolicPath);
+    Result result = path.result;
+    if (result.status == Status::OK) {
+        const Directory* parent;
+        result = normalLookup(path, &parent);
+        if (result.status == Status::OK) {
+            const File* targetFile = parent->lookupFile(path.target);
+            const Directory* targetDir = parent->lookupDirectory(path.target);
+            if (targetFile != NULL) {
+                actualVersion = targetFile->version;
+            } else if (targetDir != NULL) {
+                actualVersion = targetDir->version;
+            } else {
+                result.status = Status::LOOKUP_ERROR;
+                result.error = format("%s does not exist",
+                                      path.symbolic.c_str());
+            }
+        }
+    }
+    if (result.status == Status::OK) {
+        // Version 0 means "does not exist", even for nodes that predate
+        // version tracking and so still have a version of 0.
+        if (version != 0 && actualVersion == version)
+            return Result();
+        result.status = Status::CONDITION_NOT_MET;
+        if (version == 0) {
+            result.error = format("Path '%s' exists, but version 0 requires "
+                                  "that it does not",
+                                  symbolicPath.c_str());
+        } else {
+            result.error = format("Path '%s' has version %lu, not %lu as "
+                                  "required",
+                                  symbolicPath.c_str(),
+                                  actualVersion,
+                                  version);
+        }
+    } else if (result.status == Status::LOOKUP_ERROR && version == 0) {
+        return Result();
+    } else {
+        result.status = Status::CONDITION_NOT_MET;
+        result.error = format("Could not find version of path '%s': %s",
+                              symbolicPath.c_str(),
+                              result.error.c_str());
+    }
+    ++numConditionsFailed;
+    return result;
+}
+
+void
+Tree::setCurrentIndex(uint64_t index)
+{
+    currentIndex = index;
+}
+
+uint64_t
+Tree::getCurrentIndex() const
+{
+    return currentIndex;
+}
+
+void
+Tree::setCurrentTime(uint64_t clusterTime)
+{
+    currentTime = clusterTime;
+}
+
 Result
 Tree::makeDirectory(const std::string& symbolicPath)
 {
@@ -422,7 +868,7 @@ Tree::makeDirectory(const std::string& symbolicPath)
     Result result = mkdirLookup(path, &parent);
     if (result.status != Status::OK)
         return result;
-    if (parent->makeDirectory(path.target) == NULL) {
+    if (makeChildDirectory(*parent, path.target) == NULL) {
         result.status = Status::TYPE_ERROR;
         result.error = format("%s already exists but is a file",
                               path.symbolic.c_str());
@@ -435,9 +881,22 @@ Tree::makeDirectory(const std::string& symbolicPath)
 Result
 Tree::listDirectory(const std::string& symbolicPath,
                     std::vector<std::string>& children) const
+{
+    bool more;
+    return listDirectory(symbolicPath, "", "", 0, children, more);
+}
+
+Result
+Tree::listDirectory(const std::string& symbolicPath,
+                    const std::string& startAfter,
+                    const std::string& prefix,
+                    uint64_t limit,
+                    std::vector<std::string>& children,
+                    bool& more) const
 {
     ++numListDirectoryAttempted;
     children.clear();
+    more = false;
     Path path(symbolicPath);
     if (path.result.status != Status::OK)
         return path.result;
@@ -458,7 +917,7 @@ Tree::listDirectory(const std::string& symbolicPath,
         }
         return result;
     }
-    children = targetDir->getChildren();
+    more = targetDir->getChildren(startAfter, prefix, limit, children);
     ++numListDirectorySuccess;
     return result;
 }
@@ -494,12 +953,14 @@ Tree::removeDirectory(const std::string& symbolicPath)
             return result;
         }
     }
+    forgetTransientFiles(*targetDir, path.canonical());
     parent->removeDirectory(path.target);
+    parent->version = currentIndex;
     if (parent == &superRoot) { // removeDirectory("/")
         // If the caller is trying to remove the root directory, we remove the
         // contents but not the directory itself. The easiest way to do this
         // is to drop but then recreate the directory.
-        parent->makeDirectory(path.target);
+        makeChildDirectory(*parent, path.target);
     }
     ++numRemoveDirectoryDone;
     ++numRemoveDirectorySuccess;
@@ -508,6 +969,15 @@ Tree::removeDirectory(const std::string& symbolicPath)
 
 Result
 Tree::write(const std::string& symbolicPath, const std::string& contents)
+{
+    return write(symbolicPath, contents, 0, 0);
+}
+
+Result
+Tree::write(const std::string& symbolicPath,
+            const std::string& contents,
+            uint64_t owner,
+            uint64_t ttlNanos)
 {
     ++numWriteAttempted;
     Path path(symbolicPath);
@@ -517,44 +987,253 @@ Tree::write(const std::string& symbolicPath, const std::string& contents)
     Result result = normalLookup(path, &parent);
     if (result.status != Status::OK)
         return result;
-    File* targetFile = parent->makeFile(path.target);
+    if (contents.size() > File::MAX_SIZE) {
+        result.status = Status::INVALID_ARGUMENT;
+        result.error = format("Contents of %s would be %lu bytes, but files "
+                              "may hold at most %lu bytes",
+                              path.symbolic.c_str(),
+                              contents.size(),
+                              File::MAX_SIZE);
+        return result;
+    }
+    File* targetFile = makeChildFile(*parent, path.target);
     if (targetFile == NULL) {
         result.status = Status::TYPE_ERROR;
         result.error = format("%s is a directory",
                               path.symbolic.c_str());
         return result;
     }
-    targetFile->contents = contents;
+    targetFile->setContents(contents);
+    targetFile->version = currentIndex;
+    std::string canonicalPath = path.canonical();
+    setOwner(*targetFile, canonicalPath, owner);
+    setExpiration(*targetFile, canonicalPath,
+                  getExpiration(ttlNanos));
     ++numWriteSuccess;
     return result;
 }
 
 Result
-Tree::read(const std::string& symbolicPath, std::string& contents) const
+Tree::increment(const std::string& symbolicPath,
+                int64_t delta,
+                int64_t& value)
 {
-    ++numReadAttempted;
-    contents.clear();
+    ++numIncrementAttempted;
+    value = 0;
     Path path(symbolicPath);
     if (path.result.status != Status::OK)
         return path.result;
-    const Directory* parent;
+    Directory* parent;
     Result result = normalLookup(path, &parent);
     if (result.status != Status::OK)
         return result;
-    const File* targetFile = parent->lookupFile(path.target);
+    if (parent->lookupDirectory(path.target) != NULL) {
+        result.status = Status::TYPE_ERROR;
+        result.error = format("%s is a directory",
+                              path.symbolic.c_str());
+        return result;
+    }
+    int64_t oldValue = 0;
+    File* targetFile = parent->lookupFile(path.target);
+    if (targetFile != NULL &&
+        !parseInteger(targetFile->getContents(), oldValue)) {
+        result.status = Status::TYPE_ERROR;
+        result.error = format("%s does not contain an integer",
+                              path.symbolic.c_str());
+        return result;
+    }
+    if ((delta > 0 &&
+         oldValue > std::numeric_limits<int64_t>::max() - delta) ||
+        (delta < 0 &&
+         oldValue < std::numeric_limits<int64_t>::min() - delta)) {
+        result.status = Status::INVALID_ARGUMENT;
+        result.error = format("Adding %ld to %s (%ld) would overflow",
+                              delta,
+                              path.symbolic.c_str(),
+                              oldValue);
+        return result;
+    }
+    targetFile = makeChildFile(*parent, path.target);
+    value = oldValue + delta;
+    targetFile->setContents(format("%ld", value));
+    targetFile->version = currentIndex;
+    ++numIncrementSuccess;
+    return result;
+}
+
+Result
+Tree::append(const std::string& symbolicPath, const std::string& contents)
+{
+    ++numAppendAttempted;
+    Path path(symbolicPath);
+    if (path.result.status != Status::OK)
+        return path.result;
+    Directory* parent;
+    Result result = normalLookup(path, &parent);
+    if (result.status != Status::OK)
+        return result;
+    const File* existingFile = parent->lookupFile(path.target);
+    uint64_t oldSize = (existingFile == NULL ? 0 : existingFile->getSize());
+    if (contents.size() > File::MAX_SIZE - oldSize) {
+        result.status = Status::INVALID_ARGUMENT;
+        result.error = format("Contents of %s would be %lu bytes, but files "
+                              "may hold at most %lu bytes",
+                              path.symbolic.c_str(),
+                              oldSize + contents.size(),
+                              File::MAX_SIZE);
+        return result;
+    }
+    File* targetFile = makeChildFile(*parent, path.target);
     if (targetFile == NULL) {
-        if (parent->lookupDirectory(path.target) != NULL) {
-            result.status = Status::TYPE_ERROR;
-            result.error = format("%s is a directory",
-                                  path.symbolic.c_str());
-        } else {
-            result.status = Status::LOOKUP_ERROR;
-            result.error = format("%s does not exist",
+        result.status = Status::TYPE_ERROR;
+        result.error = format("%s is a directory",
+                              path.symbolic.c_str());
+        return result;
+    }
+    targetFile->appendContents(contents);
+    targetFile->version = currentIndex;
+    ++numAppendSuccess;
+    return result;
+}
+
+Result
+Tree::compareAndSwap(const std::string& symbolicPath,
+                     const std::string& oldContents,
+                     const std::string& newContents)
+{
+    return compareAndSwap(symbolicPath, oldContents, newContents, 0, 0);
+}
+
+Result
+Tree::compareAndSwap(const std::string& symbolicPath,
+                     const std::string& oldContents,
+                     const std::string& newContents,
+                     uint64_t owner,
+                     uint64_t ttlNanos)
+{
+    ++numCompareAndSwapAttempted;
+    Path path(symbolicPath);
+    if (path.result.status != Status::OK)
+        return path.result;
+    Directory* parent;
+    Result result = normalLookup(path, &parent);
+    if (result.status == Status::LOOKUP_ERROR && !oldContents.empty()) {
+        result.status = Status::CONDITION_NOT_MET;
+        result.error = format("Could not read value at path '%s': %s",
+                              path.symbolic.c_str(),
+                              result.error.c_str());
+        return result;
+    }
+    if (result.status != Status::OK)
+        return result;
+    if (newContents.size() > File::MAX_SIZE) {
+        result.status = Status::INVALID_ARGUMENT;
+        result.error = format("Contents of %s would be %lu bytes, but files "
+                              "may hold at most %lu bytes",
+                              path.symbolic.c_str(),
+                              newContents.size(),
+                              File::MAX_SIZE);
+        return result;
+    }
+    if (parent->lookupDirectory(path.target) != NULL) {
+        result.status = Status::TYPE_ERROR;
+        result.error = format("%s is a directory",
+                              path.symbolic.c_str());
+        return result;
+    }
+    File* targetFile = parent->lookupFile(path.target);
+    if (targetFile == NULL) {
+        if (!oldContents.empty()) {
+            result.status = Status::CONDITION_NOT_MET;
+            result.error = format("Could not read value at path '%s': "
+                                  "%s does not exist",
+                                  path.symbolic.c_str(),
                                   path.symbolic.c_str());
+            return result;
         }
+        targetFile = makeChildFile(*parent, path.target);
+    } else if (!targetFile->hasContents(oldContents)) {
+        result.status = Status::CONDITION_NOT_MET;
+        result.error = format("Path '%s' has value '%s', not '%s' as "
+                              "required",
+                              path.symbolic.c_str(),
+                              excerpt(targetFile->getContents()).c_str(),
+                              excerpt(oldContents).c_str());
         return result;
     }
-    contents = targetFile->contents;
+    targetFile->setContents(newContents);
+    targetFile->version = currentIndex;
+    std::string canonicalPath = path.canonical();
+    setOwner(*targetFile, canonicalPath, owner);
+    setExpiration(*targetFile, canonicalPath,
+                  getExpiration(ttlNanos));
+    ++numCompareAndSwapSuccess;
+    return result;
+}
+
+Result
+Tree::read(const std::string& symbolicPath, std::string& contents) const
+{
+    uint64_t version;
+    return read(symbolicPath, contents, version);
+}
+
+Result
+Tree::read(const std::string& symbolicPath,
+           std::string& contents,
+           uint64_t& version) const
+{
+    uint64_t owner;
+    uint64_t expiresAt;
+    return read(symbolicPath, contents, version, owner, expiresAt);
+}
+
+Result
+Tree::read(const std::string& symbolicPath,
+           std::string& contents,
+           uint64_t& version,
+           uint64_t& owner,
+           uint64_t& expiresAt) const
+{
+    ++numReadAttempted;
+    contents.clear();
+    version = 0;
+    owner = 0;
+    expiresAt = 0;
+    const File* targetFile;
+    Result result = lookupFile(symbolicPath, &targetFile);
+    if (result.status != Status::OK)
+        return result;
+    targetFile->readContents(0, std::numeric_limits<uint64_t>::max(),
+                             contents);
+    version = targetFile->version;
+    owner = targetFile->owner;
+    expiresAt = targetFile->expiresAt;
+    ++numReadSuccess;
+    return result;
+}
+
+Result
+Tree::read(const std::string& symbolicPath,
+           uint64_t offset,
+           uint64_t length,
+           std::string& contents,
+           uint64_t& version,
+           uint64_t& size) const
+{
+    ++numReadAttempted;
+    contents.clear();
+    version = 0;
+    size = 0;
+    const File* targetFile;
+    Result result = lookupFile(symbolicPath, &targetFile);
+    if (result.status != Status::OK)
+        return result;
+    if (length == 0)
+        length = std::numeric_limits<uint64_t>::max();
+    targetFile->readContents(offset, length, contents);
+    version = targetFile->version;
+    size = targetFile->getSize();
     ++numReadSuccess;
     return result;
 }
@@ -582,14 +1261,76 @@ Tree::removeFile(const std::string& symbolicPath)
                               path.symbolic.c_str());
         return result;
     }
-    if (parent->removeFile(path.target))
+    File* targetFile = parent->lookupFile(path.target);
+    if (targetFile != NULL) {
+        forgetFile(*targetFile, path.canonical());
+        parent->removeFile(path.target);
+        parent->version = currentIndex;
         ++numRemoveFileDone;
-    else
+    } else {
         ++numRemoveFileTargetNotFound;
+    }
     ++numRemoveFileSuccess;
     return result;
 }
 
+void
+Tree::removeOwnedFiles(uint64_t owner)
+{
+    auto ownerIt = ownedFiles.find(owner);
+    if (ownerIt == ownedFiles.end())
+        return;
+    // forgetFile() modifies the set, so iterate over a copy.
+    std::set<std::string> paths = ownerIt->second;
+    for (auto it = paths.begin(); it != paths.end(); ++it) {
+        Path path(*it);
+        Directory* parent;
+        Result result = normalLookup(path, &parent);
+        File* targetFile = NULL;
+        if (result.status == Status::OK)
+            targetFile = parent->lookupFile(path.target);
+        if (targetFile == NULL || targetFile->owner != owner) {
+            PANIC("Index of ephemeral files lists %s for owner %lu, but "
+                  "that's not in the tree", it->c_str(), owner);
+        }
+        forgetFile(*targetFile, *it);
+        parent->removeFile(path.target);
+        parent->version = currentIndex;
+        ++numOwnedFilesRemoved;
+    }
+}
+
+uint64_t
+Tree::getNextExpiration() const
+{
+    if (expiringFiles.empty())
+        return 0;
+    return expiringFiles.begin()->first;
+}
+
+void
+Tree::removeExpiredFiles()
+{
+    while (!expiringFiles.empty() &&
+           expiringFiles.begin()->first <= currentTime) {
+        std::string canonicalPath = expiringFiles.begin()->second;
+        Path path(canonicalPath);
+        Directory* parent;
+        Result result = normalLookup(path, &parent);
+        File* targetFile = NULL;
+        if (result.status == Status::OK)
+            targetFile = parent->lookupFile(path.target);
+        if (targetFile == NULL) {
+            PANIC("Index of expiring files lists %s, but that's not in the "
+                  "tree", canonicalPath.c_str());
+        }
+        forgetFile(*targetFile, canonicalPath);
+        parent->removeFile(path.target);
+        parent->version = currentIndex;
+        ++numExpiredFilesRemoved;
+    }
+}
+
 void
 Tree::updateServerStats(Protocol::ServerStats::Tree& tstats) const
 {
@@ -633,6 +1374,22 @@ Tree::updateServerStats(Protocol::ServerStats::Tree& tstats) const
         numRemoveFileDone);
     tstats.set_num_remove_file_success(
         numRemoveFileSuccess);
+    tstats.set_num_increment_attempted(
+        numIncrementAttempted);
+    tstats.set_num_increment_success(
+        numIncrementSuccess);
+    tstats.set_num_append_attempted(
+        numAppendAttempted);
+    tstats.set_num_append_success(
+        numAppendSuccess);
+    tstats.set_num_compare_and_swap_attempted(
+        numCompareAndSwapAttempted);
+    tstats.set_num_compare_and_swap_success(
+        numCompareAndSwapSuccess);
+    tstats.set_num_owned_files_removed(
+        numOwnedFilesRemoved);
+    tstats.set_num_expired_files_removed(
+        numExpiredFilesRemoved);
 }
 
 } // namespace LogCabin::Tree
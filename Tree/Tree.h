@@ -15,9 +15,11 @@
  */
 
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
+#include "Core/CompatAtomic.h"
 #include "Core/ProtoBuf.h"
 
 #ifndef LOGCABIN_TREE_TREE_H
@@ -95,10 +97,22 @@ struct Result {
 namespace Internal {
 
 /**
- * A leaf object in the Tree; stores an opaque blob of data.
+ * A leaf object in the Tree; stores an opaque blob of data. The data is kept
+ * in fixed-size chunks, so that ranged reads and appends on large files only
+ * touch the chunks they need rather than copying the entire value.
  */
 class File {
   public:
+    /**
+     * The number of bytes in each chunk of a file's contents (see #chunks).
+     */
+    static const uint64_t CHUNK_SIZE = 64 * 1024;
+    /**
+     * The largest number of bytes a file may hold. Each file is written to
+     * snapshots as a single message, and this keeps that message well under
+     * protobuf's 64 MB limit so that snapshots can always be loaded.
+     */
+    static const uint64_t MAX_SIZE = 32 * 1024 * 1024;
     /// Default constructor.
     File();
     /**
@@ -110,9 +124,61 @@ class File {
      */
     void loadSnapshot(Core::ProtoBuf::InputStream& stream);
     /**
-     * Opaque data stored in the File.
+     * Return the entire contents of the file.
+     */
+    std::string getContents() const;
+    /**
+     * Return the number of bytes in the file's contents.
+     */
+    uint64_t getSize() const;
+    /**
+     * Return true if the file's contents are exactly the given bytes.
+     */
+    bool hasContents(const std::string& other) const;
+    /**
+     * Copy part of the file's contents.
+     * \param offset
+     *      The index of the first byte to copy. If this is past the end of
+     *      the file, nothing is copied.
+     * \param length
+     *      The maximum number of bytes to copy.
+     * \param[out] out
+     *      Replaced with the bytes copied.
+     */
+    void readContents(uint64_t offset,
+                      uint64_t length,
+                      std::string& out) const;
+    /**
+     * Replace the file's contents.
+     */
+    void setContents(const std::string& contents);
+    /**
+     * Add to the end of the file's contents. This only modifies the last
+     * chunk and any new ones.
      */
-    std::string contents;
+    void appendContents(const std::string& contents);
+    /**
+     * Opaque data stored in the File, in order. Every chunk but the last
+     * holds exactly CHUNK_SIZE bytes; the last holds between 1 and CHUNK_SIZE
+     * bytes. An empty file has no chunks.
+     */
+    std::vector<std::string> chunks;
+    /**
+     * The log index of the command that last modified this file, or 0 if it
+     * has not been modified since versions started being tracked.
+     */
+    uint64_t version;
+    /**
+     * For ephemeral files, the ID of the client session that owns the file;
+     * the file is removed when that session ends. 0 for regular files.
+     */
+    uint64_t owner;
+    /**
+     * For files written with a time-to-live, the cluster time (in
+     * nanoseconds) at which the file is removed. 0 if the file doesn't
+     * expire.
+     */
+    uint64_t expiresAt;
 };
 
 /**
@@ -135,6 +201,31 @@ class Directory {
      */
     std::vector<std::string> getChildren() const;
 
+    /**
+     * List a window of the contents of the directory, without materializing
+     * the full listing.
+     * \param startAfter
+     *      Only children that come after this one in the order of
+     *      getChildren() are listed. This should have a trailing slash if it
+     *      names a directory (it need not exist). If empty, the listing starts
+     *      with the first child.
+     * \param prefix
+     *      Only children whose names (excluding the trailing slash for
+     *      directories) begin with this string are listed.
+     * \param limit
+     *      The maximum number of children to list, or 0 for no limit.
+     * \param[out] children
+     *      This will be replaced by the names of the children in the window,
+     *      in the same format and order as getChildren().
+     * \return
+     *      True if more children matching 'prefix' follow the window; false
+     *      if this window ends the listing.
+     */
+    bool getChildren(const std::string& startAfter,
+                     const std::string& prefix,
+                     uint64_t limit,
+                     std::vector<std::string>& children) const;
+
     /**
      * Find the child directory by the given name.
      * \param name
@@ -200,6 +291,19 @@ class Directory {
      */
     bool removeFile(const std::string& name);
 
+    /**
+     * Find the files in this directory and its descendants that are
+     * ephemeral or that expire.
+     * \param path
+     *      The absolute path of this directory, used to build the paths of
+     *      the files found.
+     * \param[in,out] found
+     *      Pairs of absolute path and file are appended to this.
+     */
+    void findTransientFiles(
+            const std::string& path,
+            std::vector<std::pair<std::string, const File*>>& found) const;
+
     /**
      * Write the directory and its children to the stream.
      */
@@ -209,6 +313,13 @@ class Directory {
      */
     void loadSnapshot(Core::ProtoBuf::InputStream& stream);
 
+    /**
+     * The log index of the command that created this directory or that last
+     * added or removed one of its immediate children, or 0 if it has not been
+     * modified since versions started being tracked.
+     */
+    uint64_t version;
+
   private:
     /**
      * Map from names of child directories (without trailing slashes) to the
@@ -250,6 +361,12 @@ class Path {
     std::string
     parentsThrough(std::vector<std::string>::const_iterator end) const;
 
+    /**
+     * Return the path in a canonical form: slash-delimited, with no empty
+     * components and no trailing slash, not including "/root".
+     */
+    std::string canonical() const;
+
   public:
     /**
      * Status and error message from the constructor. Possible errors are:
@@ -283,6 +400,9 @@ class Path {
 /**
  * This is an in-memory, hierarchical key-value store.
  * TODO(ongaro): Document how this fits into the rest of the system.
+ *
+ * This class is not thread-safe, except that its const methods may be called
+ * concurrently with each other (for example, under a shared lock).
  */
 class Tree {
   public:
@@ -320,6 +440,52 @@ class Tree {
     checkCondition(const std::string& path,
                    const std::string& contents) const;
 
+    /**
+     * Verify that the file or directory at path has the given version.
+     * This is much cheaper than comparing contents for large files.
+     * \param path
+     *      The path to the file or directory that must have the version
+     *      specified in 'version'.
+     * \param version
+     *      The version that the file or directory specified by 'path' should
+     *      have for an OK response. A version of 0 requires that nothing
+     *      exists at 'path'.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - CONDITION_NOT_MET upon any error.
+     */
+    Result
+    checkCondition(const std::string& path,
+                   uint64_t version) const;
+
+    /**
+     * Set the log index of the command that is about to be applied. Files and
+     * directories modified from now on will record this index as their
+     * version, until the next call to this method.
+     * \param index
+     *      The log index of the command being applied, or 0 to stop tracking
+     *      versions.
+     */
+    void
+    setCurrentIndex(uint64_t index);
+
+    /**
+     * Return the index given to the last call to setCurrentIndex(), which is
+     * the version of anything modified since then.
+     */
+    uint64_t
+    getCurrentIndex() const;
+
+    /**
+     * Set the cluster time of the command that is about to be applied. Files
+     * written with a time-to-live from now on expire relative to this time,
+     * and removeExpiredFiles() removes the files that expired by this time.
+     * \param clusterTime
+     *      The cluster time of the command being applied, in nanoseconds.
+     */
+    void
+    setCurrentTime(uint64_t clusterTime);
+
     /**
      * Make sure a directory exists at the given path.
      * Create parent directories listed in path as necessary.
@@ -356,6 +522,34 @@ class Tree {
     listDirectory(const std::string& path,
                   std::vector<std::string>& children) const;
 
+    /**
+     * List a window of the contents of a directory.
+     * \param path
+     *      The directory whose direct children to list.
+     * \param startAfter
+     *      Only children listed after this one are returned (see
+     *      Internal::Directory::getChildren()). Empty to start at the
+     *      beginning.
+     * \param prefix
+     *      Only children whose names begin with this string are returned.
+     * \param limit
+     *      The maximum number of children to return, or 0 for no limit.
+     * \param[out] children
+     *      This will be replaced by the window of the listing, in the same
+     *      format and order as the listDirectory() above.
+     * \param[out] more
+     *      Set to true if more children follow the window.
+     * \return
+     *      See listDirectory() above.
+     */
+    Result
+    listDirectory(const std::string& path,
+                  const std::string& startAfter,
+                  const std::string& prefix,
+                  uint64_t limit,
+                  std::vector<std::string>& children,
+                  bool& more) const;
+
     /**
      * Make sure a directory does not exist.
      * Also removes all direct and indirect children of the directory.
@@ -384,7 +578,7 @@ class Tree {
      * \return
      *      Status and error message. Possible errors are:
      *       - INVALID_ARGUMENT if path is malformed.
-     *       - INVALID_ARGUMENT if contents are too large to fit in a file.
+     *       - INVALID_ARGUMENT if contents are larger than File::MAX_SIZE.
      *       - LOOKUP_ERROR if a parent of path does not exist.
      *       - TYPE_ERROR if a parent of path is a file.
      *       - TYPE_ERROR if path exists but is a directory.
@@ -392,6 +586,120 @@ class Tree {
     Result
     write(const std::string& path, const std::string& contents);
 
+    /**
+     * Set the value of a file and how long it lives.
+     * \param path
+     *      The path where there should be a file with the given contents after
+     *      this call.
+     * \param contents
+     *      The new value associated with the file.
+     * \param owner
+     *      If nonzero, the file becomes ephemeral: it is removed when
+     *      removeOwnedFiles() is called with this owner. If 0, the file
+     *      becomes a regular file.
+     * \param ttlNanos
+     *      If nonzero, the file is removed by removeExpiredFiles() once the
+     *      cluster time is this many nanoseconds past the current time (see
+     *      setCurrentTime()). If 0, the file doesn't expire. Times past the
+     *      largest representable cluster time are clamped to it.
+     * \return
+     *      See write(path, contents).
+     */
+    Result
+    write(const std::string& path,
+          const std::string& contents,
+          uint64_t owner,
+          uint64_t ttlNanos);
+
+    /**
+     * Atomically add to the integer stored in a file. The file's contents are
+     * interpreted as a signed decimal integer; a file that does not exist or
+     * is empty is treated as 0 and is created as necessary.
+     * \param path
+     *      The path of the file holding the integer.
+     * \param delta
+     *      The amount to add (may be negative).
+     * \param[out] value
+     *      Upon success, the new value stored in the file.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - INVALID_ARGUMENT if the addition would overflow.
+     *       - LOOKUP_ERROR if a parent of path does not exist.
+     *       - TYPE_ERROR if a parent of path is a file.
+     *       - TYPE_ERROR if path exists but is a directory.
+     *       - TYPE_ERROR if the file does not contain an integer.
+     */
+    Result
+    increment(const std::string& path, int64_t delta, int64_t& value);
+
+    /**
+     * Append to the value of a file, creating the file if necessary.
+     * \param path
+     *      The path of the file to append to.
+     * \param contents
+     *      The bytes to add to the end of the file.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - INVALID_ARGUMENT if the file would grow beyond File::MAX_SIZE.
+     *       - LOOKUP_ERROR if a parent of path does not exist.
+     *       - TYPE_ERROR if a parent of path is a file.
+     *       - TYPE_ERROR if path exists but is a directory.
+     */
+    Result
+    append(const std::string& path, const std::string& contents);
+
+    /**
+     * Set the value of a file only if it currently has the given value.
+     * \param path
+     *      The path of the file to set.
+     * \param oldContents
+     *      The contents that the file must have for the swap to happen. If
+     *      this is the empty string, the swap will also happen if the file
+     *      does not exist (like checkCondition()).
+     * \param newContents
+     *      The new value associated with the file.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - INVALID_ARGUMENT if newContents is larger than File::MAX_SIZE.
+     *       - LOOKUP_ERROR if a parent of path does not exist and
+     *         'oldContents' is empty.
+     *       - TYPE_ERROR if a parent of path is a file.
+     *       - TYPE_ERROR if path exists but is a directory.
+     *       - CONDITION_NOT_MET if the file's contents are not 'oldContents'.
+     */
+    Result
+    compareAndSwap(const std::string& path,
+                   const std::string& oldContents,
+                   const std::string& newContents);
+
+    /**
+     * Set the value of a file and how long it lives, only if it currently has
+     * the given value.
+     * \param path
+     *      The path of the file to set.
+     * \param oldContents
+     *      See compareAndSwap(path, oldContents, newContents).
+     * \param newContents
+     *      The new value associated with the file.
+     * \param owner
+     *      If the swap happens, the file's new owner; see
+     *      write(path, contents, owner, ttlNanos).
+     * \param ttlNanos
+     *      If the swap happens, the file's new time-to-live; see
+     *      write(path, contents, owner, ttlNanos).
+     * \return
+     *      See compareAndSwap(path, oldContents, newContents).
+     */
+    Result
+    compareAndSwap(const std::string& path,
+                   const std::string& oldContents,
+                   const std::string& newContents,
+                   uint64_t owner,
+                   uint64_t ttlNanos);
+
     /**
      * Get the value of a file.
      * \param path
@@ -409,6 +717,72 @@ class Tree {
     Result
     read(const std::string& path, std::string& contents) const;
 
+    /**
+     * Get the value and version of a file.
+     * \param path
+     *      The path of the file whose contents to read.
+     * \param contents
+     *      The current value associated with the file.
+     * \param version
+     *      The log index of the command that last modified the file.
+     * \return
+     *      See read(path, contents).
+     */
+    Result
+    read(const std::string& path,
+         std::string& contents,
+         uint64_t& version) const;
+
+    /**
+     * Get the value, version, owner, and expiration time of a file.
+     * \param path
+     *      The path of the file whose contents to read.
+     * \param contents
+     *      The current value associated with the file.
+     * \param version
+     *      The log index of the command that last modified the file.
+     * \param owner
+     *      The session that owns the file if it is ephemeral, or 0.
+     * \param expiresAt
+     *      The cluster time at which the file expires, or 0.
+     * \return
+     *      See read(path, contents).
+     */
+    Result
+    read(const std::string& path,
+         std::string& contents,
+         uint64_t& version,
+         uint64_t& owner,
+         uint64_t& expiresAt) const;
+
+    /**
+     * Get part of the value of a file, along with its version and size. This
+     * only copies the requested bytes, so it's cheap even for large files.
+     * \param path
+     *      The path of the file whose contents to read.
+     * \param offset
+     *      The index of the first byte to read. If this is at or past the end
+     *      of the file, no bytes are read.
+     * \param length
+     *      The maximum number of bytes to read, or 0 to read to the end of
+     *      the file.
+     * \param contents
+     *      The requested range of the value associated with the file.
+     * \param version
+     *      The log index of the command that last modified the file.
+     * \param size
+     *      The total number of bytes in the file.
+     * \return
+     *      See read(path, contents).
+     */
+    Result
+    read(const std::string& path,
+         uint64_t offset,
+         uint64_t length,
+         std::string& contents,
+         uint64_t& version,
+         uint64_t& size) const;
+
     /**
      * Make sure a file does not exist.
      * \param path
@@ -422,6 +796,29 @@ class Tree {
     Result
     removeFile(const std::string& path);
 
+    /**
+     * Remove all the ephemeral files that the given owner created. Their
+     * parent directories are left in place.
+     * \param owner
+     *      The ID of the client session that has ended.
+     */
+    void
+    removeOwnedFiles(uint64_t owner);
+
+    /**
+     * Return the earliest cluster time at which a file expires, or 0 if no
+     * files expire.
+     */
+    uint64_t
+    getNextExpiration() const;
+
+    /**
+     * Remove all the files whose time-to-live ended by the current time (see
+     * setCurrentTime()). Their parent directories are left in place.
+     */
+    void
+    removeExpiredFiles();
+
     /**
      * Add metrics about the tree to the given structure.
      */
@@ -454,6 +851,19 @@ class Tree {
     normalLookup(const Internal::Path& path,
                  const Internal::Directory** parent) const;
 
+    /**
+     * Find the file to be read at the given path. Helper for read().
+     * \param[in] path
+     *      The path of the file.
+     * \param[out] targetFile
+     *      Upon successful return, points to the file.
+     * \return
+     *      See read(path, contents).
+     */
+    Result
+    lookupFile(const std::string& path,
+               const Internal::File** targetFile) const;
+
     /**
      * Like normalLookup but creates parent directories as necessary.
      * \param[in] path
@@ -467,6 +877,99 @@ class Tree {
     Result
     mkdirLookup(const Internal::Path& path, Internal::Directory** parent);
 
+    /**
+     * Find the child file by the given name, or create it if it doesn't exist.
+     * If created, the version of the parent is set to #currentIndex (the
+     * caller is responsible for setting the version of the file itself).
+     * \param parent
+     *      The directory in which to find or create the file.
+     * \param name
+     *      Must not contain a trailing slash.
+     * \return
+     *      The file by the given name, or
+     *      NULL if a directory exists by that name.
+     */
+    Internal::File*
+    makeChildFile(Internal::Directory& parent, const std::string& name);
+
+    /**
+     * Find the child directory by the given name, or create it if it doesn't
+     * exist. If created, the versions of both the parent and the new child are
+     * set to #currentIndex.
+     * \param parent
+     *      The directory in which to find or create the child.
+     * \param name
+     *      Must not contain a trailing slash.
+     * \return
+     *      The directory by the given name, or
+     *      NULL if a file exists by that name.
+     */
+    Internal::Directory*
+    makeChildDirectory(Internal::Directory& parent, const std::string& name);
+
+    /**
+     * Change the owner of a file and keep #ownedFiles up to date.
+     * \param file
+     *      The file whose owner to set.
+     * \param path
+     *      The canonical path of the file.
+     * \param owner
+     *      The new owner, or 0 to make it a regular file.
+     */
+    void
+    setOwner(Internal::File& file, const std::string& path, uint64_t owner);
+
+    /**
+     * Return the expiration time for a file written now with the given
+     * time-to-live, saturating at the largest cluster time rather than
+     * wrapping around.
+     * \param ttlNanos
+     *      Time-to-live in nanoseconds, or 0 if the file shouldn't expire.
+     * \return
+     *      The expiration time, or 0 if the file shouldn't expire.
+     */
+    uint64_t
+    getExpiration(uint64_t ttlNanos) const;
+
+    /**
+     * Change the expiration time of a file and keep #expiringFiles up to
+     * date.
+     * \param file
+     *      The file whose expiration time to set.
+     * \param path
+     *      The canonical path of the file.
+     * \param expiresAt
+     *      The new expiration time, or 0 if the file shouldn't expire.
+     */
+    void
+    setExpiration(Internal::File& file,
+                  const std::string& path,
+                  uint64_t expiresAt);
+
+    /**
+     * Remove the entries for a file from #ownedFiles and #expiringFiles,
+     * before the file is removed.
+     * \param file
+     *      The file about to be removed.
+     * \param path
+     *      The canonical path of the file.
+     */
+    void
+    forgetFile(const Internal::File& file, const std::string& path);
+
+    /**
+     * Remove the entries for the files in the given directory and its
+     * descendants from #ownedFiles and #expiringFiles, before the directory
+     * is removed.
+     * \param dir
+     *      The directory about to be removed.
+     * \param path
+     *      The canonical path of the directory.
+     */
+    void
+    forgetTransientFiles(const Internal::Directory& dir,
+                         const std::string& path);
+
     /**
      * This directory contains the root directory. The super root has a single
      * child directory named "root", and the rest of the tree lies below
@@ -479,15 +982,43 @@ class Tree {
      */
     Internal::Directory superRoot;
 
+    /**
+     * The log index of the command currently being applied; see
+     * setCurrentIndex().
+     */
+    uint64_t currentIndex;
+
+    /**
+     * Index of the ephemeral files in the tree: maps each owner to the
+     * canonical paths of the files it owns. This is not part of snapshots
+     * (it's rebuilt from the files' owners when loading one).
+     */
+    std::map<uint64_t, std::set<std::string>> ownedFiles;
+
+    /**
+     * The cluster time of the command currently being applied; see
+     * setCurrentTime().
+     */
+    uint64_t currentTime;
+
+    /**
+     * Index of the files that expire: contains an (expiresAt, canonical path)
+     * pair for each. Like #ownedFiles, this is rebuilt when loading a
+     * snapshot.
+     */
+    std::set<std::pair<uint64_t, std::string>> expiringFiles;
+
     // Server stats collected in updateServerStats.
     // Note that when a condition fails, the operation is not invoked,
     // so operations whose conditions fail are not counted as 'Attempted'.
-    mutable uint64_t numConditionsChecked;
-    mutable uint64_t numConditionsFailed;
+    // The mutable stats are updated from const methods, which may run
+    // concurrently, so they are atomic.
+    mutable std::atomic<uint64_t> numConditionsChecked;
+    mutable std::atomic<uint64_t> numConditionsFailed;
     uint64_t numMakeDirectoryAttempted;
     uint64_t numMakeDirectorySuccess;
-    mutable uint64_t numListDirectoryAttempted;
-    mutable uint64_t numListDirectorySuccess;
+    mutable std::atomic<uint64_t> numListDirectoryAttempted;
+    mutable std::atomic<uint64_t> numListDirectorySuccess;
     uint64_t numRemoveDirectoryAttempted;
     uint64_t numRemoveDirectoryParentNotFound;
     uint64_t numRemoveDirectoryTargetNotFound;
@@ -495,13 +1026,21 @@ class Tree {
     uint64_t numRemoveDirectorySuccess;
     uint64_t numWriteAttempted;
     uint64_t numWriteSuccess;
-    mutable uint64_t numReadAttempted;
-    mutable uint64_t numReadSuccess;
+    mutable std::atomic<uint64_t> numReadAttempted;
+    mutable std::atomic<uint64_t> numReadSuccess;
     uint64_t numRemoveFileAttempted;
     uint64_t numRemoveFileParentNotFound;
     uint64_t numRemoveFileTargetNotFound;
     uint64_t numRemoveFileDone;
     uint64_t numRemoveFileSuccess;
+    uint64_t numIncrementAttempted;
+    uint64_t numIncrementSuccess;
+    uint64_t numAppendAttempted;
+    uint64_t numAppendSuccess;
+    uint64_t numCompareAndSwapAttempted;
+    uint64_t numCompareAndSwapSuccess;
+    uint64_t numOwnedFilesRemoved;
+    uint64_t numExpiredFilesRemoved;
 };
 
 
@@ -77,7 +77,12 @@ TEST(TreeFileTest, dumpSnapshot)
     {
         Storage::SnapshotFile::Writer writer(layout);
         File f;
-        f.contents = "hello, world!";
+        f.setContents("hello, world!");
+        f.version = 7;
+        f.dumpSnapshot(writer);
+        f.owner = 9;
+        f.dumpSnapshot(writer);
+        f.expiresAt = 11;
         f.dumpSnapshot(writer);
         writer.save();
     }
@@ -85,8 +90,110 @@ TEST(TreeFileTest, dumpSnapshot)
         Storage::SnapshotFile::Reader reader(layout);
         File f;
         f.loadSnapshot(reader);
-        EXPECT_EQ("hello, world!", f.contents);
+        EXPECT_EQ("hello, world!", f.getContents());
+        EXPECT_EQ(7U, f.version);
+        EXPECT_EQ(0U, f.owner);
+        f.loadSnapshot(reader);
+        EXPECT_EQ(9U, f.owner);
+        EXPECT_EQ(0U, f.expiresAt);
+        f.loadSnapshot(reader);
+        EXPECT_EQ(11U, f.expiresAt);
+    }
+}
+
+TEST(TreeFileTest, dumpSnapshot_chunks)
+{
+    Storage::Layout layout;
+    layout.initTemporary();
+    std::string big(File::CHUNK_SIZE * 2 + 7, 'x');
+    {
+        Storage::SnapshotFile::Writer writer(layout);
+        File f;
+        f.setContents(big);
+        f.dumpSnapshot(writer);
+        writer.save();
     }
+    {
+        Storage::SnapshotFile::Reader reader(layout);
+        File f;
+        f.loadSnapshot(reader);
+        EXPECT_EQ(3U, f.chunks.size());
+        EXPECT_TRUE(f.hasContents(big));
+    }
+}
+
+TEST(TreeFileTest, setContents)
+{
+    File f;
+    f.setContents("");
+    EXPECT_EQ(0U, f.chunks.size());
+    EXPECT_EQ(0U, f.getSize());
+    f.setContents("abc");
+    EXPECT_EQ(1U, f.chunks.size());
+    EXPECT_EQ("abc", f.getContents());
+    std::string big(File::CHUNK_SIZE * 2, 'x');
+    f.setContents(big);
+    EXPECT_EQ(2U, f.chunks.size());
+    EXPECT_EQ(File::CHUNK_SIZE * 2, f.getSize());
+    EXPECT_EQ(big, f.getContents());
+}
+
+TEST(TreeFileTest, appendContents)
+{
+    File f;
+    f.appendContents("");
+    EXPECT_EQ(0U, f.chunks.size());
+    f.appendContents("abc");
+    EXPECT_EQ("abc", f.getContents());
+
+    // fills the last chunk before starting new ones
+    std::string fill(File::CHUNK_SIZE - 4, 'x');
+    f.appendContents(fill);
+    EXPECT_EQ(1U, f.chunks.size());
+    f.appendContents("de");
+    EXPECT_EQ(2U, f.chunks.size());
+    EXPECT_EQ(File::CHUNK_SIZE, f.chunks.at(0).size());
+    EXPECT_EQ("e", f.chunks.at(1));
+    EXPECT_EQ("abc" + fill + "de", f.getContents());
+    EXPECT_EQ(File::CHUNK_SIZE + 1, f.getSize());
+}
+
+TEST(TreeFileTest, hasContents)
+{
+    File f;
+    EXPECT_TRUE(f.hasContents(""));
+    EXPECT_FALSE(f.hasContents("a"));
+    std::string big(File::CHUNK_SIZE + 3, 'x');
+    f.setContents(big);
+    EXPECT_TRUE(f.hasContents(big));
+    EXPECT_FALSE(f.hasContents(big + "y"));
+    big.at(File::CHUNK_SIZE + 1) = 'y';
+    EXPECT_FALSE(f.hasContents(big));
+}
+
+TEST(TreeFileTest, readContents)
+{
+    File f;
+    std::string out = "junk";
+    f.readContents(0, 10, out);
+    EXPECT_EQ("", out);
+
+    std::string big;
+    for (uint64_t i = 0; i < File::CHUNK_SIZE * 3; ++i)
+        big.push_back(char('a' + i % 26));
+    f.setContents(big);
+    f.readContents(1, 3, out);
+    EXPECT_EQ("bcd", out);
+    // spans chunk boundaries
+    f.readContents(File::CHUNK_SIZE - 2, File::CHUNK_SIZE + 4, out);
+    EXPECT_EQ(big.substr(File::CHUNK_SIZE - 2, File::CHUNK_SIZE + 4), out);
+    // truncated at the end
+    f.readContents(File::CHUNK_SIZE * 3 - 2, 10, out);
+    EXPECT_EQ(big.substr(File::CHUNK_SIZE * 3 - 2), out);
+    f.readContents(File::CHUNK_SIZE * 3, 10, out);
+    EXPECT_EQ("", out);
+    f.readContents(File::CHUNK_SIZE * 5, 10, out);
+    EXPECT_EQ("", out);
 }
 
 TEST(TreeDirectoryTest, getChildren)
@@ -103,6 +210,70 @@ TEST(TreeDirectoryTest, getChildren)
                }), d.getChildren());
 }
 
+TEST(TreeDirectoryTest, getChildren_window)
+{
+    Directory d;
+    std::vector<std::string> children;
+    EXPECT_FALSE(d.getChildren("", "", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+               }), children);
+    d.makeDirectory("a");
+    d.makeDirectory("ab");
+    d.makeDirectory("c");
+    d.makeFile("aa");
+    d.makeFile("b");
+    d.makeFile("d");
+
+    EXPECT_FALSE(d.getChildren("", "", 0, children));
+    EXPECT_EQ(d.getChildren(), children);
+
+    // paging through with a limit
+    EXPECT_TRUE(d.getChildren("", "", 2, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "a/", "ab/",
+               }), children);
+    EXPECT_TRUE(d.getChildren("ab/", "", 2, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "c/", "aa",
+               }), children);
+    EXPECT_FALSE(d.getChildren("aa", "", 2, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "b", "d",
+               }), children);
+    EXPECT_FALSE(d.getChildren("d", "", 2, children));
+    EXPECT_EQ((std::vector<std::string> {
+               }), children);
+
+    // limit exactly covers the rest
+    EXPECT_FALSE(d.getChildren("c/", "", 3, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "aa", "b", "d",
+               }), children);
+
+    // startAfter need not exist
+    EXPECT_FALSE(d.getChildren("aaa/", "", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "ab/", "c/", "aa", "b", "d",
+               }), children);
+
+    // prefix
+    EXPECT_FALSE(d.getChildren("", "a", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "a/", "ab/", "aa",
+               }), children);
+    EXPECT_TRUE(d.getChildren("a/", "a", 1, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "ab/",
+               }), children);
+    EXPECT_FALSE(d.getChildren("ab/", "a", 1, children));
+    EXPECT_EQ((std::vector<std::string> {
+                "aa",
+               }), children);
+    EXPECT_FALSE(d.getChildren("", "x", 0, children));
+    EXPECT_EQ((std::vector<std::string> {
+               }), children);
+}
+
 TEST(TreeDirectoryTest, lookupDirectory)
 {
     Directory d;
@@ -163,7 +334,7 @@ TEST(TreeDirectoryTest, lookupFile)
     d.makeFile("bar");
     File* f = d.lookupFile("bar");
     ASSERT_TRUE(f != NULL);
-    EXPECT_EQ("", f->contents);
+    EXPECT_EQ("", f->getContents());
     EXPECT_EQ(f, d.lookupFile("bar"));
 }
 
@@ -177,7 +348,7 @@ TEST(TreeDirectoryTest, lookupFile_const)
     d.makeFile("bar");
     const File* f = constd.lookupFile("bar");
     ASSERT_TRUE(f != NULL);
-    EXPECT_EQ("", f->contents);
+    EXPECT_EQ("", f->getContents());
     EXPECT_EQ(f, constd.lookupFile("bar"));
 }
 
@@ -188,7 +359,7 @@ TEST(TreeDirectoryTest, makeFile)
     EXPECT_TRUE(NULL == d.makeFile("foo"));
     File* f = d.makeFile("bar");
     ASSERT_TRUE(f != NULL);
-    EXPECT_EQ("", f->contents);
+    EXPECT_EQ("", f->getContents());
     EXPECT_EQ(f, d.makeFile("bar"));
 }
 
@@ -271,6 +442,13 @@ TEST(TreePathTest, parentsThrough)
     EXPECT_EQ("/a/b/c", path.parentsThrough(it));
 }
 
+TEST(TreePathTest, canonical)
+{
+    EXPECT_EQ("/", Path("/").canonical());
+    EXPECT_EQ("/a", Path("/a/").canonical());
+    EXPECT_EQ("/a/b/c", Path("//a//b/c").canonical());
+}
+
 class TreeTreeTest : public ::testing::Test {
     TreeTreeTest()
         : tree()
@@ -302,6 +480,54 @@ TEST_F(TreeTreeTest, dumpSnapshot)
     EXPECT_EQ((std::vector<std::string>{ "c" }), children);
 }
 
+TEST_F(TreeTreeTest, dumpSnapshot_owners)
+{
+    Storage::Layout layout;
+    layout.initTemporary();
+    {
+        Storage::SnapshotFile::Writer writer(layout);
+        tree.makeDirectory("/a");
+        tree.write("/a/b", "foo", 5, 0);
+        tree.write("/c", "bar", 6, 0);
+        tree.dumpSnapshot(writer);
+        writer.save();
+    }
+    Tree tree2;
+    {
+        Storage::SnapshotFile::Reader reader(layout);
+        tree2.loadSnapshot(reader);
+    }
+    EXPECT_EQ((std::map<uint64_t, std::set<std::string>> {
+                  {5, {"/a/b"}},
+                  {6, {"/c"}},
+              }), tree2.ownedFiles);
+}
+
+TEST_F(TreeTreeTest, dumpSnapshot_expiringFiles)
+{
+    Storage::Layout layout;
+    layout.initTemporary();
+    {
+        Storage::SnapshotFile::Writer writer(layout);
+        tree.setCurrentTime(100);
+        tree.makeDirectory("/a");
+        tree.write("/a/b", "foo", 0, 5);
+        tree.write("/c", "bar", 6, 3);
+        tree.dumpSnapshot(writer);
+        writer.save();
+    }
+    Tree tree2;
+    {
+        Storage::SnapshotFile::Reader reader(layout);
+        tree2.loadSnapshot(reader);
+    }
+    EXPECT_EQ((std::set<std::pair<uint64_t, std::string>> {
+                  {103, "/c"},
+                  {105, "/a/b"},
+              }), tree2.expiringFiles);
+    EXPECT_EQ(103U, tree2.getNextExpiration());
+}
+
 
 TEST_F(TreeTreeTest, normalLookup)
 {
@@ -363,6 +589,107 @@ TEST_F(TreeTreeTest, checkCondition)
     EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
     EXPECT_EQ("Could not read value at path '/c': /c is a directory",
               result.error);
+
+    // long values are shortened in the error message
+    tree.write("/long", std::string(200, 'x'));
+    result = tree.checkCondition("/long", std::string(150, 'y'));
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Path '/long' has value '" + std::string(100, 'x') + "...', "
+              "not '" + std::string(100, 'y') + "...' as required",
+              result.error);
+}
+
+TEST_F(TreeTreeTest, checkCondition_version)
+{
+    tree.setCurrentIndex(5);
+    tree.write("/a", "b");
+    EXPECT_OK(tree.checkCondition("/a", 5UL));
+    EXPECT_OK(tree.checkCondition("/", 5UL));
+    EXPECT_OK(tree.checkCondition("/x", 0UL));
+    EXPECT_OK(tree.checkCondition("/x/y", 0UL));
+    Result result;
+    result = tree.checkCondition("/a", 4UL);
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Path '/a' has version 5, not 4 as required",
+              result.error);
+    result = tree.checkCondition("/a", 0UL);
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Path '/a' exists, but version 0 requires that it does not",
+              result.error);
+    // Nodes written without version tracking still have version 0, but
+    // they exist, so version 0 must not match them.
+    tree.setCurrentIndex(0);
+    tree.write("/old", "v");
+    result = tree.checkCondition("/old", 0UL);
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    result = tree.checkCondition("/c", 3UL);
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Could not find version of path '/c': /c does not exist",
+              result.error);
+    result = tree.checkCondition("/a/b", 3UL);
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Could not find version of path '/a/b': "
+              "Parent /a of /a/b is a file",
+              result.error);
+}
+
+TEST_F(TreeTreeTest, versions)
+{
+    uint64_t version = 0;
+    std::string contents;
+    tree.setCurrentIndex(2);
+    EXPECT_OK(tree.makeDirectory("/d/e"));
+    EXPECT_OK(tree.checkCondition("/", 2UL));
+    EXPECT_OK(tree.checkCondition("/d", 2UL));
+    EXPECT_OK(tree.checkCondition("/d/e", 2UL));
+
+    // writing a new file changes its parent's version
+    tree.setCurrentIndex(3);
+    EXPECT_OK(tree.write("/d/f", "x"));
+    EXPECT_OK(tree.read("/d/f", contents, version));
+    EXPECT_EQ(3U, version);
+    EXPECT_OK(tree.checkCondition("/d", 3UL));
+    EXPECT_OK(tree.checkCondition("/", 2UL));
+
+    // overwriting an existing file does not
+    tree.setCurrentIndex(4);
+    EXPECT_OK(tree.write("/d/f", "y"));
+    EXPECT_OK(tree.read("/d/f", contents, version));
+    EXPECT_EQ(4U, version);
+    EXPECT_OK(tree.checkCondition("/d", 3UL));
+
+    // neither does making an existing directory
+    tree.setCurrentIndex(5);
+    EXPECT_OK(tree.makeDirectory("/d/e"));
+    EXPECT_OK(tree.checkCondition("/d", 3UL));
+    EXPECT_OK(tree.checkCondition("/d/e", 2UL));
+
+    // removals change the parent's version, but only if something was removed
+    tree.setCurrentIndex(6);
+    EXPECT_OK(tree.removeFile("/d/g"));
+    EXPECT_OK(tree.removeDirectory("/d/h"));
+    EXPECT_OK(tree.checkCondition("/d", 3UL));
+    EXPECT_OK(tree.removeFile("/d/f"));
+    EXPECT_OK(tree.checkCondition("/d", 6UL));
+    tree.setCurrentIndex(7);
+    EXPECT_OK(tree.removeDirectory("/d/e"));
+    EXPECT_OK(tree.checkCondition("/d", 7UL));
+
+    // versions survive snapshots
+    Storage::Layout layout;
+    layout.initTemporary();
+    {
+        Storage::SnapshotFile::Writer writer(layout);
+        tree.dumpSnapshot(writer);
+        writer.save();
+    }
+    {
+        Storage::SnapshotFile::Reader reader(layout);
+        Tree t2;
+        t2.loadSnapshot(reader);
+        EXPECT_OK(t2.checkCondition("/", 2UL));
+        EXPECT_OK(t2.checkCondition("/d", 7UL));
+    }
 }
 
 TEST_F(TreeTreeTest, makeDirectory)
@@ -411,6 +738,35 @@ TEST_F(TreeTreeTest, listDirectory)
     EXPECT_EQ("/d is a file", result.error);
 }
 
+TEST_F(TreeTreeTest, listDirectory_window)
+{
+    std::vector<std::string> children;
+    bool more = true;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.listDirectory("", "", "", 0, children, more).status);
+    EXPECT_FALSE(more);
+    EXPECT_OK(tree.makeDirectory("/a/"));
+    EXPECT_OK(tree.write("/b", "foo"));
+    EXPECT_OK(tree.write("/bb", "foo"));
+    EXPECT_OK(tree.listDirectory("/", "", "", 2, children, more));
+    EXPECT_EQ((std::vector<std::string>{
+                    "a/", "b",
+               }), children);
+    EXPECT_TRUE(more);
+    EXPECT_OK(tree.listDirectory("/", "b", "", 2, children, more));
+    EXPECT_EQ((std::vector<std::string>{
+                    "bb",
+               }), children);
+    EXPECT_FALSE(more);
+    EXPECT_OK(tree.listDirectory("/", "", "b", 0, children, more));
+    EXPECT_EQ((std::vector<std::string>{
+                    "b", "bb",
+               }), children);
+    EXPECT_FALSE(more);
+    EXPECT_EQ(Status::TYPE_ERROR,
+              tree.listDirectory("/b", "", "", 1, children, more).status);
+}
+
 TEST_F(TreeTreeTest, removeDirectory)
 {
     EXPECT_EQ(Status::INVALID_ARGUMENT, tree.removeDirectory("").status);
@@ -454,6 +810,220 @@ TEST_F(TreeTreeTest, write)
     EXPECT_EQ("/b is a directory", result.error);
 }
 
+TEST_F(TreeTreeTest, write_maxSize)
+{
+    EXPECT_OK(tree.write("/a", std::string(File::MAX_SIZE, 'x')));
+    Result result = tree.write("/b", std::string(File::MAX_SIZE + 1, 'x'));
+    EXPECT_EQ(Status::INVALID_ARGUMENT, result.status);
+    EXPECT_EQ(Core::StringUtil::format(
+                  "Contents of /b would be %lu bytes, but files may hold "
+                  "at most %lu bytes",
+                  File::MAX_SIZE + 1, File::MAX_SIZE),
+              result.error);
+    EXPECT_EQ("/ /a", dumpTree(tree));
+}
+
+TEST_F(TreeTreeTest, write_owner)
+{
+    std::string contents;
+    uint64_t version;
+    uint64_t owner;
+    uint64_t expiresAt;
+    EXPECT_OK(tree.write("//a", "foo", 5, 0));
+    EXPECT_OK(tree.read("/a", contents, version, owner, expiresAt));
+    EXPECT_EQ(5U, owner);
+    EXPECT_EQ((std::set<std::string> { "/a" }), tree.ownedFiles[5]);
+
+    // rewriting the file transfers or drops ownership
+    EXPECT_OK(tree.write("/a", "foo", 6, 0));
+    EXPECT_EQ(0U, tree.ownedFiles.count(5));
+    EXPECT_EQ((std::set<std::string> { "/a" }), tree.ownedFiles[6]);
+    EXPECT_OK(tree.write("/a", "foo"));
+    EXPECT_OK(tree.read("/a", contents, version, owner, expiresAt));
+    EXPECT_EQ(0U, owner);
+    EXPECT_TRUE(tree.ownedFiles.empty());
+}
+
+TEST_F(TreeTreeTest, write_ttl)
+{
+    std::string contents;
+    uint64_t version;
+    uint64_t owner;
+    uint64_t expiresAt;
+    tree.setCurrentTime(100);
+    EXPECT_OK(tree.write("/a", "foo", 0, 10));
+    EXPECT_OK(tree.read("/a", contents, version, owner, expiresAt));
+    EXPECT_EQ(110U, expiresAt);
+    EXPECT_EQ(110U, tree.getNextExpiration());
+
+    // rewriting the file restarts or drops its time-to-live
+    tree.setCurrentTime(105);
+    EXPECT_OK(tree.write("/a", "foo", 0, 10));
+    EXPECT_EQ((std::set<std::pair<uint64_t, std::string>> {
+                  {115, "/a"},
+              }), tree.expiringFiles);
+    EXPECT_OK(tree.append("/a", "bar"));
+    EXPECT_EQ(115U, tree.getNextExpiration());
+    EXPECT_OK(tree.write("/a", "foo"));
+    EXPECT_OK(tree.read("/a", contents, version, owner, expiresAt));
+    EXPECT_EQ(0U, expiresAt);
+    EXPECT_EQ(0U, tree.getNextExpiration());
+
+    // a huge time-to-live saturates instead of wrapping into the past
+    EXPECT_OK(tree.write("/a", "foo", 0, ~0UL));
+    EXPECT_OK(tree.read("/a", contents, version, owner, expiresAt));
+    EXPECT_EQ(~0UL, expiresAt);
+    tree.setCurrentTime(106);
+    EXPECT_OK(tree.compareAndSwap("/a", "foo", "bar", 0, ~0UL - 10));
+    EXPECT_OK(tree.read("/a", contents, version, owner, expiresAt));
+    EXPECT_EQ(~0UL, expiresAt);
+    tree.removeExpiredFiles();
+    EXPECT_OK(tree.read("/a", contents));
+}
+
+TEST_F(TreeTreeTest, increment)
+{
+    int64_t value = 9;
+    EXPECT_EQ(Status::INVALID_ARGUMENT, tree.increment("", 1, value).status);
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree.increment("/a/b", 1, value).status);
+    EXPECT_OK(tree.increment("/a", 1, value));
+    EXPECT_EQ(1, value);
+    EXPECT_OK(tree.increment("/a", 5, value));
+    EXPECT_EQ(6, value);
+    EXPECT_OK(tree.increment("/a", -10, value));
+    EXPECT_EQ(-4, value);
+    std::string contents;
+    EXPECT_OK(tree.read("/a", contents));
+    EXPECT_EQ("-4", contents);
+
+    EXPECT_OK(tree.write("/b", ""));
+    EXPECT_OK(tree.increment("/b", 2, value));
+    EXPECT_EQ(2, value);
+
+    Result result;
+    EXPECT_OK(tree.write("/c", "12x"));
+    result = tree.increment("/c", 1, value);
+    EXPECT_EQ(Status::TYPE_ERROR, result.status);
+    EXPECT_EQ("/c does not contain an integer", result.error);
+    EXPECT_OK(tree.write("/c", " 12"));
+    EXPECT_EQ(Status::TYPE_ERROR, tree.increment("/c", 1, value).status);
+    EXPECT_OK(tree.write("/c", "99999999999999999999"));
+    EXPECT_EQ(Status::TYPE_ERROR, tree.increment("/c", 1, value).status);
+
+    EXPECT_OK(tree.write("/d", "9223372036854775806"));
+    EXPECT_OK(tree.increment("/d", 1, value));
+    EXPECT_EQ(9223372036854775807L, value);
+    result = tree.increment("/d", 1, value);
+    EXPECT_EQ(Status::INVALID_ARGUMENT, result.status);
+    EXPECT_EQ("Adding 1 to /d (9223372036854775807) would overflow",
+              result.error);
+    EXPECT_OK(tree.read("/d", contents));
+    EXPECT_EQ("9223372036854775807", contents);
+
+    EXPECT_OK(tree.makeDirectory("/e"));
+    result = tree.increment("/e", 1, value);
+    EXPECT_EQ(Status::TYPE_ERROR, result.status);
+    EXPECT_EQ("/e is a directory", result.error);
+}
+
+TEST_F(TreeTreeTest, append)
+{
+    EXPECT_EQ(Status::INVALID_ARGUMENT, tree.append("", "x").status);
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree.append("/a/b", "x").status);
+    EXPECT_OK(tree.append("/a", "foo"));
+    EXPECT_OK(tree.append("/a", "bar"));
+    std::string contents;
+    EXPECT_OK(tree.read("/a", contents));
+    EXPECT_EQ("foobar", contents);
+
+    EXPECT_OK(tree.makeDirectory("/b"));
+    Result result = tree.append("/b", "x");
+    EXPECT_EQ(Status::TYPE_ERROR, result.status);
+    EXPECT_EQ("/b is a directory", result.error);
+}
+
+TEST_F(TreeTreeTest, append_maxSize)
+{
+    Result result = tree.append("/a", std::string(File::MAX_SIZE + 1, 'x'));
+    EXPECT_EQ(Status::INVALID_ARGUMENT, result.status);
+    EXPECT_EQ("/", dumpTree(tree));
+
+    EXPECT_OK(tree.append("/a", std::string(File::MAX_SIZE - 1, 'x')));
+    EXPECT_OK(tree.append("/a", "y"));
+    result = tree.append("/a", "z");
+    EXPECT_EQ(Status::INVALID_ARGUMENT, result.status);
+    EXPECT_EQ(Core::StringUtil::format(
+                  "Contents of /a would be %lu bytes, but files may hold "
+                  "at most %lu bytes",
+                  File::MAX_SIZE + 1, File::MAX_SIZE),
+              result.error);
+    std::string contents;
+    EXPECT_OK(tree.read("/a", contents));
+    EXPECT_EQ(File::MAX_SIZE, contents.size());
+}
+
+TEST_F(TreeTreeTest, compareAndSwap)
+{
+    std::string contents;
+    Result result;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.compareAndSwap("", "", "x").status);
+    EXPECT_EQ(Status::LOOKUP_ERROR,
+              tree.compareAndSwap("/a/b", "", "x").status);
+    result = tree.compareAndSwap("/a/b", "y", "x");
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Could not read value at path '/a/b': "
+              "Parent /a of /a/b does not exist",
+              result.error);
+    result = tree.compareAndSwap("/a", "y", "x");
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Could not read value at path '/a': /a does not exist",
+              result.error);
+    EXPECT_EQ(Status::LOOKUP_ERROR, tree.read("/a", contents).status);
+
+    EXPECT_OK(tree.compareAndSwap("/a", "", "x"));
+    EXPECT_OK(tree.read("/a", contents));
+    EXPECT_EQ("x", contents);
+    result = tree.compareAndSwap("/a", "y", "z");
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Path '/a' has value 'x', not 'y' as required",
+              result.error);
+    EXPECT_OK(tree.compareAndSwap("/a", "x", "z"));
+    EXPECT_OK(tree.read("/a", contents));
+    EXPECT_EQ("z", contents);
+
+    EXPECT_OK(tree.makeDirectory("/b"));
+    result = tree.compareAndSwap("/b", "", "x");
+    EXPECT_EQ(Status::TYPE_ERROR, result.status);
+    EXPECT_EQ("/b is a directory", result.error);
+
+    result = tree.compareAndSwap("/a", "z",
+                                 std::string(File::MAX_SIZE + 1, 'x'));
+    EXPECT_EQ(Status::INVALID_ARGUMENT, result.status);
+    EXPECT_OK(tree.read("/a", contents));
+    EXPECT_EQ("z", contents);
+
+    // long values are shortened in the error message
+    EXPECT_OK(tree.write("/long", std::string(200, 'x')));
+    result = tree.compareAndSwap("/long", std::string(150, 'y'), "z");
+    EXPECT_EQ(Status::CONDITION_NOT_MET, result.status);
+    EXPECT_EQ("Path '/long' has value '" + std::string(100, 'x') + "...', "
+              "not '" + std::string(100, 'y') + "...' as required",
+              result.error);
+}
+
+TEST_F(TreeTreeTest, compareAndSwap_owner)
+{
+    EXPECT_EQ(Status::CONDITION_NOT_MET,
+              tree.compareAndSwap("/a", "x", "y", 5, 0).status);
+    EXPECT_TRUE(tree.ownedFiles.empty());
+    EXPECT_OK(tree.compareAndSwap("/a", "", "y", 5, 0));
+    EXPECT_EQ((std::set<std::string> { "/a" }), tree.ownedFiles[5]);
+    // append keeps the owner
+    EXPECT_OK(tree.append("/a", "z"));
+    EXPECT_EQ((std::set<std::string> { "/a" }), tree.ownedFiles[5]);
+}
+
 TEST_F(TreeTreeTest, read)
 {
     std::string contents;
@@ -476,6 +1046,31 @@ TEST_F(TreeTreeTest, read)
     EXPECT_EQ("/c does not exist", result.error);
 }
 
+TEST_F(TreeTreeTest, read_range)
+{
+    std::string contents;
+    uint64_t version;
+    uint64_t size;
+    EXPECT_EQ(Status::INVALID_ARGUMENT,
+              tree.read("", 0, 0, contents, version, size).status);
+    EXPECT_EQ(Status::TYPE_ERROR,
+              tree.read("/", 0, 0, contents, version, size).status);
+    EXPECT_EQ(Status::LOOKUP_ERROR,
+              tree.read("/a", 0, 0, contents, version, size).status);
+
+    tree.setCurrentIndex(3);
+    EXPECT_OK(tree.write("/a", "hello, world!"));
+    EXPECT_OK(tree.read("/a", 7, 5, contents, version, size));
+    EXPECT_EQ("world", contents);
+    EXPECT_EQ(3U, version);
+    EXPECT_EQ(13U, size);
+    EXPECT_OK(tree.read("/a", 7, 0, contents, version, size));
+    EXPECT_EQ("world!", contents);
+    EXPECT_OK(tree.read("/a", 20, 5, contents, version, size));
+    EXPECT_EQ("", contents);
+    EXPECT_EQ(13U, size);
+}
+
 TEST_F(TreeTreeTest, removeFile)
 {
     EXPECT_EQ(Status::INVALID_ARGUMENT, tree.removeFile("").status);
@@ -492,6 +1087,62 @@ TEST_F(TreeTreeTest, removeFile)
     result = tree.removeFile("/e");
     EXPECT_EQ(Status::TYPE_ERROR, result.status);
     EXPECT_EQ("/e is a directory", result.error);
+
+    EXPECT_OK(tree.write("/f", "foo", 5, 0));
+    EXPECT_OK(tree.removeFile("/f"));
+    EXPECT_TRUE(tree.ownedFiles.empty());
+}
+
+TEST_F(TreeTreeTest, removeDirectory_owners)
+{
+    EXPECT_OK(tree.makeDirectory("/a/b"));
+    EXPECT_OK(tree.write("/a/b/c", "foo", 5, 0));
+    EXPECT_OK(tree.write("/a/d", "foo", 5, 0));
+    EXPECT_OK(tree.write("/e", "foo", 5, 0));
+    EXPECT_OK(tree.write("/f", "foo", 6, 0));
+    EXPECT_OK(tree.removeDirectory("/a"));
+    EXPECT_EQ((std::set<std::string> { "/e" }), tree.ownedFiles[5]);
+    EXPECT_OK(tree.removeDirectory("/"));
+    EXPECT_TRUE(tree.ownedFiles.empty());
+}
+
+TEST_F(TreeTreeTest, removeOwnedFiles)
+{
+    EXPECT_OK(tree.makeDirectory("/a"));
+    EXPECT_OK(tree.write("/a/b", "foo", 5, 0));
+    EXPECT_OK(tree.write("/a/c", "foo", 6, 0));
+    EXPECT_OK(tree.write("/d", "foo", 5, 0));
+    EXPECT_OK(tree.write("/e", "foo"));
+    tree.setCurrentIndex(10);
+    tree.removeOwnedFiles(5);
+    tree.removeOwnedFiles(7);
+    EXPECT_EQ("/ /a/ /a/c /e", dumpTree(tree));
+    EXPECT_EQ(0U, tree.ownedFiles.count(5));
+    EXPECT_EQ(2U, tree.numOwnedFilesRemoved);
+    EXPECT_OK(tree.checkCondition("/a", 10));
+}
+
+TEST_F(TreeTreeTest, removeExpiredFiles)
+{
+    tree.setCurrentTime(100);
+    EXPECT_OK(tree.makeDirectory("/a"));
+    EXPECT_OK(tree.write("/a/b", "foo", 0, 5));
+    EXPECT_OK(tree.write("/a/c", "foo", 0, 20));
+    EXPECT_OK(tree.write("/d", "foo", 7, 10));
+    EXPECT_OK(tree.write("/e", "foo"));
+    EXPECT_OK(tree.removeFile("/a/c"));
+    tree.setCurrentIndex(10);
+    tree.setCurrentTime(109);
+    tree.removeExpiredFiles();
+    EXPECT_EQ("/ /a/ /d /e", dumpTree(tree));
+    EXPECT_EQ(110U, tree.getNextExpiration());
+    EXPECT_OK(tree.checkCondition("/a", 10));
+    tree.setCurrentTime(110);
+    tree.removeExpiredFiles();
+    EXPECT_EQ("/ /a/ /e", dumpTree(tree));
+    EXPECT_EQ(0U, tree.getNextExpiration());
+    EXPECT_TRUE(tree.ownedFiles.empty());
+    EXPECT_EQ(2U, tree.numExpiredFilesRemoved);
 }
 
 } // namespace LogCabin::Tree::<anonymous>
@@ -20,6 +20,7 @@
  */
 
 #include <cstddef>
+#include <iosfwd>
 #include <memory>
 #include <map>
 #include <mutex>
@@ -51,6 +52,8 @@ class StateMachineCommand_Response;
 namespace Client {
 
 class ClientImpl; // forward declaration
+class DirectoryIterator; // forward declaration
+class FutureDetails; // forward declaration
 class TreeDetails; // forward declaration
 
 // To control how the debug log operates, clients should
@@ -126,6 +129,34 @@ struct ConfigurationResult {
     std::string error;
 };
 
+/**
+ * Returned by Cluster::getReadCacheStats. Counters describing how well the
+ * client library's read cache is working (see Cluster::Options).
+ */
+struct ReadCacheStats {
+    ReadCacheStats();
+
+    /**
+     * Reads served from the cache.
+     */
+    uint64_t hits;
+
+    /**
+     * Cacheable reads that had to be sent to the cluster.
+     */
+    uint64_t misses;
+
+    /**
+     * Cached files dropped because this client modified them.
+     */
+    uint64_t invalidations;
+
+    /**
+     * Cached files dropped because their lease or staleness bound ran out.
+     */
+    uint64_t expirations;
+};
+
 /**
  * Status codes returned by Tree operations.
  */
@@ -243,6 +274,99 @@ class TimeoutException : public Exception {
     explicit TimeoutException(const std::string& error);
 };
 
+/**
+ * The eventual outcome of an asynchronous Tree operation, returned by methods
+ * such as Tree::writeAsync(). The operation is sent to the cluster when the
+ * Future is created, so a single thread can have many operations in flight at
+ * once. Read-write operations still take effect exactly once, even if they
+ * are retried on a new leader.
+ *
+ * Usage:
+ * \code
+ *  std::vector<Future> futures;
+ *  for (int i = 0; i < 100; ++i)
+ *      futures.push_back(tree.writeAsync("/a/" + std::to_string(i), "x"));
+ *  for (auto it = futures.begin(); it != futures.end(); ++it)
+ *      it->waitEx();
+ * \endcode
+ *
+ * Like std::future, a Future may be moved but not copied, and it should only
+ * be used from one thread at a time. Destroying a Future whose operation has
+ * not completed abandons the operation: it may or may not take effect.
+ */
+class Future {
+  private:
+    /// Constructor. See the asynchronous methods of Tree.
+    explicit Future(std::shared_ptr<FutureDetails> futureDetails);
+  public:
+    /// Default constructor. Creates a Future with no operation.
+    Future();
+    /// Move constructor.
+    Future(Future&& other);
+    /// Destructor.
+    ~Future();
+    /// Move assignment.
+    Future& operator=(Future&& other);
+
+    /**
+     * Return true if this Future refers to an operation (it wasn't default
+     * constructed or moved from).
+     */
+    bool valid() const;
+
+    /**
+     * Wait for the operation to complete, or for the timeout that was set on
+     * the Tree when the operation started to elapse. This may be called more
+     * than once; later calls return the same result right away.
+     * \return
+     *      Status and error message, as returned by the synchronous version
+     *      of the operation.
+     */
+    Result wait();
+
+    /**
+     * Like wait but throws exceptions upon errors.
+     */
+    void waitEx();
+
+    /**
+     * Wait for a read operation to complete and return the file's contents,
+     * or the empty string if the read failed.
+     */
+    std::string getContents();
+
+    /**
+     * Wait for a read operation to complete and return the file's version,
+     * or 0 if the read failed.
+     */
+    uint64_t getVersion();
+
+    /**
+     * Wait for an increment operation to complete and return the counter's
+     * new value, or 0 if the increment failed.
+     */
+    int64_t getValue();
+
+    /**
+     * Wait for a listDirectory operation to complete and return the
+     * directory's children, or an empty list if the listing failed.
+     */
+    std::vector<std::string> getChildren();
+
+  private:
+    /**
+     * Implementation-specific members, or NULL if this Future refers to no
+     * operation.
+     */
+    std::shared_ptr<FutureDetails> futureDetails;
+
+    // Future is not copyable
+    Future(const Future&) = delete;
+    Future& operator=(const Future&) = delete;
+
+    friend class Tree;
+};
+
 /**
  * Provides access to the hierarchical key-value store.
  * You can get an instance of Tree through Cluster::getTree() or by copying
@@ -306,10 +430,24 @@ class Tree {
      *      First component: the absolute path corresponding to the 'path'
      *      argument of setCondition().
      *      Second component: the file contents given as the 'value' argument
-     *      of setCondition().
+     *      of setCondition(), or the empty string if the condition was set on
+     *      a version; use getVersionCondition() to tell these apart.
      */
     std::pair<std::string, std::string> getCondition() const;
 
+    /**
+     * Return whether the condition set by a previous call to setCondition()
+     * is on a version rather than on file contents.
+     * \param[out] version
+     *      Set to the 'version' argument of setCondition() if this returns
+     *      true; left unchanged otherwise.
+     * \return
+     *      True if the condition was set on a version, false if it was set on
+     *      file contents or no condition is set. The condition's path is
+     *      returned by getCondition() either way.
+     */
+    bool getVersionCondition(uint64_t& version) const;
+
     /**
      * Set a predicate on all future operations. Future operations will return
      * Status::CONDITION_NOT_MET and have no effect unless the file at 'path'
@@ -336,6 +474,37 @@ class Tree {
      */
     void setConditionEx(const std::string& path, const std::string& value);
 
+    /**
+     * Set a predicate on all future operations. Future operations will return
+     * Status::CONDITION_NOT_MET and have no effect unless the file or
+     * directory at 'path' has the version 'version'. To remove the predicate,
+     * pass an empty string as 'path'.
+     * \param path
+     *      The relative or absolute path to the file or directory that must
+     *      have the version specified, or an empty string to clear the
+     *      condition.
+     * \param version
+     *      The version that the file or directory specified by 'path' must
+     *      have for future operations to succeed, as returned by read(). A
+     *      file's version changes whenever it is written; a directory's
+     *      version changes whenever a child is added or removed. If 'version'
+     *      is 0, the condition is satisfied only if nothing exists at 'path'.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *      If this returns an error, future operations on this tree will fail
+     *      until a new condition is set or the condition is cleared.
+     * \since
+     *      Read-write operations honor version conditions only once all
+     *      servers in the cluster support state machine version 3.
+     */
+    Result setCondition(const std::string& path, uint64_t version);
+
+    /**
+     * Like setCondition but throws exceptions upon errors.
+     */
+    void setConditionEx(const std::string& path, uint64_t version);
+
     /**
      * Return the timeout set by a previous call to setTimeout().
      * \return
@@ -356,6 +525,53 @@ class Tree {
      */
     void setTimeout(uint64_t nanoseconds);
 
+    /**
+     * Return whether files written through this Tree are ephemeral, as set
+     * by a previous call to setEphemeral().
+     */
+    bool getEphemeral() const;
+
+    /**
+     * Make the files that future calls to write() and compareAndSwap() (and
+     * their asynchronous versions) create or replace ephemeral, or regular
+     * again. An ephemeral file is owned by the client's session and is
+     * removed when that session is closed or expires, which makes it useful
+     * for advertising that a process is alive (for example, holding a
+     * leader lock or registering a service) without heartbeat writes. Other
+     * operations on an existing ephemeral file leave it ephemeral.
+     * \param ephemeral
+     *      True to create ephemeral files, false for regular files.
+     * \since
+     *      Files are only made ephemeral once all servers in the cluster
+     *      support state machine version 8; until then, they're written as
+     *      regular files.
+     */
+    void setEphemeral(bool ephemeral);
+
+    /**
+     * Return the time-to-live given to files written through this Tree, as
+     * set by a previous call to setTTL().
+     * \return
+     *      The time-to-live in nanoseconds, or 0 if files don't expire.
+     */
+    uint64_t getTTL() const;
+
+    /**
+     * Make the files that future calls to write() and compareAndSwap() (and
+     * their asynchronous versions) create or replace expire after the given
+     * duration. The cluster removes an expired file on its own, without
+     * further client requests; the duration is measured in the cluster's
+     * replicated time, so all servers agree on when that happens. Other
+     * operations on an existing file leave its expiration unchanged.
+     * \param nanoseconds
+     *      Time-to-live in nanoseconds, or 0 for files that don't expire.
+     * \since
+     *      Files only expire once all servers in the cluster support state
+     *      machine version 9; until then, they're written without a
+     *      time-to-live.
+     */
+    void setTTL(uint64_t nanoseconds);
+
     /**
      * Make sure a directory exists at the given path.
      * Create parent directories listed in path as necessary.
@@ -406,6 +622,53 @@ class Tree {
      */
     std::vector<std::string> listDirectoryEx(const std::string& path) const;
 
+    /**
+     * List one page of the contents of a directory. This is useful for
+     * directories too large to list in a single request; see also
+     * iterateDirectory().
+     * \param path
+     *      The directory whose direct children to list.
+     * \param startAfter
+     *      Only children listed after this one are returned; pass the last
+     *      child of the previous page to continue a listing. If empty, the
+     *      listing starts at the beginning.
+     * \param prefix
+     *      Only children whose names begin with this string are returned.
+     * \param limit
+     *      The maximum number of children to return, or 0 for no limit.
+     * \param[out] children
+     *      This will be replaced by the page of the listing, in the same format
+     *      and order as listDirectory() above.
+     * \param[out] more
+     *      Set to true if more children follow this page.
+     * \return
+     *      See listDirectory() above.
+     */
+    Result
+    listDirectory(const std::string& path,
+                  const std::string& startAfter,
+                  const std::string& prefix,
+                  uint64_t limit,
+                  std::vector<std::string>& children,
+                  bool& more) const;
+
+    /**
+     * Return an iterator over the contents of a directory that fetches the
+     * children lazily, a page at a time. The iterator uses a copy of this
+     * Tree, so its working directory, condition, and timeout are fixed at
+     * the time of this call.
+     * \param path
+     *      The directory whose direct children to list.
+     * \param prefix
+     *      Only children whose names begin with this string are listed.
+     * \param pageSize
+     *      The maximum number of children to fetch per request.
+     */
+    DirectoryIterator
+    iterateDirectory(const std::string& path,
+                     const std::string& prefix = "",
+                     uint64_t pageSize = 1000) const;
+
     /**
      * Make sure a directory does not exist.
      * Also removes all direct and indirect children of the directory.
@@ -442,7 +705,7 @@ class Tree {
      * \return
      *      Status and error message. Possible errors are:
      *       - INVALID_ARGUMENT if path is malformed.
-     *       - INVALID_ARGUMENT if contents are too large to fit in a file.
+     *       - INVALID_ARGUMENT if contents are larger than 32 MB.
      *       - LOOKUP_ERROR if a parent of path does not exist.
      *       - TYPE_ERROR if a parent of path is a file.
      *       - TYPE_ERROR if path exists but is a directory.
@@ -458,6 +721,137 @@ class Tree {
     void
     writeEx(const std::string& path, const std::string& contents);
 
+    /**
+     * Set the value of a file to the rest of a stream, so that files too
+     * large for a single request can be written. The first piece replaces
+     * the file's contents (subject to setCondition(), setEphemeral(), and
+     * setTTL()), and the rest are appended to it one at a time. This is not
+     * atomic: readers may see some of the pieces before the rest are
+     * appended, and after a failure the file may hold only the first few.
+     * If another client modifies the file partway through, this fails with
+     * CONDITION_NOT_MET. The timeout from setTimeout() applies to the entire
+     * operation.
+     * \param path
+     *      The path where there should be a file with the stream's contents
+     *      after this call.
+     * \param in
+     *      The stream to read the new value from, until its end.
+     * \param pieceSize
+     *      The maximum number of bytes to send per request.
+     * \return
+     *      See write() and append() above.
+     */
+    Result
+    writeStream(const std::string& path,
+                std::istream& in,
+                uint64_t pieceSize = 512 * 1024);
+
+    /**
+     * Like writeStream but throws exceptions upon errors.
+     */
+    void
+    writeStreamEx(const std::string& path,
+                  std::istream& in,
+                  uint64_t pieceSize = 512 * 1024);
+
+    /**
+     * Atomically add to the integer stored in a file, in a single round trip
+     * to the cluster. The file's contents are a signed decimal integer; a
+     * file that does not exist or is empty is treated as 0 and is created.
+     * \param path
+     *      The path of the file holding the counter.
+     * \param delta
+     *      The amount to add (may be negative).
+     * \param[out] value
+     *      Upon success, the new value of the counter.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - INVALID_ARGUMENT if the addition would overflow.
+     *       - INVALID_ARGUMENT if the cluster does not support this
+     *         operation yet.
+     *       - LOOKUP_ERROR if a parent of path does not exist.
+     *       - TYPE_ERROR if a parent of path is a file.
+     *       - TYPE_ERROR if path exists but is a directory.
+     *       - TYPE_ERROR if the file does not contain an integer.
+     *       - CONDITION_NOT_MET if predicate from setCondition() was false.
+     *       - TIMEOUT if timeout elapsed before the operation completed.
+     */
+    Result
+    increment(const std::string& path, int64_t delta, int64_t& value);
+
+    /**
+     * Like increment but throws exceptions upon errors.
+     * \return
+     *      The new value of the counter.
+     */
+    int64_t
+    incrementEx(const std::string& path, int64_t delta = 1);
+
+    /**
+     * Atomically add to the end of a file, creating it if necessary.
+     * \param path
+     *      The path of the file to append to.
+     * \param contents
+     *      The bytes to add to the end of the file.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - INVALID_ARGUMENT if the file would grow larger than 32 MB.
+     *       - INVALID_ARGUMENT if the cluster does not support this
+     *         operation yet.
+     *       - LOOKUP_ERROR if a parent of path does not exist.
+     *       - TYPE_ERROR if a parent of path is a file.
+     *       - TYPE_ERROR if path exists but is a directory.
+     *       - CONDITION_NOT_MET if predicate from setCondition() was false.
+     *       - TIMEOUT if timeout elapsed before the operation completed.
+     */
+    Result
+    append(const std::string& path, const std::string& contents);
+
+    /**
+     * Like append but throws exceptions upon errors.
+     */
+    void
+    appendEx(const std::string& path, const std::string& contents);
+
+    /**
+     * Atomically set the value of a file if it currently has the given value.
+     * Unlike a write guarded by setCondition(), this does not replace the
+     * condition set on this Tree, which is also checked.
+     * \param path
+     *      The path of the file to set.
+     * \param oldContents
+     *      The contents the file must currently have. If this is the empty
+     *      string, the swap also happens if the file does not exist.
+     * \param newContents
+     *      The new value associated with the file.
+     * \return
+     *      Status and error message. Possible errors are:
+     *       - INVALID_ARGUMENT if path is malformed.
+     *       - INVALID_ARGUMENT if newContents is larger than 32 MB.
+     *       - INVALID_ARGUMENT if the cluster does not support this
+     *         operation yet.
+     *       - LOOKUP_ERROR if a parent of path does not exist.
+     *       - TYPE_ERROR if a parent of path is a file.
+     *       - TYPE_ERROR if path exists but is a directory.
+     *       - CONDITION_NOT_MET if the file did not have 'oldContents'.
+     *       - CONDITION_NOT_MET if predicate from setCondition() was false.
+     *       - TIMEOUT if timeout elapsed before the operation completed.
+     */
+    Result
+    compareAndSwap(const std::string& path,
+                   const std::string& oldContents,
+                   const std::string& newContents);
+
+    /**
+     * Like compareAndSwap but throws exceptions upon errors.
+     */
+    void
+    compareAndSwapEx(const std::string& path,
+                     const std::string& oldContents,
+                     const std::string& newContents);
+
     /**
      * Get the value of a file.
      * \param path
@@ -477,12 +871,93 @@ class Tree {
     Result
     read(const std::string& path, std::string& contents) const;
 
+    /**
+     * Get the value and version of a file.
+     * \param path
+     *      The path of the file whose contents to read.
+     * \param contents
+     *      The current value associated with the file.
+     * \param version
+     *      The current version of the file, for use with setCondition().
+     * \return
+     *      See read() above.
+     */
+    Result
+    read(const std::string& path,
+         std::string& contents,
+         uint64_t& version) const;
+
     /**
      * Like read but throws exceptions upon errors.
      */
     std::string
     readEx(const std::string& path) const;
 
+    /**
+     * Like read (with version) but throws exceptions upon errors.
+     */
+    std::string
+    readEx(const std::string& path, uint64_t& version) const;
+
+    /**
+     * Get part of the value of a file. Only the requested bytes are sent, so
+     * this is useful for reading a piece of a large file; see also
+     * readStream().
+     * \param path
+     *      The path of the file whose contents to read.
+     * \param offset
+     *      The index of the first byte to read. If this is at or past the end
+     *      of the file, contents will be empty.
+     * \param length
+     *      The maximum number of bytes to read, or 0 to read to the end of
+     *      the file.
+     * \param[out] contents
+     *      The requested range of the value associated with the file.
+     * \param[out] version
+     *      The current version of the file, for use with setCondition().
+     * \param[out] size
+     *      The total number of bytes in the file.
+     * \return
+     *      See read() above.
+     */
+    Result
+    read(const std::string& path,
+         uint64_t offset,
+         uint64_t length,
+         std::string& contents,
+         uint64_t& version,
+         uint64_t& size) const;
+
+    /**
+     * Copy the value of a file to a stream, one piece at a time, so that
+     * files too large for a single request can be read. All pieces come from
+     * the same version of the file: if the file is modified partway through,
+     * this fails with CONDITION_NOT_MET. The predicate from setCondition() is
+     * checked on every piece. The timeout from setTimeout() applies to the
+     * entire operation.
+     * \param path
+     *      The path of the file whose contents to read.
+     * \param out
+     *      The file's contents are written here. After a failure, it may
+     *      hold some of them.
+     * \param pieceSize
+     *      The maximum number of bytes to fetch per request.
+     * \return
+     *      See read() above.
+     */
+    Result
+    readStream(const std::string& path,
+               std::ostream& out,
+               uint64_t pieceSize = 512 * 1024) const;
+
+    /**
+     * Like readStream but throws exceptions upon errors.
+     */
+    void
+    readStreamEx(const std::string& path,
+                 std::ostream& out,
+                 uint64_t pieceSize = 512 * 1024) const;
+
     /**
      * Make sure a file does not exist.
      * \param path
@@ -504,11 +979,75 @@ class Tree {
     void
     removeFileEx(const std::string& path);
 
+    /**
+     * Asynchronous version of makeDirectory(). See Future.
+     */
+    Future
+    makeDirectoryAsync(const std::string& path);
+
+    /**
+     * Asynchronous version of listDirectory(). See Future::getChildren().
+     */
+    Future
+    listDirectoryAsync(const std::string& path) const;
+
+    /**
+     * Asynchronous version of removeDirectory(). See Future.
+     */
+    Future
+    removeDirectoryAsync(const std::string& path);
+
+    /**
+     * Asynchronous version of write(). See Future.
+     */
+    Future
+    writeAsync(const std::string& path, const std::string& contents);
+
+    /**
+     * Asynchronous version of increment(). See Future::getValue().
+     */
+    Future
+    incrementAsync(const std::string& path, int64_t delta = 1);
+
+    /**
+     * Asynchronous version of append(). See Future.
+     */
+    Future
+    appendAsync(const std::string& path, const std::string& contents);
+
+    /**
+     * Asynchronous version of compareAndSwap(). See Future.
+     */
+    Future
+    compareAndSwapAsync(const std::string& path,
+                        const std::string& oldContents,
+                        const std::string& newContents);
+
+    /**
+     * Asynchronous version of read(). See Future::getContents() and
+     * Future::getVersion().
+     */
+    Future
+    readAsync(const std::string& path) const;
+
+    /**
+     * Asynchronous version of removeFile(). See Future.
+     */
+    Future
+    removeFileAsync(const std::string& path);
+
   private:
     /**
      * Get a reference to the implementation-specific members of this class.
      */
     std::shared_ptr<const TreeDetails> getTreeDetails() const;
+    /**
+     * Common implementation of both setCondition() variants.
+     */
+    Result setConditionHelper(const std::string& path,
+                              const std::string& value,
+                              bool hasVersion,
+                              uint64_t version);
     /**
      * Provides mutual exclusion to treeDetails pointer.
      */
@@ -522,6 +1061,74 @@ class Tree {
     friend class Cluster;
 };
 
+/**
+ * Iterates over the children of a directory, fetching them from the cluster
+ * one page at a time. Created by Tree::iterateDirectory(). Children are
+ * produced in the same format and order as Tree::listDirectory(); children
+ * added or removed during the iteration may or may not be seen.
+ *
+ * Usage:
+ * \code
+ *  DirectoryIterator it = tree.iterateDirectory("/dir");
+ *  while (it.hasNext())
+ *      std::cout << it.next() << std::endl;
+ * \endcode
+ *
+ * Errors are reported by throwing exceptions, as in Tree::listDirectoryEx().
+ */
+class DirectoryIterator {
+  private:
+    /// Constructor. See Tree::iterateDirectory().
+    DirectoryIterator(const Tree& tree,
+                      const std::string& path,
+                      const std::string& prefix,
+                      uint64_t pageSize);
+  public:
+    /**
+     * Return true if next() will return another child. This blocks to fetch
+     * the next page from the cluster if the current one is used up.
+     */
+    bool hasNext();
+
+    /**
+     * Return the next child and advance the iterator. Must only be called
+     * after hasNext() returned true.
+     */
+    std::string next();
+
+  private:
+    /**
+     * Used to fetch pages.
+     */
+    Tree tree;
+    /**
+     * The directory being listed.
+     */
+    std::string path;
+    /**
+     * See Tree::iterateDirectory().
+     */
+    std::string prefix;
+    /**
+     * See Tree::iterateDirectory().
+     */
+    uint64_t pageSize;
+    /**
+     * The children fetched in the current page.
+     */
+    std::vector<std::string> page;
+    /**
+     * The index into 'page' of the child that next() will return.
+     */
+    size_t pageIndex;
+    /**
+     * True if the cluster has more children following 'page' (or if no page
+     * has been fetched yet).
+     */
+    bool more;
+    friend class Tree;
+};
+
 /**
  * When running in testing mode, these callbacks serve as a way for the
  * application to interpose on requests and responses to inject failures and
@@ -608,6 +1215,46 @@ class Cluster {
      *      the client will wait until giving up on the close session RPC. It
      *      defaults to tcpConnectTimeoutMilliseconds, since they should be on
      *      the same order of magnitude.
+     * - exactlyOnceSessions:
+     *      The number of sessions this Cluster object may open with LogCabin
+     *      for read-write commands. Each thread always uses the same session,
+     *      and threads are spread evenly across them. Multi-threaded clients
+     *      issuing many read-write commands at once can raise this to reduce
+     *      contention, in the client library and in the servers' per-session
+     *      bookkeeping. Each session is only opened when first used, and each
+     *      costs a log entry to open and some memory on the servers. Defaults
+     *      to 1.
+     * - writeBatchMaxOperations:
+     *      If greater than 1, read-write tree operations issued around the
+     *      same time, from any number of threads, are coalesced into batches
+     *      of up to this many operations, each sent to the cluster as a
+     *      single command. Each operation still completes individually with
+     *      its own Result and exactly-once semantics. This reduces the load
+     *      on the cluster when issuing many small writes, at the cost of some
+     *      latency. Requires state machine version 6; against older clusters,
+     *      the client falls back to sending operations individually. Defaults
+     *      to 1 (no batching).
+     * - writeBatchMicroseconds:
+     *      When batching, how long an operation waits for others to join its
+     *      batch before the batch is sent. Defaults to 1000.
+     * - readCache:
+     *      Whether and how to cache the files that Tree::read returns, for
+     *      reads without a condition. One of:
+     *       - none: every read goes to the cluster leader (the default).
+     *       - linearizable: reads are served from the cache while the leader's
+     *         read lease on the file lasts, so they still observe every
+     *         completed write. This requires the servers to grant leases (see
+     *         readLeaseMilliseconds in sample.conf); otherwise nothing is
+     *         cached. Writes to a leased file wait for the lease to expire.
+     *       - bounded: reads are served from the cache for up to
+     *         readCacheMaxStalenessMilliseconds, so they may miss writes from
+     *         other clients made during that time. Writes from this client
+     *         invalidate the cache right away.
+     * - readCacheMaxStalenessMilliseconds:
+     *      How long cached files are served in the bounded mode. Defaults to
+     *      1000.
+     * - readCacheMaxEntries:
+     *      The most files kept in the cache. Defaults to 1000.
      */
     typedef std::map<std::string, std::string> Options;
 
@@ -635,7 +1282,9 @@ class Cluster {
      *      A string describing the hosts in the cluster. This should be of the
      *      form host:port, where host is usually a DNS name that resolves to
      *      multiple IP addresses. Alternatively, you can pass a list of hosts
-     *      as host1:port1,host2:port2,host3:port3.
+     *      as host1:port1,host2:port2,host3:port3. Servers running on the
+     *      same host as the client may also be reached through a Unix domain
+     *      socket as unix:/path/to/socket.
      * \param options
      *      Settings for the client library (see #Options).
      */
@@ -734,6 +1383,13 @@ class Cluster {
      */
     Tree getTree();
 
+    /**
+     * Return counters for the read cache, which is shared by all Tree objects
+     * created by this Cluster object. These are all zero if the cache is
+     * disabled (see #Options).
+     */
+    ReadCacheStats getReadCacheStats() const;
+
   private:
     std::shared_ptr<ClientImpl> clientImpl;
 };